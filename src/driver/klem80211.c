@@ -26,14 +26,46 @@
 #include <linux/etherdevice.h>
 #include <linux/kthread.h>
 #include <linux/wait.h>
+#include <linux/semaphore.h>
+#include <linux/ktime.h>
+#include <linux/jhash.h>
+#include <linux/workqueue.h>
+#include <linux/random.h>
 #include "klemHdr.h"
 #include "klemData.h"
 #include "klemNet.h"
+#include "klemMedium.h"
+#include "klemDev.h"
 
 #define KLEM_MAX_QOS 4
-#define KLEM_QUEUE_MAX 32
-#define KLEM_QUEUE_HIGH 16
-#define KLEM_QUEUE_LOW 8
+
+/* How often the drain rate of a fake hardware queue is measured. */
+#define KLEM_DRAIN_WINDOW (HZ / 10)
+
+/* Airtime, in usec, a station may use before its turn ends. */
+#define KLEM_AIRTIME_QUANTUM 300
+
+/* Key indexes we keep track of for emulated hardware crypto. */
+#define KLEM_MAX_KEYS 4
+
+/* Traffic identifiers that can have a block ack session. */
+#define KLEM_MAX_TID 8
+
+/* Beacons and probe responses remembered for hw_scan, and how long. */
+#define KLEM_SCAN_HASH 64
+#define KLEM_SCAN_MAX 512
+#define KLEM_SCAN_AGE (10 * HZ)
+
+/* Noise floor reported by get_survey, dBm. */
+#define KLEM_SURVEY_NOISE -95
+
+/* OFDM slot and SIFS in usec for carrier sense, no backoff drawn yet */
+#define KLEM_CSMA_SLOT 9
+#define KLEM_CSMA_SIFS 16
+#define KLEM_CSMA_NONE -1
+
+/* Frames waiting for a remote ack, a power of two */
+#define KLEM_ACK_SLOTS 1024
 
 /*
  * values obtained from
@@ -359,22 +391,32 @@ static const struct ieee80211_channel privConstChannels_5ghz[] = {
 };
 
 
-/* Just use what is a requirement for 2gb bitrate. */
+/* All of the DSSS, CCK and OFDM rates for 2gb bitrate. */
 static const struct ieee80211_rate privConstBitRate_2g[] = {
   { .bitrate = 10,  .flags = 0 },
   { .bitrate = 20,  .flags = IEEE80211_RATE_SHORT_PREAMBLE },
   { .bitrate = 55,  .flags = IEEE80211_RATE_SHORT_PREAMBLE },
   { .bitrate = 110, .flags = IEEE80211_RATE_SHORT_PREAMBLE },
   { .bitrate = 60,  .flags = 0 },
+  { .bitrate = 90,  .flags = 0 },
   { .bitrate = 120, .flags = 0 },
+  { .bitrate = 180, .flags = 0 },
   { .bitrate = 240, .flags = 0 },
+  { .bitrate = 360, .flags = 0 },
+  { .bitrate = 480, .flags = 0 },
+  { .bitrate = 540, .flags = 0 },
 };
 
-/* Just use what is a requirement for 5gb bitrate. */
+/* All of the OFDM rates for 5gb bitrate. */
 static const struct ieee80211_rate privConstBitRate_5g[] = {
   { .bitrate = 60,  .flags = 0 },
+  { .bitrate = 90,  .flags = 0 },
   { .bitrate = 120, .flags = 0 },
+  { .bitrate = 180, .flags = 0 },
   { .bitrate = 240, .flags = 0 },
+  { .bitrate = 360, .flags = 0 },
+  { .bitrate = 480, .flags = 0 },
+  { .bitrate = 540, .flags = 0 },
 };
 
 /* define a length for above tables */
@@ -383,14 +425,107 @@ static const struct ieee80211_rate privConstBitRate_5g[] = {
 #define RATE_SIZE_2G ARRAY_SIZE(privConstBitRate_2g)
 #define RATE_SIZE_5G ARRAY_SIZE(privConstBitRate_5g)
 
+/*
+ * 802.1p priority frames of each access category go on the wire with,
+ * and the access category of each priority as 802.1D maps them back.
+ */
+static const u8 privConstAcPcp [KLEM_MAX_QOS] = { 6, 4, 0, 1 };
+static const u8 privConstPcpAc [8] = {
+  IEEE80211_AC_BE, IEEE80211_AC_BK, IEEE80211_AC_BK, IEEE80211_AC_BE,
+  IEEE80211_AC_VI, IEEE80211_AC_VI, IEEE80211_AC_VO, IEEE80211_AC_VO
+};
+
 typedef struct {
   bool bActive;
+
+  /* Group keys installed in our fake hardware, cipher suite or 0 */
+  u32 uKeyCipher [KLEM_MAX_KEYS];
+
+  /*
+   * Beacon template, rebuilt by mac80211 only when the beacon or the
+   * TIM changed, or on every interval while stations doze.  Each
+   * interval sends a clone with the TSF, DTIM count and sequence
+   * number patched in place.
+   */
+  spinlock_t sBeaconLock;
+  struct sk_buff *pBeacon;
+  bool bBeaconRefresh;
+  unsigned int uTimGeneration;
+  unsigned int uTimOffset;
+  u8 uTimGroup;               /* group traffic bit mac80211 built it with */
+  u8 uDtimCount;
+  u8 uDtimPeriod;
+  u16 uBeaconSeq;
+  bool bGroupLive;            /* built each interval, group may be buffered */
 } VIFData;
 
 typedef struct {
   bool bActive;
+
+  /* Pairwise keys installed in our fake hardware, cipher suite or 0 */
+  u32 uKeyCipher [KLEM_MAX_KEYS];
+
+  /* Group keys of this peer, mesh and IBSS install them per station */
+  u32 uGroupCipher [KLEM_MAX_KEYS];
+
+  /* Transmit block ack window per tid, 0 without a session */
+  u16 uAmpduBuf [KLEM_MAX_TID];
+
+  /* Airtime fairness, deficit and totals in usec per access category. */
+  s32 iAirtimeDeficit [KLEM_MAX_QOS];
+  u64 uAirtimeTX;
+  u64 uAirtimeRX;
+
+  /* Node id the station sends from, -1 until we heard it */
+  int iNode;
+
+  /* In power save, counted in uDozing */
+  bool bDozing;
 } STAData;
 
+/* A unicast frame on the wire, waiting for the receiving host's ack. */
+typedef struct {
+  struct sk_buff *pSkb;
+  u32 uSequence;
+  unsigned long uSent;
+  u8 uCount [IEEE80211_TX_MAX_RATES];
+} AckData;
+
+/* Our book keeping for each mac80211 intermediate software queue. */
+typedef struct {
+  struct list_head list;
+  bool bScheduled;
+  bool bDead;                 /* mac80211 is freeing it, never requeue */
+} TXQData;
+
+/* Looks for an interface with the address a frame was sent to. */
+typedef struct {
+  const u8 *pAddr;
+  bool bFound;
+} AddrMatch;
+
+/* Looks for an interface that can take a protected group frame. */
+typedef struct {
+  struct ieee80211_hdr *pWHdr;
+  bool bFound;
+} GroupMatch;
+
+/* Airtime in usec seen on a channel, busy counts everything heard. */
+typedef struct {
+  u64 uBusy;
+  u64 uTX;
+  u64 uRX;
+} SurveyData;
+
+/* Last beacon or probe response heard from a BSSID on a channel. */
+typedef struct {
+  struct hlist_node node;
+  u8 uBssid [ETH_ALEN];
+  u32 uFrequency;
+  unsigned long uHeard;
+  struct sk_buff *pSkb;
+} ScanData;
+
 
 /*
  * Data we need for each mac 802.11 instance.
@@ -403,8 +538,53 @@ typedef struct {
   struct device *pDev;
   int iPower;
   bool bIdle;
+  unsigned int uGroupKeys;
+  unsigned int uPairwiseKeys;
+  unsigned long uRecvNoKeyNumber;
+  unsigned long uAmpduNumber;
+  unsigned long uAmpduFrames;
+  unsigned long uRetryNumber;
+  unsigned long uRetryFailed;
+
+  /*
+   * Frames waiting for a remote ack, the slot is the wire sequence
+   * modulo KLEM_ACK_SLOTS.  uAckOrder holds the sequences in the order
+   * they were sent, expiry starts at uAckTail with the oldest.
+   */
+  struct semaphore sAckWait;
+  AckData ackSlot [KLEM_ACK_SLOTS];
+  u32 uAckOrder [KLEM_ACK_SLOTS];
+  unsigned int uAckHead;
+  unsigned int uAckTail;
+  unsigned int uAckPending;   /* slots still holding a frame */
+  unsigned long uAckNumber;
+  unsigned long uAckLost;
+  u32 uAmpduReference;
   unsigned long uBeacons;
   unsigned long uBeaconCount;
+  unsigned long uBeaconBuilds;
+  atomic_t uTimGeneration;
+
+  /* Stations dozing, mac80211 buffers group traffic while there are */
+  atomic_t uDozing;
+
+  /* Wall clock in usec when the TSF of this radio was 0 */
+  atomic64_t uTsfBase;
+
+  /*
+   * hw_scan answers from what the wire already told us.  The table is
+   * hashed on BSSID and frequency, the request is owned by scanWork.
+   */
+  spinlock_t sScanLock;
+  struct hlist_head scanHash [KLEM_SCAN_HASH];
+  unsigned int uScanEntries;
+  struct delayed_work scanWork;
+  struct cfg80211_scan_request *pScanReq;
+  u8 uScanAddr [ETH_ALEN];
+  unsigned int uScanChannel;
+  unsigned long uScanStart;
+  unsigned long uScanNumber;
+  unsigned long uScanResults;
   char devName [64];
   struct mac_address  macAddress;
 
@@ -418,12 +598,26 @@ typedef struct {
   struct ieee80211_channel channel_5g [CHANNEL_SIZE_5G];
   struct ieee80211_rate rate_5g [RATE_SIZE_5G];
 
+  /* Channel utilization for get_survey, since uSurveyStart in usec */
+  SurveyData survey_2g [CHANNEL_SIZE_2G];
+  SurveyData survey_5g [CHANNEL_SIZE_5G];
+  u64 uSurveyStart;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0))
+  /* HE capabilities, per band */
+  struct ieee80211_sband_iftype_data iftype_2g [1];
+  struct ieee80211_sband_iftype_data iftype_5g [1];
+#endif
+
   /* Send thread info */
   char pSendName [64];
   void *pSendThread;
   spinlock_t sSpinLock;
   wait_queue_head_t sListWait;
 
+  /* mac80211 software queues with frames, round robin per qos */
+  struct list_head listTxq [KLEM_MAX_QOS];
+
 
   bool bRadioActive;
   bool bActive;
@@ -443,11 +637,45 @@ typedef struct {
 
     /* Queue information for transitting a packet */
     struct sk_buff_head listSkb;
-    unsigned int uListDepth;
     bool bListActive;
+
+    /*
+     * Byte based limit, BQL style.  The limit follows the drain rate
+     * measured over KLEM_DRAIN_WINDOW, so a queue holds about the same
+     * amount of time regardless of the frame sizes.
+     */
+    unsigned int uBytesQueued;
+    unsigned int uByteLimit;
+    unsigned int uDrainBytes;
+    unsigned long uDrainStart;
+
+    /* CoDel state, times are in micro seconds. */
+    s64 iCodelFirstAbove;
+    s64 iCodelDropNext;
+    unsigned int uCodelCount;
+    bool bCodelDropping;
+    unsigned long uCodelDropNumber;
+
+    /*
+     * EDCA backoff, slots left counted from uBackoffFrom, the end of
+     * the AIFS after the last busy period.  Send thread only.
+     */
+    int iBackoff;
+    u64 uBackoffFrom;
+    unsigned long uDeferNumber;
   } qos [KLEM_MAX_QOS];
 } mac80211Data;
 
+/*
+ * Beacons taken in the atomic interface walk, and the group traffic
+ * their DTIMs released, sent once it is done.
+ */
+typedef struct {
+  mac80211Data *pMacData;
+  struct sk_buff_head listBeacon;
+  struct sk_buff_head listGroup;
+} BeaconList;
+
 /* forward declarations of needed functions. */
 static int privStart(struct ieee80211_hw *pHW);
 static void privStop(struct ieee80211_hw *pHW);
@@ -469,6 +697,38 @@ static void privStaNotify(struct ieee80211_hw *pHW,
               struct ieee80211_vif *pVIF,
               enum sta_notify_cmd eCmd,
               struct ieee80211_sta *pSta);
+static int privSetTim(struct ieee80211_hw *pHW,
+                      struct ieee80211_sta *pSta,
+                      bool bSet);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,0))
+static u64 privGetTsf(struct ieee80211_hw *pHW,
+                      struct ieee80211_vif *pVIF);
+static void privSetTsf(struct ieee80211_hw *pHW,
+                       struct ieee80211_vif *pVIF,
+                       u64 uTsf);
+#else
+static u64 privGetTsf(struct ieee80211_hw *pHW);
+static void privSetTsf(struct ieee80211_hw *pHW, u64 uTsf);
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,17,0))
+static int privHwScan(struct ieee80211_hw *pHW,
+                      struct ieee80211_vif *pVIF,
+                      struct ieee80211_scan_request *pHwReq);
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36))
+static int privHwScan(struct ieee80211_hw *pHW,
+                      struct ieee80211_vif *pVIF,
+                      struct cfg80211_scan_request *pReq);
+#else
+static int privHwScan(struct ieee80211_hw *pHW,
+                      struct cfg80211_scan_request *pReq);
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0))
+static void privCancelHwScan(struct ieee80211_hw *pHW,
+                             struct ieee80211_vif *pVIF);
+#endif
+static int privGetSurvey(struct ieee80211_hw *pHW,
+                         int iIdx,
+                         struct survey_info *pSurvey);
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0))
 static void privTX(struct ieee80211_hw *pHW,
            struct ieee80211_tx_control *pControl,
@@ -494,6 +754,32 @@ static int privConfigureTX(struct ieee80211_hw *pHW,
                const struct ieee80211_tx_queue_params *pQueue);
 #endif
 static void privCompleteTX(void *pPtr, struct sk_buff *pSkb, bool bAck);
+static int privSetKey(struct ieee80211_hw *pHW,
+                      enum set_key_cmd eCmd,
+                      struct ieee80211_vif *pVIF,
+                      struct ieee80211_sta *pSta,
+                      struct ieee80211_key_conf *pKey);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0))
+static void privWakeTxQueue(struct ieee80211_hw *pHW,
+                            struct ieee80211_txq *pTxq);
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,6,0))
+static int privAmpduAction(struct ieee80211_hw *pHW,
+                           struct ieee80211_vif *pVIF,
+                           struct ieee80211_ampdu_params *pParams);
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0))
+static int privAmpduAction(struct ieee80211_hw *pHW,
+                           struct ieee80211_vif *pVIF,
+                           enum ieee80211_ampdu_mlme_action eAction,
+                           struct ieee80211_sta *pSta,
+                           u16 uTid, u16 *puSsn, u8 uBufSize, bool bAmsdu);
+#else
+static int privAmpduAction(struct ieee80211_hw *pHW,
+                           struct ieee80211_vif *pVIF,
+                           enum ieee80211_ampdu_mlme_action eAction,
+                           struct ieee80211_sta *pSta,
+                           u16 uTid, u16 *puSsn, u8 uBufSize);
+#endif
 
 static struct ieee80211_ops privKlem80211OPS =
 {
@@ -512,8 +798,19 @@ static struct ieee80211_ops privKlem80211OPS =
   .sta_add = privStaAdd,
   .sta_remove = privStaRemove,
   .sta_notify = privStaNotify,
+  .set_tim = privSetTim,
+  .get_tsf = privGetTsf,
+  .set_tsf = privSetTsf,
+  .hw_scan = privHwScan,
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0))
+  .cancel_hw_scan = privCancelHwScan,
+#endif
 
   .tx = privTX,
+  .set_key = privSetKey,
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0))
+  .wake_tx_queue = privWakeTxQueue,
+#endif
   .config = privConfig,
 
   /* Added as a required function in later kernels. */
@@ -526,9 +823,8 @@ static struct ieee80211_ops privKlem80211OPS =
   /* not required for using mac80211 */
   .prepare_multicast = NULL,
   .change_interface = NULL,
-  .set_tim = NULL,
-  .get_survey = NULL,
-  .ampdu_action = NULL,
+  .get_survey = privGetSurvey,
+  .ampdu_action = privAmpduAction,
   .sw_scan_start = NULL,
   .sw_scan_complete = NULL,
   .flush = NULL,
@@ -539,225 +835,1821 @@ static struct device_driver klem80211Driver = {
 };
 
 /*
- * Called when the wireless mac 802.11 radio is started
+ * Block ack sessions.  Our fake hardware accepts every session, and
+ * remembers the transmit window so the send thread can aggregate.
  */
-static int privStart(struct ieee80211_hw *pHW)
+static int privCommonAmpdu(struct ieee80211_hw *pHW,
+                           struct ieee80211_vif *pVIF,
+                           enum ieee80211_ampdu_mlme_action eAction,
+                           struct ieee80211_sta *pSta,
+                           u16 uTid, u16 uBufSize)
 {
-  mac80211Data *pMacData = (mac80211Data *)pHW->priv;
+  STAData *pSTAData = (STAData *)pSta->drv_priv;
+  int rvalue = 0;
 
-  if (NULL != pMacData) {
-    pMacData->bRadioActive = true;
-    KLEM_LOG("Called (%p)\n", pMacData);
+  if (uTid >= KLEM_MAX_TID) {
+    return -EINVAL;
   }
-  return 0;
+
+  switch(eAction)
+    {
+    case IEEE80211_AMPDU_RX_START:
+    case IEEE80211_AMPDU_RX_STOP:
+      break;
+    case IEEE80211_AMPDU_TX_START:
+      ieee80211_start_tx_ba_cb_irqsafe(pVIF, pSta->addr, uTid);
+      break;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,9,0))
+    case IEEE80211_AMPDU_TX_STOP_CONT:
+      pSTAData->uAmpduBuf [uTid] = 0;
+      ieee80211_stop_tx_ba_cb_irqsafe(pVIF, pSta->addr, uTid);
+      break;
+    case IEEE80211_AMPDU_TX_STOP_FLUSH:
+    case IEEE80211_AMPDU_TX_STOP_FLUSH_CONT:
+      pSTAData->uAmpduBuf [uTid] = 0;
+      break;
+#else
+    case IEEE80211_AMPDU_TX_STOP:
+      pSTAData->uAmpduBuf [uTid] = 0;
+      ieee80211_stop_tx_ba_cb_irqsafe(pVIF, pSta->addr, uTid);
+      break;
+#endif
+    case IEEE80211_AMPDU_TX_OPERATIONAL:
+      pSTAData->uAmpduBuf [uTid] = min_t(u16, uBufSize, KLEM_MAX_SUBFRAMES);
+      break;
+    default:
+      rvalue = -EOPNOTSUPP;
+      break;
+    }
+
+  KLEM_LOG("Action(%d) pSta(%pM) tid %d buf %d = %d\n",
+           eAction, pSta->addr, uTid, uBufSize, rvalue);
+
+  return rvalue;
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,6,0))
+static int privAmpduAction(struct ieee80211_hw *pHW,
+                           struct ieee80211_vif *pVIF,
+                           struct ieee80211_ampdu_params *pParams)
+{
+  return privCommonAmpdu(pHW, pVIF, pParams->action, pParams->sta,
+                         pParams->tid, pParams->buf_size);
+}
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0))
+static int privAmpduAction(struct ieee80211_hw *pHW,
+                           struct ieee80211_vif *pVIF,
+                           enum ieee80211_ampdu_mlme_action eAction,
+                           struct ieee80211_sta *pSta,
+                           u16 uTid, u16 *puSsn, u8 uBufSize, bool bAmsdu)
+{
+  return privCommonAmpdu(pHW, pVIF, eAction, pSta, uTid, uBufSize);
+}
+#else
+static int privAmpduAction(struct ieee80211_hw *pHW,
+                           struct ieee80211_vif *pVIF,
+                           enum ieee80211_ampdu_mlme_action eAction,
+                           struct ieee80211_sta *pSta,
+                           u16 uTid, u16 *puSsn, u8 uBufSize)
+{
+  return privCommonAmpdu(pHW, pVIF, eAction, pSta, uTid, uBufSize);
 }
+#endif
 
 /*
- * Called when the wireless mac 802.11 radio is stopped
-*/
-static void privStop(struct ieee80211_hw *pHW)
+ * Describe a transmit rate entry the way it goes on the wire.
+ */
+static void privRateFromEntry(struct ieee80211_tx_rate *pTXRate,
+                              KLEM_RATE_HEADER *pRate)
 {
-  mac80211Data *pMacData = (mac80211Data *)pHW->priv;
+  memset(pRate, 0, sizeof(KLEM_RATE_HEADER));
+  pRate->uNss = 1;
+  if (pTXRate->idx < 0) {
+    return;
+  }
 
-  if (NULL != pMacData) {
-    pMacData->bRadioActive = false;
+  pRate->uIndex = pTXRate->idx;
+  if (pTXRate->flags & IEEE80211_TX_RC_MCS) {
+    pRate->uEncoding = KLEM_RATE_HT;
+    pRate->uIndex = pTXRate->idx & 0x7;
+    pRate->uNss = (pTXRate->idx >> 3) + 1;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0))
+  } else if (pTXRate->flags & IEEE80211_TX_RC_VHT_MCS) {
+    pRate->uEncoding = KLEM_RATE_VHT;
+    pRate->uIndex = ieee80211_rate_get_vht_mcs(pTXRate);
+    pRate->uNss = ieee80211_rate_get_vht_nss(pTXRate);
+#endif
+  } else if (pTXRate->flags & IEEE80211_TX_RC_USE_SHORT_PREAMBLE) {
+    pRate->uFlags |= KLEM_RATE_FLAG_SHORTPRE;
+  }
 
-    KLEM_LOG("Called (%p)\n", pMacData);
+  if (pTXRate->flags & IEEE80211_TX_RC_40_MHZ_WIDTH) {
+    pRate->uFlags |= KLEM_RATE_BW_40;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0))
+  } else if (pTXRate->flags & IEEE80211_TX_RC_80_MHZ_WIDTH) {
+    pRate->uFlags |= KLEM_RATE_BW_80;
+  } else if (pTXRate->flags & IEEE80211_TX_RC_160_MHZ_WIDTH) {
+    pRate->uFlags |= KLEM_RATE_BW_160;
+#endif
+  }
+
+  if (pTXRate->flags & IEEE80211_TX_RC_SHORT_GI) {
+    pRate->uFlags |= KLEM_RATE_FLAG_SGI;
   }
 }
 
 /*
- * Add wireless interface
+ * The first transmit rate entry, what we send at without retries.
  */
-static int privAddInterface(struct ieee80211_hw *pHW,
-                struct ieee80211_vif *pVIF)
+static void privRateFromTX(struct ieee80211_tx_info *pInfo,
+                           KLEM_RATE_HEADER *pRate)
 {
-  mac80211Data *pMacData = (mac80211Data *)pHW->priv;
-  VIFData *pVIFData = (VIFData *)pVIF->drv_priv;
+  privRateFromEntry(&pInfo->control.rates [0], pRate);
+}
 
-  KLEM_LOG("Called pMacData (%p) pVIFData(%p)\n", pMacData, pVIFData);
+/*
+ * Rate in 100kbps, the same unit as ieee80211_rate.bitrate.  Unknown
+ * rates are reported as the lowest rate of the band.
+ */
+static unsigned int privRateBitrate(mac80211Data *pMacData,
+                                    unsigned int uBand,
+                                    KLEM_RATE_HEADER *pRate)
+{
+  /* HT and VHT mcs 0-9, HE mcs 0-11, one stream, 20MHZ, long GI. */
+  static const u16 uVHTRate [10] = {
+    65, 130, 195, 260, 390, 520, 585, 650, 780, 867
+  };
+  static const u16 uHERate [12] = {
+    86, 172, 258, 344, 516, 688, 774, 860, 1032, 1147, 1290, 1434
+  };
+  struct ieee80211_supported_band *pBand = NULL;
+  unsigned int uNss = clamp_t(unsigned int, pRate->uNss, 1, 8);
+  unsigned int uRate = 10;
+
+  switch (pRate->uEncoding) {
+  case KLEM_RATE_HT:
+  case KLEM_RATE_VHT:
+    uRate = uVHTRate [min_t(unsigned int, pRate->uIndex, 9)] * uNss;
+    break;
+  case KLEM_RATE_HE:
+    uRate = uHERate [min_t(unsigned int, pRate->uIndex, 11)] * uNss;
+    break;
+  default:
+    if (uBand < ARRAY_SIZE(pMacData->pHW->wiphy->bands)) {
+      pBand = pMacData->pHW->wiphy->bands [uBand];
+    }
+    if (NULL != pBand) {
+      uRate = pBand->bitrates [0].bitrate;
+      if (pRate->uIndex < pBand->n_bitrates) {
+        uRate = pBand->bitrates [pRate->uIndex].bitrate;
+      }
+    }
+    return uRate;
+  }
 
-  if (NULL != pVIFData) {
-    pVIFData->bActive = true;
+  /* Scale by the number of data subcarriers */
+  switch (pRate->uFlags & KLEM_RATE_BW_MASK) {
+  case KLEM_RATE_BW_40:
+    uRate = (KLEM_RATE_HE == pRate->uEncoding) ?
+      uRate * 2 : (uRate * 27) / 13;
+    break;
+  case KLEM_RATE_BW_80:
+    uRate = (KLEM_RATE_HE == pRate->uEncoding) ?
+      (uRate * 490) / 117 : (uRate * 9) / 2;
+    break;
+  case KLEM_RATE_BW_160:
+    uRate = (KLEM_RATE_HE == pRate->uEncoding) ?
+      (uRate * 980) / 117 : uRate * 9;
+    break;
+  default:
+    break;
   }
 
-  return 0;
+  if ((KLEM_RATE_HE != pRate->uEncoding) &&
+      (pRate->uFlags & KLEM_RATE_FLAG_SGI)) {
+    uRate = (uRate * 10) / 9;
+  }
+
+  return uRate;
 }
 
 /*
- * Remove wireless Interface
+ * Rate of a transmit rate entry in 100kbps.
  */
-static void privRemoveInterface(struct ieee80211_hw *pHW,
-                struct ieee80211_vif *pVIF)
+static unsigned int privTXRate(mac80211Data *pMacData,
+                               struct ieee80211_tx_info *pInfo)
 {
-  mac80211Data *pMacData = (mac80211Data *)pHW->priv;
-  VIFData *pVIFData = (VIFData *)pVIF->drv_priv;
-
-  KLEM_LOG("Called pMacData (%p) pVIFData(%p)\n", pMacData, pVIFData);
+  KLEM_RATE_HEADER sRate;
 
-  if (NULL != pVIFData) {
-    pVIFData->bActive = false;
+  if (pInfo->control.rates [0].idx < 0) {
+    return 60;
   }
 
-  KLEM_LOG("Remove Interface pMacData (%p) pVIIFData (%p)\n",
-       pMacData, pVIFData);
-
+  privRateFromTX(pInfo, &sRate);
+  return privRateBitrate(pMacData, pInfo->band, &sRate);
 }
 
 /*
- * configurfe beacons
- *
+ * Rough airtime in usec for uLength bytes at a rate in 100kbps, without
+ * the preamble.  MPDUs of an aggregate share one preamble.
  */
-static void privBssInfoChanged(struct ieee80211_hw *pHW,
-                   struct ieee80211_vif *pVIF,
-                   struct ieee80211_bss_conf *pBSS,
-                   u32 uChanged)
+static unsigned int privAirtimePayload(unsigned int uLength,
+                                       unsigned int uRate)
 {
-  VIFData *pVIFData = (VIFData *)pVIF->drv_priv;
-  mac80211Data *pMacData = (mac80211Data *)pHW->priv;
-
-  if ((NULL != pMacData) && (NULL != pVIFData)) {
-    if (true == pVIFData->bActive) {
-      /* Could do something with bssid, assoc and aid here. */
-      if (uChanged & BSS_CHANGED_BEACON_INT) {
-        if (NULL != pMacData) {
-          pMacData->uBeacons = (pBSS->beacon_int * HZ) >> 10;
-          if (0 == pMacData->uBeacons)
-            pMacData->uBeacons = 1;
-          KLEM_LOG("Beacons = %lud\n", pMacData->uBeacons);
-        }
-      }
+  if (0 == uRate) {
+    uRate = 10;
+  }
 
-      if (uChanged & BSS_CHANGED_ERP_CTS_PROT) {
-        KLEM_LOG("ERP_CTS_PROT: %d\n", pBSS->use_cts_prot);
-      }
+  return DIV_ROUND_UP(uLength * 80, uRate);
+}
 
-      if (uChanged & BSS_CHANGED_ERP_PREAMBLE) {
-        KLEM_LOG("ERP_PREAMBLE: %d\n", pBSS->use_short_preamble);
-      }
+/*
+ * Rough airtime in usec for a frame of uLength bytes at a rate in
+ * 100kbps.  A DSSS/CCK preamble below 6Mbps, an OFDM preamble above.
+ */
+static unsigned int privAirtime(unsigned int uLength, unsigned int uRate)
+{
+  unsigned int uPreamble = (uRate < 60) ? 192 : 20;
 
-      if (uChanged & BSS_CHANGED_ERP_SLOT) {
-        KLEM_LOG("ERP_SLOT: %d\n", pBSS->use_short_slot);
-      }
+  return uPreamble + privAirtimePayload(uLength, uRate);
+}
 
-      if (uChanged & BSS_CHANGED_HT) {
+/* The channel the radio is tuned to. */
+static struct ieee80211_channel *privChannel(mac80211Data *pMacData)
+{
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0))
-        KLEM_LOG("HT: op_mode=0x%x, chantype=%d\n",
-                 pBSS->ht_operation_mode,
-                 pBSS->channel_type);
+  return pMacData->pHW->conf.channel;
 #else
-        KLEM_LOG("HT: op_mode=0x%x\n",
-                 pBSS->ht_operation_mode);
+  return pMacData->pHW->conf.chandef.chan;
 #endif
-      }
-
-      if (uChanged & BSS_CHANGED_BASIC_RATES) {
-        KLEM_LOG("BASIC_RATES: 0x%llx\n",
-                 (unsigned long long)pBSS->basic_rates);
-      }
-    }
-  }
 }
 
-static int privStaAdd(struct ieee80211_hw *pHW,
-              struct ieee80211_vif *pVIF,
-              struct ieee80211_sta *pSta)
+/*
+ * Account uAirtime usec on the channel at uFrequency.  Every frame we
+ * send or hear makes it busy, bTX and bRX say whether it was ours.
+ * bBusy is false for a frame whose busy time was counted already.
+ */
+static void privSurveyAdd(mac80211Data *pMacData,
+                          u32 uFrequency,
+                          unsigned int uAirtime,
+                          bool bBusy,
+                          bool bTX,
+                          bool bRX)
 {
-  VIFData *pVIFData = (VIFData *)pVIF->drv_priv;
-  STAData *pSTAData = (STAData *)pSta->drv_priv;
+  SurveyData *pSurvey = NULL;
+  int loop;
 
-  if ((NULL != pVIFData) && (NULL != pSTAData)) {
-    if (true == pVIFData->bActive) {
-      pSTAData->bActive = true;
+  for (loop = 0; loop < CHANNEL_SIZE_2G; loop++) {
+    if (pMacData->channel_2g [loop].center_freq == uFrequency) {
+      pSurvey = &pMacData->survey_2g [loop];
+      break;
     }
   }
 
-  KLEM_LOG("Called pHW(%p) pVIFData(%p) pSTAData(%p)\n",
-       pHW, pVIFData, pSTAData);
+  for (loop = 0; (NULL == pSurvey) && (loop < CHANNEL_SIZE_5G); loop++) {
+    if (pMacData->channel_5g [loop].center_freq == uFrequency) {
+      pSurvey = &pMacData->survey_5g [loop];
+    }
+  }
 
-  return 0;
+  if (NULL != pSurvey) {
+    if (true == bBusy) pSurvey->uBusy += uAirtime;
+    if (true == bTX) pSurvey->uTX += uAirtime;
+    if (true == bRX) pSurvey->uRX += uAirtime;
+  }
 }
 
-static int privStaRemove(struct ieee80211_hw *pHW,
-             struct ieee80211_vif *pVIF,
-             struct ieee80211_sta *pSta)
+static u32 privRandom(void)
 {
-  VIFData *pVIFData = (VIFData *)pVIF->drv_priv;
-  STAData *pSTAData = (STAData *)pSta->drv_priv;
-
-  if ((NULL != pVIFData) && (NULL != pSTAData)) {
-    if (true == pVIFData->bActive) {
-      pSTAData->bActive = false;
-    }
-  }
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0))
+  return get_random_u32();
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(3,8,0))
+  return prandom_u32();
+#else
+  return random32();
+#endif
+}
 
-  KLEM_LOG("Called pHW(%p) pVIFData(%p) pSTAData(%p)\n",
-       pHW, pVIFData, pSTAData);
+/* Our own transmission of uAirtime usec, for the survey and SINR. */
+static void privAirTX(mac80211Data *pMacData, unsigned int uAirtime)
+{
+  u32 uFrequency = privChannel(pMacData)->center_freq;
 
-  return 0;
+  privSurveyAdd(pMacData, uFrequency, uAirtime, true, true, false);
+  klemMediumBusy(pMacData->pData->pMedium, uFrequency, uAirtime);
+  klemMediumTransmit(pMacData->pData->pMedium, uFrequency,
+                     pMacData->pHW->conf.power_level, uAirtime);
 }
 
-static void privStaNotify(struct ieee80211_hw *pHW,
-              struct ieee80211_vif *pVIF,
-              enum sta_notify_cmd eCmd,
-              struct ieee80211_sta *pSta)
+/*
+ * Rough SINR in dB a frame needs at its rate, by modulation and
+ * coding.  uRate is the bitrate in 100kbps for legacy rates.
+ */
+static int privRateSinr(KLEM_RATE_HEADER *pRate, unsigned int uRate)
 {
-  /* Not really using this function, record it was called. */
-  KLEM_LOG("Called Command(%d) pHW(%p) pVIF(%p) pSta(%p)\n",
-       eCmd, pHW, pVIF, pSta);
+  static const int iMcs [] = { 5, 8, 10, 14, 18, 22, 24, 26, 30, 32, 35, 37 };
+
+  switch (pRate->uEncoding)
+    {
+    case KLEM_RATE_HT:
+      return iMcs [pRate->uIndex % 8];
+    case KLEM_RATE_VHT:
+    case KLEM_RATE_HE:
+      return iMcs [min_t(unsigned int, pRate->uIndex, ARRAY_SIZE(iMcs) - 1)];
+    default:
+      break;
+    }
+
+  if (uRate <= 20) return 2;
+  if (uRate <= 110) return (60 == uRate) ? 5 : 6;
+  if (uRate <= 120) return 8;
+  if (uRate <= 180) return 10;
+  if (uRate <= 240) return 14;
+  if (uRate <= 360) return 18;
+  if (uRate <= 480) return 22;
+  return 24;
 }
 
 /*
- * Common Transmit sk_buff through wireless device
+ * Packet error rate in percent by how many dB the SNR is above what
+ * the rate needs, from -3 dB up.  Above the table nothing is lost.
  */
-static inline void privCommonTX(struct ieee80211_hw *pHW, struct sk_buff *pSkb)
-{
-  mac80211Data *pMacData = (mac80211Data *)pHW->priv;
-  struct ieee80211_hdr *pHdr = NULL;
-  unsigned int uqos = 0;
-  unsigned long uSigFlags;
+static const u8 privConstPer [] = { 100, 95, 80, 50, 20, 5, 1 };
 
-  if ((NULL != pMacData) && (NULL != pSkb)) {
-    if (true == pMacData->bRadioActive) {
-      if (pSkb->len < 10) {
-        KLEM_MSG(" drop this small packet\n");
-        dev_kfree_skb(pSkb);
-      } else {
-        pHdr = (struct ieee80211_hdr *)pSkb->data;
+/*
+ * Node id of the station a frame goes to, -1 if we never heard it.
+ */
+static int privTXNode(mac80211Data *pMacData, struct ieee80211_hdr *pWHdr)
+{
+  struct ieee80211_sta *pSta = NULL;
+  int rvalue = -1;
 
-        /* Determine the qos mapping */
-        if (ieee80211_is_data_qos(pHdr->frame_control)) {
-          uqos = skb_get_queue_mapping(pSkb);
-        }
+  rcu_read_lock();
+  pSta = ieee80211_find_sta_by_ifaddr(pMacData->pHW, pWHdr->addr1, NULL);
+  if (NULL != pSta) {
+    rvalue = ((STAData *)pSta->drv_priv)->iNode;
+  }
+  rcu_read_unlock();
 
-        /*
-         * Assuming we have a valid qos, enqueue the packet onto our
-         * fake hardware.
-         */
-        if (uqos < KLEM_MAX_QOS) {
-          spin_lock_irqsave(&pMacData->sSpinLock, uSigFlags);
+  return rvalue;
+}
 
-          if (pMacData->qos [uqos].uListDepth < KLEM_QUEUE_MAX) {
-            skb_queue_tail(&pMacData->qos [uqos].listSkb,
-                           pSkb);
-            pMacData->qos [uqos].uListDepth++;
-            /* Check to see if are close to high water mark for queue storage.*/
-            if (pMacData->qos [uqos].uListDepth >= KLEM_QUEUE_HIGH) {
-              if (true == pMacData->qos [uqos].bListActive) {
-                /* Mainly due this, so a network issue don't consume all mem */
-                pMacData->qos [uqos].bListActive = false;
-                ieee80211_stop_queue(pMacData->pHW, uqos);
-              }
-            }
-          } else {
-            /* Our fake hardware ran out of storage space, drop packet */
-            pMacData->qos [uqos].uSendDroppedNumber++;
-          }
+/*
+ * Remember which node a station's frames come from, retries need to
+ * know where their frames go.
+ */
+static void privRecvNode(mac80211Data *pMacData,
+                         struct ieee80211_hdr *pWHdr,
+                         unsigned int uId)
+{
+  struct ieee80211_sta *pSta = NULL;
+
+  rcu_read_lock();
+  pSta = ieee80211_find_sta_by_ifaddr(pMacData->pHW, pWHdr->addr2, NULL);
+  if (NULL != pSta) {
+    ((STAData *)pSta->drv_priv)->iNode = (int)uId;
+  }
+  rcu_read_unlock();
+}
+
+/*
+ * Does the rate table have an entry to try?  Without one the frame is
+ * sent once, as it was before retries were emulated.
+ */
+static bool privRetryUsable(struct ieee80211_tx_info *pInfo)
+{
+  int loop;
+
+  for (loop = 0; loop < IEEE80211_TX_MAX_RATES; loop++) {
+    if (pInfo->control.rates [loop].idx < 0) {
+      break;
+    }
+    if (0 != pInfo->control.rates [loop].count) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/*
+ * Run a unicast frame through its rate table the way hardware would,
+ * each entry tried count times.  An attempt is lost with the packet
+ * error rate at the SNR the receiver sees, plus the configured loss.
+ * puCount gets the attempts per entry and puAirtime what they took.
+ * Returns the entry that got through, -1 when all attempts failed.
+ */
+static int privRetryChain(mac80211Data *pMacData,
+                          struct sk_buff *pSkb,
+                          u8 *puCount,
+                          unsigned int *puAirtime)
+{
+  KLEMData *pData = pMacData->pData;
+  struct ieee80211_tx_info *pInfo = IEEE80211_SKB_CB(pSkb);
+  struct ieee80211_tx_rate *pTXRate = NULL;
+  KLEM_RATE_HEADER sRate;
+  unsigned int uRate;
+  unsigned int uPer;
+  int iNode;
+  int iSignal = 0;
+  int iMargin;
+  bool bSignal = false;
+  int loop;
+  int attempt;
+
+  memset(puCount, 0, IEEE80211_TX_MAX_RATES);
+  *puAirtime = 0;
+
+  iNode = privTXNode(pMacData, (struct ieee80211_hdr *)pSkb->data);
+  if (iNode >= 0) {
+    bSignal = klemMediumPredict(pData->pMedium, pData->uDeviceId, iNode,
+                                privChannel(pMacData)->center_freq,
+                                pMacData->pHW->conf.power_level, &iSignal);
+  }
+
+  for (loop = 0; loop < IEEE80211_TX_MAX_RATES; loop++) {
+    pTXRate = &pInfo->control.rates [loop];
+    if (pTXRate->idx < 0) {
+      break;
+    }
+
+    privRateFromEntry(pTXRate, &sRate);
+    uRate = privRateBitrate(pMacData, pInfo->band, &sRate);
+
+    uPer = 0;
+    if (true == bSignal) {
+      iMargin = iSignal - KLEM_MEDIUM_NOISE - privRateSinr(&sRate, uRate) + 3;
+      if (iMargin < 0) {
+        uPer = 100;
+      } else if (iMargin < (int)ARRAY_SIZE(privConstPer)) {
+        uPer = privConstPer [iMargin];
+      }
+    }
+    uPer = 100 - ((100 - uPer) * (100 - min_t(unsigned int,
+                                              pData->uRetryLoss, 100))) / 100;
+
+    for (attempt = 0; attempt < pTXRate->count; attempt++) {
+      puCount [loop]++;
+      *puAirtime += privAirtime(pSkb->len, uRate);
+      if ((privRandom() % 100) >= uPer) {
+        return loop;
+      }
+    }
+  }
+
+  return -1;
+}
+
+/* Survey entry iIdx, 2GHz channels first then 5GHz, or NULL. */
+static SurveyData *privSurveyIndex(mac80211Data *pMacData,
+                                   int iIdx,
+                                   struct ieee80211_channel **ppChannel)
+{
+  if ((iIdx < 0) || (iIdx >= CHANNEL_SIZE_2G + CHANNEL_SIZE_5G)) {
+    return NULL;
+  }
+
+  if (iIdx < CHANNEL_SIZE_2G) {
+    *ppChannel = &pMacData->channel_2g [iIdx];
+    return &pMacData->survey_2g [iIdx];
+  }
+
+  *ppChannel = &pMacData->channel_5g [iIdx - CHANNEL_SIZE_2G];
+  return &pMacData->survey_5g [iIdx - CHANNEL_SIZE_2G];
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0))
+/*
+ * Remove a software queue from our rotation.
+ */
+static void privTxqUnschedule(mac80211Data *pMacData,
+                              struct ieee80211_txq *pTxq)
+{
+  TXQData *pTxqData = (TXQData *)pTxq->drv_priv;
+  unsigned long uSigFlags;
+
+  spin_lock_irqsave(&pMacData->sSpinLock, uSigFlags);
+  if (true == pTxqData->bScheduled) {
+    list_del(&pTxqData->list);
+    pTxqData->bScheduled = false;
+  }
+  pTxqData->bDead = true;
+  spin_unlock_irqrestore(&pMacData->sSpinLock, uSigFlags);
+
+  /*
+   * privTxqRefill may be dequeuing from it with the lock dropped, it
+   * does so in an rcu read section.  mac80211 frees the queue and its
+   * station as soon as we return, so wait that section out.
+   */
+  synchronize_rcu();
+}
+
+/*
+ * mac80211 has frames on a software queue, put it in our rotation and
+ * let the send thread pull from it.
+ */
+static void privWakeTxQueue(struct ieee80211_hw *pHW,
+                            struct ieee80211_txq *pTxq)
+{
+  mac80211Data *pMacData = (mac80211Data *)pHW->priv;
+  TXQData *pTxqData = (TXQData *)pTxq->drv_priv;
+  unsigned long uSigFlags;
+
+  if ((NULL != pMacData) && (pTxq->ac < KLEM_MAX_QOS)) {
+    spin_lock_irqsave(&pMacData->sSpinLock, uSigFlags);
+    if ((false == pTxqData->bScheduled) && (false == pTxqData->bDead)) {
+      list_add_tail(&pTxqData->list, &pMacData->listTxq [pTxq->ac]);
+      pTxqData->bScheduled = true;
+    }
+    spin_unlock_irqrestore(&pMacData->sSpinLock, uSigFlags);
+
+    wake_up_all(&pMacData->sListWait);
+  }
+}
+
+#endif
+
+/*
+ * Called when the wireless mac 802.11 radio is started
+ */
+static int privStart(struct ieee80211_hw *pHW)
+{
+  mac80211Data *pMacData = (mac80211Data *)pHW->priv;
+
+  if (NULL != pMacData) {
+    pMacData->bRadioActive = true;
+    KLEM_LOG("Called (%p)\n", pMacData);
+  }
+  return 0;
+}
+
+/*
+ * Called when the wireless mac 802.11 radio is stopped
+*/
+static void privStop(struct ieee80211_hw *pHW)
+{
+  mac80211Data *pMacData = (mac80211Data *)pHW->priv;
+
+  if (NULL != pMacData) {
+    pMacData->bRadioActive = false;
+
+    KLEM_LOG("Called (%p)\n", pMacData);
+  }
+}
+
+/*
+ * Add wireless interface
+ */
+static int privAddInterface(struct ieee80211_hw *pHW,
+                struct ieee80211_vif *pVIF)
+{
+  mac80211Data *pMacData = (mac80211Data *)pHW->priv;
+  VIFData *pVIFData = (VIFData *)pVIF->drv_priv;
+
+  KLEM_LOG("Called pMacData (%p) pVIFData(%p)\n", pMacData, pVIFData);
+
+  if (NULL != pVIFData) {
+    pVIFData->bActive = true;
+    memset(pVIFData->uKeyCipher, 0, sizeof(pVIFData->uKeyCipher));
+
+    spin_lock_init(&pVIFData->sBeaconLock);
+    pVIFData->pBeacon = NULL;
+    pVIFData->bBeaconRefresh = true;
+    pVIFData->uTimGeneration = atomic_read(&pMacData->uTimGeneration);
+    pVIFData->uTimOffset = 0;
+    pVIFData->uTimGroup = 0;
+    pVIFData->uDtimCount = 0;
+    pVIFData->uDtimPeriod = 1;
+    pVIFData->uBeaconSeq = 0;
+    pVIFData->bGroupLive = false;
+  }
+
+  return 0;
+}
+
+/*
+ * Forget the keys of a station or interface that is going away, so the
+ * counts privRecvHasKey looks at don't keep them.
+ */
+static void privKeyForget(mac80211Data *pMacData, u32 *puCipher,
+                          unsigned int *puKeys)
+{
+  unsigned long uSigFlags;
+  int loop;
+
+  spin_lock_irqsave(&pMacData->sSpinLock, uSigFlags);
+  for (loop = 0; loop < KLEM_MAX_KEYS; loop++) {
+    if ((0 != puCipher [loop]) && (0 != *puKeys)) {
+      *puKeys -= 1;
+    }
+    puCipher [loop] = 0;
+  }
+  spin_unlock_irqrestore(&pMacData->sSpinLock, uSigFlags);
+}
+
+/*
+ * Remove wireless Interface
+ */
+static void privRemoveInterface(struct ieee80211_hw *pHW,
+                struct ieee80211_vif *pVIF)
+{
+  mac80211Data *pMacData = (mac80211Data *)pHW->priv;
+  VIFData *pVIFData = (VIFData *)pVIF->drv_priv;
+  struct sk_buff *pSkb = NULL;
+
+  KLEM_LOG("Called pMacData (%p) pVIFData(%p)\n", pMacData, pVIFData);
+
+  if (NULL != pVIFData) {
+    pVIFData->bActive = false;
+    privKeyForget(pMacData, pVIFData->uKeyCipher, &pMacData->uGroupKeys);
+
+    spin_lock_bh(&pVIFData->sBeaconLock);
+    pSkb = pVIFData->pBeacon;
+    pVIFData->pBeacon = NULL;
+    spin_unlock_bh(&pVIFData->sBeaconLock);
+
+    if (NULL != pSkb) {
+      dev_kfree_skb(pSkb);
+    }
+  }
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0))
+  /* mac80211 frees the queue, make sure we no longer reference it */
+  if (NULL != pVIF->txq) {
+    privTxqUnschedule(pMacData, pVIF->txq);
+  }
+#endif
+
+  KLEM_LOG("Remove Interface pMacData (%p) pVIIFData (%p)\n",
+       pMacData, pVIFData);
+
+}
+
+/*
+ * configurfe beacons
+ *
+ */
+static void privBssInfoChanged(struct ieee80211_hw *pHW,
+                   struct ieee80211_vif *pVIF,
+                   struct ieee80211_bss_conf *pBSS,
+                   u32 uChanged)
+{
+  VIFData *pVIFData = (VIFData *)pVIF->drv_priv;
+  mac80211Data *pMacData = (mac80211Data *)pHW->priv;
+
+  if ((NULL != pMacData) && (NULL != pVIFData)) {
+    if (true == pVIFData->bActive) {
+      /* Could do something with bssid, assoc and aid here. */
+      if (uChanged & (BSS_CHANGED_BEACON | BSS_CHANGED_BEACON_ENABLED)) {
+        spin_lock_bh(&pVIFData->sBeaconLock);
+        pVIFData->bBeaconRefresh = true;
+        spin_unlock_bh(&pVIFData->sBeaconLock);
+      }
+
+      if (uChanged & BSS_CHANGED_BEACON_INT) {
+        if (NULL != pMacData) {
+          pMacData->uBeacons = (pBSS->beacon_int * HZ) >> 10;
+          if (0 == pMacData->uBeacons)
+            pMacData->uBeacons = 1;
+          KLEM_LOG("Beacons = %lud\n", pMacData->uBeacons);
+        }
+      }
+
+      if (uChanged & BSS_CHANGED_ERP_CTS_PROT) {
+        KLEM_LOG("ERP_CTS_PROT: %d\n", pBSS->use_cts_prot);
+      }
+
+      if (uChanged & BSS_CHANGED_ERP_PREAMBLE) {
+        KLEM_LOG("ERP_PREAMBLE: %d\n", pBSS->use_short_preamble);
+      }
+
+      if (uChanged & BSS_CHANGED_ERP_SLOT) {
+        KLEM_LOG("ERP_SLOT: %d\n", pBSS->use_short_slot);
+      }
+
+      if (uChanged & BSS_CHANGED_HT) {
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0))
+        KLEM_LOG("HT: op_mode=0x%x, chantype=%d\n",
+                 pBSS->ht_operation_mode,
+                 pBSS->channel_type);
+#else
+        KLEM_LOG("HT: op_mode=0x%x\n",
+                 pBSS->ht_operation_mode);
+#endif
+      }
+
+      if (uChanged & BSS_CHANGED_BASIC_RATES) {
+        KLEM_LOG("BASIC_RATES: 0x%llx\n",
+                 (unsigned long long)pBSS->basic_rates);
+      }
+    }
+  }
+}
+
+/* Count a station in or out of power save, once each way. */
+static void privStaDozing(mac80211Data *pMacData, STAData *pSTAData,
+                          bool bDozing)
+{
+  unsigned long uSigFlags;
+
+  spin_lock_irqsave(&pMacData->sSpinLock, uSigFlags);
+  if (bDozing != pSTAData->bDozing) {
+    pSTAData->bDozing = bDozing;
+    if (true == bDozing) {
+      atomic_inc(&pMacData->uDozing);
+    } else {
+      atomic_dec(&pMacData->uDozing);
+    }
+  }
+  spin_unlock_irqrestore(&pMacData->sSpinLock, uSigFlags);
+}
+
+static int privStaAdd(struct ieee80211_hw *pHW,
+              struct ieee80211_vif *pVIF,
+              struct ieee80211_sta *pSta)
+{
+  VIFData *pVIFData = (VIFData *)pVIF->drv_priv;
+  STAData *pSTAData = (STAData *)pSta->drv_priv;
+  int loop;
+
+  if ((NULL != pVIFData) && (NULL != pSTAData)) {
+    if (true == pVIFData->bActive) {
+      pSTAData->bActive = true;
+    }
+
+    for (loop = 0; loop < KLEM_MAX_QOS; loop++) {
+      pSTAData->iAirtimeDeficit [loop] = KLEM_AIRTIME_QUANTUM;
+    }
+    pSTAData->uAirtimeTX = 0;
+    pSTAData->uAirtimeRX = 0;
+    memset(pSTAData->uKeyCipher, 0, sizeof(pSTAData->uKeyCipher));
+    memset(pSTAData->uGroupCipher, 0, sizeof(pSTAData->uGroupCipher));
+    memset(pSTAData->uAmpduBuf, 0, sizeof(pSTAData->uAmpduBuf));
+    pSTAData->iNode = -1;
+    pSTAData->bDozing = false;
+  }
+
+  KLEM_LOG("Called pHW(%p) pVIFData(%p) pSTAData(%p)\n",
+       pHW, pVIFData, pSTAData);
+
+  return 0;
+}
+
+static int privStaRemove(struct ieee80211_hw *pHW,
+             struct ieee80211_vif *pVIF,
+             struct ieee80211_sta *pSta)
+{
+  mac80211Data *pMacData = (mac80211Data *)pHW->priv;
+  VIFData *pVIFData = (VIFData *)pVIF->drv_priv;
+  STAData *pSTAData = (STAData *)pSta->drv_priv;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0))
+  int loop;
+#endif
+
+  if ((NULL != pVIFData) && (NULL != pSTAData)) {
+    if (true == pVIFData->bActive) {
+      pSTAData->bActive = false;
+    }
+  }
+
+  if (NULL != pSTAData) {
+    privKeyForget(pMacData, pSTAData->uKeyCipher, &pMacData->uPairwiseKeys);
+    privKeyForget(pMacData, pSTAData->uGroupCipher, &pMacData->uGroupKeys);
+    privStaDozing(pMacData, pSTAData, false);
+  }
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0))
+  /* The station queues are going away, drop them from our rotation */
+  for (loop = 0; loop < ARRAY_SIZE(pSta->txq); loop++) {
+    if (NULL != pSta->txq [loop]) {
+      privTxqUnschedule(pMacData, pSta->txq [loop]);
+    }
+  }
+#endif
+
+  KLEM_LOG("Called pHW(%p) pVIFData(%p) pSTAData(%p)\n",
+       pHW, pVIFData, pSTAData);
+
+  return 0;
+}
+
+/*
+ * Power save of a station changed, beacons are built every interval
+ * while any station dozes so mac80211 releases its group traffic.
+ */
+static void privStaNotify(struct ieee80211_hw *pHW,
+              struct ieee80211_vif *pVIF,
+              enum sta_notify_cmd eCmd,
+              struct ieee80211_sta *pSta)
+{
+  mac80211Data *pMacData = (mac80211Data *)pHW->priv;
+  STAData *pSTAData = (STAData *)pSta->drv_priv;
+
+  KLEM_LOG("Called Command(%d) pHW(%p) pVIF(%p) pSta(%p)\n",
+       eCmd, pHW, pVIF, pSta);
+
+  if ((NULL != pMacData) && (NULL != pSTAData)) {
+    privStaDozing(pMacData, pSTAData, (STA_NOTIFY_SLEEP == eCmd));
+  }
+}
+
+/* TSF of this radio in usec. */
+static u64 privTsf(mac80211Data *pMacData)
+{
+  return ktime_to_us(ktime_get_real()) - atomic64_read(&pMacData->uTsfBase);
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,0))
+static u64 privGetTsf(struct ieee80211_hw *pHW,
+                      struct ieee80211_vif *pVIF)
+#else
+static u64 privGetTsf(struct ieee80211_hw *pHW)
+#endif
+{
+  return privTsf((mac80211Data *)pHW->priv);
+}
+
+/*
+ * Move the TSF of this radio, as an IBSS does when it adopts a peer's.
+ */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,0))
+static void privSetTsf(struct ieee80211_hw *pHW,
+                       struct ieee80211_vif *pVIF,
+                       u64 uTsf)
+#else
+static void privSetTsf(struct ieee80211_hw *pHW, u64 uTsf)
+#endif
+{
+  mac80211Data *pMacData = (mac80211Data *)pHW->priv;
+
+  atomic64_set(&pMacData->uTsfBase,
+               ktime_to_us(ktime_get_real()) - (s64)uTsf);
+}
+
+/*
+ * A station's traffic indication changed, every beacon template of
+ * this radio has a stale TIM and is rebuilt on its next interval.
+ */
+static int privSetTim(struct ieee80211_hw *pHW,
+                      struct ieee80211_sta *pSta,
+                      bool bSet)
+{
+  mac80211Data *pMacData = (mac80211Data *)pHW->priv;
+
+  if (NULL != pMacData) {
+    atomic_inc(&pMacData->uTimGeneration);
+  }
+
+  return 0;
+}
+
+/*
+ * Channel survey, 2GHz channels first then 5GHz.  Times are in msec
+ * since the radio was created, we hear every channel all the time.
+ */
+static int privGetSurvey(struct ieee80211_hw *pHW,
+                         int iIdx,
+                         struct survey_info *pSurvey)
+{
+  mac80211Data *pMacData = (mac80211Data *)pHW->priv;
+  struct ieee80211_channel *pChannel = NULL;
+  SurveyData *pSurveyData = NULL;
+  u64 uTime;
+
+  pSurveyData = privSurveyIndex(pMacData, iIdx, &pChannel);
+  if (NULL == pSurveyData) {
+    return -ENOENT;
+  }
+
+  uTime = ktime_to_us(ktime_get()) - pMacData->uSurveyStart;
+
+  memset(pSurvey, 0, sizeof(struct survey_info));
+  pSurvey->channel = pChannel;
+  pSurvey->noise = KLEM_SURVEY_NOISE;
+  pSurvey->filled = SURVEY_INFO_NOISE_DBM;
+  if (pChannel == privChannel(pMacData)) {
+    pSurvey->filled |= SURVEY_INFO_IN_USE;
+  }
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,0,0))
+  pSurvey->time = div_u64(uTime, 1000);
+  pSurvey->time_busy = div_u64(pSurveyData->uBusy, 1000);
+  pSurvey->time_rx = div_u64(pSurveyData->uRX, 1000);
+  pSurvey->time_tx = div_u64(pSurveyData->uTX, 1000);
+  pSurvey->filled |= SURVEY_INFO_TIME |
+    SURVEY_INFO_TIME_BUSY |
+    SURVEY_INFO_TIME_RX |
+    SURVEY_INFO_TIME_TX;
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38))
+  pSurvey->channel_time = div_u64(uTime, 1000);
+  pSurvey->channel_time_busy = div_u64(pSurveyData->uBusy, 1000);
+  pSurvey->channel_time_rx = div_u64(pSurveyData->uRX, 1000);
+  pSurvey->channel_time_tx = div_u64(pSurveyData->uTX, 1000);
+  pSurvey->filled |= SURVEY_INFO_CHANNEL_TIME |
+    SURVEY_INFO_CHANNEL_TIME_BUSY |
+    SURVEY_INFO_CHANNEL_TIME_RX |
+    SURVEY_INFO_CHANNEL_TIME_TX;
+#endif
+
+  return 0;
+}
+
+static unsigned int privScanHash(const u8 *pBssid, u32 uFrequency)
+{
+  return jhash(pBssid, ETH_ALEN, uFrequency) & (KLEM_SCAN_HASH - 1);
+}
+
+/*
+ * Remember a received beacon or probe response.  The radio hears every
+ * channel on the wire, so this covers channels we are not tuned to.
+ */
+static void privScanCache(mac80211Data *pMacData, struct sk_buff *pSkb)
+{
+  struct ieee80211_mgmt *pMgmt = (struct ieee80211_mgmt *)pSkb->data;
+  struct ieee80211_rx_status *pStat = IEEE80211_SKB_RXCB(pSkb);
+  struct hlist_head *pHead = NULL;
+  struct hlist_node *pNode = NULL;
+  ScanData *pEntry = NULL;
+  ScanData *pStale = NULL;
+  ScanData *pNew = NULL;
+  struct sk_buff *pCopy = NULL;
+  struct sk_buff *pOld = NULL;
+
+  if ((pSkb->len < offsetof(struct ieee80211_mgmt, u.beacon.variable)) ||
+      (!ieee80211_is_beacon(pMgmt->frame_control) &&
+       !ieee80211_is_probe_resp(pMgmt->frame_control))) {
+    return;
+  }
+
+  pCopy = skb_copy(pSkb, GFP_ATOMIC);
+  if (NULL == pCopy) {
+    return;
+  }
+
+  pHead = &pMacData->scanHash [privScanHash(pMgmt->bssid, pStat->freq)];
+
+  spin_lock_bh(&pMacData->sScanLock);
+  for (pNode = pHead->first; NULL != pNode; pNode = pNode->next) {
+    pEntry = hlist_entry(pNode, ScanData, node);
+    if ((pEntry->uFrequency == pStat->freq) &&
+        (0 == memcmp(pEntry->uBssid, pMgmt->bssid, ETH_ALEN))) {
+      break;
+    }
+
+    if (time_after(jiffies, pEntry->uHeard + KLEM_SCAN_AGE)) {
+      pStale = pEntry;
+    }
+    pEntry = NULL;
+  }
+
+  /* A full table reuses something we have not heard from in a while */
+  if ((NULL == pEntry) && (NULL != pStale)) {
+    pEntry = pStale;
+  }
+
+  if ((NULL == pEntry) && (pMacData->uScanEntries < KLEM_SCAN_MAX)) {
+    pNew = kmalloc(sizeof(ScanData), GFP_ATOMIC);
+    if (NULL != pNew) {
+      pNew->pSkb = NULL;
+      hlist_add_head(&pNew->node, pHead);
+      pMacData->uScanEntries++;
+      pEntry = pNew;
+    }
+  }
+
+  if (NULL != pEntry) {
+    memcpy(pEntry->uBssid, pMgmt->bssid, ETH_ALEN);
+    pEntry->uFrequency = pStat->freq;
+    pEntry->uHeard = jiffies;
+    pOld = pEntry->pSkb;
+    pEntry->pSkb = pCopy;
+    pCopy = NULL;
+  }
+  spin_unlock_bh(&pMacData->sScanLock);
+
+  if (NULL != pOld) dev_kfree_skb_any(pOld);
+  if (NULL != pCopy) dev_kfree_skb_any(pCopy);
+}
+
+/*
+ * Copy what was heard on a channel since uSince, called with the scan
+ * lock held.  Probe responses get our address so mac80211 takes them.
+ */
+static void privScanCollect(mac80211Data *pMacData,
+                            struct ieee80211_channel *pChannel,
+                            unsigned long uSince,
+                            struct sk_buff_head *pList)
+{
+  struct hlist_node *pNode = NULL;
+  struct ieee80211_mgmt *pMgmt = NULL;
+  struct sk_buff *pSkb = NULL;
+  ScanData *pEntry = NULL;
+  int loop;
+
+  for (loop = 0; loop < KLEM_SCAN_HASH; loop++) {
+    pNode = pMacData->scanHash [loop].first;
+    for (; NULL != pNode; pNode = pNode->next) {
+      pEntry = hlist_entry(pNode, ScanData, node);
+      if ((pEntry->uFrequency != pChannel->center_freq) ||
+          time_before(pEntry->uHeard, uSince)) {
+        continue;
+      }
+
+      pSkb = skb_copy(pEntry->pSkb, GFP_ATOMIC);
+      if (NULL != pSkb) {
+        pMgmt = (struct ieee80211_mgmt *)pSkb->data;
+        if (ieee80211_is_probe_resp(pMgmt->frame_control)) {
+          memcpy(pMgmt->da, pMacData->uScanAddr, ETH_ALEN);
+        }
+        __skb_queue_tail(pList, pSkb);
+      }
+    }
+  }
+}
+
+static void privScanDone(mac80211Data *pMacData, bool bAborted)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0))
+  struct cfg80211_scan_info sInfo;
+
+  memset(&sInfo, 0, sizeof(sInfo));
+  sInfo.aborted = bAborted;
+  ieee80211_scan_completed(pMacData->pHW, &sInfo);
+#else
+  ieee80211_scan_completed(pMacData->pHW, bAborted);
+#endif
+}
+
+/*
+ * Without a dwell time every requested channel is answered from the
+ * cache at once.  With one we sit on each channel for scan_dwell msec
+ * and report only what was heard meanwhile, like real hardware.
+ */
+static void privScanWork(struct work_struct *pWork)
+{
+  mac80211Data *pMacData = container_of(pWork, mac80211Data,
+                                        scanWork.work);
+  struct cfg80211_scan_request *pReq = NULL;
+  struct sk_buff_head listResult;
+  struct sk_buff *pSkb = NULL;
+  unsigned long uDwell = msecs_to_jiffies(pMacData->pData->uScanDwell);
+  bool bDone = false;
+  int loop;
+
+  skb_queue_head_init(&listResult);
+
+  spin_lock_bh(&pMacData->sScanLock);
+  pReq = pMacData->pScanReq;
+  if (NULL != pReq) {
+    if (0 == uDwell) {
+      for (loop = 0; loop < pReq->n_channels; loop++) {
+        privScanCollect(pMacData, pReq->channels [loop],
+                        jiffies - KLEM_SCAN_AGE, &listResult);
+      }
+      bDone = true;
+    } else {
+      privScanCollect(pMacData, pReq->channels [pMacData->uScanChannel],
+                      pMacData->uScanStart, &listResult);
+      pMacData->uScanChannel++;
+      pMacData->uScanStart = jiffies;
+      if (pMacData->uScanChannel >= pReq->n_channels) {
+        bDone = true;
+      }
+    }
+
+    if (true == bDone) {
+      pMacData->pScanReq = NULL;
+    }
+  }
+  spin_unlock_bh(&pMacData->sScanLock);
+
+  while (NULL != (pSkb = __skb_dequeue(&listResult))) {
+    pMacData->uScanResults++;
+    ieee80211_rx_irqsafe(pMacData->pHW, pSkb);
+  }
+
+  if (NULL != pReq) {
+    if (true == bDone) {
+      privScanDone(pMacData, false);
+    } else {
+      ieee80211_queue_delayed_work(pMacData->pHW, &pMacData->scanWork,
+                                   uDwell);
+    }
+  }
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,17,0))
+static int privHwScan(struct ieee80211_hw *pHW,
+                      struct ieee80211_vif *pVIF,
+                      struct ieee80211_scan_request *pHwReq)
+{
+  struct cfg80211_scan_request *pReq = &pHwReq->req;
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36))
+static int privHwScan(struct ieee80211_hw *pHW,
+                      struct ieee80211_vif *pVIF,
+                      struct cfg80211_scan_request *pReq)
+{
+#else
+static int privHwScan(struct ieee80211_hw *pHW,
+                      struct cfg80211_scan_request *pReq)
+{
+  struct ieee80211_vif *pVIF = NULL;
+#endif
+  mac80211Data *pMacData = (mac80211Data *)pHW->priv;
+  unsigned long uDwell = msecs_to_jiffies(pMacData->pData->uScanDwell);
+  int rvalue = 0;
+
+  spin_lock_bh(&pMacData->sScanLock);
+  if (NULL != pMacData->pScanReq) {
+    rvalue = -EBUSY;
+  } else {
+    pMacData->pScanReq = pReq;
+    pMacData->uScanChannel = 0;
+    pMacData->uScanStart = jiffies;
+    pMacData->uScanNumber++;
+    if (NULL != pVIF) {
+      memcpy(pMacData->uScanAddr, pVIF->addr, ETH_ALEN);
+    } else {
+      memcpy(pMacData->uScanAddr, &pMacData->macAddress, ETH_ALEN);
+    }
+  }
+  spin_unlock_bh(&pMacData->sScanLock);
+
+  if (0 == rvalue) {
+    ieee80211_queue_delayed_work(pHW, &pMacData->scanWork, uDwell);
+  }
+
+  KLEM_LOG("Called pMacData (%p) channels %d (%d)\n",
+           pMacData, pReq->n_channels, rvalue);
+
+  return rvalue;
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0))
+static void privCancelHwScan(struct ieee80211_hw *pHW,
+                             struct ieee80211_vif *pVIF)
+{
+  mac80211Data *pMacData = (mac80211Data *)pHW->priv;
+  struct cfg80211_scan_request *pReq = NULL;
+
+  cancel_delayed_work_sync(&pMacData->scanWork);
+
+  spin_lock_bh(&pMacData->sScanLock);
+  pReq = pMacData->pScanReq;
+  pMacData->pScanReq = NULL;
+  spin_unlock_bh(&pMacData->sScanLock);
+
+  if (NULL != pReq) {
+    privScanDone(pMacData, true);
+  }
+}
+#endif
+
+/* Forget everything heard, the radio is going away. */
+static void privScanFlush(mac80211Data *pMacData)
+{
+  struct hlist_node *pNode = NULL;
+  ScanData *pEntry = NULL;
+  int loop;
+
+  spin_lock_bh(&pMacData->sScanLock);
+  for (loop = 0; loop < KLEM_SCAN_HASH; loop++) {
+    while (NULL != (pNode = pMacData->scanHash [loop].first)) {
+      pEntry = hlist_entry(pNode, ScanData, node);
+      hlist_del(pNode);
+      if (NULL != pEntry->pSkb) dev_kfree_skb_any(pEntry->pSkb);
+      kfree(pEntry);
+    }
+  }
+  pMacData->uScanEntries = 0;
+  spin_unlock_bh(&pMacData->sScanLock);
+}
+
+/*
+ * Emulated hardware crypto.  We only remember which keys are installed,
+ * frames cross the wire in cleartext with KLEM_TAP_FLAG_PROTECTED and
+ * the receiver marks them decrypted if it holds a matching key.
+ * Management frame protection (BIP) stays in software.
+ */
+static int privSetKey(struct ieee80211_hw *pHW,
+                      enum set_key_cmd eCmd,
+                      struct ieee80211_vif *pVIF,
+                      struct ieee80211_sta *pSta,
+                      struct ieee80211_key_conf *pKey)
+{
+  mac80211Data *pMacData = (mac80211Data *)pHW->priv;
+  VIFData *pVIFData = (VIFData *)pVIF->drv_priv;
+  STAData *pSTAData = NULL;
+  unsigned int *puKeys = NULL;
+  u32 *puCipher = NULL;
+  unsigned long uSigFlags;
+  int rvalue = 0;
+
+  /* A bridge has no tap header to carry the protected flag. */
+  if ((NULL == pMacData) || (LEMU != pMacData->pData->eMode)) {
+    return -EOPNOTSUPP;
+  }
+
+  /* Nor does version 1, mac80211 encrypts in software then. */
+  if ((SET_KEY == eCmd) &&
+      (KLEM_WIRE_V2 != klemNetVersion(pMacData->pData->pRawSocket))) {
+    return -EOPNOTSUPP;
+  }
+
+  switch(pKey->cipher)
+    {
+    case WLAN_CIPHER_SUITE_WEP40:
+    case WLAN_CIPHER_SUITE_WEP104:
+    case WLAN_CIPHER_SUITE_TKIP:
+    case WLAN_CIPHER_SUITE_CCMP:
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,0,0))
+    case WLAN_CIPHER_SUITE_CCMP_256:
+    case WLAN_CIPHER_SUITE_GCMP:
+    case WLAN_CIPHER_SUITE_GCMP_256:
+#endif
+      break;
+    default:
+      return -EOPNOTSUPP;
+    }
+
+  if (pKey->keyidx >= KLEM_MAX_KEYS) {
+    return -EOPNOTSUPP;
+  }
+
+  /* A station's key may still be a group key, as in mesh and IBSS */
+  if (pKey->flags & IEEE80211_KEY_FLAG_PAIRWISE) {
+    if (NULL == pSta) {
+      return -EOPNOTSUPP;
+    }
+    pSTAData = (STAData *)pSta->drv_priv;
+    puCipher = &pSTAData->uKeyCipher [pKey->keyidx];
+    puKeys = &pMacData->uPairwiseKeys;
+  } else if (NULL != pSta) {
+    pSTAData = (STAData *)pSta->drv_priv;
+    puCipher = &pSTAData->uGroupCipher [pKey->keyidx];
+    puKeys = &pMacData->uGroupKeys;
+  } else {
+    puCipher = &pVIFData->uKeyCipher [pKey->keyidx];
+    puKeys = &pMacData->uGroupKeys;
+  }
+
+  spin_lock_irqsave(&pMacData->sSpinLock, uSigFlags);
+  switch(eCmd)
+    {
+    case SET_KEY:
+      if (0 == *puCipher) {
+        *puKeys += 1;
+      }
+      *puCipher = pKey->cipher;
+      pKey->hw_key_idx = pKey->keyidx;
+      break;
+    case DISABLE_KEY:
+      if (0 != *puCipher) {
+        *puKeys -= 1;
+      }
+      *puCipher = 0;
+      break;
+    default:
+      rvalue = -EOPNOTSUPP;
+      break;
+    }
+  spin_unlock_irqrestore(&pMacData->sSpinLock, uSigFlags);
+
+  KLEM_LOG("Command(%d) cipher 0x%x idx %d pSta(%p) = %d\n",
+           eCmd, pKey->cipher, pKey->keyidx, pSta, rvalue);
+
+  return rvalue;
+}
+
+/* Any key set in a cipher table? */
+static bool privKeyAny(const u32 *puCipher)
+{
+  int loop;
+
+  for (loop = 0; loop < KLEM_MAX_KEYS; loop++) {
+    if (0 != puCipher [loop]) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* Does an interface of the BSS a group frame came from hold a group key? */
+static void privRecvGroupIter(void *pPtr, u8 *pMac, struct ieee80211_vif *pVIF)
+{
+  GroupMatch *pMatch = (GroupMatch *)pPtr;
+  VIFData *pVIFData = (VIFData *)pVIF->drv_priv;
+  const u8 *pBssid = pVIF->bss_conf.bssid;
+
+  if ((NULL != pBssid) &&
+      (ether_addr_equal(pBssid, pMatch->pWHdr->addr2) ||
+       ether_addr_equal(pBssid, pMatch->pWHdr->addr3)) &&
+      (true == privKeyAny(pVIFData->uKeyCipher))) {
+    pMatch->bFound = true;
+  }
+}
+
+/*
+ * Can we "decrypt" a frame that was protected by a hardware key?
+ * Unicast needs a pairwise key for the sender.  Group traffic needs a
+ * group key of the sender, as mesh and IBSS peers have, or one of the
+ * interface in the sender's BSS.
+ */
+static bool privRecvHasKey(mac80211Data *pMacData,
+                           struct ieee80211_hdr *pWHdr)
+{
+  struct ieee80211_sta *pSta = NULL;
+  STAData *pSTAData = NULL;
+  GroupMatch sMatch;
+  bool bGroup = is_multicast_ether_addr(pWHdr->addr1);
+  bool rvalue = false;
+
+  if (0 == ((true == bGroup) ? pMacData->uGroupKeys :
+            pMacData->uPairwiseKeys)) {
+    return false;
+  }
+
+  rcu_read_lock();
+  pSta = ieee80211_find_sta_by_ifaddr(pMacData->pHW, pWHdr->addr2, NULL);
+  if (NULL != pSta) {
+    pSTAData = (STAData *)pSta->drv_priv;
+    rvalue = privKeyAny((true == bGroup) ? pSTAData->uGroupCipher :
+                        pSTAData->uKeyCipher);
+  }
+  rcu_read_unlock();
+
+  if ((true == bGroup) && (false == rvalue)) {
+    sMatch.pWHdr = pWHdr;
+    sMatch.bFound = false;
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0))
+    ieee80211_iterate_active_interfaces_atomic(pMacData->pHW,
+                                               privRecvGroupIter, &sMatch);
+#else
+    ieee80211_iterate_active_interfaces_atomic(pMacData->pHW,
+                                               IEEE80211_IFACE_ITER_NORMAL,
+                                               privRecvGroupIter, &sMatch);
+#endif
+    rvalue = sMatch.bFound;
+  }
+
+  return rvalue;
+}
+
+/*
+ * CoDel control law, next drop time is interval / sqrt(count) away.
+ * int_sqrt is scaled by 2^16 to keep 8 bits of fraction.
+ */
+static inline s64 privCodelControlLaw(s64 iTime,
+                                      unsigned int uInterval,
+                                      unsigned int uCount)
+{
+  return iTime + div_u64((u64)uInterval << 8,
+                         int_sqrt((unsigned long)uCount << 16));
+}
+
+/*
+ * Put a packet on a fake hardware queue.  The caller holds sSpinLock.
+ * Returns false if the queue has no room, the caller owns the packet.
+ */
+static bool privQueueEnqueue(mac80211Data *pMacData,
+                             unsigned int uqos,
+                             struct sk_buff *pSkb)
+{
+  KLEMData *pData = pMacData->pData;
+  struct qos_info *pQos = &pMacData->qos [uqos];
+
+  /* The hard cap covers packets mac80211 had in flight when we stopped */
+  if ((pQos->uBytesQueued + pSkb->len) > pData->queue.uMaxBytes) {
+    pQos->uSendDroppedNumber++;
+    return false;
+  }
+
+  /* Remember when we queued it, CoDel wants the sojourn time */
+  pSkb->tstamp = ktime_get();
+  skb_queue_tail(&pQos->listSkb, pSkb);
+  pQos->uBytesQueued += pSkb->len;
+
+  /* Reached our byte limit, so a network issue don't consume all mem */
+  if (pQos->uBytesQueued >= pQos->uByteLimit) {
+    if (true == pQos->bListActive) {
+      pQos->bListActive = false;
+      ieee80211_stop_queue(pMacData->pHW, uqos);
+    }
+  }
+
+  return true;
+}
+
+/*
+ * Remove the head of a fake hardware queue and account for it.
+ * The caller holds sSpinLock.
+ */
+static struct sk_buff *privQueuePull(mac80211Data *pMacData,
+                                     unsigned int uqos)
+{
+  KLEMData *pData = pMacData->pData;
+  struct qos_info *pQos = &pMacData->qos [uqos];
+  struct sk_buff *pSkb = NULL;
+  unsigned long uElapsed;
+  u64 uRate;
+
+  pSkb = skb_dequeue(&pQos->listSkb);
+  if (NULL != pSkb) {
+    pQos->uBytesQueued -= pSkb->len;
+    pQos->uDrainBytes += pSkb->len;
+
+    /*
+     * We emptied the queue while mac80211 was held off, the limit
+     * starved the hardware, let it grow by this packet.
+     */
+    if ((0 == pQos->uBytesQueued) && (false == pQos->bListActive)) {
+      pQos->uByteLimit = min(pQos->uByteLimit + pSkb->len,
+                             pData->queue.uMaxBytes);
+    }
+
+    /* Size the limit to the drain rate seen in the last window */
+    uElapsed = jiffies - pQos->uDrainStart;
+    if (uElapsed >= KLEM_DRAIN_WINDOW) {
+      uRate = div_u64((u64)pQos->uDrainBytes * HZ, uElapsed);
+      uRate = div_u64(uRate * pData->queue.uTimeUsec, USEC_PER_SEC);
+      pQos->uByteLimit = clamp_t(u64, uRate,
+                                 pData->queue.uMinBytes,
+                                 pData->queue.uMaxBytes);
+      pQos->uDrainBytes = 0;
+      pQos->uDrainStart = jiffies;
+    }
+  }
+
+  return pSkb;
+}
+
+/*
+ * Decide if CoDel would like to drop the packet at the head.
+ */
+static bool privCodelShouldDrop(mac80211Data *pMacData,
+                                unsigned int uqos,
+                                struct sk_buff *pSkb,
+                                s64 iNow)
+{
+  KLEMData *pData = pMacData->pData;
+  struct qos_info *pQos = &pMacData->qos [uqos];
+  s64 iSojourn;
+
+  iSojourn = iNow - ktime_to_us(pSkb->tstamp);
+
+  /* Below target, or we only hold about a packet, nothing to do */
+  if ((iSojourn < pData->queue.uCodelTarget) ||
+      (pQos->uBytesQueued <= ETH_FRAME_LEN)) {
+    pQos->iCodelFirstAbove = 0;
+    return false;
+  }
+
+  if (0 == pQos->iCodelFirstAbove) {
+    pQos->iCodelFirstAbove = iNow + pData->queue.uCodelInterval;
+    return false;
+  }
+
+  return (iNow >= pQos->iCodelFirstAbove);
+}
+
+/*
+ * Dequeue the next packet to transmit, running CoDel on the way.
+ * Packets CoDel drops are put on pDropList, the caller completes
+ * them once sSpinLock is released.
+ */
+static struct sk_buff *privQueueDequeue(mac80211Data *pMacData,
+                                        unsigned int uqos,
+                                        struct sk_buff_head *pDropList)
+{
+  KLEMData *pData = pMacData->pData;
+  struct qos_info *pQos = &pMacData->qos [uqos];
+  struct sk_buff *pSkb = NULL;
+  bool bDrop;
+  s64 iNow;
+
+  pSkb = privQueuePull(pMacData, uqos);
+  if (NULL == pSkb) {
+    pQos->bCodelDropping = false;
+    return NULL;
+  }
+
+  iNow = ktime_to_us(ktime_get());
+  bDrop = privCodelShouldDrop(pMacData, uqos, pSkb, iNow);
+
+  if (true == pQos->bCodelDropping) {
+    if (false == bDrop) {
+      /* Sojourn time is back below target, leave drop state. */
+      pQos->bCodelDropping = false;
+    } else {
+      while ((NULL != pSkb) &&
+             (true == pQos->bCodelDropping) &&
+             (iNow >= pQos->iCodelDropNext)) {
+        __skb_queue_tail(pDropList, pSkb);
+        pQos->uCodelDropNumber++;
+        pQos->uCodelCount++;
+
+        pSkb = privQueuePull(pMacData, uqos);
+        if ((NULL == pSkb) ||
+            (false == privCodelShouldDrop(pMacData, uqos, pSkb, iNow))) {
+          pQos->bCodelDropping = false;
+        } else {
+          pQos->iCodelDropNext =
+            privCodelControlLaw(pQos->iCodelDropNext,
+                                pData->queue.uCodelInterval,
+                                pQos->uCodelCount);
+        }
+      }
+    }
+  } else if (true == bDrop) {
+    /* First drop, then decide how hard to start the drop state. */
+    __skb_queue_tail(pDropList, pSkb);
+    pQos->uCodelDropNumber++;
+    pSkb = privQueuePull(pMacData, uqos);
+
+    pQos->bCodelDropping = true;
+    if ((pQos->uCodelCount > 2) &&
+        ((iNow - pQos->iCodelDropNext) <
+         (16 * (s64)pData->queue.uCodelInterval))) {
+      pQos->uCodelCount -= 2;
+    } else {
+      pQos->uCodelCount = 1;
+    }
+    pQos->iCodelDropNext = privCodelControlLaw(iNow,
+                                               pData->queue.uCodelInterval,
+                                               pQos->uCodelCount);
+  }
+
+  /* Let mac80211 have the queue back once we fall below half the limit */
+  if (false == pQos->bListActive) {
+    if (pQos->uBytesQueued <= (pQos->uByteLimit >> 1)) {
+      ieee80211_wake_queue(pMacData->pHW, uqos);
+      pQos->bListActive = true;
+    }
+  }
+
+  return pSkb;
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0))
+/*
+ * Fill a fake hardware queue from the mac80211 software queues.
+ *
+ * Stations take turns by airtime deficit round robin, so one greedy
+ * station can't fill the hardware queue for everyone.  Each dequeued
+ * frame is charged its estimated airtime.
+ */
+static void privTxqRefill(mac80211Data *pMacData, unsigned int uqos)
+{
+  struct qos_info *pQos = &pMacData->qos [uqos];
+  struct ieee80211_txq *pTxq = NULL;
+  TXQData *pTxqData = NULL;
+  STAData *pSTAData = NULL;
+  struct sk_buff *pSkb = NULL;
+  unsigned long uSigFlags;
+  unsigned int uAirtime;
+  bool bQueued;
+  bool bDead;
+
+  while (true) {
+    spin_lock_irqsave(&pMacData->sSpinLock, uSigFlags);
+
+    /* Stop once the hardware queue is at its byte limit. */
+    if ((pQos->uBytesQueued >= pQos->uByteLimit) ||
+        (list_empty(&pMacData->listTxq [uqos]))) {
+      spin_unlock_irqrestore(&pMacData->sSpinLock, uSigFlags);
+      break;
+    }
+
+    pTxqData = list_first_entry(&pMacData->listTxq [uqos], TXQData, list);
+    pTxq = container_of((void *)pTxqData, struct ieee80211_txq, drv_priv);
+    pSTAData = (NULL != pTxq->sta) ? (STAData *)pTxq->sta->drv_priv : NULL;
+
+    /* Station used its share this round, give it more and move on. */
+    if ((NULL != pSTAData) && (pSTAData->iAirtimeDeficit [uqos] <= 0)) {
+      pSTAData->iAirtimeDeficit [uqos] += KLEM_AIRTIME_QUANTUM;
+      list_move_tail(&pTxqData->list, &pMacData->listTxq [uqos]);
+      spin_unlock_irqrestore(&pMacData->sSpinLock, uSigFlags);
+      continue;
+    }
+
+    /*
+     * Off the rotation while we dequeue, mac80211 may wake it again.
+     * The rcu read section keeps privTxqUnschedule, and so the free of
+     * the queue and its station, waiting until we are done with them.
+     */
+    list_del(&pTxqData->list);
+    pTxqData->bScheduled = false;
+    rcu_read_lock();
+    spin_unlock_irqrestore(&pMacData->sSpinLock, uSigFlags);
+
+    pSkb = ieee80211_tx_dequeue(pMacData->pHW, pTxq);
+    if (NULL == pSkb) {
+      /* Queue is empty, it stays out until mac80211 wakes it. */
+      rcu_read_unlock();
+      continue;
+    }
+
+    /* Aggregated frames share the preamble, only charge the payload. */
+    if (IEEE80211_SKB_CB(pSkb)->flags & IEEE80211_TX_CTL_AMPDU) {
+      uAirtime =
+        privAirtimePayload(pSkb->len,
+                           privTXRate(pMacData, IEEE80211_SKB_CB(pSkb)));
+    } else {
+      uAirtime = privAirtime(pSkb->len,
+                             privTXRate(pMacData, IEEE80211_SKB_CB(pSkb)));
+    }
+
+    spin_lock_irqsave(&pMacData->sSpinLock, uSigFlags);
+
+    /* Its station or interface may be going away, don't requeue it */
+    bDead = pTxqData->bDead;
+    if ((false == bDead) && (NULL != pSTAData)) {
+      pSTAData->iAirtimeDeficit [uqos] -= uAirtime;
+      pSTAData->uAirtimeTX += uAirtime;
+    }
+
+    bQueued = privQueueEnqueue(pMacData, uqos, pSkb);
+
+    /* It may hold more frames, back to the end of the rotation. */
+    if ((false == pTxqData->bScheduled) && (false == bDead)) {
+      list_add_tail(&pTxqData->list, &pMacData->listTxq [uqos]);
+      pTxqData->bScheduled = true;
+    }
+    spin_unlock_irqrestore(&pMacData->sSpinLock, uSigFlags);
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5,1,0))
+    /* Only feeds the station's tx duration, the scheduling is ours */
+    if ((false == bDead) && (NULL != pTxq->sta)) {
+      ieee80211_sta_register_airtime(pTxq->sta, pTxq->tid, uAirtime, 0);
+    }
+#endif
+    rcu_read_unlock();
+
+    if (false == bQueued) {
+      privCompleteTX(pMacData, pSkb, false);
+    }
+  }
+}
+#endif
+
+/*
+ * Put a packet back at the head of a fake hardware queue, undoing
+ * privQueuePull.  The caller holds sSpinLock.
+ */
+static void privQueueRequeue(mac80211Data *pMacData,
+                             unsigned int uqos,
+                             struct sk_buff *pSkb)
+{
+  struct qos_info *pQos = &pMacData->qos [uqos];
+
+  skb_queue_head(&pQos->listSkb, pSkb);
+  pQos->uBytesQueued += pSkb->len;
+  if (pQos->uDrainBytes >= pSkb->len) {
+    pQos->uDrainBytes -= pSkb->len;
+  }
+}
+
+/*
+ * Would pNext go into the same A-MPDU as pFirst, same receiver and tid?
+ */
+static bool privAmpduMatch(struct sk_buff *pFirst, struct sk_buff *pNext)
+{
+  struct ieee80211_hdr *pFirstHdr = (struct ieee80211_hdr *)pFirst->data;
+  struct ieee80211_hdr *pNextHdr = (struct ieee80211_hdr *)pNext->data;
+
+  if (0 == (IEEE80211_SKB_CB(pNext)->flags & IEEE80211_TX_CTL_AMPDU)) {
+    return false;
+  }
+
+  if ((pFirst->priority & IEEE80211_QOS_CTL_TID_MASK) !=
+      (pNext->priority & IEEE80211_QOS_CTL_TID_MASK)) {
+    return false;
+  }
+
+  return ether_addr_equal(pFirstHdr->addr1, pNextHdr->addr1);
+}
+
+/*
+ * Block ack window the receiver of an aggregate agreed to.
+ */
+static unsigned int privAmpduWindow(struct sk_buff *pSkb)
+{
+  struct ieee80211_tx_info *pInfo = IEEE80211_SKB_CB(pSkb);
+  struct ieee80211_hdr *pWHdr = (struct ieee80211_hdr *)pSkb->data;
+  struct ieee80211_sta *pSta = NULL;
+  unsigned int utid = pSkb->priority & IEEE80211_QOS_CTL_TID_MASK;
+  unsigned int rvalue = 1;
+
+  if ((NULL == pInfo->control.vif) || (utid >= KLEM_MAX_TID)) {
+    return rvalue;
+  }
+
+  rcu_read_lock();
+  pSta = ieee80211_find_sta(pInfo->control.vif, pWHdr->addr1);
+  if (NULL != pSta) {
+    rvalue = ((STAData *)pSta->drv_priv)->uAmpduBuf [utid];
+  }
+  rcu_read_unlock();
+
+  return max_t(unsigned int, rvalue, 1);
+}
+
+/*
+ * pSkb starts an aggregate, pull the MPDUs that follow it for the same
+ * receiver and tid off the queue, as long as they fit the block ack
+ * window and one wire frame.  Returns the number of MPDUs in ppSkb.
+ */
+static unsigned int privAmpduCollect(mac80211Data *pMacData,
+                                     unsigned int uqos,
+                                     struct sk_buff **ppSkb,
+                                     struct sk_buff_head *pDropList)
+{
+  KLEMData *pData = pMacData->pData;
+  struct sk_buff *pNext = NULL;
+  unsigned long uSigFlags;
+  unsigned int uCount = 1;
+  unsigned int uBytes;
+  unsigned int uRoom;
+  unsigned int uMax;
+
+  if (0 == (IEEE80211_SKB_CB(ppSkb [0])->flags & IEEE80211_TX_CTL_AMPDU)) {
+    return uCount;
+  }
+
+  uMax = min_t(unsigned int, privAmpduWindow(ppSkb [0]), KLEM_MAX_SUBFRAMES);
+  uRoom = klemNetPayload(pData->pRawSocket);
+  uBytes = sizeof(KLEM_SUB_HEADER) + ppSkb [0]->len;
+
+  spin_lock_irqsave(&pMacData->sSpinLock, uSigFlags);
+  while (uCount < uMax) {
+    pNext = skb_peek(&pMacData->qos [uqos].listSkb);
+    if ((NULL == pNext) || (false == privAmpduMatch(ppSkb [0], pNext)) ||
+        ((uBytes + sizeof(KLEM_SUB_HEADER) + pNext->len) > uRoom)) {
+      break;
+    }
+
+    /* CoDel may hand us a different packet than the one we peeked */
+    pNext = privQueueDequeue(pMacData, uqos, pDropList);
+    if (NULL == pNext) {
+      break;
+    }
+    if ((false == privAmpduMatch(ppSkb [0], pNext)) ||
+        ((uBytes + sizeof(KLEM_SUB_HEADER) + pNext->len) > uRoom)) {
+      privQueueRequeue(pMacData, uqos, pNext);
+      break;
+    }
+
+    uBytes += sizeof(KLEM_SUB_HEADER) + pNext->len;
+    ppSkb [uCount++] = pNext;
+  }
+  spin_unlock_irqrestore(&pMacData->sSpinLock, uSigFlags);
+
+  return uCount;
+}
+
+/*
+ * Common Transmit sk_buff through wireless device
+ */
+static inline void privCommonTX(struct ieee80211_hw *pHW, struct sk_buff *pSkb)
+{
+  mac80211Data *pMacData = (mac80211Data *)pHW->priv;
+  struct ieee80211_hdr *pHdr = NULL;
+  unsigned int uqos = 0;
+  unsigned long uSigFlags;
+  bool bQueued;
+
+  if ((NULL != pMacData) && (NULL != pSkb)) {
+    if (true == pMacData->bRadioActive) {
+      if (pSkb->len < 10) {
+        KLEM_MSG(" drop this small packet\n");
+        dev_kfree_skb(pSkb);
+      } else {
+        pHdr = (struct ieee80211_hdr *)pSkb->data;
+
+        /* Determine the qos mapping */
+        if (ieee80211_is_data_qos(pHdr->frame_control)) {
+          uqos = skb_get_queue_mapping(pSkb);
+        }
 
+        /*
+         * Assuming we have a valid qos, enqueue the packet onto our
+         * fake hardware.
+         */
+        if (uqos < KLEM_MAX_QOS) {
+          spin_lock_irqsave(&pMacData->sSpinLock, uSigFlags);
+          bQueued = privQueueEnqueue(pMacData, uqos, pSkb);
           spin_unlock_irqrestore(&pMacData->sSpinLock, uSigFlags);
 
-          /* Added the packet, wake a potential sleeper. */
-          wake_up_all(&pMacData->sListWait);
+          if (true == bQueued) {
+            /* Added the packet, wake a potential sleeper. */
+            wake_up_all(&pMacData->sListWait);
+          } else {
+            /* Our fake hardware ran out of storage space, drop packet */
+            privCompleteTX(pMacData, pSkb, false);
+          }
+        } else {
+          privCompleteTX(pMacData, pSkb, false);
         }
       }
     } else {
@@ -906,7 +2798,8 @@ static int privQueuePoll(void *pPtr)
     if (true == pMacData->bActive) {
       spin_lock_irqsave(&pMacData->sSpinLock, uSigFlags);
       for (loop = 0; loop < KLEM_MAX_QOS; loop++) {
-        if (skb_queue_len(&pMacData->qos [loop].listSkb) > 0) {
+        if ((skb_queue_len(&pMacData->qos [loop].listSkb) > 0) ||
+            (!list_empty(&pMacData->listTxq [loop]))) {
           rvalue = loop;
           break;
         }
@@ -920,71 +2813,530 @@ static int privQueuePoll(void *pPtr)
   return rvalue;
 }
 
-/* Quick function to transmit a beacon */
-void privBeaconTX(void *pPtr, u8 *mac,
-          struct ieee80211_vif *pVIF)
+/*
+ * Priority of a frame on the wire.  Qos data goes by the access
+ * category mac80211 queued it on, other data is best effort, and
+ * management is voice as mac80211 sends it.
+ */
+static void privMetaPriority(struct sk_buff *pSkb, KLEM_META *pMeta)
+{
+  struct ieee80211_hdr *pHdr = (struct ieee80211_hdr *)pSkb->data;
+  unsigned int uAc = IEEE80211_AC_VO;
+
+  if (ieee80211_is_data_qos(pHdr->frame_control)) {
+    uAc = min_t(unsigned int, skb_get_queue_mapping(pSkb),
+                KLEM_MAX_QOS - 1);
+  } else if (ieee80211_is_data(pHdr->frame_control)) {
+    uAc = IEEE80211_AC_BE;
+  }
+
+  pMeta->rate.uFlags = (pMeta->rate.uFlags & ~KLEM_RATE_PCP_MASK) |
+    (privConstAcPcp [uAc] << KLEM_RATE_PCP_SHIFT);
+}
+
+/*
+ * Describe a frame on our current channel for the wire headers.
+ */
+static void privMetaFill(mac80211Data *pMacData,
+                         struct sk_buff *pSkb,
+                         u32 uFlags,
+                         KLEM_META *pMeta)
 {
-  struct ieee80211_hw *pHW = (struct ieee80211_hw *)pPtr;
-  mac80211Data *pMacData = (mac80211Data *)pHW->priv;
-  KLEMData *pData = (KLEMData *)pMacData->pData;
+  memset(pMeta, 0, sizeof(KLEM_META));
+
+  /* Put in the information on band, frequency, etc */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0))
+  pMeta->uBand = (u32)pMacData->pHW->conf.channel->band;
+  pMeta->uFrequency = (u32)pMacData->pHW->conf.channel->center_freq;
+#else
+  pMeta->uBand = (u32)pMacData->pHW->conf.chandef.chan->band;
+  pMeta->uFrequency = (u32)pMacData->pHW->conf.chandef.chan->center_freq;
+#endif
+  pMeta->iPower = pMacData->pHW->conf.power_level;
+  pMeta->uId = pMacData->pData->uDeviceId;
+  pMeta->uFlags = uFlags | KLEM_TAP_FLAG_RATE;
+
+  /* The receiver reports the rate we sent at */
+  privRateFromTX(IEEE80211_SKB_CB(pSkb), &pMeta->rate);
+  privMetaPriority(pSkb, pMeta);
+}
+
+/*
+ * Ask mac80211 for a fresh beacon and remember where its TIM lives,
+ * called with the vif beacon lock held.
+ */
+static void privBeaconRefresh(mac80211Data *pMacData,
+                              struct ieee80211_vif *pVIF,
+                              VIFData *pVIFData)
+{
+  struct sk_buff *pSkb = NULL;
+  unsigned int uOffset = offsetof(struct ieee80211_mgmt, u.beacon.variable);
+
+  if (NULL != pVIFData->pBeacon) {
+    dev_kfree_skb_any(pVIFData->pBeacon);
+    pVIFData->pBeacon = NULL;
+  }
+
+  pVIFData->bBeaconRefresh = false;
+  pVIFData->uTimGeneration = atomic_read(&pMacData->uTimGeneration);
+  pVIFData->uTimOffset = 0;
+
+  pSkb = ieee80211_beacon_get(pMacData->pHW, pVIF);
+  if (NULL == pSkb) {
+    return;
+  }
+
+  if (pSkb->len < uOffset) {
+    dev_kfree_skb_any(pSkb);
+    return;
+  }
+
+  /* element id, length, dtim count, dtim period, bitmap control ... */
+  while (uOffset + 2 <= pSkb->len) {
+    if (uOffset + 2 + pSkb->data [uOffset + 1] > pSkb->len) {
+      break;
+    }
+
+    if ((WLAN_EID_TIM == pSkb->data [uOffset]) &&
+        (3 <= pSkb->data [uOffset + 1])) {
+      pVIFData->uTimOffset = uOffset;
+      pVIFData->uTimGroup = pSkb->data [uOffset + 4] & 0x01;
+      pVIFData->uDtimCount = pSkb->data [uOffset + 2];
+      pVIFData->uDtimPeriod = pSkb->data [uOffset + 3];
+      if (0 == pVIFData->uDtimPeriod)
+        pVIFData->uDtimPeriod = 1;
+      break;
+    }
+
+    uOffset += 2 + pSkb->data [uOffset + 1];
+  }
+
+  pVIFData->pBeacon = pSkb;
+  pMacData->uBeaconBuilds++;
+}
+
+/*
+ * Take the beacon of an interface, the cached template gets the fields
+ * that move every interval and a clone of it goes on pPtr's list.
+ * Runs in the atomic interface walk, sending can sleep so
+ * privBeaconSend does that afterwards.
+ */
+static void privBeaconTX(void *pPtr, u8 *mac,
+                         struct ieee80211_vif *pVIF)
+{
+  BeaconList *pList = (BeaconList *)pPtr;
+  mac80211Data *pMacData = pList->pMacData;
+  VIFData *pVIFData = (VIFData *)pVIF->drv_priv;
+  struct ieee80211_mgmt *pMgmt = NULL;
   struct sk_buff *pSkb = NULL;
-  KLEM_TAP_HEADER sTapHdr;
+  u8 *pTim = NULL;
+  bool bDozing;
+  bool bDtim = false;
 
   /* is the mac 802.11 active? */
   if (true == pMacData->bActive) {
     if (true == pMacData->bRadioActive) {
-      pSkb = ieee80211_beacon_get(pHW, pVIF);
+      spin_lock_bh(&pVIFData->sBeaconLock);
+
+      /*
+       * While a station dozes mac80211 buffers group traffic, and only
+       * its own DTIM count knows when to announce and release it.  So
+       * every beacon is built then, DTIM ones included, until a DTIM
+       * beacon after the last station woke up.
+       */
+      bDozing = (0 != atomic_read(&pMacData->uDozing));
+      if (true == bDozing) {
+        pVIFData->bGroupLive = true;
+      }
 
-      if (NULL != pSkb) {
-        if (LEMU == pData->eMode) {
-          /* Put in the information on band, frequency, etc */
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0))
-          sTapHdr.uBand = htonl((u32)pMacData->pHW->conf.channel->band);
-          sTapHdr.uFrequency =
-            htonl((u32)pMacData->pHW->conf.channel->center_freq);
-          sTapHdr.uPower = htonl((u32)pMacData->pHW->conf.power_level);
-#else
-          sTapHdr.uBand = htonl((u32)pMacData->pHW->conf.chandef.chan->band);
-          sTapHdr.uFrequency =
-            htonl((u32)pMacData->pHW->conf.chandef.chan->center_freq);
-          sTapHdr.uPower = htonl((u32)pMacData->pHW->conf.power_level);
-#endif
-          sTapHdr.uId = htonl((u32)pData->uDeviceId);
+      if ((true == pVIFData->bBeaconRefresh) ||
+          (true == pVIFData->bGroupLive) ||
+          (pVIFData->uTimGeneration !=
+           atomic_read(&pMacData->uTimGeneration))) {
+        privBeaconRefresh(pMacData, pVIF, pVIFData);
+      }
+
+      if (NULL != pVIFData->pBeacon) {
+        pMgmt = (struct ieee80211_mgmt *)pVIFData->pBeacon->data;
+        pMgmt->u.beacon.timestamp = cpu_to_le64(privTsf(pMacData));
+        pMgmt->seq_ctrl = cpu_to_le16((pVIFData->uBeaconSeq << 4) &
+                                      IEEE80211_SCTL_SEQ);
+        pVIFData->uBeaconSeq++;
 
-          klemTransmit(pData->pRawSocket, pSkb,
-                       (char *)&sTapHdr, sizeof(KLEM_TAP_HEADER));
+        /*
+         * Buffered group traffic is only announced on DTIM beacons, the
+         * bit mac80211 set comes back on each one until the next build.
+         */
+        if (0 != pVIFData->uTimOffset) {
+          pTim = pVIFData->pBeacon->data + pVIFData->uTimOffset;
+          pTim [2] = pVIFData->uDtimCount;
+          if (0 != pVIFData->uDtimCount) {
+            pTim [4] &= ~0x01;
+            pVIFData->uDtimCount--;
+          } else {
+            pTim [4] = (pTim [4] & ~0x01) | pVIFData->uTimGroup;
+            pVIFData->uDtimCount = pVIFData->uDtimPeriod - 1;
+            bDtim = pVIFData->bGroupLive;
+            pVIFData->bGroupLive = bDozing;
+          }
         } else {
-          klemTransmit(pData->pRawSocket, pSkb,
-                       NULL, 0);
+          /* No TIM, no DTIM to wait for */
+          pVIFData->bGroupLive = false;
         }
-        pMacData->uBeaconCount++;
-        dev_kfree_skb(pSkb);
+
+        pSkb = skb_clone(pVIFData->pBeacon, GFP_ATOMIC);
+      }
+
+      spin_unlock_bh(&pVIFData->sBeaconLock);
+
+      if (NULL != pSkb) {
+        __skb_queue_tail(&pList->listBeacon, pSkb);
+      }
+
+      /* What mac80211 buffered for the group goes out after the DTIM */
+      while ((true == bDtim) &&
+             (NULL != (pSkb = ieee80211_get_buffered_bc(pMacData->pHW,
+                                                        pVIF)))) {
+        __skb_queue_tail(&pList->listGroup, pSkb);
       }
     }
   }
 }
 
 /*
- * comlpete packet transmission
+ * comlpete packet transmission, uAmpduLen is the size of the aggregate
+ * this packet started, or 0.  puCount holds the attempts made with each
+ * rate entry, NULL for a frame that never went out.
  */
-static void privCompleteTX(void *pPtr, struct sk_buff *pSkb, bool bAck)
+static void privCompleteStatus(mac80211Data *pMacData,
+                               struct sk_buff *pSkb,
+                               bool bAck,
+                               unsigned int uAmpduLen,
+                               const u8 *puCount)
 {
-  mac80211Data *pMacData = (mac80211Data *)pPtr;
   struct ieee80211_tx_info *pTXResp = NULL;
+  int loop;
+
+  /* Drop that packet offically */
+  skb_orphan(pSkb);
+  skb_dst_drop(pSkb);
+  pSkb->mark = 0;
+  secpath_reset(pSkb);
+  nf_reset(pSkb);
+
+  pTXResp = IEEE80211_SKB_CB(pSkb);
+  ieee80211_tx_info_clear_status(pTXResp);
+
+  /* Rate control learns from what each rate entry cost */
+  if (NULL != puCount) {
+    for (loop = 0; loop < IEEE80211_TX_MAX_RATES; loop++) {
+      pTXResp->status.rates [loop].count = puCount [loop];
+      if (0 == puCount [loop]) {
+        pTXResp->status.rates [loop].idx = -1;
+      }
+    }
+  }
+
+  if ((0 == (pTXResp->flags & IEEE80211_TX_CTL_NO_ACK)) && (true == bAck)) {
+    pTXResp->flags |= IEEE80211_TX_STAT_ACK;
+  }
+
+  /* Block ack result, rate control looks at it on the first MPDU */
+  if (0 != uAmpduLen) {
+    pTXResp->flags |= IEEE80211_TX_STAT_AMPDU;
+    pTXResp->status.ampdu_len = uAmpduLen;
+    pTXResp->status.ampdu_ack_len = (true == bAck) ? uAmpduLen : 0;
+  }
+  ieee80211_tx_status_irqsafe(pMacData->pHW, pSkb);
+}
+
+static void privCompleteTX(void *pPtr, struct sk_buff *pSkb, bool bAck)
+{
+  privCompleteStatus((mac80211Data *)pPtr, pSkb, bAck, 0, NULL);
+}
+
+/*
+ * Report a frame that waited for its remote ack, caller holds
+ * sAckWait.
+ */
+static void privAckComplete(mac80211Data *pMacData, AckData *pAck, bool bAck)
+{
+  privCompleteStatus(pMacData, pAck->pSkb, bAck, 0, pAck->uCount);
+  pAck->pSkb = NULL;
+  pMacData->uAckPending--;
+  if (true == bAck) {
+    pMacData->uAckNumber++;
+  } else {
+    pMacData->uAckLost++;
+  }
+}
+
+/*
+ * Hold a frame sent with wire sequence uSequence until its ack comes
+ * back.  A frame still in the slot, or the oldest one when the order
+ * list is full, is given up.  Caller holds sAckWait.
+ */
+static void privAckWait(mac80211Data *pMacData,
+                        struct sk_buff *pSkb,
+                        u32 uSequence,
+                        const u8 *puCount)
+{
+  AckData *pAck = &pMacData->ackSlot [uSequence & (KLEM_ACK_SLOTS - 1)];
+  AckData *pOld = NULL;
+  u32 uOld;
+
+  if (NULL != pAck->pSkb) {
+    privAckComplete(pMacData, pAck, false);
+  }
+
+  if (pMacData->uAckHead - pMacData->uAckTail >= KLEM_ACK_SLOTS) {
+    uOld = pMacData->uAckOrder [pMacData->uAckTail & (KLEM_ACK_SLOTS - 1)];
+    pOld = &pMacData->ackSlot [uOld & (KLEM_ACK_SLOTS - 1)];
+    if ((NULL != pOld->pSkb) && (uOld == pOld->uSequence)) {
+      privAckComplete(pMacData, pOld, false);
+    }
+    pMacData->uAckTail++;
+  }
+
+  pAck->pSkb = pSkb;
+  pAck->uSequence = uSequence;
+  pAck->uSent = jiffies;
+  pMacData->uAckPending++;
+  memcpy(pAck->uCount, puCount, IEEE80211_TX_MAX_RATES);
+  pMacData->uAckOrder [pMacData->uAckHead & (KLEM_ACK_SLOTS - 1)] = uSequence;
+  pMacData->uAckHead++;
+}
+
+/*
+ * Give up on frames whose ack is overdue, or on all of them with bAll.
+ */
+static void privAckExpire(mac80211Data *pMacData, bool bAll)
+{
+  unsigned long uTimeout = msecs_to_jiffies(pMacData->pData->uAckTimeout);
+  AckData *pAck = NULL;
+  u32 uSequence;
+
+  down(&pMacData->sAckWait);
+  while (pMacData->uAckTail != pMacData->uAckHead) {
+    uSequence = pMacData->uAckOrder [pMacData->uAckTail &
+                                     (KLEM_ACK_SLOTS - 1)];
+    pAck = &pMacData->ackSlot [uSequence & (KLEM_ACK_SLOTS - 1)];
+    if ((NULL != pAck->pSkb) && (uSequence == pAck->uSequence)) {
+      if ((false == bAll) && time_before(jiffies, pAck->uSent + uTimeout)) {
+        break;
+      }
+      privAckComplete(pMacData, pAck, false);
+    }
+    pMacData->uAckTail++;
+  }
+  up(&pMacData->sAckWait);
+}
+
+/*
+ * Put frames on the wire, more than one frame goes out as an A-MPDU
+ * in a single wire frame.
+ */
+static void privSendFrames(mac80211Data *pMacData,
+                           struct sk_buff **ppSkb,
+                           unsigned int uCount)
+{
+  KLEMData *pData = pMacData->pData;
+  struct ieee80211_tx_info *pInfo = NULL;
+  struct ieee80211_hdr *pWHdr = NULL;
+  KLEM_META sMeta;
+  u32 uFlags = 0;
+  unsigned int uRate;
+  unsigned int uAirtime;
+  unsigned int loop;
+  u8 uAttempts [IEEE80211_TX_MAX_RATES] = { 1 };
+  int iEntry = 0;
+  bool bUnicast;
+  bool bAcked = true;
+
+  /* Our own airtime, an aggregate shares one preamble */
+  uRate = privTXRate(pMacData, IEEE80211_SKB_CB(ppSkb [0]));
+  uAirtime = privAirtime(ppSkb [0]->len, uRate);
+  for (loop = 1; loop < uCount; loop++) {
+    uAirtime += privAirtimePayload(ppSkb [loop]->len, uRate);
+  }
+
+  /* A unicast frame may take a few tries, and only the last one counts */
+  pInfo = IEEE80211_SKB_CB(ppSkb [0]);
+  pWHdr = (struct ieee80211_hdr *)ppSkb [0]->data;
+  bUnicast = ((LEMU == pData->eMode) && (1 == uCount) &&
+              (0 == (pInfo->flags & IEEE80211_TX_CTL_NO_ACK)) &&
+              (!is_multicast_ether_addr(pWHdr->addr1)));
+  if ((true == pData->bRetry) && (true == bUnicast) &&
+      (true == privRetryUsable(pInfo))) {
+    iEntry = privRetryChain(pMacData, ppSkb [0], uAttempts, &uAirtime);
+    for (loop = 0; loop < IEEE80211_TX_MAX_RATES; loop++) {
+      pMacData->uRetryNumber += uAttempts [loop];
+    }
+    pMacData->uRetryNumber--;
+    if (iEntry < 0) {
+      pMacData->uRetryFailed++;
+    }
+  }
+  pWHdr = NULL;
+  privAirTX(pMacData, uAirtime);
+
+  if (iEntry < 0) {
+    /* Every attempt failed, nobody heard it */
+    privCompleteStatus(pMacData, ppSkb [0], false, 0, uAttempts);
+    return;
+  }
+
+  /* Only a version 2 wire tells the receiver which frame to ack */
+  if ((true == pData->bAck) && (true == bUnicast) &&
+      (KLEM_WIRE_V2 == klemNetVersion(pData->pRawSocket))) {
+    uFlags |= KLEM_TAP_FLAG_ACKREQ;
+  }
+
+  if (LEMU == pData->eMode) {
+    /* Our fake hardware "encrypts", flag it on the wire */
+    for (loop = 0; loop < uCount; loop++) {
+      pInfo = IEEE80211_SKB_CB(ppSkb [loop]);
+      if (NULL != pInfo->control.hw_key) {
+        pWHdr = (struct ieee80211_hdr *)ppSkb [loop]->data;
+        pWHdr->frame_control |= cpu_to_le16(IEEE80211_FCTL_PROTECTED);
+        uFlags |= KLEM_TAP_FLAG_PROTECTED;
+      }
+    }
+
+    if (uCount > 1) {
+      uFlags |= KLEM_TAP_FLAG_AMPDU;
+      privMetaFill(pMacData, ppSkb [0], uFlags, &sMeta);
+      klemTransmitList(pData->pRawSocket, ppSkb, uCount, &sMeta);
+      pMacData->uAmpduNumber++;
+      pMacData->uAmpduFrames += uCount;
+    } else {
+      privMetaFill(pMacData, ppSkb [0], uFlags, &sMeta);
+      privRateFromEntry(&pInfo->control.rates [iEntry], &sMeta.rate);
+      privMetaPriority(ppSkb [0], &sMeta);
+
+      if (uFlags & KLEM_TAP_FLAG_ACKREQ) {
+        /*
+         * Held until the receiving host acks it.  Pruned frames come
+         * back without the flag, nobody will ack those.
+         */
+        down(&pMacData->sAckWait);
+        if ((0 != klemTransmit(pData->pRawSocket, ppSkb [0], &sMeta)) &&
+            (sMeta.uFlags & KLEM_TAP_FLAG_ACKREQ)) {
+          privAckWait(pMacData, ppSkb [0], sMeta.uSequence, uAttempts);
+          ppSkb [0] = NULL;
+        } else {
+          pMacData->uAckLost++;
+          bAcked = false;
+        }
+        up(&pMacData->sAckWait);
+
+        if (NULL == ppSkb [0]) {
+          return;
+        }
+      } else {
+        /*
+         * Transmit that packet,
+         * and encapulate a mactap header.  Small ones may wait a
+         * little to share a wire frame.
+         */
+        klemTransmitCoalesce(pData->pRawSocket, ppSkb [0], &sMeta);
+      }
+    }
+  } else {
+    KLEM_MSG("bridge send \n");
+    for (loop = 0; loop < uCount; loop++) {
+      klemTransmit(pData->pRawSocket, ppSkb [loop], NULL);
+    }
+  }
+
+  /* Indicate a success transmission, an aggregate reports a block ack */
+  pInfo = IEEE80211_SKB_CB(ppSkb [0]);
+  if (pInfo->flags & IEEE80211_TX_CTL_AMPDU) {
+    for (loop = 0; loop < uCount; loop++) {
+      privCompleteStatus(pMacData, ppSkb [loop], bAcked,
+                         (0 == loop) ? uCount : 0, uAttempts);
+    }
+  } else {
+    privCompleteStatus(pMacData, ppSkb [0], bAcked, 0, uAttempts);
+  }
+}
+
+/*
+ * EDCA channel access for a qos queue.  Wait for the medium to be idle
+ * for AIFS, then count down a random backoff that freezes while others
+ * are on the air.  Returns the usec still to wait, 0 to transmit now.
+ */
+static unsigned int privCsmaDefer(mac80211Data *pMacData, unsigned int uqos)
+{
+  struct qos_info *pQos = &pMacData->qos [uqos];
+  u64 uBusyStart;
+  u64 uBusyEnd;
+  u64 uIdle;
+  u64 uNow;
+  u64 uSlots;
+  u64 uDeadline;
+
+  if (false == klemMediumCarrier(pMacData->pData->pMedium,
+                                 privChannel(pMacData)->center_freq,
+                                 &uBusyStart, &uBusyEnd)) {
+    return 0;
+  }
+
+  uNow = ktime_to_us(ktime_get());
+  uIdle = uBusyEnd + KLEM_CSMA_SIFS + pQos->aifs * KLEM_CSMA_SLOT;
+
+  if (KLEM_CSMA_NONE == pQos->iBackoff) {
+    pQos->iBackoff = privRandom() % ((u32)pQos->cw_min + 1);
+    pQos->uBackoffFrom = uIdle;
+  }
+
+  /* Someone took the channel, keep the slots that went by before */
+  if (pQos->uBackoffFrom < uIdle) {
+    if (uBusyStart > pQos->uBackoffFrom) {
+      uSlots = div_u64(uBusyStart - pQos->uBackoffFrom, KLEM_CSMA_SLOT);
+      pQos->iBackoff -= (int)min_t(u64, uSlots, pQos->iBackoff);
+    }
+    pQos->uBackoffFrom = uIdle;
+  }
+
+  uDeadline = uIdle + (u64)pQos->iBackoff * KLEM_CSMA_SLOT;
+  if (uNow < uDeadline) {
+    return (unsigned int)min_t(u64, uDeadline - uNow, USEC_PER_SEC);
+  }
+
+  /* Our turn, the next frame draws a new backoff */
+  pQos->iBackoff = KLEM_CSMA_NONE;
+  return 0;
+}
+
+/*
+ * Put the beacons privBeaconTX collected on the wire, from the send
+ * thread.  Group traffic released by a DTIM beacon follows it.
+ */
+static void privBeaconSend(mac80211Data *pMacData, BeaconList *pList)
+{
+  KLEMData *pData = pMacData->pData;
+  struct sk_buff *pSkb = NULL;
+  KLEM_META sMeta;
 
-  /* Drop that packet offically */
-  skb_orphan(pSkb);
-  skb_dst_drop(pSkb);
-  pSkb->mark = 0;
-  secpath_reset(pSkb);
-  nf_reset(pSkb);
+  while (NULL != (pSkb = __skb_dequeue(&pList->listBeacon))) {
+    privAirTX(pMacData,
+              privAirtime(pSkb->len,
+                          privTXRate(pMacData, IEEE80211_SKB_CB(pSkb))));
 
-  pTXResp = IEEE80211_SKB_CB(pSkb);
-  ieee80211_tx_info_clear_status(pTXResp);
-  if ((0 == (pTXResp->flags & IEEE80211_TX_CTL_NO_ACK)) && (true == bAck)) {
-    pTXResp->flags |= IEEE80211_TX_STAT_ACK;
+    if (LEMU == pData->eMode) {
+      privMetaFill(pMacData, pSkb, 0, &sMeta);
+      klemTransmitCoalesce(pData->pRawSocket, pSkb, &sMeta);
+    } else {
+      klemTransmit(pData->pRawSocket, pSkb, NULL);
+    }
+    pMacData->uBeaconCount++;
+    dev_kfree_skb(pSkb);
+  }
+
+  while (NULL != (pSkb = __skb_dequeue(&pList->listGroup))) {
+    privSendFrames(pMacData, &pSkb, 1);
   }
-  ieee80211_tx_status_irqsafe(pMacData->pHW, pSkb);
 }
 
 /*
@@ -1000,101 +3352,144 @@ static int privSendRawThread(void *pPtr)
   KLEMData *pData = pMacData->pData;
   unsigned int uqos = 0;
   struct sk_buff *pSkb = NULL;
-  KLEM_TAP_HEADER sTapHdr;
+  struct sk_buff *pSkbDrop = NULL;
+  struct sk_buff_head listDrop;
+  struct sk_buff *ppSkb [KLEM_MAX_SUBFRAMES];
+  BeaconList sBeacons;
+  unsigned int uCount;
   unsigned long ctime;
+  unsigned long uSigFlags;
+  unsigned int uDefer;
+  long lDelay;
+  long lAckDelay;
 
   set_user_nice(current, -20);
+  __skb_queue_head_init(&listDrop);
+  sBeacons.pMacData = pMacData;
+  __skb_queue_head_init(&sBeacons.listBeacon);
+  __skb_queue_head_init(&sBeacons.listGroup);
 
   ctime = jiffies + pMacData->uBeacons;
   while ((false == kthread_should_stop()) &&
          (false != pMacData->bActive)) {
 
-    /* Wait until we have something to do. */
-    wait_event_interruptible_timeout(pMacData->sListWait,
-                                     ((uqos = privQueuePoll(pMacData)) < KLEM_MAX_QOS),
-                                     pMacData->uBeacons);
+    /*
+     * Wait until we have something to do, or small frames waiting
+     * on the wire side are due.
+     */
+    lDelay = klemNetFlushDelay(pData->pRawSocket);
+
+    /* Frames waiting for an ack are given up on in time */
+    if (pMacData->uAckHead != pMacData->uAckTail) {
+      lAckDelay = (long)pData->uAckTimeout * USEC_PER_MSEC;
+      lDelay = (lDelay < 0) ? lAckDelay : min(lDelay, lAckDelay);
+    }
+
+    if (lDelay < 0) {
+      wait_event_interruptible_timeout(pMacData->sListWait,
+                                       ((uqos = privQueuePoll(pMacData)) < KLEM_MAX_QOS),
+                                       pMacData->uBeacons);
+    } else if (lDelay > 0) {
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0))
+      wait_event_interruptible_hrtimeout(pMacData->sListWait,
+                                         ((uqos = privQueuePoll(pMacData)) < KLEM_MAX_QOS),
+                                         ns_to_ktime((u64)lDelay * NSEC_PER_USEC));
+#else
+      wait_event_interruptible_timeout(pMacData->sListWait,
+                                       ((uqos = privQueuePoll(pMacData)) < KLEM_MAX_QOS),
+                                       max_t(long, usecs_to_jiffies(lDelay), 1));
+#endif
+    } else {
+      uqos = privQueuePoll(pMacData);
+    }
 
     if (true == pMacData->bActive) {
       if (false == pMacData->bIdle) {
         if (true == pMacData->bRadioActive) {
           if (jiffies < ctime) {
-            if (uqos < KLEM_MAX_QOS) {
+            /* Others on the channel go first */
+            if ((uqos < KLEM_MAX_QOS) &&
+                (LEMU == pData->eMode) &&
+                (0 != (uDefer = privCsmaDefer(pMacData, uqos)))) {
+              pMacData->qos [uqos].uDeferNumber++;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36))
+              usleep_range(uDefer, uDefer + KLEM_CSMA_SLOT);
+#else
+              msleep(DIV_ROUND_UP(uDefer, USEC_PER_MSEC));
+#endif
+            } else if (uqos < KLEM_MAX_QOS) {
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0))
+              /* Top up the fake hardware from the mac80211 queues. */
+              privTxqRefill(pMacData, uqos);
+#endif
+
               /* remove a packet from the list. */
-              spin_lock(&pMacData->sSpinLock);
+              spin_lock_irqsave(&pMacData->sSpinLock, uSigFlags);
 
               /* We have the qos position from the privQueuePoll above. */
-              pSkb = skb_dequeue(&pMacData->qos [uqos].listSkb);
+              pSkb = privQueueDequeue(pMacData, uqos, &listDrop);
 
-              /* We should always have a packet here, but check anyways. */
               if (NULL != pSkb) {
-                pMacData->qos [uqos].uListDepth--;
-                if (pMacData->qos [uqos].bListActive == false) {
-                  if (pMacData->qos [uqos].uListDepth <= KLEM_QUEUE_LOW) {
-                    ieee80211_wake_queue(pMacData->pHW, uqos);
-                    pMacData->qos [uqos].bListActive = true;
-                  }
-                }
-              }
-
-              if (uqos < KLEM_QUEUE_LOW) {
                 pMacData->qos [uqos].uSendNumber++;
               }
 
               /* Done removing the packet, release this portion of data */
-              spin_unlock(&pMacData->sSpinLock);
+              spin_unlock_irqrestore(&pMacData->sSpinLock, uSigFlags);
+
+              /* Let mac80211 know about anything CoDel dropped */
+              while (NULL != (pSkbDrop = __skb_dequeue(&listDrop))) {
+                privCompleteTX(pMacData, pSkbDrop, false);
+              }
 
               if (NULL != pSkb) {
-                if (LEMU == pData->eMode) {
-                  /* Put in the information on band, frequency, etc */
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0))
-                  sTapHdr.uBand = htonl((u32)pMacData->pHW->conf.channel->band);
-                  sTapHdr.uFrequency =
-                    htonl((u32)pMacData->pHW->conf.channel->center_freq);
-#else
-                  sTapHdr.uBand = htonl((u32)pMacData->pHW->conf.chandef.chan->band);
-                  sTapHdr.uFrequency =
-                    htonl((u32)pMacData->pHW->conf.chandef.chan->center_freq);
-#endif
-                  sTapHdr.uPower = htonl((u32)pMacData->pHW->conf.power_level);
-                  sTapHdr.uId = htonl((u32)pData->uDeviceId);
-
-                  /*
-                   * Transmit that packet,
-                   * and encapulate a mactap header.
-                   */
-                  klemTransmit(pData->pRawSocket, pSkb,
-                               (char *)&sTapHdr, sizeof(KLEM_TAP_HEADER));
-                } else {
-                  KLEM_MSG("bridge send \n");
-                  klemTransmit(pData->pRawSocket, pSkb, NULL, 0);
+                ppSkb [0] = pSkb;
+                uCount = 1;
+
+                /*
+                 * Frames of a block ack session go out aggregated, on
+                 * a version 2 wire that has the flag for it.
+                 */
+                if ((LEMU == pData->eMode) &&
+                    (KLEM_WIRE_V2 == klemNetVersion(pData->pRawSocket))) {
+                  uCount = privAmpduCollect(pMacData, uqos, ppSkb, &listDrop);
+                  while (NULL != (pSkbDrop = __skb_dequeue(&listDrop))) {
+                    privCompleteTX(pMacData, pSkbDrop, false);
+                  }
+                  pMacData->qos [uqos].uSendNumber += uCount - 1;
                 }
 
-                /* Indicate a success transmission */
-                privCompleteTX(pMacData, pSkb, true);
-              } else {
-                /* Indicate a success transmission */
-                privCompleteTX(pMacData, pSkb, false);
+                privSendFrames(pMacData, ppSkb, uCount);
               }
             }
           } else {
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0))
             ieee80211_iterate_active_interfaces_atomic(pMacData->pHW,
                                                        privBeaconTX,
-                                                       pMacData->pHW);
+                                                       &sBeacons);
 #else
             ieee80211_iterate_active_interfaces_atomic(pMacData->pHW,
 						       IEEE80211_IFACE_ITER_NORMAL,
                                                        privBeaconTX,
-                                                       pMacData->pHW);
+                                                       &sBeacons);
 #endif
+            privBeaconSend(pMacData, &sBeacons);
             ctime = jiffies + pMacData->uBeacons;
             pMacData->uBeaconCount++;
           }
         }
       }
+
+      /* Small frames that waited long enough go out now */
+      klemNetFlush(pData->pRawSocket, false);
+      privAckExpire(pMacData, false);
+      klemNetProbe(pData->pRawSocket);
+      klemNetHello(pData->pRawSocket);
     }
   }
 
+  /* Nothing acks what is still waiting */
+  privAckExpire(pMacData, true);
+
   /* Clean up any packets the might here. */
   for (uqos = 0; uqos < KLEM_MAX_QOS; uqos++) {
     pSkb = skb_dequeue(&pMacData->qos [uqos].listSkb);
@@ -1102,6 +3497,7 @@ static int privSendRawThread(void *pPtr)
       dev_kfree_skb(pSkb);
       pSkb = skb_dequeue(&pMacData->qos [uqos].listSkb);
     }
+    pMacData->qos [uqos].uBytesQueued = 0;
   }
 
   while ((false == kthread_should_stop())) {
@@ -1114,40 +3510,451 @@ static int privSendRawThread(void *pPtr)
   return 0;
 }
 
-void klem80211Recv(void *pPtr, struct sk_buff *pSkb)
+/*
+ * Report the rate the sender used in the receive status.  Anything we
+ * can't report, or this kernel can't, becomes the lowest legacy rate.
+ */
+static void privRecvRate(mac80211Data *pMacData,
+                         struct ieee80211_rx_status *pStat,
+                         KLEM_RATE_HEADER *pRate)
+{
+  struct ieee80211_supported_band *pBand = NULL;
+  bool bValid = false;
+
+  switch (pRate->uEncoding) {
+  case KLEM_RATE_LEGACY:
+    if (pStat->band < ARRAY_SIZE(pMacData->pHW->wiphy->bands)) {
+      pBand = pMacData->pHW->wiphy->bands [pStat->band];
+    }
+    bValid = ((NULL != pBand) && (pRate->uIndex < pBand->n_bitrates));
+    break;
+  case KLEM_RATE_HT:
+    bValid = ((pRate->uIndex <= 7) &&
+              (pRate->uNss >= 1) && (pRate->uNss <= 4));
+    break;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0))
+  case KLEM_RATE_VHT:
+    bValid = ((pRate->uIndex <= 9) &&
+              (pRate->uNss >= 1) && (pRate->uNss <= 8));
+    break;
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0))
+  case KLEM_RATE_HE:
+    bValid = ((pRate->uIndex <= 11) &&
+              (pRate->uNss >= 1) && (pRate->uNss <= 8));
+    break;
+#endif
+  default:
+    break;
+  }
+
+  if (false == bValid) {
+    memset(pRate, 0, sizeof(KLEM_RATE_HEADER));
+  }
+
+  pStat->rate_idx = pRate->uIndex;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,12,0))
+  switch (pRate->uEncoding) {
+  case KLEM_RATE_HT:
+    pStat->encoding = RX_ENC_HT;
+    pStat->rate_idx += (pRate->uNss - 1) * 8;
+    break;
+  case KLEM_RATE_VHT:
+    pStat->encoding = RX_ENC_VHT;
+    pStat->nss = pRate->uNss;
+    break;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0))
+  case KLEM_RATE_HE:
+    pStat->encoding = RX_ENC_HE;
+    pStat->nss = pRate->uNss;
+    break;
+#endif
+  default:
+    pStat->encoding = RX_ENC_LEGACY;
+    break;
+  }
+
+  switch (pRate->uFlags & KLEM_RATE_BW_MASK) {
+  case KLEM_RATE_BW_40:
+    pStat->bw = RATE_INFO_BW_40;
+    break;
+  case KLEM_RATE_BW_80:
+    pStat->bw = RATE_INFO_BW_80;
+    break;
+  case KLEM_RATE_BW_160:
+    pStat->bw = RATE_INFO_BW_160;
+    break;
+  default:
+    pStat->bw = RATE_INFO_BW_20;
+    break;
+  }
+
+  if ((pRate->uFlags & KLEM_RATE_FLAG_SGI) &&
+      (KLEM_RATE_HE != pRate->uEncoding)) {
+    pStat->enc_flags |= RX_ENC_FLAG_SHORT_GI;
+  }
+  if (pRate->uFlags & KLEM_RATE_FLAG_SHORTPRE) {
+    pStat->enc_flags |= RX_ENC_FLAG_SHORTPRE;
+  }
+#else
+  if (KLEM_RATE_HT == pRate->uEncoding) {
+    pStat->flag |= RX_FLAG_HT;
+    pStat->rate_idx += (pRate->uNss - 1) * 8;
+  }
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0))
+  if (KLEM_RATE_VHT == pRate->uEncoding) {
+    pStat->flag |= RX_FLAG_VHT;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,9,0))
+    pStat->vht_nss = pRate->uNss;
+#endif
+  }
+#endif
+
+  switch (pRate->uFlags & KLEM_RATE_BW_MASK) {
+  case KLEM_RATE_BW_40:
+    pStat->flag |= RX_FLAG_40MHZ;
+    break;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0))
+  case KLEM_RATE_BW_80:
+    pStat->vht_flag |= RX_VHT_FLAG_80MHZ;
+    break;
+  case KLEM_RATE_BW_160:
+    pStat->vht_flag |= RX_VHT_FLAG_160MHZ;
+    break;
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0))
+  case KLEM_RATE_BW_80:
+    pStat->flag |= RX_FLAG_80MHZ;
+    break;
+  case KLEM_RATE_BW_160:
+    pStat->flag |= RX_FLAG_160MHZ;
+    break;
+#endif
+  default:
+    break;
+  }
+
+  if (pRate->uFlags & KLEM_RATE_FLAG_SGI) {
+    pStat->flag |= RX_FLAG_SHORT_GI;
+  }
+  if (pRate->uFlags & KLEM_RATE_FLAG_SHORTPRE) {
+    pStat->flag |= RX_FLAG_SHORTPRE;
+  }
+#endif
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5,1,0))
+/*
+ * Charge the airtime of a received data frame to the station that sent
+ * it, so mac80211 airtime fairness sees both directions.
+ */
+static void privRecvAirtime(mac80211Data *pMacData,
+                            struct sk_buff *pSkb,
+                            unsigned int utid,
+                            unsigned int uRate)
+{
+  struct ieee80211_hdr *pWHdr = (struct ieee80211_hdr *)pSkb->data;
+  struct ieee80211_sta *pSta = NULL;
+  STAData *pSTAData = NULL;
+  unsigned int uAirtime;
+
+  uAirtime = privAirtime(pSkb->len, uRate);
+
+  rcu_read_lock();
+  pSta = ieee80211_find_sta_by_ifaddr(pMacData->pHW, pWHdr->addr2, NULL);
+  if (NULL != pSta) {
+    pSTAData = (STAData *)pSta->drv_priv;
+    pSTAData->uAirtimeRX += uAirtime;
+    ieee80211_sta_register_airtime(pSta, utid, 0, uAirtime);
+  }
+  rcu_read_unlock();
+}
+#endif
+
+/*
+ * Hand a received frame, with its rx status filled in, to mac80211.
+ * uRate is the rate it was sent at in 100kbps.
+ */
+static void privRecvDeliver(mac80211Data *pMacData,
+                            struct sk_buff *pSkb,
+                            unsigned int uRate)
+{
+  struct ieee80211_hdr *pWHdr = (struct ieee80211_hdr *)pSkb->data;
+  unsigned int uqos = 0;
+  unsigned int utid = 0;
+
+  if (ieee80211_is_data_qos(pWHdr->frame_control)) {
+    utid = *((u8*)ieee80211_get_qos_ctl(pWHdr)) &
+      IEEE80211_QOS_CTL_TID_MASK;
+    switch(utid)
+      {
+      case 6:
+      case 7:
+        uqos = 0;
+        break;
+      case 4:
+      case 5:
+        uqos = 1;
+        break;
+      case 0:
+      case 3:
+        uqos = 2;
+        break;
+      case 1:
+      case 2:
+        uqos = 3;
+        break;
+      default:
+        uqos = 0;
+        break;
+      }
+  }
+
+  pMacData->qos [uqos].uRecvNumber++;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5,1,0))
+  if (ieee80211_is_data(pWHdr->frame_control)) {
+    privRecvAirtime(pMacData, pSkb, utid, uRate);
+  }
+#endif
+  if (ieee80211_is_mgmt(pWHdr->frame_control)) {
+    privScanCache(pMacData, pSkb);
+  }
+  ieee80211_rx_irqsafe(pMacData->pHW, pSkb);
+}
+
+/*
+ * Split a received A-MPDU into its MPDUs.  Every MPDU but the last is
+ * copied out, the last one reuses the wire buffer.
+ */
+static void privRecvAMPDU(mac80211Data *pMacData,
+                          struct sk_buff *pSkb,
+                          unsigned int uRate)
+{
+  struct ieee80211_rx_status *pStat = IEEE80211_SKB_RXCB(pSkb);
+  KLEM_SUB_HEADER *pSubHdr = NULL;
+  struct sk_buff *pSubSkb = NULL;
+  unsigned int uLength;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,6,0))
+  u32 uReference = pMacData->uAmpduReference++;
+
+  pStat->flag |= RX_FLAG_AMPDU_DETAILS;
+  pStat->ampdu_reference = uReference;
+#endif
+
+  while (pSkb->len >= sizeof(KLEM_SUB_HEADER)) {
+    pSubHdr = (KLEM_SUB_HEADER *)pSkb->data;
+    uLength = ntohs(pSubHdr->uLength);
+    skb_pull(pSkb, sizeof(KLEM_SUB_HEADER));
+
+    /* Don't trust a length we can't hold */
+    if ((uLength < 10) || (uLength > pSkb->len)) {
+      break;
+    }
+
+    if (uLength == pSkb->len) {
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,6,0))
+      pStat->flag |= RX_FLAG_AMPDU_IS_LAST;
+#endif
+      privRecvDeliver(pMacData, pSkb, uRate);
+      return;
+    }
+
+    pSubSkb = dev_alloc_skb(uLength);
+    if (NULL != pSubSkb) {
+      memcpy(skb_put(pSubSkb, uLength), pSkb->data, uLength);
+      memcpy(IEEE80211_SKB_RXCB(pSubSkb), pStat, sizeof(*pStat));
+      privRecvDeliver(pMacData, pSubSkb, uRate);
+    }
+    skb_pull(pSkb, uLength);
+  }
+
+  /* Whatever is left is malformed */
+  dev_kfree_skb(pSkb);
+}
+
+static void privRecvAddrIter(void *pPtr, u8 *pMac, struct ieee80211_vif *pVIF)
+{
+  AddrMatch *pMatch = (AddrMatch *)pPtr;
+
+  if (ether_addr_equal(pMac, pMatch->pAddr)) {
+    pMatch->bFound = true;
+  }
+}
+
+/*
+ * Is pAddr one of our active interfaces?  Their addresses may have
+ * been changed from the one the wiphy was registered with.
+ */
+static bool privRecvForUs(mac80211Data *pMacData, const u8 *pAddr)
+{
+  AddrMatch sMatch;
+
+  sMatch.pAddr = pAddr;
+  sMatch.bFound = false;
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0))
+  ieee80211_iterate_active_interfaces_atomic(pMacData->pHW,
+                                             privRecvAddrIter, &sMatch);
+#else
+  ieee80211_iterate_active_interfaces_atomic(pMacData->pHW,
+                                             IEEE80211_IFACE_ITER_NORMAL,
+                                             privRecvAddrIter, &sMatch);
+#endif
+
+  return sMatch.bFound;
+}
+
+/*
+ * A frame from the wire, pMeta holds what the klem headers said about
+ * it and is NULL in bridge mode.  bDecided frames come back from the
+ * medium daemon, which already took care of the signal and
+ * interference.
+ */
+static void privRecv(KLEMData *pData, struct sk_buff *pSkb,
+                     KLEM_META *pMeta, bool bDecided)
 {
-  KLEMData *pData = (KLEMData *)pPtr;
   mac80211Data *pMacData = (mac80211Data *)pData->pMacData;
-  KLEM_TAP_HEADER *pTapHdr = (KLEM_TAP_HEADER *)pSkb->data;
   struct ieee80211_rx_status recvStat;
   struct ieee80211_hdr *pWHdr = NULL;
-  unsigned int uqos = 0;
-  unsigned int utmp;
+  KLEM_RATE_HEADER sRate;
+  unsigned int uRate = 10;
+  unsigned int uAirtime = 0;
+  u16 uNav;
+  int iSignal;
+  u32 uFlags = 0;
   struct sk_buff *pTmpSkb = pSkb;
   bool bRecvFlag = false;
 
   if (NULL != pMacData) {
     if (true == pMacData->bRadioActive) {
-      if (LEMU == pData->eMode) {
+      if ((LEMU == pData->eMode) && (NULL != pMeta)) {
         memset(&recvStat, 0, sizeof(recvStat));
 
         /* Get the needed recv information. */
-        recvStat.band = ntohl(pTapHdr->uBand);
-        recvStat.freq = ntohl(pTapHdr->uFrequency);
-        recvStat.signal = ntohl(pTapHdr->uPower);
-        recvStat.rate_idx = 1;
+        recvStat.band = pMeta->uBand;
+        recvStat.freq = pMeta->uFrequency;
+        recvStat.signal = pMeta->iPower;
+        uFlags = pMeta->uFlags;
+
+        /* The rate it was sent at, older senders don't tell us */
+        memset(&sRate, 0, sizeof(sRate));
+        if (uFlags & KLEM_TAP_FLAG_RATE) {
+          memcpy(&sRate, &pMeta->rate, sizeof(KLEM_RATE_HEADER));
+        }
+        privRecvRate(pMacData, &recvStat, &sRate);
 
-        /* Get the wireless header */
-        pWHdr = (struct ieee80211_hdr *)skb_pull(pTmpSkb,
-                                                 sizeof(KLEM_TAP_HEADER));
+        /* Back on the access category it was sent from */
+        pTmpSkb->priority = KLEM_RATE_PCP(sRate.uFlags);
+        skb_set_queue_mapping(pTmpSkb,
+                              privConstPcpAc [pTmpSkb->priority]);
+        uRate = privRateBitrate(pMacData, recvStat.band, &sRate);
+
+        /* Get the wireless header, an A-MPDU starts with a sub header */
+        pWHdr = (struct ieee80211_hdr *)pTmpSkb->data;
+        if (uFlags & KLEM_TAP_FLAG_AMPDU) {
+          pWHdr = (struct ieee80211_hdr *)(pTmpSkb->data +
+                                           sizeof(KLEM_SUB_HEADER));
+        }
 
-        utmp = ntohl(pTapHdr->uId);
-        if (utmp < MAX_WIRELESS_NODE) {
-          if (false == pData->bFilterNode [utmp]) {
-            memcpy(IEEE80211_SKB_RXCB(pTmpSkb), &recvStat, sizeof(recvStat));
+        if ((0 == (uFlags & ~KLEM_TAP_FLAGS_KNOWN)) &&
+            (pTmpSkb->len >=
+             (unsigned int)((u8 *)pWHdr - pTmpSkb->data) + 10) &&
+            (pMeta->uId < MAX_WIRELESS_NODE)) {
+          if (false == pData->bFilterNode [pMeta->uId]) {
             bRecvFlag = true;
           }
         }
+
+        /*
+         * An external medium decides, the frame comes back later.  It
+         * was on the air whatever the daemon makes of it, so it keeps
+         * the channel busy now; the skb may be gone once posted.
+         */
+        if ((true == bRecvFlag) && (false == bDecided)) {
+          uAirtime = privAirtime(pTmpSkb->len, uRate);
+          uNav = le16_to_cpu(pWHdr->duration_id);
+          if (uNav & 0x8000) {
+            uNav = 0;
+          }
+          if (true == klemDevPost(pData->pDevice, pTmpSkb, pMeta)) {
+            klemMediumBusy(pData->pMedium, recvStat.freq, uAirtime + uNav);
+            privSurveyAdd(pMacData, recvStat.freq, uAirtime,
+                          true, false, false);
+            pTmpSkb = NULL;
+            bRecvFlag = false;
+          }
+          uAirtime = 0;
+        }
+
+        /* Path loss from where the sender is, too weak is not heard */
+        if ((true == bRecvFlag) && (false == bDecided)) {
+          iSignal = pMeta->iPower;
+          if (true == klemMediumSignal(pData->pMedium, pMeta->uId,
+                                       pData->uDeviceId, pMeta->uFrequency,
+                                       &iSignal)) {
+            recvStat.signal = iSignal;
+          } else {
+            bRecvFlag = false;
+          }
+        }
+
+        /* What we hear keeps the channel busy, even if we can't use it */
+        if ((true == bRecvFlag) && (false == bDecided)) {
+          uAirtime = privAirtime(pTmpSkb->len, uRate);
+
+          /* Carrier sense, plus the NAV the sender announced */
+          uNav = le16_to_cpu(pWHdr->duration_id);
+          if (uNav & 0x8000) {
+            uNav = 0;
+          }
+          klemMediumBusy(pData->pMedium, recvStat.freq, uAirtime + uNav);
+        }
+
+        /* Whatever else is on the air meanwhile, ours too, may spoil it */
+        if ((true == bRecvFlag) && (false == bDecided) &&
+            (false == klemMediumReceive(pData->pMedium, pMeta->uId,
+                                        recvStat.freq, recvStat.signal,
+                                        uAirtime,
+                                        privRateSinr(&sRate, uRate),
+                                        (KLEM_WIRE_V2 == pMeta->uVersion) ?
+                                        pMeta->uTimestamp : 0))) {
+          bRecvFlag = false;
+        }
+
+        /* Cleartext from a hardware key, only if we hold the key too. */
+        if ((true == bRecvFlag) && (uFlags & KLEM_TAP_FLAG_PROTECTED)) {
+          if (true == privRecvHasKey(pMacData, pWHdr)) {
+            recvStat.flag |= RX_FLAG_DECRYPTED |
+              RX_FLAG_IV_STRIPPED |
+              RX_FLAG_MIC_STRIPPED |
+              RX_FLAG_MMIC_STRIPPED;
+          } else {
+            pMacData->uRecvNoKeyNumber++;
+            bRecvFlag = false;
+          }
+        }
+
+        if ((true == bRecvFlag) && (true == pData->bRetry)) {
+          privRecvNode(pMacData, pWHdr, pMeta->uId);
+        }
+
+        /* The sender waits for our ack, if the frame is for us */
+        if ((true == bRecvFlag) && (uFlags & KLEM_TAP_FLAG_ACKREQ) &&
+            (true == privRecvForUs(pMacData, pWHdr->addr1))) {
+          klemNetAck(pData->pRawSocket, pMeta->uId, pMeta->uSequence);
+        }
+
+        /* A decided frame made the channel busy when it was posted */
+        if ((true == bRecvFlag) && (true == bDecided)) {
+          uAirtime = privAirtime(pTmpSkb->len, uRate);
+          privSurveyAdd(pMacData, recvStat.freq, uAirtime,
+                        false, false, true);
+        } else if (0 != uAirtime) {
+          privSurveyAdd(pMacData, recvStat.freq, uAirtime,
+                        true, false, bRecvFlag);
+        }
+
+        if (true == bRecvFlag) {
+          memcpy(IEEE80211_SKB_RXCB(pTmpSkb), &recvStat, sizeof(recvStat));
+        }
       } else {
         memset(&recvStat, 0, sizeof(recvStat));
 
@@ -1160,7 +3967,7 @@ void klem80211Recv(void *pPtr, struct sk_buff *pSkb)
         recvStat.freq = (u32)pMacData->pHW->conf.chandef.chan->center_freq;
 #endif
         recvStat.signal = (u32)pMacData->pHW->conf.power_level;
-        recvStat.rate_idx = 1;
+        recvStat.rate_idx = 0;
 
         /* Get the wireless header */
         pWHdr = (struct ieee80211_hdr *)pTmpSkb->data;
@@ -1169,38 +3976,13 @@ void klem80211Recv(void *pPtr, struct sk_buff *pSkb)
       }
 
       if (true == bRecvFlag) {
-        /* Remove the Data/tap header */
-        if (ieee80211_is_data_qos(pWHdr->frame_control)) {
-          switch(*((u8*)ieee80211_get_qos_ctl(pWHdr)) &
-                 IEEE80211_QOS_CTL_TID_MASK)
-            {
-            case 6:
-            case 7:
-              uqos = 0;
-              break;
-            case 4:
-            case 5:
-              uqos = 1;
-              break;
-            case 0:
-            case 3:
-              uqos = 2;
-              break;
-            case 1:
-            case 2:
-              uqos = 3;
-              break;
-            default:
-              uqos = 0;
-              break;
-            }
+        if (uFlags & KLEM_TAP_FLAG_AMPDU) {
+          privRecvAMPDU(pMacData, pTmpSkb, uRate);
+        } else {
+          privRecvDeliver(pMacData, pTmpSkb, uRate);
         }
-
-        pMacData->qos [uqos].uRecvNumber++;
-        ieee80211_rx_irqsafe(pMacData->pHW, pTmpSkb);
         pTmpSkb = NULL;
         bRecvFlag = false;
-
       }
     }
   }
@@ -1209,19 +3991,71 @@ void klem80211Recv(void *pPtr, struct sk_buff *pSkb)
   if (NULL != pTmpSkb) dev_kfree_skb(pTmpSkb);
 }
 
+/*
+ * Access category of an 802.1p priority, or of a TID.
+ */
+unsigned int klem80211PcpAc(unsigned int uPcp)
+{
+  return privConstPcpAc [uPcp & IEEE80211_QOS_CTL_TAG1D_MASK];
+}
+
+void klem80211Recv(void *pPtr, struct sk_buff *pSkb, KLEM_META *pMeta)
+{
+  privRecv((KLEMData *)pPtr, pSkb, pMeta, false);
+}
+
+void klem80211RecvDecided(void *pPtr, struct sk_buff *pSkb, KLEM_META *pMeta)
+{
+  privRecv((KLEMData *)pPtr, pSkb, pMeta, true);
+}
 
 /*
- * Called from proc, to output 802.11 specific data.
- * !Warning, be sure pOutput points to enough space
- * or you have memory overwrite.
- *
+ * The receiving host acked the frames we sent with wire sequence
+ * uStart + n, for each bit n of uBitmap.  Late acks find their slot
+ * empty or reused and are ignored.
+ */
+void klem80211Acked(void *pPtr, u32 uStart, u32 uBitmap)
+{
+  KLEMData *pData = (KLEMData *)pPtr;
+  mac80211Data *pMacData = NULL;
+  AckData *pAck = NULL;
+  u32 uSequence;
+  int loop;
+
+  if ((NULL == pData) || (NULL == pData->pMacData)) {
+    return;
+  }
+  pMacData = (mac80211Data *)pData->pMacData;
+
+  down(&pMacData->sAckWait);
+  for (loop = 0; loop < 32; loop++) {
+    if (0 == (uBitmap & (1U << loop))) {
+      continue;
+    }
+
+    uSequence = uStart + loop;
+    pAck = &pMacData->ackSlot [uSequence & (KLEM_ACK_SLOTS - 1)];
+    if ((NULL != pAck->pSkb) && (uSequence == pAck->uSequence)) {
+      privAckComplete(pMacData, pAck, true);
+    }
+  }
+  up(&pMacData->sAckWait);
+}
+
+
+/*
+ * Called from proc, to output 802.11 specific data.  On old kernels
+ * it writes at most uSize bytes to pOutput, the terminating zero
+ * included, and returns the length written.
  */
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0))
 
-unsigned int klem80211Proc(void *pPtr, char *pOutput)
+unsigned int klem80211Proc(void *pPtr, char *pOutput, unsigned int uSize)
 {
   KLEMData *pData = (KLEMData *)pPtr;
   mac80211Data *pMacData = NULL;
+  SurveyData *pSurvey = NULL;
+  struct ieee80211_channel *pChannel = NULL;
   unsigned int rvalue = 0;
   unsigned int tmp = 0;
   int loop;
@@ -1230,57 +4064,127 @@ unsigned int klem80211Proc(void *pPtr, char *pOutput)
     pMacData = (mac80211Data *)pData->pMacData;
     if (NULL != pMacData) {
       if (NULL != pOutput) {
-        sprintf(pOutput, "MAC Address:          %pM\n",
-                (void *)&pMacData->macAddress);
-        tmp = strlen(pOutput);
+        tmp = scnprintf(pOutput, uSize - rvalue,
+                        "MAC Address:          %pM\n",
+                        (void *)&pMacData->macAddress);
         pOutput += tmp;
         rvalue += tmp;
 
-        sprintf(pOutput, "beacon count :         %ld\n",
-                pMacData->uBeaconCount);
-        tmp = strlen(pOutput);
+        tmp = scnprintf(pOutput, uSize - rvalue,
+                        "beacon count :         %ld (%ld built)\n",
+                        pMacData->uBeaconCount, pMacData->uBeaconBuilds);
         pOutput += tmp;
         rvalue += tmp;
 
+        tmp = scnprintf(pOutput, uSize - rvalue,
+                        "hw keys:              %u pairwise %u group\n",
+                        pMacData->uPairwiseKeys, pMacData->uGroupKeys);
+        pOutput += tmp;
+        rvalue += tmp;
+
+        tmp = scnprintf(pOutput, uSize - rvalue,
+                        "hw scan:              %ld scans %ld results %u cached\n",
+                        pMacData->uScanNumber, pMacData->uScanResults,
+                        pMacData->uScanEntries);
+        pOutput += tmp;
+        rvalue += tmp;
+
+        tmp = scnprintf(pOutput, uSize - rvalue,
+                        "recv no key:          %ld\n",
+                        pMacData->uRecvNoKeyNumber);
+        pOutput += tmp;
+        rvalue += tmp;
+
+        tmp = scnprintf(pOutput, uSize - rvalue,
+                        "ampdu sent:           %ld (%ld mpdu)\n",
+                        pMacData->uAmpduNumber, pMacData->uAmpduFrames);
+        pOutput += tmp;
+        rvalue += tmp;
+
+        tmp = scnprintf(pOutput, uSize - rvalue,
+                        "retries:              %ld (%ld failed)\n",
+                        pMacData->uRetryNumber, pMacData->uRetryFailed);
+        pOutput += tmp;
+        rvalue += tmp;
+
+        tmp = scnprintf(pOutput, uSize - rvalue,
+                        "remote acks:          %ld acked %ld lost %u waiting\n",
+                        pMacData->uAckNumber, pMacData->uAckLost,
+                        pMacData->uAckPending);
+        pOutput += tmp;
+        rvalue += tmp;
+
+        /* Only channels that saw traffic, in msec */
+        for (loop = 0; NULL != (pSurvey = privSurveyIndex(pMacData, loop,
+                                                          &pChannel));
+             loop++) {
+          if (0 != pSurvey->uBusy) {
+            tmp = scnprintf(pOutput, uSize - rvalue,
+                            "survey [%d]:        busy %llu tx %llu rx %llu\n",
+                            pChannel->center_freq,
+                            (unsigned long long)div_u64(pSurvey->uBusy, 1000),
+                            (unsigned long long)div_u64(pSurvey->uTX, 1000),
+                            (unsigned long long)div_u64(pSurvey->uRX, 1000));
+            pOutput += tmp;
+            rvalue += tmp;
+          }
+        }
+
         for (loop = 0; loop < KLEM_MAX_QOS; loop++) {
-          sprintf(pOutput, "qos [%d] aifs:         %d\n", loop,
-                  pMacData->qos [loop].aifs);
-          tmp = strlen(pOutput);
+          tmp = scnprintf(pOutput, uSize - rvalue,
+                          "qos [%d] aifs:         %d\n", loop,
+                          pMacData->qos [loop].aifs);
+          pOutput += tmp;
+          rvalue += tmp;
+          tmp = scnprintf(pOutput, uSize - rvalue,
+                          "qos [%d] cw_min:       %d\n", loop,
+                          pMacData->qos [loop].cw_min);
+          pOutput += tmp;
+          rvalue += tmp;
+          tmp = scnprintf(pOutput, uSize - rvalue,
+                          "qos [%d] cw_max:       %d\n", loop,
+                          pMacData->qos [loop].cw_max);
+          pOutput += tmp;
+          rvalue += tmp;
+          tmp = scnprintf(pOutput, uSize - rvalue,
+                          "qos [%d] txop:         %d\n", loop,
+                          pMacData->qos [loop].txop);
           pOutput += tmp;
           rvalue += tmp;
-          sprintf(pOutput, "qos [%d] cw_min:       %d\n", loop,
-                  pMacData->qos [loop].cw_min);
-          tmp = strlen(pOutput);
+          tmp = scnprintf(pOutput, uSize - rvalue,
+                          "qos [%d] recv:         %ld\n", loop,
+                          pMacData->qos [loop].uRecvNumber);
           pOutput += tmp;
           rvalue += tmp;
-          sprintf(pOutput, "qos [%d] cw_max:       %d\n", loop,
-                  pMacData->qos [loop].cw_max);
-          tmp = strlen(pOutput);
+          tmp = scnprintf(pOutput, uSize - rvalue,
+                          "qos [%d] sent:         %ld\n", loop,
+                          pMacData->qos [loop].uSendNumber);
           pOutput += tmp;
           rvalue += tmp;
-          sprintf(pOutput, "qos [%d] txop:         %d\n", loop,
-                  pMacData->qos [loop].txop);
-          tmp = strlen(pOutput);
+          tmp = scnprintf(pOutput, uSize - rvalue,
+                          "qos [%d] sent error:   %ld\n", loop,
+                          pMacData->qos [loop].uSendErrorNumber);
           pOutput += tmp;
           rvalue += tmp;
-          sprintf(pOutput, "qos [%d] recv:         %ld\n", loop,
-                  pMacData->qos [loop].uRecvNumber);
-          tmp = strlen(pOutput);
+          tmp = scnprintf(pOutput, uSize - rvalue,
+                          "qos [%d] sent drop:    %ld\n", loop,
+                          pMacData->qos [loop].uSendDroppedNumber);
           pOutput += tmp;
           rvalue += tmp;
-          sprintf(pOutput, "qos [%d] sent:         %ld\n", loop,
-                  pMacData->qos [loop].uSendNumber);
-          tmp = strlen(pOutput);
+          tmp = scnprintf(pOutput, uSize - rvalue,
+                          "qos [%d] codel drop:   %ld\n", loop,
+                          pMacData->qos [loop].uCodelDropNumber);
           pOutput += tmp;
           rvalue += tmp;
-          sprintf(pOutput, "qos [%d] sent error:   %ld\n", loop,
-                  pMacData->qos [loop].uSendErrorNumber);
-          tmp = strlen(pOutput);
+          tmp = scnprintf(pOutput, uSize - rvalue,
+                          "qos [%d] deferred:     %ld\n", loop,
+                          pMacData->qos [loop].uDeferNumber);
           pOutput += tmp;
           rvalue += tmp;
-          sprintf(pOutput, "qos [%d] sent drop:    %ld\n", loop,
-                  pMacData->qos [loop].uSendDroppedNumber);
-          tmp = strlen(pOutput);
+          tmp = scnprintf(pOutput, uSize - rvalue,
+                          "qos [%d] bytes:        %u / %u\n", loop,
+                          pMacData->qos [loop].uBytesQueued,
+                          pMacData->qos [loop].uByteLimit);
           pOutput += tmp;
           rvalue += tmp;
         }
@@ -1295,6 +4199,8 @@ void klem80211Proc(void *pPtr, struct seq_file *pOutput)
 {
   KLEMData *pData = (KLEMData *)pPtr;
   mac80211Data *pMacData = NULL;
+  SurveyData *pSurvey = NULL;
+  struct ieee80211_channel *pChannel = NULL;
   int loop;
 
   if (NULL != pData) {
@@ -1303,8 +4209,35 @@ void klem80211Proc(void *pPtr, struct seq_file *pOutput)
       if (NULL != pOutput) {
         seq_printf(pOutput, "MAC Address:          %pM\n",
 		   (void *)&pMacData->macAddress);
-        seq_printf(pOutput, "beacon count :         %ld\n",
-		   pMacData->uBeaconCount);
+        seq_printf(pOutput, "beacon count :         %ld (%ld built)\n",
+		   pMacData->uBeaconCount, pMacData->uBeaconBuilds);
+        seq_printf(pOutput, "hw keys:              %u pairwise %u group\n",
+		   pMacData->uPairwiseKeys, pMacData->uGroupKeys);
+        seq_printf(pOutput, "hw scan:              %ld scans %ld results %u cached\n",
+		   pMacData->uScanNumber, pMacData->uScanResults,
+		   pMacData->uScanEntries);
+        seq_printf(pOutput, "recv no key:          %ld\n",
+		   pMacData->uRecvNoKeyNumber);
+        seq_printf(pOutput, "ampdu sent:           %ld (%ld mpdu)\n",
+		   pMacData->uAmpduNumber, pMacData->uAmpduFrames);
+        seq_printf(pOutput, "retries:              %ld (%ld failed)\n",
+		   pMacData->uRetryNumber, pMacData->uRetryFailed);
+        seq_printf(pOutput, "remote acks:          %ld acked %ld lost %u waiting\n",
+		   pMacData->uAckNumber, pMacData->uAckLost,
+		   pMacData->uAckPending);
+
+        /* Only channels that saw traffic, in msec */
+        for (loop = 0; NULL != (pSurvey = privSurveyIndex(pMacData, loop,
+                                                          &pChannel));
+             loop++) {
+          if (0 != pSurvey->uBusy) {
+            seq_printf(pOutput, "survey [%d]:        busy %llu tx %llu rx %llu\n",
+                       pChannel->center_freq,
+                       (unsigned long long)div_u64(pSurvey->uBusy, 1000),
+                       (unsigned long long)div_u64(pSurvey->uTX, 1000),
+                       (unsigned long long)div_u64(pSurvey->uRX, 1000));
+          }
+        }
 
         for (loop = 0; loop < KLEM_MAX_QOS; loop++) {
           seq_printf(pOutput, "qos [%d] aifs:         %d\n", loop,
@@ -1323,6 +4256,13 @@ void klem80211Proc(void *pPtr, struct seq_file *pOutput)
 		     pMacData->qos [loop].uSendErrorNumber);
           seq_printf(pOutput, "qos [%d] sent drop:    %ld\n", loop,
 		     pMacData->qos [loop].uSendDroppedNumber);
+          seq_printf(pOutput, "qos [%d] codel drop:   %ld\n", loop,
+		     pMacData->qos [loop].uCodelDropNumber);
+          seq_printf(pOutput, "qos [%d] deferred:     %ld\n", loop,
+		     pMacData->qos [loop].uDeferNumber);
+          seq_printf(pOutput, "qos [%d] bytes:        %u / %u\n", loop,
+		     pMacData->qos [loop].uBytesQueued,
+		     pMacData->qos [loop].uByteLimit);
         }
       }
     }
@@ -1330,6 +4270,101 @@ void klem80211Proc(void *pPtr, struct seq_file *pOutput)
 }
 #endif
 
+/*
+ * HT40, both guard intervals and two spatial streams.
+ */
+static void privHTCap(struct ieee80211_sta_ht_cap *pCap)
+{
+  pCap->ht_supported = true;
+  pCap->cap =
+    IEEE80211_HT_CAP_SUP_WIDTH_20_40 |
+    IEEE80211_HT_CAP_GRN_FLD |
+    IEEE80211_HT_CAP_SGI_20 |
+    IEEE80211_HT_CAP_SGI_40 |
+    IEEE80211_HT_CAP_DSSSCCK40;
+  pCap->ampdu_factor = 0x3;
+  pCap->ampdu_density = 0x6;
+  memset(&pCap->mcs, 0, sizeof(pCap->mcs));
+  pCap->mcs.rx_mask[0] = 0xff;
+  pCap->mcs.rx_mask[1] = 0xff;
+  pCap->mcs.tx_params = IEEE80211_HT_MCS_TX_DEFINED;
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0))
+/*
+ * VHT80 and VHT160, mcs 0-9 on two spatial streams.
+ */
+static void privVHTCap(struct ieee80211_sta_vht_cap *pCap)
+{
+  u16 uMcsMap =
+    (IEEE80211_VHT_MCS_SUPPORT_0_9 << 0) |
+    (IEEE80211_VHT_MCS_SUPPORT_0_9 << 2) |
+    (IEEE80211_VHT_MCS_NOT_SUPPORTED << 4) |
+    (IEEE80211_VHT_MCS_NOT_SUPPORTED << 6) |
+    (IEEE80211_VHT_MCS_NOT_SUPPORTED << 8) |
+    (IEEE80211_VHT_MCS_NOT_SUPPORTED << 10) |
+    (IEEE80211_VHT_MCS_NOT_SUPPORTED << 12) |
+    (IEEE80211_VHT_MCS_NOT_SUPPORTED << 14);
+
+  pCap->vht_supported = true;
+  pCap->cap =
+    IEEE80211_VHT_CAP_MAX_MPDU_LENGTH_11454 |
+    IEEE80211_VHT_CAP_SUPP_CHAN_WIDTH_160MHZ |
+    IEEE80211_VHT_CAP_SHORT_GI_80 |
+    IEEE80211_VHT_CAP_SHORT_GI_160 |
+    IEEE80211_VHT_CAP_MAX_A_MPDU_LENGTH_EXPONENT_MASK;
+  pCap->vht_mcs.rx_mcs_map = cpu_to_le16(uMcsMap);
+  pCap->vht_mcs.tx_mcs_map = cpu_to_le16(uMcsMap);
+}
+#endif
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0))
+/*
+ * HE for stations and access points, mcs 0-11 on two spatial
+ * streams.  HE40 on 2GHZ, HE80 and HE160 on 5GHZ.
+ */
+static void privHECap(struct ieee80211_sband_iftype_data *pIftype, bool b5g)
+{
+  struct ieee80211_sta_he_cap *pCap = &pIftype->he_cap;
+  __le16 uMcsMap = cpu_to_le16(0xfffa);
+
+  memset(pIftype, 0, sizeof(struct ieee80211_sband_iftype_data));
+  pIftype->types_mask = BIT(NL80211_IFTYPE_STATION) | BIT(NL80211_IFTYPE_AP);
+  pCap->has_he = true;
+  pCap->he_cap_elem.mac_cap_info[0] = IEEE80211_HE_MAC_CAP0_HTC_HE;
+  pCap->he_cap_elem.phy_cap_info[1] =
+    IEEE80211_HE_PHY_CAP1_LDPC_CODING_IN_PAYLOAD;
+  if (true == b5g) {
+    pCap->he_cap_elem.phy_cap_info[0] =
+      IEEE80211_HE_PHY_CAP0_CHANNEL_WIDTH_SET_40MHZ_80MHZ_IN_5G |
+      IEEE80211_HE_PHY_CAP0_CHANNEL_WIDTH_SET_160MHZ_IN_5G;
+  } else {
+    pCap->he_cap_elem.phy_cap_info[0] =
+      IEEE80211_HE_PHY_CAP0_CHANNEL_WIDTH_SET_40MHZ_IN_2G;
+  }
+  pCap->he_mcs_nss_supp.rx_mcs_80 = uMcsMap;
+  pCap->he_mcs_nss_supp.tx_mcs_80 = uMcsMap;
+  pCap->he_mcs_nss_supp.rx_mcs_160 = uMcsMap;
+  pCap->he_mcs_nss_supp.tx_mcs_160 = uMcsMap;
+  pCap->he_mcs_nss_supp.rx_mcs_80p80 = cpu_to_le16(0xffff);
+  pCap->he_mcs_nss_supp.tx_mcs_80p80 = cpu_to_le16(0xffff);
+}
+
+/*
+ * Hook the HE capabilities into a band.
+ */
+static void privSetIftypeData(struct ieee80211_supported_band *pBand,
+                              struct ieee80211_sband_iftype_data *pIftype)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0))
+  _ieee80211_set_sband_iftype_data(pBand, pIftype, 1);
+#else
+  pBand->iftype_data = pIftype;
+  pBand->n_iftype_data = 1;
+#endif
+}
+#endif
+
 void klem80211Start(void *pPtr)
 {
   KLEMData *pData = (KLEMData *)pPtr;
@@ -1375,11 +4410,44 @@ void klem80211Start(void *pPtr)
     pMacData->bActive = true;
     pMacData->bRadioActive = false;
     pMacData->bIdle = true;
+    pMacData->uGroupKeys = 0;
+    pMacData->uPairwiseKeys = 0;
+    pMacData->uRecvNoKeyNumber = 0;
+    pMacData->uAmpduNumber = 0;
+    pMacData->uAmpduFrames = 0;
+    pMacData->uRetryNumber = 0;
+    pMacData->uRetryFailed = 0;
+    sema_init(&pMacData->sAckWait, 1);
+    memset(pMacData->ackSlot, 0, sizeof(pMacData->ackSlot));
+    pMacData->uAckHead = 0;
+    pMacData->uAckTail = 0;
+    pMacData->uAckPending = 0;
+    pMacData->uAckNumber = 0;
+    pMacData->uAckLost = 0;
+    pMacData->uAmpduReference = 0;
     pMacData->uBeacons = (1024 * HZ) >> 10;
 
     spin_lock_init(&pMacData->sSpinLock);
     init_waitqueue_head(&pMacData->sListWait);
     pMacData->uBeaconCount = 0;
+    pMacData->uBeaconBuilds = 0;
+    atomic_set(&pMacData->uTimGeneration, 0);
+    atomic_set(&pMacData->uDozing, 0);
+    atomic64_set(&pMacData->uTsfBase, ktime_to_us(ktime_get_real()));
+
+    spin_lock_init(&pMacData->sScanLock);
+    for (loop = 0; loop < KLEM_SCAN_HASH; loop++) {
+      INIT_HLIST_HEAD(&pMacData->scanHash [loop]);
+    }
+    pMacData->uScanEntries = 0;
+    INIT_DELAYED_WORK(&pMacData->scanWork, privScanWork);
+    pMacData->pScanReq = NULL;
+    pMacData->uScanNumber = 0;
+    pMacData->uScanResults = 0;
+
+    memset(pMacData->survey_2g, 0, sizeof(pMacData->survey_2g));
+    memset(pMacData->survey_5g, 0, sizeof(pMacData->survey_5g));
+    pMacData->uSurveyStart = ktime_to_us(ktime_get());
 
     for (loop = 0; loop < KLEM_MAX_QOS; loop++) {
       pMacData->qos [loop].aifs = 0;
@@ -1390,10 +4458,22 @@ void klem80211Start(void *pPtr)
       pMacData->qos [loop].uSendNumber = 0;
       pMacData->qos [loop].uSendErrorNumber = 0;
       pMacData->qos [loop].uSendDroppedNumber = 0;
-      pMacData->qos [loop].uListDepth = 0;
+      pMacData->qos [loop].uBytesQueued = 0;
+      pMacData->qos [loop].uByteLimit = pData->queue.uMinBytes;
+      pMacData->qos [loop].uDrainBytes = 0;
+      pMacData->qos [loop].uDrainStart = jiffies;
+      pMacData->qos [loop].iCodelFirstAbove = 0;
+      pMacData->qos [loop].iCodelDropNext = 0;
+      pMacData->qos [loop].uCodelCount = 0;
+      pMacData->qos [loop].bCodelDropping = false;
+      pMacData->qos [loop].uCodelDropNumber = 0;
+      pMacData->qos [loop].iBackoff = KLEM_CSMA_NONE;
+      pMacData->qos [loop].uBackoffFrom = 0;
+      pMacData->qos [loop].uDeferNumber = 0;
 
       /* We need to create a skb buffer queue */
       skb_queue_head_init(&pMacData->qos [loop].listSkb);
+      INIT_LIST_HEAD(&pMacData->listTxq [loop]);
       pMacData->qos [loop].bListActive = true;
     }
 
@@ -1407,6 +4487,8 @@ void klem80211Start(void *pPtr)
     pMacData->pHW->channel_change_time = 1;
 #endif
     pMacData->pHW->queues = KLEM_MAX_QOS;
+    pMacData->pHW->max_rx_aggregation_subframes = KLEM_MAX_SUBFRAMES;
+    pMacData->pHW->max_tx_aggregation_subframes = KLEM_MAX_SUBFRAMES;
     pMacData->pHW->wiphy->n_addresses = 1;
 
     /* Generate a mac address */
@@ -1420,6 +4502,10 @@ void klem80211Start(void *pPtr)
       BIT(NL80211_IFTYPE_P2P_GO) |
       BIT(NL80211_IFTYPE_STATION);
 
+    /* hw_scan sends no probes of its own, accept any request */
+    pMacData->pHW->wiphy->max_scan_ssids = 255;
+    pMacData->pHW->wiphy->max_scan_ie_len = IEEE80211_MAX_DATA_LEN;
+
     pMacData->pHW->flags = IEEE80211_HW_MFP_CAPABLE |
       IEEE80211_HW_SIGNAL_DBM |
       /* SWW CHECK test 3.18 */
@@ -1432,6 +4518,9 @@ void klem80211Start(void *pPtr)
     /* Lets not fake vif and sta for now */
     pMacData->pHW->vif_data_size = sizeof(VIFData);
     pMacData->pHW->sta_data_size = sizeof(STAData);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0))
+    pMacData->pHW->txq_data_size = sizeof(TXQData);
+#endif
 
     /* copy memory for the channels and rate for 2g */
     memcpy(pMacData->channel_2g, privConstChannels_2ghz,
@@ -1442,19 +4531,11 @@ void klem80211Start(void *pPtr)
     memcpy(pMacData->rate_2g, privConstBitRate_2g, sizeof(privConstBitRate_2g));
     pMacData->band_2g.bitrates = pMacData->rate_2g;
     pMacData->band_2g.n_bitrates = RATE_SIZE_2G;
-    pMacData->band_2g.ht_cap.ht_supported = true;
-    pMacData->band_2g.ht_cap.cap =
-      IEEE80211_HT_CAP_SUP_WIDTH_20_40 |
-      IEEE80211_HT_CAP_GRN_FLD |
-      IEEE80211_HT_CAP_SGI_40 |
-      IEEE80211_HT_CAP_DSSSCCK40;
-    pMacData->band_2g.ht_cap.ampdu_factor = 0x3;
-    pMacData->band_2g.ht_cap.ampdu_density = 0x6;
-    memset(&pMacData->band_2g.ht_cap.mcs, 0,
-       sizeof(pMacData->band_2g.ht_cap.mcs));
-    pMacData->band_2g.ht_cap.mcs.rx_mask[0] = 0xff;
-    pMacData->band_2g.ht_cap.mcs.rx_mask[1] = 0xff;
-    pMacData->band_2g.ht_cap.mcs.tx_params = IEEE80211_HT_MCS_TX_DEFINED;
+    privHTCap(&pMacData->band_2g.ht_cap);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0))
+    privHECap(&pMacData->iftype_2g [0], false);
+    privSetIftypeData(&pMacData->band_2g, pMacData->iftype_2g);
+#endif
     pMacData->pHW->wiphy->bands[IEEE80211_BAND_2GHZ] = &pMacData->band_2g;
 
     /* copy memory for the channels and rate for 5g */
@@ -1466,19 +4547,14 @@ void klem80211Start(void *pPtr)
     memcpy(pMacData->rate_5g, privConstBitRate_5g, sizeof(privConstBitRate_5g));
     pMacData->band_5g.bitrates = pMacData->rate_5g;
     pMacData->band_5g.n_bitrates = RATE_SIZE_5G;
-    pMacData->band_5g.ht_cap.ht_supported = true;
-    pMacData->band_5g.ht_cap.cap =
-      IEEE80211_HT_CAP_SUP_WIDTH_20_40 |
-      IEEE80211_HT_CAP_GRN_FLD |
-      IEEE80211_HT_CAP_SGI_40 |
-      IEEE80211_HT_CAP_DSSSCCK40;
-    pMacData->band_5g.ht_cap.ampdu_factor = 0x3;
-    pMacData->band_5g.ht_cap.ampdu_density = 0x6;
-    memset(&pMacData->band_2g.ht_cap.mcs, 0,
-       sizeof(pMacData->band_2g.ht_cap.mcs));
-    pMacData->band_2g.ht_cap.mcs.rx_mask[0] = 0xff;
-    pMacData->band_5g.ht_cap.mcs.rx_mask[1] = 0xff;
-    pMacData->band_5g.ht_cap.mcs.tx_params = IEEE80211_HT_MCS_TX_DEFINED;
+    privHTCap(&pMacData->band_5g.ht_cap);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0))
+    privVHTCap(&pMacData->band_5g.vht_cap);
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0))
+    privHECap(&pMacData->iftype_5g [0], true);
+    privSetIftypeData(&pMacData->band_5g, pMacData->iftype_5g);
+#endif
     pMacData->pHW->wiphy->bands[IEEE80211_BAND_5GHZ] = &pMacData->band_5g;
 
     /* Need a name for the thread. */
@@ -1515,6 +4591,8 @@ void klem80211Stop(void *pPtr)
 
       if (NULL != pMacData->pHW) {
         ieee80211_unregister_hw(pMacData->pHW);
+        cancel_delayed_work_sync(&pMacData->scanWork);
+        privScanFlush(pMacData);
         if (NULL != pMacData->pDev) {
           device_unregister(pMacData->pDev);
         }
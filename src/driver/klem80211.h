@@ -20,14 +20,19 @@
 #ifndef KLEM80211_INCLUDE
 #define KLEM80211_INCLUDE
 #include <linux/version.h>
+#include "klemHdr.h"
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0))
-unsigned int klem80211Proc(void *pPtr, char *pOutput);
+unsigned int klem80211Proc(void *pPtr, char *pOutput,
+                          unsigned int uSize);
 #else
 void klem80211Proc(void *pPtr, struct seq_file *pOutput);
 #endif
 
-void klem80211Recv(void *pPtr, struct sk_buff *pSkb);
+void klem80211Recv(void *pPtr, struct sk_buff *pSkb, KLEM_META *pMeta);
+void klem80211RecvDecided(void *pPtr, struct sk_buff *pSkb, KLEM_META *pMeta);
+void klem80211Acked(void *pPtr, u32 uStart, u32 uBitmap);
+unsigned int klem80211PcpAc(unsigned int uPcp);
 void klem80211Start(void *pPtr);
 void klem80211Stop(void *pPtr);
 #endif
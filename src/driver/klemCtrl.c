@@ -44,12 +44,22 @@ static void privCtrlProcess(struct work_struct *pPtr)
 {
   ctrl_data *pWork = (ctrl_data *)pPtr;
   KLEMData *pData = NULL;
+  void *pVlanRaw = NULL;
 
   KLEM_MSG("Entering work queue\n");
 
   if (NULL != pWork) {
     pData = pWork->pData;
 
+    /* The VLAN filter sleeps on the rtnl lock, close it unlocked */
+    if (CONNECTION_STOP == pWork->eCommand) {
+      spin_lock(&pData->sLock);
+      pVlanRaw = pData->pRawSocket;
+      spin_unlock(&pData->sLock);
+      klemNetVlan(pVlanRaw, false);
+      pVlanRaw = NULL;
+    }
+
     /* Lock the data structure */
     spin_lock(&pData->sLock);
 
@@ -60,6 +70,7 @@ static void privCtrlProcess(struct work_struct *pPtr)
           if (strlen(pData->pDevName) > 0) {
             KLEM_MSG("Start socket\n");
             pData->pRawSocket = klemNetConnect(pData, pData->pDevName);
+            pVlanRaw = pData->pRawSocket;
             KLEM_MSG("Start socket Completed\n");
           } else {
             KLEM_MSG("Network Device not specified.");
@@ -84,6 +95,9 @@ static void privCtrlProcess(struct work_struct *pPtr)
 
     /* Unlock the data structure */
     spin_unlock(&pData->sLock);
+
+    /* Same for opening it on a new socket */
+    klemNetVlan(pVlanRaw, true);
   }
 
   KLEM_MSG("Leaving work queue\n");
@@ -174,6 +188,7 @@ void klemCtrlDestroy(void *pPtr)
   /* Destroy the socket, if its still exists */
   if (NULL != pData->pRawSocket) {
     klem80211Stop(pData);
+    klemNetVlan(pData->pRawSocket, false);
     klemNetDisconnect(pData->pRawSocket);
     pData->pRawSocket = NULL;
   }
@@ -36,12 +36,39 @@ void *klemDataInit(void)
     pData->uiVersion = KLEM_INT_VERSION;
     pData->ubNode = 0;
     pData->proc.pEntry = NULL;
+    pData->proc.pScheduleEntry = NULL;
+    pData->proc.pPeerEntry = NULL;
     pData->pNetLink = NULL;
     pData->pRawSocket = NULL;
     pData->pCtrlQueue = NULL;
     pData->pMacData = NULL;
+    pData->pMedium = NULL;
+    pData->pSchedule = NULL;
+    pData->pDevice = NULL;
+    pData->pPeer = NULL;
     pData->uDeviceId = 0;
     memset(pData->bFilterNode, false, MAX_WIRELESS_NODE);
+    pData->queue.uMinBytes = KLEM_QUEUE_MIN_BYTES;
+    pData->queue.uMaxBytes = KLEM_QUEUE_MAX_BYTES;
+    pData->queue.uTimeUsec = KLEM_QUEUE_TIME_USEC;
+    pData->queue.uCodelTarget = KLEM_CODEL_TARGET_USEC;
+    pData->queue.uCodelInterval = KLEM_CODEL_INTERVAL_USEC;
+    pData->uWireVersion = KLEM_WIRE_AUTO;
+    pData->coalesce.uUsec = KLEM_COALESCE_USEC;
+    pData->coalesce.uBytes = KLEM_COALESCE_BYTES;
+    pData->uScanDwell = KLEM_SCAN_DWELL_MSEC;
+    pData->uPrune = KLEM_PRUNE_OFF;
+    pData->uPruneCopies = KLEM_PRUNE_COPIES;
+    memset(pData->iReach, KLEM_REACH_UNKNOWN, sizeof(pData->iReach));
+    pData->bRetry = false;
+    pData->uRetryLoss = KLEM_RETRY_LOSS;
+    pData->bAck = false;
+    pData->uAckTimeout = KLEM_ACK_TIMEOUT_MSEC;
+    pData->uProbe = 0;
+    pData->uExperiment = 0;
+    pData->uVlan = 0;
+    pData->bQos = false;
+    pData->uRxPriority = KLEM_RX_STRICT;
     pData->eMode = LEMU;
     pData->pClass = NULL;
 
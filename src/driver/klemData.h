@@ -26,6 +26,51 @@
 #define MAX_WIRELESS_NODE 256
 #define MAX_DEVICE_NAME 64
 
+/* Defaults for the byte based fake hardware queues and CoDel. */
+#define KLEM_QUEUE_MIN_BYTES 4500
+#define KLEM_QUEUE_MAX_BYTES 131072
+#define KLEM_QUEUE_TIME_USEC 2000
+#define KLEM_CODEL_TARGET_USEC 5000
+#define KLEM_CODEL_INTERVAL_USEC 100000
+
+/* Send version 2 headers unless we heard a version 1 only sender. */
+#define KLEM_WIRE_AUTO 0
+
+/* Small frame coalescing, off by default.  usec and bytes. */
+#define KLEM_COALESCE_USEC 0
+#define KLEM_COALESCE_BYTES 400
+
+/* hw_scan dwell per channel in msec, 0 answers from the cache at once */
+#define KLEM_SCAN_DWELL_MSEC 0
+#define KLEM_SCAN_DWELL_MAX 1000
+
+/*
+ * Sender side pruning.  Off broadcasts every frame, unicast sends a
+ * copy to each host in range, up to KLEM_PRUNE_COPIES before it falls
+ * back to broadcast.  Reach is a pushed link table, unknown leaves it
+ * to the medium.
+ */
+#define KLEM_PRUNE_OFF 0
+#define KLEM_PRUNE_UNICAST 1
+#define KLEM_PRUNE_COPIES 8
+#define KLEM_PRUNE_COPIES_MAX 32
+#define KLEM_REACH_UNKNOWN -1
+#define KLEM_REACH_NO 0
+#define KLEM_REACH_YES 1
+
+/* Extra loss per transmit attempt in percent, with retries emulated */
+#define KLEM_RETRY_LOSS 0
+
+/* How long a unicast frame waits for the remote ack, in msec */
+#define KLEM_ACK_TIMEOUT_MSEC 20
+
+/*
+ * How received frames leave the per access category queues.  Strict
+ * always takes voice first, weighted gives each category turns.
+ */
+#define KLEM_RX_STRICT 0
+#define KLEM_RX_WEIGHTED 1
+
 typedef struct klem_data {
   /* Keep track of our version number. */
   unsigned int uiVersion;
@@ -44,6 +89,8 @@ typedef struct klem_data {
     char pBuffer [4096];
     int iSize;
     struct proc_dir_entry *pEntry;
+    struct proc_dir_entry *pScheduleEntry;
+    struct proc_dir_entry *pPeerEntry;
   } proc;
 
   /* Netlink socket */
@@ -57,6 +104,18 @@ typedef struct klem_data {
   /* Keep pointer to our only mac radio.  */
   void *pMacData;
 
+  /* Node positions and path loss between them */
+  void *pMedium;
+
+  /* Timed topology and position events */
+  void *pSchedule;
+
+  /* /dev/klem, frames for an external medium daemon */
+  void *pDevice;
+
+  /* Nodes heard on the wire */
+  void *pPeer;
+
   /* What is our id */
   unsigned int uDeviceId;
 
@@ -66,6 +125,60 @@ typedef struct klem_data {
   */
   bool bFilterNode [MAX_WIRELESS_NODE];
 
+  /*
+   * Fake hardware queue limits.  The byte limit of each queue floats
+   * between uMinBytes and uMaxBytes, sized to hold uTimeUsec worth of
+   * the measured drain rate.  CoDel values are in micro seconds.
+   */
+  struct {
+    unsigned int uMinBytes;
+    unsigned int uMaxBytes;
+    unsigned int uTimeUsec;
+    unsigned int uCodelTarget;
+    unsigned int uCodelInterval;
+  } queue;
+
+  /* Wire header version we send, 1, 2 or KLEM_WIRE_AUTO */
+  unsigned int uWireVersion;
+
+  /*
+   * Frames up to uBytes wait up to uUsec to share a wire frame with
+   * other small frames, 0 usec sends them right away.
+   */
+  struct {
+    unsigned int uUsec;
+    unsigned int uBytes;
+  } coalesce;
+
+  /* msec a hw_scan listens on each channel, 0 reports cached results */
+  unsigned int uScanDwell;
+
+  /* Which hosts a frame is sent to, and who can hear us at all */
+  unsigned int uPrune;
+  unsigned int uPruneCopies;
+  s8 iReach [MAX_WIRELESS_NODE];
+
+  /* Walk the rate table of unicast frames against the link errors */
+  bool bRetry;
+  unsigned int uRetryLoss;
+
+  /* TX status of unicast frames waits for the receiving host */
+  bool bAck;
+  unsigned int uAckTimeout;
+
+  /* msec between rtt probes of the peers, 0 doesn't probe */
+  unsigned int uProbe;
+
+  /* Experiment we belong to, and the 802.1Q VLAN we send on, 0 none */
+  unsigned int uExperiment;
+  unsigned int uVlan;
+
+  /* Tag frames with their 802.1p priority and queue them by it */
+  bool bQos;
+
+  /* KLEM_RX_STRICT or KLEM_RX_WEIGHTED */
+  unsigned int uRxPriority;
+
   /*
    * Specificy if the driver is a virtual wireless / lemu
    * or a bridge wireless connection
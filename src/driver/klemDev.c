@@ -0,0 +1,562 @@
+/*
+ * Wireless Kernel Link Emulator
+ *
+ * Copyright (C) 2013 - 2016 Stuart Wells <swells@stuartwells.net>
+ * All rights reserved.
+ *
+ * Licensed under the GNU General Public License, version 2 (GPLv2)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+#include <linux/kernel.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/skbuff.h>
+#include <linux/ieee80211.h>
+#include "klemData.h"
+#include "klemHdr.h"
+#include "klem80211.h"
+#include "klemDev.h"
+
+/*
+ * A frame the daemon never answered is given up after a second, and
+ * no delay it asks for may be longer.
+ */
+#define KLEM_DEV_TIMEOUT_USEC 1000000
+
+/* Decided frames waiting out their delay, later ones are dropped. */
+#define KLEM_DEV_DELAY_MAX KLEM_DEV_SLOTS
+
+/* The shared ring indexes are written by the other side. */
+#define KLEM_DEV_READ(x) (*(volatile typeof(x) *)&(x))
+
+/* What a frame waiting for the daemon keeps in skb->cb. */
+typedef struct {
+  KLEM_META meta;
+  u64 uDue;
+} dev_cb;
+
+/* A frame posted to the daemon, indexed by cookie modulo the slots. */
+typedef struct {
+  struct sk_buff *pSkb;
+  u64 uCookie;
+  u64 uTime;
+} dev_pending;
+
+typedef struct {
+  KLEMData *pData;
+  struct miscdevice sMisc;
+  bool bRegistered;
+
+  /*
+   * The mmap'd rings.  sLock orders the producers on the receive path
+   * against the decisions the daemon hands back and against close.
+   */
+  spinlock_t sLock;
+  void *pArea;
+  size_t uAreaSize;
+  KLEM_DEV_HEADER *pHeader;
+  KLEM_DEV_FRAME *pFrames;
+  KLEM_DEV_DECISION *pDecisions;
+  atomic_t iOpen;
+  bool bAttached;
+  wait_queue_head_t sWait;
+  u64 uCookie;
+  dev_pending pending [KLEM_DEV_SLOTS];
+
+  /* Delivered frames that still have to wait out their delay */
+  struct sk_buff_head listDelay;
+  struct hrtimer sTimer;
+  struct tasklet_struct sTasklet;
+
+  unsigned long uPosted;
+  unsigned long uDelivered;
+  unsigned long uDropped;
+  unsigned long uOverflow;
+  unsigned long uExpired;
+} dev_data;
+
+static dev_data *privDevGet(void)
+{
+  KLEMData *pData = (KLEMData *)klemGetData();
+
+  return (NULL != pData) ? (dev_data *)pData->pDevice : NULL;
+}
+
+/* Hand a decided frame to mac80211, in softirq context. */
+static void privDevDeliver(dev_data *pDev, struct sk_buff_head *pList)
+{
+  struct sk_buff *pSkb = NULL;
+  KLEM_META sMeta;
+
+  while (NULL != (pSkb = __skb_dequeue(pList))) {
+    memcpy(&sMeta, &((dev_cb *)pSkb->cb)->meta, sizeof(sMeta));
+    klem80211RecvDecided(pDev->pData, pSkb, &sMeta);
+  }
+}
+
+/* Start the timer for the first delayed frame, called with sLock held. */
+static void privDevArm(dev_data *pDev)
+{
+  struct sk_buff *pSkb = skb_peek(&pDev->listDelay);
+
+  if (NULL != pSkb) {
+    hrtimer_start(&pDev->sTimer,
+                  ns_to_ktime(((dev_cb *)pSkb->cb)->uDue * NSEC_PER_USEC),
+                  HRTIMER_MODE_ABS);
+  }
+}
+
+/*
+ * Delayed frames leave in the order they were decided, a frame behind
+ * one with a longer delay waits for it like on a real link.
+ */
+static void privDevTasklet(unsigned long uPtr)
+{
+  dev_data *pDev = (dev_data *)uPtr;
+  struct sk_buff_head listNow;
+  struct sk_buff *pSkb = NULL;
+  unsigned long uFlags;
+  u64 uNow = ktime_to_us(ktime_get());
+
+  __skb_queue_head_init(&listNow);
+
+  spin_lock_irqsave(&pDev->sLock, uFlags);
+  while (NULL != (pSkb = skb_peek(&pDev->listDelay))) {
+    if (((dev_cb *)pSkb->cb)->uDue > uNow) {
+      break;
+    }
+    __skb_unlink(pSkb, &pDev->listDelay);
+    __skb_queue_tail(&listNow, pSkb);
+  }
+  privDevArm(pDev);
+  spin_unlock_irqrestore(&pDev->sLock, uFlags);
+
+  privDevDeliver(pDev, &listNow);
+}
+
+static enum hrtimer_restart privDevTimer(struct hrtimer *pTimer)
+{
+  dev_data *pDev = container_of(pTimer, dev_data, sTimer);
+
+  tasklet_schedule(&pDev->sTasklet);
+  return HRTIMER_NORESTART;
+}
+
+/* Take the daemon's decisions off the ring and act on them. */
+static void privDevDecide(dev_data *pDev)
+{
+  KLEM_DEV_HEADER *pHeader = pDev->pHeader;
+  KLEM_DEV_DECISION sDecision;
+  dev_pending *pEntry = NULL;
+  dev_cb *pCb = NULL;
+  struct sk_buff *pSkb = NULL;
+  struct sk_buff_head listNow;
+  struct sk_buff_head listDrop;
+  unsigned long uFlags;
+  u32 uHead;
+  u32 uTail;
+  u64 uNow = ktime_to_us(ktime_get());
+
+  __skb_queue_head_init(&listNow);
+  __skb_queue_head_init(&listDrop);
+
+  spin_lock_irqsave(&pDev->sLock, uFlags);
+  uTail = pHeader->uDecisionTail;
+  uHead = KLEM_DEV_READ(pHeader->uDecisionHead);
+  if ((u32)(uHead - uTail) > KLEM_DEV_SLOTS) {
+    uHead = uTail + KLEM_DEV_SLOTS;
+  }
+  smp_rmb();
+
+  while (uTail != uHead) {
+    memcpy(&sDecision, &pDev->pDecisions [uTail % KLEM_DEV_SLOTS],
+           sizeof(sDecision));
+    uTail++;
+
+    pEntry = &pDev->pending [sDecision.uCookie % KLEM_DEV_SLOTS];
+    if ((NULL == pEntry->pSkb) || (pEntry->uCookie != sDecision.uCookie)) {
+      continue;
+    }
+    pSkb = pEntry->pSkb;
+    pEntry->pSkb = NULL;
+
+    if (0 == (sDecision.uAction & KLEM_DEV_DELIVER)) {
+      pDev->uDropped++;
+      __skb_queue_tail(&listDrop, pSkb);
+      continue;
+    }
+
+    if (skb_queue_len(&pDev->listDelay) >= KLEM_DEV_DELAY_MAX) {
+      pDev->uOverflow++;
+      __skb_queue_tail(&listDrop, pSkb);
+      continue;
+    }
+
+    pCb = (dev_cb *)pSkb->cb;
+    pCb->meta.iPower = sDecision.iSignal;
+    if (sDecision.uAction & KLEM_DEV_RATE) {
+      pCb->meta.rate.uEncoding = sDecision.uEncoding;
+      pCb->meta.rate.uIndex = sDecision.uIndex;
+      pCb->meta.rate.uNss = sDecision.uNss;
+      pCb->meta.rate.uFlags = sDecision.uRateFlags;
+      pCb->meta.uFlags |= KLEM_TAP_FLAG_RATE;
+    }
+    sDecision.uDelay = min_t(u32, sDecision.uDelay, KLEM_DEV_TIMEOUT_USEC);
+    pCb->uDue = uNow + sDecision.uDelay;
+    pDev->uDelivered++;
+
+    /* Nothing may overtake a frame still waiting */
+    if ((0 == sDecision.uDelay) && skb_queue_empty(&pDev->listDelay)) {
+      __skb_queue_tail(&listNow, pSkb);
+    } else {
+      __skb_queue_tail(&pDev->listDelay, pSkb);
+    }
+  }
+
+  smp_mb();
+  pHeader->uDecisionTail = uTail;
+  if (!hrtimer_active(&pDev->sTimer)) {
+    privDevArm(pDev);
+  }
+  spin_unlock_irqrestore(&pDev->sLock, uFlags);
+
+  while (NULL != (pSkb = __skb_dequeue(&listDrop))) {
+    dev_kfree_skb(pSkb);
+  }
+
+  local_bh_disable();
+  privDevDeliver(pDev, &listNow);
+  local_bh_enable();
+}
+
+static int privDevOpen(struct inode *pInode, struct file *pFile)
+{
+  dev_data *pDev = privDevGet();
+  KLEM_DEV_HEADER *pHeader = NULL;
+  unsigned long uFlags;
+
+  if (NULL == pDev) {
+    return -ENODEV;
+  }
+
+  /* One medium daemon at a time */
+  if (0 != atomic_cmpxchg(&pDev->iOpen, 0, 1)) {
+    return -EBUSY;
+  }
+
+  spin_lock_irqsave(&pDev->sLock, uFlags);
+  pHeader = pDev->pHeader;
+  pHeader->uFrameHead = 0;
+  pHeader->uFrameTail = 0;
+  pHeader->uDecisionHead = 0;
+  pHeader->uDecisionTail = 0;
+  pDev->bAttached = true;
+  spin_unlock_irqrestore(&pDev->sLock, uFlags);
+
+  KLEM_MSG("medium daemon attached\n");
+  return 0;
+}
+
+/* The daemon is gone, everything it still owed us is dropped. */
+static int privDevRelease(struct inode *pInode, struct file *pFile)
+{
+  dev_data *pDev = privDevGet();
+  struct sk_buff_head listDrop;
+  struct sk_buff *pSkb = NULL;
+  unsigned long uFlags;
+  unsigned int loop;
+
+  if (NULL == pDev) {
+    return 0;
+  }
+
+  __skb_queue_head_init(&listDrop);
+
+  spin_lock_irqsave(&pDev->sLock, uFlags);
+  pDev->bAttached = false;
+  for (loop = 0; loop < KLEM_DEV_SLOTS; loop++) {
+    if (NULL != pDev->pending [loop].pSkb) {
+      __skb_queue_tail(&listDrop, pDev->pending [loop].pSkb);
+      pDev->pending [loop].pSkb = NULL;
+    }
+  }
+  skb_queue_splice_tail_init(&pDev->listDelay, &listDrop);
+  spin_unlock_irqrestore(&pDev->sLock, uFlags);
+
+  hrtimer_cancel(&pDev->sTimer);
+  tasklet_kill(&pDev->sTasklet);
+
+  while (NULL != (pSkb = __skb_dequeue(&listDrop))) {
+    dev_kfree_skb(pSkb);
+  }
+
+  atomic_set(&pDev->iOpen, 0);
+  KLEM_MSG("medium daemon detached\n");
+  return 0;
+}
+
+/* Any write tells us there are decisions on the ring. */
+static ssize_t privDevWrite(struct file *pFile, const char __user *pBuffer,
+                            size_t uCount, loff_t *pOffset)
+{
+  dev_data *pDev = privDevGet();
+
+  if (NULL == pDev) {
+    return -ENODEV;
+  }
+
+  privDevDecide(pDev);
+  return uCount;
+}
+
+static unsigned int privDevPoll(struct file *pFile, poll_table *pWait)
+{
+  dev_data *pDev = privDevGet();
+
+  if (NULL == pDev) {
+    return POLLERR;
+  }
+
+  poll_wait(pFile, &pDev->sWait, pWait);
+  smp_mb();
+  if (KLEM_DEV_READ(pDev->pHeader->uFrameHead) !=
+      KLEM_DEV_READ(pDev->pHeader->uFrameTail)) {
+    return POLLIN | POLLRDNORM;
+  }
+
+  return 0;
+}
+
+static int privDevMmap(struct file *pFile, struct vm_area_struct *pVma)
+{
+  dev_data *pDev = privDevGet();
+
+  if (NULL == pDev) {
+    return -ENODEV;
+  }
+
+  if ((0 != pVma->vm_pgoff) ||
+      ((pVma->vm_end - pVma->vm_start) > pDev->uAreaSize)) {
+    return -EINVAL;
+  }
+
+  return remap_vmalloc_range(pVma, pDev->pArea, 0);
+}
+
+static const struct file_operations priv_dev_fops = {
+  .owner = THIS_MODULE,
+  .open = privDevOpen,
+  .release = privDevRelease,
+  .write = privDevWrite,
+  .poll = privDevPoll,
+  .mmap = privDevMmap,
+};
+
+void klemDevCreate(void *pPtr)
+{
+  KLEMData *pData = (KLEMData *)pPtr;
+  dev_data *pDev = NULL;
+  KLEM_DEV_HEADER *pHeader = NULL;
+  size_t uFrames = sizeof(KLEM_DEV_FRAME) * KLEM_DEV_SLOTS;
+  size_t uDecisions = sizeof(KLEM_DEV_DECISION) * KLEM_DEV_SLOTS;
+
+  BUILD_BUG_ON(sizeof(dev_cb) > sizeof(((struct sk_buff *)0)->cb));
+
+  pDev = vzalloc(sizeof(dev_data));
+  if (NULL == pDev) {
+    KLEM_MSG("Failed to allocate the medium device\n");
+    return;
+  }
+
+  pDev->uAreaSize = PAGE_ALIGN(PAGE_SIZE + uFrames + uDecisions);
+  pDev->pArea = vmalloc_user(pDev->uAreaSize);
+  if (NULL == pDev->pArea) {
+    KLEM_MSG("Failed to allocate the medium rings\n");
+    vfree(pDev);
+    return;
+  }
+
+  pHeader = (KLEM_DEV_HEADER *)pDev->pArea;
+  pHeader->uMagic = KLEM_DEV_MAGIC;
+  pHeader->uVersion = KLEM_DEV_VERSION;
+  pHeader->uSlots = KLEM_DEV_SLOTS;
+  pHeader->uFrameOffset = PAGE_SIZE;
+  pHeader->uDecisionOffset = PAGE_SIZE + uFrames;
+  pDev->pHeader = pHeader;
+  pDev->pFrames = (KLEM_DEV_FRAME *)((char *)pDev->pArea + PAGE_SIZE);
+  pDev->pDecisions = (KLEM_DEV_DECISION *)((char *)pDev->pArea +
+                                           PAGE_SIZE + uFrames);
+
+  pDev->pData = pData;
+  spin_lock_init(&pDev->sLock);
+  atomic_set(&pDev->iOpen, 0);
+  init_waitqueue_head(&pDev->sWait);
+  skb_queue_head_init(&pDev->listDelay);
+  hrtimer_init(&pDev->sTimer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+  pDev->sTimer.function = privDevTimer;
+  tasklet_init(&pDev->sTasklet, privDevTasklet, (unsigned long)pDev);
+
+  pDev->sMisc.minor = MISC_DYNAMIC_MINOR;
+  pDev->sMisc.name = KLEM_DEV_NAME;
+  pDev->sMisc.fops = &priv_dev_fops;
+  pData->pDevice = (void *)pDev;
+
+  if (0 != misc_register(&pDev->sMisc)) {
+    KLEM_MSG("Failed to register /dev/" KLEM_DEV_NAME "\n");
+  } else {
+    pDev->bRegistered = true;
+  }
+}
+
+void klemDevDestroy(void *pPtr)
+{
+  KLEMData *pData = (KLEMData *)pPtr;
+  dev_data *pDev = (dev_data *)pData->pDevice;
+
+  if (NULL != pDev) {
+    /* No file can be open, the module is referenced while it is */
+    if (true == pDev->bRegistered) {
+      misc_deregister(&pDev->sMisc);
+    }
+    hrtimer_cancel(&pDev->sTimer);
+    tasklet_kill(&pDev->sTasklet);
+    pData->pDevice = NULL;
+    vfree(pDev->pArea);
+    vfree(pDev);
+  }
+}
+
+/*
+ * Hand a received frame to the medium daemon.  True when the frame is
+ * ours now, it comes back through klem80211RecvDecided or not at all.
+ */
+bool klemDevPost(void *pPtr, struct sk_buff *pSkb, KLEM_META *pMeta)
+{
+  dev_data *pDev = (dev_data *)pPtr;
+  KLEM_DEV_HEADER *pHeader = NULL;
+  KLEM_DEV_FRAME *pFrame = NULL;
+  dev_pending *pEntry = NULL;
+  struct ieee80211_hdr *pWHdr = NULL;
+  unsigned int uOffset = 0;
+  unsigned long uFlags;
+  struct sk_buff *pOld = NULL;
+  bool bFull = false;
+  u32 uHead;
+  u64 uNow;
+
+  if ((NULL == pDev) || (false == pDev->bAttached)) {
+    return false;
+  }
+
+  uNow = ktime_to_us(ktime_get());
+  if (pMeta->uFlags & KLEM_TAP_FLAG_AMPDU) {
+    uOffset = sizeof(KLEM_SUB_HEADER);
+  }
+  pWHdr = (struct ieee80211_hdr *)(pSkb->data + uOffset);
+
+  spin_lock_irqsave(&pDev->sLock, uFlags);
+  if (false == pDev->bAttached) {
+    spin_unlock_irqrestore(&pDev->sLock, uFlags);
+    return false;
+  }
+
+  pHeader = pDev->pHeader;
+  uHead = pHeader->uFrameHead;
+  pEntry = &pDev->pending [pDev->uCookie % KLEM_DEV_SLOTS];
+
+  /* The daemon fell behind, or forgot a frame */
+  if ((u32)(uHead - KLEM_DEV_READ(pHeader->uFrameTail)) >= KLEM_DEV_SLOTS) {
+    bFull = true;
+  } else if (NULL != pEntry->pSkb) {
+    if (uNow - pEntry->uTime < KLEM_DEV_TIMEOUT_USEC) {
+      bFull = true;
+    } else {
+      pOld = pEntry->pSkb;
+      pEntry->pSkb = NULL;
+      pDev->uExpired++;
+    }
+  }
+
+  if (true == bFull) {
+    pDev->uOverflow++;
+    spin_unlock_irqrestore(&pDev->sLock, uFlags);
+    dev_kfree_skb_any(pSkb);
+    return true;
+  }
+
+  pFrame = &pDev->pFrames [uHead % KLEM_DEV_SLOTS];
+  memset(pFrame, 0, sizeof(KLEM_DEV_FRAME));
+  pFrame->uCookie = pDev->uCookie;
+  pFrame->uTime = uNow;
+  pFrame->uTx = pMeta->uId;
+  pFrame->uRx = pDev->pData->uDeviceId;
+  pFrame->uFrequency = pMeta->uFrequency;
+  pFrame->iPower = pMeta->iPower;
+  pFrame->uLength = pSkb->len - uOffset;
+  pFrame->uFlags = pMeta->uFlags;
+  pFrame->uEncoding = pMeta->rate.uEncoding;
+  pFrame->uIndex = pMeta->rate.uIndex;
+  pFrame->uNss = pMeta->rate.uNss;
+  pFrame->uRateFlags = pMeta->rate.uFlags;
+  pFrame->uFrameControl = le16_to_cpu(pWHdr->frame_control);
+  memcpy(pFrame->uAddr1, pWHdr->addr1, ETH_ALEN);
+  if (pSkb->len >= uOffset + 16) {
+    memcpy(pFrame->uAddr2, pWHdr->addr2, ETH_ALEN);
+  }
+
+  memcpy(&((dev_cb *)pSkb->cb)->meta, pMeta, sizeof(KLEM_META));
+  pEntry->pSkb = pSkb;
+  pEntry->uCookie = pDev->uCookie;
+  pEntry->uTime = uNow;
+  pDev->uCookie++;
+  pDev->uPosted++;
+
+  smp_wmb();
+  pHeader->uFrameHead = uHead + 1;
+  spin_unlock_irqrestore(&pDev->sLock, uFlags);
+
+  if (NULL != pOld) {
+    dev_kfree_skb_any(pOld);
+  }
+
+  /* A busy daemon isn't waiting, it picks this up with the rest */
+  smp_mb();
+  if (waitqueue_active(&pDev->sWait)) {
+    wake_up_interruptible(&pDev->sWait);
+  }
+
+  return true;
+}
+
+void klemDevInfo(void *pPtr, KLEM_DEV_INFO *pInfo)
+{
+  dev_data *pDev = (dev_data *)pPtr;
+
+  memset(pInfo, 0, sizeof(KLEM_DEV_INFO));
+  if (NULL != pDev) {
+    pInfo->bAttached = pDev->bAttached;
+    pInfo->uPosted = pDev->uPosted;
+    pInfo->uDelivered = pDev->uDelivered;
+    pInfo->uDropped = pDev->uDropped;
+    pInfo->uOverflow = pDev->uOverflow;
+    pInfo->uExpired = pDev->uExpired;
+  }
+}
@@ -0,0 +1,118 @@
+/*
+ * Wireless Kernel Link Emulator
+ *
+ * Copyright (C) 2013 - 2016 Stuart Wells <swells@stuartwells.net>
+ * All rights reserved.
+ *
+ * Licensed under the GNU General Public License, version 2 (GPLv2)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+#ifndef KLEM_DEV_INCLUDE
+#define KLEM_DEV_INCLUDE
+
+/*
+ * /dev/klem hands received frames to a medium daemon in user space.
+ * This part is shared with the daemon, so fixed size types only.
+ */
+#include <linux/types.h>
+
+#define KLEM_DEV_NAME "klem"
+
+#define KLEM_DEV_MAGIC 0x444d4c4b
+#define KLEM_DEV_VERSION 1
+
+/* Entries in each ring, a power of two */
+#define KLEM_DEV_SLOTS 4096
+
+/*
+ * The mmap'd area starts with this header, the frame and decision
+ * rings follow at the given offsets.  Heads are written by the
+ * producer, tails by the consumer, each on its own cache line.  The
+ * counters run free, the slot is the counter modulo uSlots.
+ */
+typedef struct {
+  __u32 uMagic;
+  __u32 uVersion;
+  __u32 uSlots;
+  __u32 uFrameOffset;
+  __u32 uDecisionOffset;
+  __u32 uReserved [11];
+  __u32 uFrameHead;       /* klem */
+  __u32 uPad1 [15];
+  __u32 uFrameTail;       /* daemon */
+  __u32 uPad2 [15];
+  __u32 uDecisionHead;    /* daemon */
+  __u32 uPad3 [15];
+  __u32 uDecisionTail;    /* klem */
+  __u32 uPad4 [15];
+} KLEM_DEV_HEADER;
+
+/* A frame waiting for its fate, 64 bytes */
+typedef struct {
+  __u64 uCookie;
+  __u64 uTime;            /* usec, monotonic clock */
+  __u32 uTx;              /* sending node */
+  __u32 uRx;              /* this node */
+  __u32 uFrequency;       /* MHz */
+  __s32 iPower;           /* dBm the sender used */
+  __u32 uLength;
+  __u32 uFlags;           /* KLEM_TAP_FLAG values */
+  __u8 uEncoding;         /* rate, as in KLEM_RATE_HEADER */
+  __u8 uIndex;
+  __u8 uNss;
+  __u8 uRateFlags;
+  __u8 uAddr1 [6];
+  __u8 uAddr2 [6];
+  __u16 uFrameControl;
+  __u16 uReserved;
+  __u32 uReserved2;
+} KLEM_DEV_FRAME;
+
+/* uAction of a decision */
+#define KLEM_DEV_DROP 0
+#define KLEM_DEV_DELIVER 1
+#define KLEM_DEV_RATE 2         /* or'd in, the rate below replaces the sender's */
+
+/* What the daemon decided for uCookie, 32 bytes */
+typedef struct {
+  __u64 uCookie;
+  __u32 uAction;
+  __s32 iSignal;          /* dBm at this receiver */
+  __u32 uDelay;           /* usec before delivery */
+  __u8 uEncoding;
+  __u8 uIndex;
+  __u8 uNss;
+  __u8 uRateFlags;
+  __u32 uReserved [2];
+} KLEM_DEV_DECISION;
+
+#ifdef __KERNEL__
+#include "klemHdr.h"
+
+struct sk_buff;
+
+/* Attachment and counters, for proc */
+typedef struct {
+  bool bAttached;
+  unsigned long uPosted;
+  unsigned long uDelivered;
+  unsigned long uDropped;
+  unsigned long uOverflow;
+  unsigned long uExpired;
+} KLEM_DEV_INFO;
+
+void klemDevCreate(void *pPtr);
+void klemDevDestroy(void *pPtr);
+bool klemDevPost(void *pPtr, struct sk_buff *pSkb, KLEM_META *pMeta);
+void klemDevInfo(void *pPtr, KLEM_DEV_INFO *pInfo);
+#endif
+#endif
@@ -22,6 +22,19 @@
 #define KELM_CONTROL "klemControl"
 #define KLEM_PROTOCOL 0xdead
 
+/* Wire header versions, version 2 starts with a magic and version byte */
+#define KLEM_WIRE_V1 1
+#define KLEM_WIRE_V2 2
+#define KLEM_WIRE_MAGIC 0x6b6c
+
+/*
+ * Hosts only take frames of their own experiment.  Version 2 carries
+ * it in the upper half of uId, version 1 in the upper half of
+ * uVersion, so experiment 0 is what older drivers send.
+ */
+#define KLEM_EXPERIMENT_SHIFT 16
+#define KLEM_EXPERIMENT_MAX 0xffff
+
 typedef struct KLEM_RAW_HEADER_DEF {
   u8 pDstMac [ETH_ALEN];
   u8 pSrcMac [ETH_ALEN];
@@ -37,5 +50,172 @@ typedef struct KELM_DATA_HDR_DEF {
   u32 uId;
 } __attribute__((packed)) KLEM_TAP_HEADER;
 
+/*
+ * The KLEM ID only needs the low byte of uId, the upper bits carry
+ * flags.  A receiver drops frames with flags it doesn't know, older
+ * drivers see an out of range ID and do the same.
+ */
+#define KLEM_TAP_ID_MASK 0x000000ff
+
+/* Frame was protected by an emulated hardware key, sent in cleartext */
+#define KLEM_TAP_FLAG_PROTECTED 0x00000100
+
+/* Payload is an A-MPDU, a KLEM_SUB_HEADER in front of each MPDU */
+#define KLEM_TAP_FLAG_AMPDU 0x00000200
+
+/* A KLEM_RATE_HEADER with the transmit rate follows the tap header */
+#define KLEM_TAP_FLAG_RATE 0x00000400
+
+/*
+ * Sender understands version 2 headers.  Only drivers in between set
+ * it, version 1 frames now go out with the bare id so version 1 only
+ * drivers take them, and a KLEM_ACK_TYPE_HELLO says we know version 2.
+ */
+#define KLEM_TAP_FLAG_V2 0x00000800
+
+/* One segment of a bigger frame, a KLEM_SEG_HEADER follows the headers */
+#define KLEM_TAP_FLAG_SEGMENT 0x00001000
+
+/* Several small frames, each one behind a KLEM_CONT_HEADER */
+#define KLEM_TAP_FLAG_CONTAINER 0x00002000
+
+/* The host that takes this unicast frame acks its sequence */
+#define KLEM_TAP_FLAG_ACKREQ 0x00004000
+
+/* No 802.11 frame, a batch of KLEM_ACK_HEADER */
+#define KLEM_TAP_FLAG_ACK 0x00008000
+
+#define KLEM_TAP_FLAGS_KNOWN (KLEM_TAP_FLAG_PROTECTED | \
+                              KLEM_TAP_FLAG_AMPDU | \
+                              KLEM_TAP_FLAG_RATE | \
+                              KLEM_TAP_FLAG_V2 | \
+                              KLEM_TAP_FLAG_SEGMENT | \
+                              KLEM_TAP_FLAG_CONTAINER | \
+                              KLEM_TAP_FLAG_ACKREQ | \
+                              KLEM_TAP_FLAG_ACK)
+
+/* Version 2 carries the flags in a byte */
+#define KLEM_TAP_FLAGS_SHIFT 8
+
+/* Most frames we will put into one wire frame. */
+#define KLEM_MAX_SUBFRAMES 32
+
+typedef struct KLEM_SUB_HDR_DEF {
+  u16 uLength;
+  u16 uReserved;
+} __attribute__((packed)) KLEM_SUB_HEADER;
+
+/*
+ * Frames that don't fit the wired MTU are cut into segments, uSequence
+ * tells the frames of one sender apart.  Receivers hold at most
+ * KLEM_SEG_MAX_BYTES of one frame.
+ */
+#define KLEM_SEG_MAX_BYTES 131072
+
+typedef struct KLEM_SEG_HDR_DEF {
+  u32 uSequence;
+  u32 uTotal;
+  u32 uOffset;
+} __attribute__((packed)) KLEM_SEG_HEADER;
+
+/* Rate encodings, uIndex is a bitrate table index or an mcs */
+#define KLEM_RATE_LEGACY 0
+#define KLEM_RATE_HT 1
+#define KLEM_RATE_VHT 2
+#define KLEM_RATE_HE 3
+
+/* uFlags, the low bits carry the channel width */
+#define KLEM_RATE_BW_20 0x00
+#define KLEM_RATE_BW_40 0x01
+#define KLEM_RATE_BW_80 0x02
+#define KLEM_RATE_BW_160 0x03
+#define KLEM_RATE_BW_MASK 0x03
+#define KLEM_RATE_FLAG_SGI 0x04
+#define KLEM_RATE_FLAG_SHORTPRE 0x08
+
+/* 802.1p priority of the frame, from its access category */
+#define KLEM_RATE_PCP_MASK 0x70
+#define KLEM_RATE_PCP_SHIFT 4
+#define KLEM_RATE_PCP(uFlags) (((uFlags) & KLEM_RATE_PCP_MASK) >> \
+                               KLEM_RATE_PCP_SHIFT)
+
+typedef struct KLEM_RATE_HDR_DEF {
+  u8 uEncoding;
+  u8 uIndex;
+  u8 uNss;
+  u8 uFlags;
+} __attribute__((packed)) KLEM_RATE_HEADER;
+
+/*
+ * Entry of a container, uFlags are the KLEM_TAP_FLAG values of that
+ * frame shifted down by KLEM_TAP_FLAGS_SHIFT.
+ */
+typedef struct KLEM_CONT_HDR_DEF {
+  u16 uLength;
+  u8 uFlags;
+  u8 uReserved;
+  KLEM_RATE_HEADER rate;
+} __attribute__((packed)) KLEM_CONT_HEADER;
+
+/*
+ * Entry of an ack batch, block ack style.  Bit n of uBitmap acks the
+ * frame node uNode sent with wire sequence uStart + n.  Probes ride in
+ * the same batches: uStart of a probe is the prober's clock in usec,
+ * node uNode echoes it back in a reply.  A hello carries the sender's
+ * own node, nobody answers it.
+ */
+#define KLEM_ACK_MAX 64
+
+#define KLEM_ACK_TYPE_ACK 0
+#define KLEM_ACK_TYPE_PROBE 1
+#define KLEM_ACK_TYPE_REPLY 2
+
+/* Broadcast now and then, the sender takes version 2 headers */
+#define KLEM_ACK_TYPE_HELLO 3
+
+typedef struct KLEM_ACK_HDR_DEF {
+  u8 uNode;
+  u8 uType;
+  u16 uReserved;
+  u32 uStart;
+  u32 uBitmap;
+} __attribute__((packed)) KLEM_ACK_HEADER;
+
+/*
+ * Version 2 replaces the raw, tap and rate headers with one 24 byte
+ * header behind the ethernet header.  Always has the rate.
+ */
+typedef struct KLEM_RAW_HEADER_V2_DEF {
+  u8 pDstMac [ETH_ALEN];
+  u8 pSrcMac [ETH_ALEN];
+  u16 uProtocol;
+  u16 uMagic;
+  u8 uVersion;
+  u8 uFlags;
+  u8 uBand;
+  s8 iPower;
+  u16 uFrequency;
+  KLEM_RATE_HEADER rate;
+  u32 uSequence;
+  u32 uTimestamp;
+  u32 uId;
+} __attribute__((packed)) KLEM_RAW_HEADER_V2;
+
+/*
+ * What the wire headers say about a frame, in host order.  uFlags
+ * holds KLEM_TAP_FLAG values, uSequence and uTimestamp (usec) are only
+ * carried by version 2.
+ */
+typedef struct KLEM_META_DEF {
+  u32 uBand;
+  u32 uFrequency;
+  s32 iPower;
+  u32 uId;
+  u32 uFlags;
+  KLEM_RATE_HEADER rate;
+  u32 uVersion;
+  u32 uSequence;
+  u32 uTimestamp;
+} KLEM_META;
 
 #endif
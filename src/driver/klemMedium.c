@@ -0,0 +1,741 @@
+/*
+ * Wireless Kernel Link Emulator
+ *
+ * Copyright (C) 2013 - 2016 Stuart Wells <swells@stuartwells.net>
+ * All rights reserved.
+ *
+ * Licensed under the GNU General Public License, version 2 (GPLv2)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+#include <linux/kernel.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/ktime.h>
+#include <linux/atomic.h>
+#include "klemData.h"
+#include "klemMedium.h"
+
+/* Matrix entry for a pair without a fixed path loss. */
+#define KLEM_MEDIUM_NO_OVERRIDE S16_MIN
+
+/* Antenna height, in cm, for two-ray nodes without a height. */
+#define KLEM_MEDIUM_HEIGHT 150
+
+/* Nodes closer than 1 meter are treated as 1 meter apart. */
+#define KLEM_MEDIUM_MIN_DIST2 10000
+
+/*
+ * Transmissions this receiver heard, in the order they arrived.
+ * Nothing is on the air longer than a maximum length PPDU, older
+ * entries don't matter.  The shortest PPDU is a preamble and one OFDM
+ * symbol, the ring holds as many of those as fit into the longest.
+ */
+#define KLEM_AIR_MAX_USEC 5500
+#define KLEM_AIR_MIN_USEC 24
+#define KLEM_AIR_RING (KLEM_AIR_MAX_USEC / KLEM_AIR_MIN_USEC + 1)
+
+/*
+ * Senders stamp version 2 frames with their wall clock.  A stamp this
+ * far from ours means the clocks aren't in sync, use ours instead.
+ */
+#define KLEM_AIR_SKEW_USEC 100000
+
+/* Transmitter of our own frames in the ring. */
+#define KLEM_AIR_SELF MAX_WIRELESS_NODE
+
+/*
+ * Carrier state per channel, indexed by frequency / 5 so the 2.4GHz
+ * and 5GHz channels land on different entries.  Lock free, senders
+ * only ever push the end of the busy period out.
+ */
+#define KLEM_CARRIER_CHANNELS 256
+
+typedef struct {
+  atomic64_t uBusyStart;
+  atomic64_t uBusyEnd;
+} medium_carrier;
+
+/* One transmission on the air, power in femto watt. */
+typedef struct {
+  u64 uStart;
+  u64 uEnd;
+  u64 uPower;
+  u32 uFrequency;
+  unsigned int uTx;
+} medium_air;
+
+typedef struct {
+  /* position in cm */
+  s32 iX;
+  s32 iY;
+  s32 iZ;
+  bool bPlaced;
+} medium_node;
+
+/*
+ * Path loss from every node to every other node, in 1/100 dB, indexed
+ * [tx * MAX_WIRELESS_NODE + rx].  Writers take sLock, the receive path
+ * only reads single entries and does without.
+ */
+typedef struct {
+  spinlock_t sLock;
+  unsigned int uModel;
+  int iExponent;
+  int iSensitivity;
+  medium_node node [MAX_WIRELESS_NODE];
+  s16 *pLoss;
+  s16 *pOverride;
+  unsigned int uOverrides;
+
+  unsigned long uDropped;
+
+  /* Interference, what is on the air around this receiver */
+  spinlock_t sAirLock;
+  bool bInterference;
+  medium_air air [KLEM_AIR_RING];
+  unsigned int uAirNext;
+  unsigned long uInterfered;
+
+  /* Carrier sense and NAV, usec the channel stays busy until */
+  bool bCsma;
+  medium_carrier carrier [KLEM_CARRIER_CHANNELS];
+} medium_data;
+
+/* 10^(x/10) for x of 0 to 9 dB, times 1000. */
+static const u32 privConstTenths [] = {
+  1000, 1259, 1585, 1995, 2512, 3162, 3981, 5012, 6310, 7943
+};
+
+/*
+ * Adjacent channel rejection in 1/100 dB by 5MHz steps apart, the
+ * overlap of the 2.4GHz channel masks.  Further away is not heard.
+ */
+static const s32 privConstAdjacent [] = {
+  0, 140, 570, 1430, 2270, 3100, 4000, 4000, 4000
+};
+
+/*
+ * log2 of uValue in 1/65536, the fraction by repeated squaring of the
+ * mantissa.  No floating point in the kernel.
+ */
+static u32 privLog2Q16(u64 uValue)
+{
+  u32 uInt;
+  u32 uFrac = 0;
+  u64 uMant;
+  int loop;
+
+  if (0 == uValue) {
+    return 0;
+  }
+
+  uInt = ilog2(uValue);
+  if (uInt >= 31) {
+    uMant = uValue >> (uInt - 31);
+  } else {
+    uMant = uValue << (31 - uInt);
+  }
+
+  for (loop = 15; loop >= 0; loop--) {
+    uMant = (uMant * uMant) >> 31;
+    if (uMant >= (2ULL << 31)) {
+      uMant >>= 1;
+      uFrac |= 1 << loop;
+    }
+  }
+
+  return (uInt << 16) | uFrac;
+}
+
+/* 10 * log10(uValue) in 1/100 dB. */
+static s32 privDb100(u64 uValue)
+{
+  return (s32)div_u64((u64)privLog2Q16(uValue) * 30103, 6553600);
+}
+
+/*
+ * Path loss in 1/100 dB from uTx to uRx at KLEM_MEDIUM_FREQUENCY.
+ * Distances stay squared, 10 log10(d^2) is 20 log10(d).
+ */
+static s32 privPathLoss(medium_data *pMedium,
+                        unsigned int uTx,
+                        unsigned int uRx)
+{
+  medium_node *pTx = &pMedium->node [uTx];
+  medium_node *pRx = &pMedium->node [uRx];
+  s64 iDX, iDY, iDZ;
+  u64 uDist2;
+  u64 uHt, uHr, uCross;
+  s32 iFree;
+  s32 iLoss = 0;
+
+  if ((false == pTx->bPlaced) || (false == pRx->bPlaced) || (uTx == uRx)) {
+    return 0;
+  }
+
+  iDX = (s64)pTx->iX - pRx->iX;
+  iDY = (s64)pTx->iY - pRx->iY;
+  iDZ = (s64)pTx->iZ - pRx->iZ;
+  uDist2 = (u64)(iDX * iDX + iDY * iDY + iDZ * iDZ);
+  if (uDist2 < KLEM_MEDIUM_MIN_DIST2) {
+    uDist2 = KLEM_MEDIUM_MIN_DIST2;
+  }
+
+  /* 20 log10(d in m) + 20 log10(f in MHz) - 27.55 */
+  iFree = privDb100(uDist2) - 4000 +
+    privDb100((u64)KLEM_MEDIUM_FREQUENCY * KLEM_MEDIUM_FREQUENCY) - 2755;
+
+  switch (pMedium->uModel)
+    {
+    case KLEM_MEDIUM_FREE_SPACE:
+      iLoss = iFree;
+      break;
+    case KLEM_MEDIUM_LOG_DISTANCE:
+      /* free space to 1 meter, then 10 n log10(d) */
+      iLoss = privDb100((u64)KLEM_MEDIUM_FREQUENCY *
+                        KLEM_MEDIUM_FREQUENCY) - 2755 +
+        (pMedium->iExponent * (privDb100(uDist2) - 4000)) / 20;
+      break;
+    case KLEM_MEDIUM_TWO_RAY:
+      /* free space up to the crossover 4 pi ht hr / lambda */
+      uHt = (pTx->iZ > 0) ? pTx->iZ : KLEM_MEDIUM_HEIGHT;
+      uHr = (pRx->iZ > 0) ? pRx->iZ : KLEM_MEDIUM_HEIGHT;
+      uCross = div_u64(uHt * uHr * KLEM_MEDIUM_FREQUENCY * 419, 1000000);
+      if (uDist2 < uCross * uCross) {
+        iLoss = iFree;
+      } else {
+        iLoss = 2 * privDb100(uDist2) -
+          privDb100(uHt * uHt) - privDb100(uHr * uHr);
+      }
+      break;
+    default:
+      iLoss = 0;
+      break;
+    }
+
+  return clamp_t(s32, iLoss, 0, S16_MAX);
+}
+
+/* Power in dBm to femto watt, 1 fW is -120 dBm. */
+static u64 privFemtoWatt(int iDbm)
+{
+  unsigned int uDb;
+  u64 uPower = 1;
+  unsigned int loop;
+
+  iDbm = clamp_t(int, iDbm, -120, 30);
+  uDb = iDbm + 120;
+
+  for (loop = 0; loop < uDb / 10; loop++) {
+    uPower *= 10;
+  }
+
+  return div_u64(uPower * privConstTenths [uDb % 10], 1000);
+}
+
+/* uPower less iDb100 1/100 dB. */
+static u64 privAttenuate(u64 uPower, s32 iDb100)
+{
+  unsigned int uDb = iDb100 / 100;
+  unsigned int loop;
+
+  for (loop = 0; loop < uDb / 10; loop++) {
+    uPower = div_u64(uPower, 10);
+  }
+
+  return div_u64(uPower * 1000, privConstTenths [uDb % 10]);
+}
+
+/* Recompute both directions between uId and every node. */
+static void privRefreshNode(medium_data *pMedium, unsigned int uId)
+{
+  unsigned int loop;
+
+  for (loop = 0; loop < MAX_WIRELESS_NODE; loop++) {
+    pMedium->pLoss [uId * MAX_WIRELESS_NODE + loop] =
+      (s16)privPathLoss(pMedium, uId, loop);
+    pMedium->pLoss [loop * MAX_WIRELESS_NODE + uId] =
+      (s16)privPathLoss(pMedium, loop, uId);
+  }
+}
+
+/* Recompute the matrix, only placed nodes cost anything. */
+static void privRefreshAll(medium_data *pMedium)
+{
+  unsigned int loop;
+
+  memset(pMedium->pLoss, 0,
+         sizeof(s16) * MAX_WIRELESS_NODE * MAX_WIRELESS_NODE);
+  for (loop = 0; loop < MAX_WIRELESS_NODE; loop++) {
+    if (true == pMedium->node [loop].bPlaced) {
+      privRefreshNode(pMedium, loop);
+    }
+  }
+}
+
+void klemMediumCreate(void *pPtr)
+{
+  KLEMData *pData = (KLEMData *)pPtr;
+  medium_data *pMedium = NULL;
+  unsigned int loop;
+
+  pMedium = kzalloc(sizeof(medium_data), GFP_KERNEL);
+  if (NULL == pMedium) {
+    KLEM_MSG("Failed to allocate the medium\n");
+    return;
+  }
+
+  pMedium->pLoss = vmalloc(sizeof(s16) * MAX_WIRELESS_NODE *
+                           MAX_WIRELESS_NODE);
+  pMedium->pOverride = vmalloc(sizeof(s16) * MAX_WIRELESS_NODE *
+                               MAX_WIRELESS_NODE);
+  if ((NULL == pMedium->pLoss) || (NULL == pMedium->pOverride)) {
+    KLEM_MSG("Failed to allocate the path loss matrix\n");
+    if (NULL != pMedium->pLoss) vfree(pMedium->pLoss);
+    if (NULL != pMedium->pOverride) vfree(pMedium->pOverride);
+    kfree(pMedium);
+    return;
+  }
+
+  spin_lock_init(&pMedium->sLock);
+  spin_lock_init(&pMedium->sAirLock);
+  pMedium->uModel = KLEM_MEDIUM_OFF;
+  pMedium->iExponent = KLEM_MEDIUM_EXPONENT;
+  pMedium->iSensitivity = KLEM_MEDIUM_SENSITIVITY;
+  memset(pMedium->pLoss, 0,
+         sizeof(s16) * MAX_WIRELESS_NODE * MAX_WIRELESS_NODE);
+  for (loop = 0; loop < MAX_WIRELESS_NODE * MAX_WIRELESS_NODE; loop++) {
+    pMedium->pOverride [loop] = KLEM_MEDIUM_NO_OVERRIDE;
+  }
+
+  pData->pMedium = (void *)pMedium;
+  KLEM_LOG("medium at %p\n", pMedium);
+}
+
+void klemMediumDestroy(void *pPtr)
+{
+  KLEMData *pData = (KLEMData *)pPtr;
+  medium_data *pMedium = (medium_data *)pData->pMedium;
+
+  if (NULL != pMedium) {
+    pData->pMedium = NULL;
+    vfree(pMedium->pLoss);
+    vfree(pMedium->pOverride);
+    kfree(pMedium);
+  }
+}
+
+void klemMediumModel(void *pPtr, unsigned int uModel)
+{
+  medium_data *pMedium = (medium_data *)pPtr;
+  unsigned long uFlags;
+
+  if (NULL != pMedium) {
+    spin_lock_irqsave(&pMedium->sLock, uFlags);
+    pMedium->uModel = uModel;
+    privRefreshAll(pMedium);
+    spin_unlock_irqrestore(&pMedium->sLock, uFlags);
+  }
+}
+
+void klemMediumExponent(void *pPtr, int iExponent)
+{
+  medium_data *pMedium = (medium_data *)pPtr;
+  unsigned long uFlags;
+
+  if (NULL != pMedium) {
+    spin_lock_irqsave(&pMedium->sLock, uFlags);
+    pMedium->iExponent = iExponent;
+    if (KLEM_MEDIUM_LOG_DISTANCE == pMedium->uModel) {
+      privRefreshAll(pMedium);
+    }
+    spin_unlock_irqrestore(&pMedium->sLock, uFlags);
+  }
+}
+
+void klemMediumSensitivity(void *pPtr, int iSensitivity)
+{
+  medium_data *pMedium = (medium_data *)pPtr;
+
+  if (NULL != pMedium) {
+    pMedium->iSensitivity = iSensitivity;
+  }
+}
+
+/* A node moved, only its row and column of the matrix change. */
+void klemMediumPosition(void *pPtr, unsigned int uId,
+                        int iX, int iY, int iZ)
+{
+  medium_data *pMedium = (medium_data *)pPtr;
+  unsigned long uFlags;
+
+  if ((NULL != pMedium) && (uId < MAX_WIRELESS_NODE)) {
+    spin_lock_irqsave(&pMedium->sLock, uFlags);
+    pMedium->node [uId].iX = iX;
+    pMedium->node [uId].iY = iY;
+    pMedium->node [uId].iZ = iZ;
+    pMedium->node [uId].bPlaced = true;
+    if (KLEM_MEDIUM_OFF != pMedium->uModel) {
+      privRefreshNode(pMedium, uId);
+    }
+    spin_unlock_irqrestore(&pMedium->sLock, uFlags);
+  }
+}
+
+/* Fix the loss from uTx to uRx at iLoss dB, or go back to the model. */
+void klemMediumOverride(void *pPtr, unsigned int uTx, unsigned int uRx,
+                        bool bSet, int iLoss)
+{
+  medium_data *pMedium = (medium_data *)pPtr;
+  unsigned long uFlags;
+  s16 *pEntry = NULL;
+
+  if ((NULL != pMedium) &&
+      (uTx < MAX_WIRELESS_NODE) && (uRx < MAX_WIRELESS_NODE)) {
+    spin_lock_irqsave(&pMedium->sLock, uFlags);
+    pEntry = &pMedium->pOverride [uTx * MAX_WIRELESS_NODE + uRx];
+    if (KLEM_MEDIUM_NO_OVERRIDE != *pEntry) {
+      pMedium->uOverrides--;
+    }
+
+    *pEntry = KLEM_MEDIUM_NO_OVERRIDE;
+    if (true == bSet) {
+      *pEntry = (s16)clamp_t(int, iLoss * 100, 0, S16_MAX);
+      pMedium->uOverrides++;
+    }
+    spin_unlock_irqrestore(&pMedium->sLock, uFlags);
+  }
+}
+
+/*
+ * Path loss from uTx to uRx in 1/100 dB at uFrequency.  False when
+ * neither an override nor the model says anything about the pair.
+ */
+static bool privLink(medium_data *pMedium, unsigned int uTx,
+                     unsigned int uRx, u32 uFrequency, int *piLoss)
+{
+  unsigned int uIndex = uTx * MAX_WIRELESS_NODE + uRx;
+  int iLoss;
+
+  iLoss = pMedium->pOverride [uIndex];
+  if (KLEM_MEDIUM_NO_OVERRIDE == iLoss) {
+    if (KLEM_MEDIUM_OFF == pMedium->uModel) {
+      return false;
+    }
+
+    /*
+     * The matrix is for one frequency, free space grows with f^2.
+     * Receivers on several channels run this at once, so no caching.
+     */
+    iLoss = pMedium->pLoss [uIndex];
+    if (KLEM_MEDIUM_TWO_RAY != pMedium->uModel) {
+      iLoss += privDb100((u64)uFrequency * uFrequency) -
+        privDb100((u64)KLEM_MEDIUM_FREQUENCY * KLEM_MEDIUM_FREQUENCY);
+    }
+  }
+
+  *piLoss = iLoss;
+  return true;
+}
+
+/*
+ * Turn the sender's power in *piSignal into what uRx hears, in dBm.
+ * False when that is below the sensitivity and the frame is lost.
+ */
+bool klemMediumSignal(void *pPtr, unsigned int uTx, unsigned int uRx,
+                      u32 uFrequency, int *piSignal)
+{
+  medium_data *pMedium = (medium_data *)pPtr;
+  int iLoss;
+  int iSignal;
+
+  if ((NULL == pMedium) ||
+      (uTx >= MAX_WIRELESS_NODE) || (uRx >= MAX_WIRELESS_NODE) ||
+      (false == privLink(pMedium, uTx, uRx, uFrequency, &iLoss))) {
+    return true;
+  }
+
+  iSignal = *piSignal * 100 - iLoss;
+  *piSignal = iSignal / 100;
+
+  if (iSignal < pMedium->iSensitivity * 100) {
+    pMedium->uDropped++;
+    return false;
+  }
+
+  return true;
+}
+
+/*
+ * Whether uRx hears uTx sending at iPower, for the sender to decide
+ * where a frame goes.  1 yes, 0 no, -1 when the medium doesn't know:
+ * no model, or a node that was never placed.
+ */
+int klemMediumHears(void *pPtr, unsigned int uTx, unsigned int uRx,
+                    u32 uFrequency, int iPower)
+{
+  medium_data *pMedium = (medium_data *)pPtr;
+  unsigned int uIndex;
+  int iLoss;
+
+  if ((NULL == pMedium) ||
+      (uTx >= MAX_WIRELESS_NODE) || (uRx >= MAX_WIRELESS_NODE)) {
+    return -1;
+  }
+
+  uIndex = uTx * MAX_WIRELESS_NODE + uRx;
+  if ((KLEM_MEDIUM_NO_OVERRIDE == pMedium->pOverride [uIndex]) &&
+      ((false == pMedium->node [uTx].bPlaced) ||
+       (false == pMedium->node [uRx].bPlaced))) {
+    return -1;
+  }
+
+  if (false == privLink(pMedium, uTx, uRx, uFrequency, &iLoss)) {
+    return -1;
+  }
+
+  return (iPower * 100 - iLoss >= pMedium->iSensitivity * 100) ? 1 : 0;
+}
+
+/*
+ * Signal uRx would see from uTx sending at iPower, without counting
+ * anything.  False when the medium doesn't know the pair.
+ */
+bool klemMediumPredict(void *pPtr, unsigned int uTx, unsigned int uRx,
+                       u32 uFrequency, int iPower, int *piSignal)
+{
+  medium_data *pMedium = (medium_data *)pPtr;
+  int iLoss;
+
+  if ((NULL == pMedium) ||
+      (uTx >= MAX_WIRELESS_NODE) || (uRx >= MAX_WIRELESS_NODE) ||
+      (false == privLink(pMedium, uTx, uRx, uFrequency, &iLoss))) {
+    return false;
+  }
+
+  *piSignal = (iPower * 100 - iLoss) / 100;
+  return true;
+}
+
+void klemMediumInterference(void *pPtr, bool bEnable)
+{
+  medium_data *pMedium = (medium_data *)pPtr;
+  unsigned long uFlags;
+
+  if (NULL != pMedium) {
+    spin_lock_irqsave(&pMedium->sAirLock, uFlags);
+    pMedium->bInterference = bEnable;
+    memset(pMedium->air, 0, sizeof(pMedium->air));
+    spin_unlock_irqrestore(&pMedium->sAirLock, uFlags);
+  }
+}
+
+/* Put a transmission on the air around us, called with sAirLock held. */
+static void privAirAdd(medium_data *pMedium, unsigned int uTx, u64 uStart,
+                       unsigned int uAirtime, u32 uFrequency, int iSignal)
+{
+  medium_air *pAir = &pMedium->air [pMedium->uAirNext];
+
+  pAir->uStart = uStart;
+  pAir->uEnd = uStart + uAirtime;
+  pAir->uPower = privFemtoWatt(iSignal);
+  pAir->uFrequency = uFrequency;
+  pAir->uTx = uTx;
+  pMedium->uAirNext = (pMedium->uAirNext + 1) % KLEM_AIR_RING;
+}
+
+/*
+ * When a frame stamped uTimestamp (low 32 bits of the sender's wall
+ * clock in usec, 0 none) went on the air, on our wall clock.
+ */
+static u64 privAirStart(u32 uTimestamp)
+{
+  u64 uNow = ktime_to_us(ktime_get_real());
+  s32 iAgo = (s32)((u32)uNow - uTimestamp);
+
+  if ((0 == uTimestamp) ||
+      (iAgo > KLEM_AIR_SKEW_USEC) || (iAgo < -KLEM_AIR_SKEW_USEC)) {
+    return uNow;
+  }
+
+  return uNow - iAgo;
+}
+
+/*
+ * Our own transmission, we hear it at full power and can't receive
+ * anything else meanwhile.
+ */
+void klemMediumTransmit(void *pPtr, u32 uFrequency, int iPower,
+                        unsigned int uAirtime)
+{
+  medium_data *pMedium = (medium_data *)pPtr;
+  unsigned long uFlags;
+
+  if ((NULL != pMedium) && (true == pMedium->bInterference)) {
+    spin_lock_irqsave(&pMedium->sAirLock, uFlags);
+    privAirAdd(pMedium, KLEM_AIR_SELF, privAirStart(0), uAirtime,
+               uFrequency, iPower);
+    spin_unlock_irqrestore(&pMedium->sAirLock, uFlags);
+  }
+}
+
+/*
+ * A frame from uTx arrives with iSignal dBm for uAirtime usec, sent at
+ * uTimestamp on the sender's clock (0 when the header had none).
+ * Everything else on the air meanwhile, less the adjacent channel
+ * rejection, adds to the noise; a sender's own earlier frames don't.
+ * False when the SINR stays below iRequired dB.
+ */
+bool klemMediumReceive(void *pPtr, unsigned int uTx, u32 uFrequency,
+                       int iSignal, unsigned int uAirtime, int iRequired,
+                       u32 uTimestamp)
+{
+  medium_data *pMedium = (medium_data *)pPtr;
+  medium_air *pAir = NULL;
+  unsigned long uFlags;
+  unsigned int uApart;
+  unsigned int loop;
+  u64 uStart;
+  u64 uEnd;
+  u64 uInterference = 0;
+  u64 uSignal;
+  s32 iSinr;
+  bool rvalue = true;
+
+  if ((NULL == pMedium) || (false == pMedium->bInterference)) {
+    return true;
+  }
+
+  uStart = privAirStart(uTimestamp);
+  uEnd = uStart + uAirtime;
+  uSignal = privFemtoWatt(iSignal);
+
+  /*
+   * The wire may deliver frames out of their air order, so look at
+   * the whole ring and let the times decide what overlaps.
+   */
+  spin_lock_irqsave(&pMedium->sAirLock, uFlags);
+  for (loop = 0; loop < KLEM_AIR_RING; loop++) {
+    pAir = &pMedium->air [loop];
+
+    if ((0 == pAir->uEnd) || (pAir->uTx == uTx) ||
+        (pAir->uEnd <= uStart) || (pAir->uStart >= uEnd)) {
+      continue;
+    }
+
+    uApart = abs((int)pAir->uFrequency - (int)uFrequency) / 5;
+    if (uApart < ARRAY_SIZE(privConstAdjacent)) {
+      uInterference += privAttenuate(pAir->uPower,
+                                     privConstAdjacent [uApart]);
+    }
+  }
+
+  iSinr = privDb100(uSignal) -
+    privDb100(privFemtoWatt(KLEM_MEDIUM_NOISE) + uInterference);
+  if (iSinr < iRequired * 100) {
+    pMedium->uInterfered++;
+    rvalue = false;
+  }
+
+  privAirAdd(pMedium, uTx, uStart, uAirtime, uFrequency, iSignal);
+  spin_unlock_irqrestore(&pMedium->sAirLock, uFlags);
+
+  return rvalue;
+}
+
+void klemMediumCsma(void *pPtr, bool bEnable)
+{
+  medium_data *pMedium = (medium_data *)pPtr;
+
+  if (NULL != pMedium) {
+    pMedium->bCsma = bEnable;
+  }
+}
+
+/*
+ * The channel is busy for the next uUsec, a frame on the air or the
+ * NAV it announced.  Only extends what is already there.
+ */
+void klemMediumBusy(void *pPtr, u32 uFrequency, unsigned int uUsec)
+{
+  medium_data *pMedium = (medium_data *)pPtr;
+  medium_carrier *pCarrier = NULL;
+  u64 uNow;
+  u64 uEnd;
+  u64 uOld;
+
+  if ((NULL == pMedium) || (false == pMedium->bCsma)) {
+    return;
+  }
+
+  pCarrier = &pMedium->carrier [(uFrequency / 5) % KLEM_CARRIER_CHANNELS];
+  uNow = ktime_to_us(ktime_get());
+  uEnd = uNow + uUsec;
+
+  uOld = atomic64_read(&pCarrier->uBusyEnd);
+  while (uOld < uEnd) {
+    if (atomic64_cmpxchg(&pCarrier->uBusyEnd, uOld, uEnd) == uOld) {
+      /* The channel was idle, a new busy period starts */
+      if (uOld < uNow) {
+        atomic64_set(&pCarrier->uBusyStart, uNow);
+      }
+      break;
+    }
+    uOld = atomic64_read(&pCarrier->uBusyEnd);
+  }
+}
+
+/*
+ * Last busy period of the channel in usec, false without carrier
+ * sense so the sender goes ahead.
+ */
+bool klemMediumCarrier(void *pPtr, u32 uFrequency, u64 *puStart, u64 *puEnd)
+{
+  medium_data *pMedium = (medium_data *)pPtr;
+  medium_carrier *pCarrier = NULL;
+
+  if ((NULL == pMedium) || (false == pMedium->bCsma)) {
+    return false;
+  }
+
+  pCarrier = &pMedium->carrier [(uFrequency / 5) % KLEM_CARRIER_CHANNELS];
+  *puEnd = atomic64_read(&pCarrier->uBusyEnd);
+  *puStart = atomic64_read(&pCarrier->uBusyStart);
+  return true;
+}
+
+void klemMediumInfo(void *pPtr, KLEM_MEDIUM_INFO *pInfo)
+{
+  medium_data *pMedium = (medium_data *)pPtr;
+  unsigned int loop;
+
+  memset(pInfo, 0, sizeof(KLEM_MEDIUM_INFO));
+  if (NULL != pMedium) {
+    pInfo->uModel = pMedium->uModel;
+    pInfo->iExponent = pMedium->iExponent;
+    pInfo->iSensitivity = pMedium->iSensitivity;
+    pInfo->uOverrides = pMedium->uOverrides;
+    pInfo->uDropped = pMedium->uDropped;
+    pInfo->bInterference = pMedium->bInterference;
+    pInfo->uInterfered = pMedium->uInterfered;
+    pInfo->bCsma = pMedium->bCsma;
+    for (loop = 0; loop < MAX_WIRELESS_NODE; loop++) {
+      if (true == pMedium->node [loop].bPlaced) {
+        pInfo->uPlaced++;
+      }
+    }
+  }
+}
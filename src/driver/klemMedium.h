@@ -0,0 +1,76 @@
+/*
+ * Wireless Kernel Link Emulator
+ *
+ * Copyright (C) 2013 - 2016 Stuart Wells <swells@stuartwells.net>
+ * All rights reserved.
+ *
+ * Licensed under the GNU General Public License, version 2 (GPLv2)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+#ifndef KLEM_MEDIUM_INCLUDE
+#define KLEM_MEDIUM_INCLUDE
+
+/* Propagation models, off leaves the signal at the sender's power */
+#define KLEM_MEDIUM_OFF 0
+#define KLEM_MEDIUM_FREE_SPACE 1
+#define KLEM_MEDIUM_LOG_DISTANCE 2
+#define KLEM_MEDIUM_TWO_RAY 3
+
+/* Defaults, the exponent is in tenths and sensitivity in dBm */
+#define KLEM_MEDIUM_EXPONENT 30
+#define KLEM_MEDIUM_SENSITIVITY -90
+
+/* Frequency in MHz the path loss matrix is computed for. */
+#define KLEM_MEDIUM_FREQUENCY 2437
+
+/* Noise floor of a 20MHz channel in dBm, for SINR. */
+#define KLEM_MEDIUM_NOISE -95
+
+/* Medium settings and counters, for proc */
+typedef struct {
+  unsigned int uModel;
+  int iExponent;
+  int iSensitivity;
+  unsigned int uPlaced;
+  unsigned int uOverrides;
+  unsigned long uDropped;
+  bool bInterference;
+  unsigned long uInterfered;
+  bool bCsma;
+} KLEM_MEDIUM_INFO;
+
+void klemMediumCreate(void *pPtr);
+void klemMediumDestroy(void *pPtr);
+void klemMediumModel(void *pPtr, unsigned int uModel);
+void klemMediumExponent(void *pPtr, int iExponent);
+void klemMediumSensitivity(void *pPtr, int iSensitivity);
+void klemMediumPosition(void *pPtr, unsigned int uId,
+                        int iX, int iY, int iZ);
+void klemMediumOverride(void *pPtr, unsigned int uTx, unsigned int uRx,
+                        bool bSet, int iLoss);
+bool klemMediumSignal(void *pPtr, unsigned int uTx, unsigned int uRx,
+                      u32 uFrequency, int *piSignal);
+int klemMediumHears(void *pPtr, unsigned int uTx, unsigned int uRx,
+                    u32 uFrequency, int iPower);
+bool klemMediumPredict(void *pPtr, unsigned int uTx, unsigned int uRx,
+                       u32 uFrequency, int iPower, int *piSignal);
+void klemMediumInterference(void *pPtr, bool bEnable);
+void klemMediumTransmit(void *pPtr, u32 uFrequency, int iPower,
+                        unsigned int uAirtime);
+bool klemMediumReceive(void *pPtr, unsigned int uTx, u32 uFrequency,
+                       int iSignal, unsigned int uAirtime, int iRequired,
+                       u32 uTimestamp);
+void klemMediumCsma(void *pPtr, bool bEnable);
+void klemMediumBusy(void *pPtr, u32 uFrequency, unsigned int uUsec);
+bool klemMediumCarrier(void *pPtr, u32 uFrequency, u64 *puStart, u64 *puEnd);
+void klemMediumInfo(void *pPtr, KLEM_MEDIUM_INFO *pInfo);
+#endif
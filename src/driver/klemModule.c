@@ -28,6 +28,10 @@
 #include "klemHdr.h"
 #include "klemProc.h"
 #include "klemCtrl.h"
+#include "klemMedium.h"
+#include "klemSchedule.h"
+#include "klemDev.h"
+#include "klemPeer.h"
 
 /*
   The linux kernel module insmod entry point.
@@ -53,6 +57,10 @@ static int __init privKLEMInit(void)
 
     /* Let the world know we loaded */
     klemCtrlCreate(pData);
+    klemMediumCreate(pData);
+    klemPeerCreate(pData);
+    klemScheduleCreate(pData);
+    klemDevCreate(pData);
     klemProcInit(pData);
     rvalue = 0;
   } else {
@@ -88,6 +96,10 @@ static void __exit privKLEMExit(void)
   if (NULL != pData) {
     klemProcDeinit(pData);
     klemCtrlDestroy(pData);
+    klemDevDestroy(pData);
+    klemScheduleDestroy(pData);
+    klemPeerDestroy(pData);
+    klemMediumDestroy(pData);
     if (NULL != pData->pClass) {
       class_destroy(pData->pClass);
     }
@@ -32,16 +32,84 @@
 #include <linux/if.h>
 #include <linux/inetdevice.h>
 #include <linux/if_ether.h>
+#include <linux/if_vlan.h>
+#include <linux/rtnetlink.h>
 #include <linux/sched.h>
 #include <linux/kthread.h>
 #include <linux/ieee80211.h>
+#include <linux/ktime.h>
+#include <linux/bitmap.h>
 
 #include "klemData.h"
 #include "klemHdr.h"
+#include "klemNet.h"
 #include "klem80211.h"
+#include "klemMedium.h"
+#include "klemPeer.h"
 
 #define MAX_RETRIES 256
 
+/* wire headers, then a sub header and data per frame */
+#define KLEM_MAX_IOVEC (1 + (2 * KLEM_MAX_SUBFRAMES))
+
+/* The biggest wire header we build, version 1 with a rate and a tag */
+#define KLEM_MAX_WIRE_HDR (sizeof(KLEM_RAW_HEADER) + \
+                           sizeof(KLEM_TAP_HEADER) + \
+                           sizeof(KLEM_RATE_HEADER) + \
+                           VLAN_HLEN)
+
+/* 802.1p priority of ack batches, that of voice */
+#define KLEM_ACK_PCP 6
+
+/*
+ * Frames moved from the socket into the access category queues, and
+ * handed up from them, per pass.  Voice waits at most one burst.
+ */
+#define KLEM_RX_BATCH 64
+#define KLEM_RX_BURST 16
+
+/*
+ * Per access category: most frames queued, whether a full queue drops
+ * its oldest frame, late voice being no use, or the new one, and the
+ * turns it gets when weighted.
+ */
+static const struct {
+  unsigned int uLimit;
+  bool bDropOldest;
+  unsigned int uWeight;
+} privConstRxQueue [KLEM_RX_QUEUES] = {
+  { 32, true, 8 },              /* voice */
+  { 64, true, 4 },              /* video */
+  { 512, false, 2 },            /* best effort */
+  { 256, false, 1 },            /* background */
+};
+
+/*
+ * How long a version 1 only sender keeps us sending version 1, and
+ * how long a version 2 host counts without being heard.
+ */
+#define KLEM_WIRE_LEGACY_TIME (10 * HZ)
+
+/* How often we tell everyone we take version 2 */
+#define KLEM_WIRE_HELLO_TIME (2 * HZ)
+
+/* Frames we reassemble at once, and how long we wait for a segment */
+#define KLEM_SEG_SLOTS 16
+#define KLEM_SEG_TIMEOUT (HZ / 10)
+
+/*
+ * A frame being reassembled from its segments.
+ */
+typedef struct {
+  struct sk_buff *pSkb;
+  u8 pSrcMac [ETH_ALEN];
+  u32 uSequence;
+  u32 uTotal;
+  u32 uReceived;
+  unsigned long uStart;
+  KLEM_META meta;
+} seg_slot;
+
 /*
  * Private information about a connection we need to maintain.
  */
@@ -71,6 +139,72 @@ typedef struct raw_socket_def {
     u32 ui;
   } hdr;
   u32 uVersion;
+
+  /* MTU and index of the wired device */
+  unsigned int uMtu;
+  int iIfIndex;
+
+  /* VLAN we tag frames with and opened on the device, 0 none */
+  u16 uVlan;
+
+  /* Frames carry their priority in a tag and the socket priority */
+  bool bQos;
+
+  /*
+   * Version 2 sequence, when we last heard a version 1 only sender,
+   * and when we last heard version 2 from anyone and from each node.
+   */
+  u32 uSequence;
+  bool bLegacyHeard;
+  unsigned long uLegacyHeard;
+  bool bV2Heard;
+  unsigned long uV2Heard;
+  bool bNodeV2 [MAX_WIRELESS_NODE];
+  unsigned long uNodeV2 [MAX_WIRELESS_NODE];
+  unsigned long uHelloLast;
+
+  /* Send scratch space, protected by sendWait */
+  struct iovec sioVec [KLEM_MAX_IOVEC];
+  struct iovec segVec [KLEM_MAX_IOVEC + 2];
+  KLEM_SUB_HEADER subHdr [KLEM_MAX_SUBFRAMES];
+  KLEM_SEG_HEADER segHdr;
+  u8 pWireHdr [KLEM_MAX_WIRE_HDR];
+  u32 uSegSequence;
+
+  /* Small frames waiting to share one wire frame, protected by sendWait */
+  u8 *pCoalesce;
+  unsigned int uCoalesceSize;
+  unsigned int uCoalesceLen;
+  unsigned int uCoalesceCount;
+  ktime_t tCoalesceStart;
+  KLEM_META coalesceMeta;
+
+  /* Reassembly, only touched by the recv thread */
+  seg_slot segSlot [KLEM_SEG_SLOTS];
+
+  /* Hosts a frame goes to and the live nodes, protected by sendWait */
+  u8 pTargets [KLEM_PRUNE_COPIES_MAX][ETH_ALEN];
+  unsigned int uLive [MAX_WIRELESS_NODE];
+
+  /* When we last probed the peers */
+  unsigned long uProbeLast;
+
+  /*
+   * Acks for frames we took, sent back by the recv thread once the
+   * socket is drained.  ackHdr is in host order, protected by sAckLock.
+   */
+  spinlock_t sAckLock;
+  KLEM_ACK_HEADER ackHdr [KLEM_ACK_MAX];
+  unsigned int uAckCount;
+  KLEM_ACK_HEADER ackSend [KLEM_ACK_MAX];
+
+  /* Received frames by access category, only touched by the recv thread */
+  struct sk_buff_head rxQueue [KLEM_RX_QUEUES];
+  unsigned int uRxQueued;
+  unsigned int uRxTurn;
+  unsigned int uRxCredit;
+
+  KLEM_NET_STATS stats;
 } raw_socket;
 
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0))
@@ -110,6 +244,7 @@ static void *privCreateRaw(char *pDevLabel)
   raw_socket *pRaw = NULL;
   int rvalue;
   struct net_device *pDev = NULL;
+  unsigned int loop;
 
   if (NULL != pDevLabel) {
     pRaw = kmalloc(sizeof(raw_socket), GFP_ATOMIC);
@@ -167,6 +302,28 @@ static void *privCreateRaw(char *pDevLabel)
 
         /* Set the protcol version */
         pRaw->uVersion = KLEM_INT_VERSION;
+        pRaw->uVlan = 0;
+        pRaw->bQos = false;
+        pRaw->uSequence = 0;
+        pRaw->bLegacyHeard = false;
+        pRaw->uLegacyHeard = jiffies;
+        pRaw->bV2Heard = false;
+        pRaw->uV2Heard = jiffies;
+        memset(pRaw->bNodeV2, 0, sizeof(pRaw->bNodeV2));
+        memset(pRaw->uNodeV2, 0, sizeof(pRaw->uNodeV2));
+        pRaw->uHelloLast = jiffies - KLEM_WIRE_HELLO_TIME;
+        pRaw->uSegSequence = 0;
+        memset(pRaw->segSlot, 0, sizeof(pRaw->segSlot));
+        for (loop = 0; loop < KLEM_RX_QUEUES; loop++) {
+          skb_queue_head_init(&pRaw->rxQueue [loop]);
+        }
+        pRaw->uRxQueued = 0;
+        pRaw->uRxTurn = 0;
+        pRaw->uRxCredit = privConstRxQueue [0].uWeight;
+        memset(&pRaw->stats, 0, sizeof(pRaw->stats));
+        pRaw->uProbeLast = jiffies;
+        spin_lock_init(&pRaw->sAckLock);
+        pRaw->uAckCount = 0;
 
         /* Resume any callbacks */
         write_unlock_bh(&pRaw->pSocket->sk->sk_callback_lock);
@@ -181,12 +338,22 @@ static void *privCreateRaw(char *pDevLabel)
 #endif
         if (NULL != pDev) {
           memcpy(pRaw->pDevMac, (char *)pDev->perm_addr, ETH_ALEN);
+          pRaw->uMtu = pDev->mtu;
+          pRaw->iIfIndex = pDev->ifindex;
         } else {
           /* We failed, broadcasting it might work, lets try that. */
           KLEM_MSG("Didn't find network device, we will broadcast it");
           memset(pRaw->pDevMac, 0xff, ETH_ALEN);
+          pRaw->uMtu = ETH_DATA_LEN;
+          pRaw->iIfIndex = 2;
         }
 
+        /* Room for small frames to share a wire frame */
+        pRaw->uCoalesceSize = pRaw->uMtu + ETH_HLEN - KLEM_MAX_WIRE_HDR;
+        pRaw->uCoalesceLen = 0;
+        pRaw->uCoalesceCount = 0;
+        pRaw->pCoalesce = kmalloc(pRaw->uCoalesceSize, GFP_ATOMIC);
+
         /* Default the lemu to broadcast. */
         memset(pRaw->pLemuMac, 0xff, ETH_ALEN);
 
@@ -212,11 +379,23 @@ static void *privCreateRaw(char *pDevLabel)
 static void privDestroyRaw(void *pPtr)
 {
   raw_socket *pRaw = (raw_socket *)pPtr;
+  unsigned int loop;
 
   if (NULL != pRaw) {
     /* We are not connected now */
     pRaw->bConnected = false;
 
+    /* Drop anything half reassembled, or not handed up yet */
+    for (loop = 0; loop < KLEM_SEG_SLOTS; loop++) {
+      if (NULL != pRaw->segSlot [loop].pSkb) {
+        dev_kfree_skb(pRaw->segSlot [loop].pSkb);
+        pRaw->segSlot [loop].pSkb = NULL;
+      }
+    }
+    for (loop = 0; loop < KLEM_RX_QUEUES; loop++) {
+      skb_queue_purge(&pRaw->rxQueue [loop]);
+    }
+
     if (NULL != pRaw->pSocket) {
       /* Wake up everyone, so they go away. */
       wake_up_all(&pRaw->recvQueue);
@@ -235,6 +414,11 @@ static void privDestroyRaw(void *pPtr)
       pRaw->pSocket = NULL;
     }
 
+    if (NULL != pRaw->pCoalesce) {
+      kfree(pRaw->pCoalesce);
+      pRaw->pCoalesce = NULL;
+    }
+
     kfree(pRaw);
   }
 }
@@ -384,6 +568,12 @@ static int privRecvPoll(void *pPtr)
       /* Fake out, if were trying to disconnect, say we have something. */
       rvalue = 1;
     }
+
+    /* Acks waiting to go back and frames waiting to go up count too */
+    if (0 != pRaw->uAckCount) {
+      rvalue += 1;
+    }
+    rvalue += pRaw->uRxQueued;
   }
 
   return rvalue;
@@ -404,12 +594,737 @@ static void privRecvWait(void *pPtr)
   }
 }
 
+/*
+ * Which header version we send.  Auto mode starts out at version 1
+ * and moves to version 2 once a host that takes it was heard, as long
+ * as no sender that only knows version 1 was heard lately.
+ */
+static unsigned int privWireVersion(raw_socket *pRaw)
+{
+  unsigned int rvalue = KLEM_WIRE_V2;
+
+  switch (pRaw->pData->uWireVersion)
+    {
+    case KLEM_WIRE_V1:
+      rvalue = KLEM_WIRE_V1;
+      break;
+    case KLEM_WIRE_V2:
+      break;
+    default:
+      if ((false == pRaw->bV2Heard) ||
+          time_after_eq(jiffies, pRaw->uV2Heard + KLEM_WIRE_LEGACY_TIME) ||
+          ((true == pRaw->bLegacyHeard) &&
+           time_before(jiffies,
+                       pRaw->uLegacyHeard + KLEM_WIRE_LEGACY_TIME))) {
+        rvalue = KLEM_WIRE_V1;
+      }
+      break;
+    }
+
+  return rvalue;
+}
+
+/*
+ * Whether pMeta goes out with a version 2 header.  Version 1 has no
+ * room for flags, ack batches only matter to version 2 hosts anyway.
+ */
+static bool privWireV2(raw_socket *pRaw, KLEM_META *pMeta)
+{
+  return ((KLEM_WIRE_V2 == privWireVersion(pRaw)) ||
+          (0 != (pMeta->uFlags & KLEM_TAP_FLAG_ACK)));
+}
+
+/*
+ * Length of the wire headers privWireEncode would build.
+ */
+static unsigned int privWireSize(raw_socket *pRaw, KLEM_META *pMeta)
+{
+  unsigned int rvalue = sizeof(KLEM_RAW_HEADER_V2);
+
+  if (false == privWireV2(pRaw, pMeta)) {
+    rvalue = sizeof(KLEM_RAW_HEADER) + sizeof(KLEM_TAP_HEADER);
+  }
+
+  if ((0 != pRaw->uVlan) || (false != pRaw->bQos)) {
+    rvalue += VLAN_HLEN;
+  }
+
+  return rvalue;
+}
+
+/*
+ * Build the wire headers for a frame into pBuffer, returns the length.
+ */
+static unsigned int privWireEncode(raw_socket *pRaw,
+                                   KLEM_META *pMeta,
+                                   u8 *pBuffer)
+{
+  unsigned int uTag = ((0 != pRaw->uVlan) || (false != pRaw->bQos)) ?
+    VLAN_HLEN : 0;
+  u16 uPcp = KLEM_RATE_PCP(pMeta->rate.uFlags);
+  KLEM_RAW_HEADER *pHdr = (KLEM_RAW_HEADER *)(pBuffer + uTag);
+  KLEM_RAW_HEADER_V2 *pHdrV2 = (KLEM_RAW_HEADER_V2 *)(pBuffer + uTag);
+  KLEM_TAP_HEADER *pTapHdr = NULL;
+  struct vlan_ethhdr *pVlanHdr = (struct vlan_ethhdr *)pBuffer;
+  u32 uExperiment = pRaw->pData->uExperiment << KLEM_EXPERIMENT_SHIFT;
+  unsigned int rvalue = 0;
+
+  /* Let everyone know our mac, and broadcast the packet */
+  memcpy(pHdr->pSrcMac, pRaw->pDevMac, ETH_ALEN);
+  memcpy(pHdr->pDstMac, pRaw->pLemuMac, ETH_ALEN);
+  pHdr->uProtocol = htons(pRaw->uProtocol);
+
+  /*
+   * Acks only go to some hosts, so only frames take a sequence.  That
+   * way every gap a receiver sees is a frame it missed.
+   */
+  if (0 == (pMeta->uFlags & KLEM_TAP_FLAG_ACK)) {
+    pRaw->uSequence++;
+  }
+  pMeta->uSequence = pRaw->uSequence;
+  if (true == privWireV2(pRaw, pMeta)) {
+    pHdrV2->uMagic = htons(KLEM_WIRE_MAGIC);
+    pHdrV2->uVersion = KLEM_WIRE_V2;
+    pHdrV2->uFlags = (pMeta->uFlags &
+                      ~(KLEM_TAP_FLAG_RATE | KLEM_TAP_FLAG_V2)) >>
+      KLEM_TAP_FLAGS_SHIFT;
+    pHdrV2->uBand = (u8)pMeta->uBand;
+    pHdrV2->iPower = (s8)clamp_t(s32, pMeta->iPower, -128, 127);
+    pHdrV2->uFrequency = htons((u16)pMeta->uFrequency);
+    memcpy(&pHdrV2->rate, &pMeta->rate, sizeof(KLEM_RATE_HEADER));
+    pHdrV2->uSequence = htonl(pRaw->uSequence);
+    pHdrV2->uTimestamp = htonl((u32)ktime_to_us(ktime_get_real()));
+    pHdrV2->uId = htonl(uExperiment | pMeta->uId);
+    rvalue = sizeof(KLEM_RAW_HEADER_V2);
+  } else {
+    pHdr->uHeader = htonl(pRaw->hdr.ui);
+    pHdr->uVersion = htonl(uExperiment | pRaw->uVersion);
+    rvalue = sizeof(KLEM_RAW_HEADER);
+
+    /* Just the id, version 1 only drivers drop anything above it */
+    pTapHdr = (KLEM_TAP_HEADER *)((u8 *)pHdr + rvalue);
+    pTapHdr->uBand = htonl(pMeta->uBand);
+    pTapHdr->uFrequency = htonl(pMeta->uFrequency);
+    pTapHdr->uPower = htonl((u32)pMeta->iPower);
+    pTapHdr->uId = htonl(pMeta->uId & KLEM_TAP_ID_MASK);
+    rvalue += sizeof(KLEM_TAP_HEADER);
+  }
+
+  /*
+   * Move the addresses up front and tag the frame in between.  With
+   * qos and no vlan it is a priority tag, vlan 0.
+   */
+  if (0 != uTag) {
+    memmove(pBuffer, pBuffer + uTag, 2 * ETH_ALEN);
+    pVlanHdr->h_vlan_proto = htons(ETH_P_8021Q);
+    pVlanHdr->h_vlan_TCI = htons((uPcp << VLAN_PRIO_SHIFT) | pRaw->uVlan);
+    rvalue += uTag;
+  }
+
+  /* The socket priority picks the qdisc band and queue of what we send */
+  if (false != pRaw->bQos) {
+    pRaw->pSocket->sk->sk_priority = uPcp;
+  }
+
+  return rvalue;
+}
+
+/*
+ * Node uNode sent version 2, or said it takes it.
+ */
+static void privWireHeardV2(raw_socket *pRaw, unsigned int uNode)
+{
+  if (uNode == pRaw->pData->uDeviceId) {
+    return;
+  }
+
+  pRaw->bV2Heard = true;
+  pRaw->uV2Heard = jiffies;
+  if (uNode < MAX_WIRELESS_NODE) {
+    pRaw->bNodeV2 [uNode] = true;
+    pRaw->uNodeV2 [uNode] = jiffies;
+  }
+}
+
+/*
+ * Check the wire headers of a received frame and fill in pMeta.
+ * Returns the header length, 0 if it isn't a klem frame we understand.
+ */
+static unsigned int privWireDecode(raw_socket *pRaw,
+                                   struct sk_buff *pSkb,
+                                   KLEM_META *pMeta)
+{
+  KLEM_RAW_HEADER *pHdr = (KLEM_RAW_HEADER *)pSkb->data;
+  KLEM_RAW_HEADER_V2 *pHdrV2 = (KLEM_RAW_HEADER_V2 *)pSkb->data;
+  KLEM_TAP_HEADER *pTapHdr = NULL;
+  unsigned int rvalue = 0;
+  u32 utmp;
+
+  memset(pMeta, 0, sizeof(KLEM_META));
+
+  /* Version 2 is the shortest header */
+  if ((pSkb->len < sizeof(KLEM_RAW_HEADER_V2)) ||
+      (pRaw->uProtocol != ntohs(pHdr->uProtocol))) {
+    return 0;
+  }
+
+  if ((KLEM_WIRE_MAGIC == ntohs(pHdrV2->uMagic)) &&
+      (KLEM_WIRE_V2 == pHdrV2->uVersion)) {
+    /* Frames of another experiment go no further */
+    if ((ntohl(pHdrV2->uId) >> KLEM_EXPERIMENT_SHIFT) !=
+        pRaw->pData->uExperiment) {
+      pRaw->stats.uForeign++;
+      return 0;
+    }
+
+    pMeta->uVersion = KLEM_WIRE_V2;
+    pMeta->uFlags = ((u32)pHdrV2->uFlags << KLEM_TAP_FLAGS_SHIFT) |
+      KLEM_TAP_FLAG_RATE | KLEM_TAP_FLAG_V2;
+    pMeta->uBand = pHdrV2->uBand;
+    pMeta->uFrequency = ntohs(pHdrV2->uFrequency);
+    pMeta->iPower = pHdrV2->iPower;
+    memcpy(&pMeta->rate, &pHdrV2->rate, sizeof(KLEM_RATE_HEADER));
+    pMeta->uSequence = ntohl(pHdrV2->uSequence);
+    pMeta->uTimestamp = ntohl(pHdrV2->uTimestamp);
+    pMeta->uId = ntohl(pHdrV2->uId) & KLEM_EXPERIMENT_MAX;
+    rvalue = sizeof(KLEM_RAW_HEADER_V2);
+    privWireHeardV2(pRaw, pMeta->uId);
+  } else if ((pSkb->len >= sizeof(KLEM_RAW_HEADER) +
+              sizeof(KLEM_TAP_HEADER)) &&
+             (pRaw->hdr.ui == ntohl(pHdr->uHeader)) &&
+             (pRaw->uVersion ==
+              (ntohl(pHdr->uVersion) & KLEM_EXPERIMENT_MAX))) {
+    if ((ntohl(pHdr->uVersion) >> KLEM_EXPERIMENT_SHIFT) !=
+        pRaw->pData->uExperiment) {
+      pRaw->stats.uForeign++;
+      return 0;
+    }
+
+    rvalue = sizeof(KLEM_RAW_HEADER);
+    pTapHdr = (KLEM_TAP_HEADER *)(pSkb->data + rvalue);
+    rvalue += sizeof(KLEM_TAP_HEADER);
+
+    utmp = ntohl(pTapHdr->uId);
+    pMeta->uVersion = KLEM_WIRE_V1;
+    pMeta->uFlags = utmp & ~KLEM_TAP_ID_MASK;
+    pMeta->uId = utmp & KLEM_TAP_ID_MASK;
+    pMeta->uBand = ntohl(pTapHdr->uBand);
+    pMeta->uFrequency = ntohl(pTapHdr->uFrequency);
+    pMeta->iPower = (s32)ntohl(pTapHdr->uPower);
+
+    if (pMeta->uFlags & KLEM_TAP_FLAG_RATE) {
+      if (pSkb->len < rvalue + sizeof(KLEM_RATE_HEADER)) {
+        return 0;
+      }
+      memcpy(&pMeta->rate, pSkb->data + rvalue, sizeof(KLEM_RATE_HEADER));
+      rvalue += sizeof(KLEM_RATE_HEADER);
+    }
+
+    /*
+     * Remember senders that can't take version 2.  A version 2 host
+     * sends version 1 too while it hears one of those, or before it
+     * heard anyone, so only a node that never said hello counts.
+     */
+    if (pMeta->uFlags & KLEM_TAP_FLAG_V2) {
+      privWireHeardV2(pRaw, pMeta->uId);
+    } else if ((false == pRaw->bNodeV2 [pMeta->uId]) ||
+               time_after_eq(jiffies, pRaw->uNodeV2 [pMeta->uId] +
+                             KLEM_WIRE_LEGACY_TIME)) {
+      pRaw->bLegacyHeard = true;
+      pRaw->uLegacyHeard = jiffies;
+    }
+  }
+
+  return rvalue;
+}
+
+/*
+ * Remember which wired host a node sends from, and which of its wire
+ * sequences we saw.
+ */
+static void privPeerLearn(raw_socket *pRaw,
+                          struct sk_buff *pSkb,
+                          KLEM_META *pMeta)
+{
+  KLEM_RAW_HEADER *pHdr = (KLEM_RAW_HEADER *)pSkb->data;
+
+  if ((pMeta->uId >= MAX_WIRELESS_NODE) ||
+      (pMeta->uId == pRaw->pData->uDeviceId)) {
+    return;
+  }
+
+  klemPeerLearn(pRaw->pData->pPeer, pHdr->pSrcMac, pMeta, pSkb->len);
+}
+
+/*
+ * Hosts of the nodes that can hear the sender of pMeta, into
+ * pTargets.  Only nodes heard within KLEM_PEER_AGE are looked at, the
+ * others have no host to send to.  A pushed reach entry wins over the
+ * medium.  Returns -1 when the frame has to be broadcast: pruning is
+ * off, too many hear it, or a live node can't be placed by either.
+ * Caller holds sendWait.
+ */
+static int privTargets(raw_socket *pRaw, KLEM_META *pMeta)
+{
+  KLEMData *pData = pRaw->pData;
+  unsigned int uCopies = min_t(unsigned int, pData->uPruneCopies,
+                               KLEM_PRUNE_COPIES_MAX);
+  DECLARE_BITMAP(uSeen, MAX_WIRELESS_NODE);
+  unsigned int uCount;
+  unsigned int uNode;
+  int iHears;
+  int rvalue = 0;
+  unsigned int loop;
+
+  if ((KLEM_PRUNE_OFF == pData->uPrune) || (LEMU != pData->eMode) ||
+      (NULL == pMeta) || (pMeta->uId >= MAX_WIRELESS_NODE)) {
+    return -1;
+  }
+
+  bitmap_zero(uSeen, MAX_WIRELESS_NODE);
+  uCount = klemPeerNodes(pData->pPeer, pRaw->uLive, MAX_WIRELESS_NODE);
+  for (loop = 0; loop < uCount; loop++) {
+    uNode = pRaw->uLive [loop];
+    if ((uNode >= MAX_WIRELESS_NODE) || (uNode == pMeta->uId) ||
+        (0 != __test_and_set_bit(uNode, uSeen))) {
+      continue;
+    }
+
+    iHears = pData->iReach [uNode];
+    if (KLEM_REACH_UNKNOWN == iHears) {
+      iHears = klemMediumHears(pData->pMedium, pMeta->uId, uNode,
+                               pMeta->uFrequency, pMeta->iPower);
+    }
+    if (0 == iHears) {
+      continue;
+    }
+
+    /* Nobody knows if a live node hears it, it must not be cut off */
+    if ((iHears < 0) || (rvalue >= uCopies) ||
+        (false == klemPeerAddr(pData->pPeer, uNode,
+                               pRaw->pTargets [rvalue]))) {
+      return -1;
+    }
+    rvalue++;
+  }
+
+  return rvalue;
+}
+
+/*
+ * Send a built wire frame, broadcast or a copy to each of iTargets
+ * nodes.  The wire header starts pVec, with the destination first.
+ */
+static unsigned int privSendWire(raw_socket *pRaw,
+                                 struct iovec *pVec,
+                                 unsigned int uVecLength,
+                                 unsigned int uSize,
+                                 struct sockaddr_ll *pAddr,
+                                 int iTargets)
+{
+  KLEM_RAW_HEADER *pHdr = (KLEM_RAW_HEADER *)pVec [0].iov_base;
+  u8 *pMac = NULL;
+  unsigned int rvalue = 0;
+  int loop;
+
+  if (iTargets < 0) {
+    return privSocketSend(pRaw, pVec, uVecLength, uSize,
+                          (void *)pAddr, sizeof(struct sockaddr_ll));
+  }
+
+  for (loop = 0; loop < iTargets; loop++) {
+    pMac = pRaw->pTargets [loop];
+    memcpy(pHdr->pDstMac, pMac, ETH_ALEN);
+    memcpy(pAddr->sll_addr, pMac, ETH_ALEN);
+    rvalue = privSocketSend(pRaw, pVec, uVecLength, uSize,
+                            (void *)pAddr, sizeof(struct sockaddr_ll));
+    pRaw->stats.uUnicast++;
+  }
+
+  return rvalue;
+}
+
+/*
+ * Forget a reassembly slot, counting it if the frame was lost.
+ */
+static void privSegFree(raw_socket *pRaw, seg_slot *pSlot, bool bDropped)
+{
+  if (NULL != pSlot->pSkb) {
+    dev_kfree_skb(pSlot->pSkb);
+    pSlot->pSkb = NULL;
+    if (true == bDropped) {
+      pRaw->stats.uReassemblyDropped++;
+    }
+  }
+}
+
+/*
+ * Add a received segment, still behind uHdrLen bytes of wire headers,
+ * to its reassembly slot.  The segments of a frame come in order over
+ * one wire, a gap drops the frame.  Returns the whole frame once the
+ * last segment is in, and pMeta then describes it.
+ */
+static struct sk_buff *privSegReceive(raw_socket *pRaw,
+                                      struct sk_buff *pSkb,
+                                      unsigned int uHdrLen,
+                                      KLEM_META *pMeta)
+{
+  KLEM_RAW_HEADER *pHdr = (KLEM_RAW_HEADER *)pSkb->data;
+  KLEM_SEG_HEADER sSegHdr;
+  seg_slot *pSlot = NULL;
+  seg_slot *pFree = NULL;
+  seg_slot *pOldest = NULL;
+  seg_slot *pTmp = NULL;
+  struct sk_buff *rvalue = NULL;
+  u8 pSrcMac [ETH_ALEN];
+  u32 uSequence;
+  u32 uTotal;
+  u32 uOffset;
+  unsigned int uLength;
+  unsigned int loop;
+
+  if (pSkb->len < uHdrLen + sizeof(KLEM_SEG_HEADER)) {
+    dev_kfree_skb(pSkb);
+    return NULL;
+  }
+
+  memcpy(pSrcMac, pHdr->pSrcMac, ETH_ALEN);
+  memcpy(&sSegHdr, pSkb->data + uHdrLen, sizeof(KLEM_SEG_HEADER));
+  skb_pull(pSkb, uHdrLen + sizeof(KLEM_SEG_HEADER));
+  uSequence = ntohl(sSegHdr.uSequence);
+  uTotal = ntohl(sSegHdr.uTotal);
+  uOffset = ntohl(sSegHdr.uOffset);
+
+  /* Find our slot, expiring stale ones on the way */
+  for (loop = 0; loop < KLEM_SEG_SLOTS; loop++) {
+    pTmp = &pRaw->segSlot [loop];
+    if ((NULL != pTmp->pSkb) &&
+        time_after(jiffies, pTmp->uStart + KLEM_SEG_TIMEOUT)) {
+      privSegFree(pRaw, pTmp, true);
+    }
+
+    if (NULL == pTmp->pSkb) {
+      if (NULL == pFree) {
+        pFree = pTmp;
+      }
+    } else if ((uSequence == pTmp->uSequence) &&
+               (0 == memcmp(pSrcMac, pTmp->pSrcMac, ETH_ALEN))) {
+      pSlot = pTmp;
+    } else if ((NULL == pOldest) ||
+               time_before(pTmp->uStart, pOldest->uStart)) {
+      pOldest = pTmp;
+    }
+  }
+
+  if (NULL == pSlot) {
+    /* Only the first segment starts a frame */
+    if ((0 != uOffset) || (0 == uTotal) || (uTotal > KLEM_SEG_MAX_BYTES)) {
+      pRaw->stats.uReassemblyDropped++;
+      dev_kfree_skb(pSkb);
+      return NULL;
+    }
+
+    if (NULL == pFree) {
+      pFree = pOldest;
+      privSegFree(pRaw, pFree, true);
+    }
+
+    /*
+     * Up to KLEM_SEG_MAX_BYTES, the recv thread may sleep for it.  The
+     * same headroom dev_alloc_skb would leave.
+     */
+    pSlot = pFree;
+    pSlot->pSkb = alloc_skb(uTotal + NET_SKB_PAD, GFP_KERNEL);
+    if (NULL == pSlot->pSkb) {
+      pRaw->stats.uReassemblyDropped++;
+      dev_kfree_skb(pSkb);
+      return NULL;
+    }
+    skb_reserve(pSlot->pSkb, NET_SKB_PAD);
+    memcpy(pSlot->pSrcMac, pSrcMac, ETH_ALEN);
+    pSlot->uSequence = uSequence;
+    pSlot->uTotal = uTotal;
+    pSlot->uReceived = 0;
+    pSlot->uStart = jiffies;
+    memcpy(&pSlot->meta, pMeta, sizeof(KLEM_META));
+    pSlot->meta.uFlags &= ~KLEM_TAP_FLAG_SEGMENT;
+  }
+
+  if ((uOffset != pSlot->uReceived) || (uTotal != pSlot->uTotal)) {
+    privSegFree(pRaw, pSlot, true);
+    dev_kfree_skb(pSkb);
+    return NULL;
+  }
+
+  /* Short wire frames get padded, anything past the frame is padding */
+  uLength = min_t(unsigned int, pSkb->len, uTotal - pSlot->uReceived);
+  memcpy(skb_put(pSlot->pSkb, uLength), pSkb->data, uLength);
+  pSlot->uReceived += uLength;
+  dev_kfree_skb(pSkb);
+
+  if (pSlot->uReceived == pSlot->uTotal) {
+    rvalue = pSlot->pSkb;
+    pSlot->pSkb = NULL;
+    memcpy(pMeta, &pSlot->meta, sizeof(KLEM_META));
+    pRaw->stats.uReassembled++;
+  }
+
+  return rvalue;
+}
+
+/*
+ * Split a received container into its frames.  The last frame reuses
+ * the wire buffer, anything behind it is padding.
+ */
+static void privContainerReceive(raw_socket *pRaw,
+                                 struct sk_buff *pSkb,
+                                 KLEM_META *pMeta)
+{
+  KLEM_CONT_HEADER *pContHdr = NULL;
+  struct sk_buff *pSubSkb = NULL;
+  KLEM_META sMeta;
+  unsigned int uLength;
+
+  pRaw->stats.uContainerReceived++;
+  while (pSkb->len >= sizeof(KLEM_CONT_HEADER)) {
+    pContHdr = (KLEM_CONT_HEADER *)pSkb->data;
+    uLength = ntohs(pContHdr->uLength);
+
+    /* Each frame has its own flags and rate */
+    memcpy(&sMeta, pMeta, sizeof(KLEM_META));
+    sMeta.uFlags &= ~(KLEM_TAP_FLAG_CONTAINER | KLEM_TAP_FLAG_PROTECTED);
+    sMeta.uFlags |= ((u32)pContHdr->uFlags << KLEM_TAP_FLAGS_SHIFT) |
+      KLEM_TAP_FLAG_RATE;
+    memcpy(&sMeta.rate, &pContHdr->rate, sizeof(KLEM_RATE_HEADER));
+    skb_pull(pSkb, sizeof(KLEM_CONT_HEADER));
+
+    if ((0 == uLength) || (uLength > pSkb->len)) {
+      break;
+    }
+
+    if (pSkb->len - uLength < sizeof(KLEM_CONT_HEADER)) {
+      skb_trim(pSkb, uLength);
+      klem80211Recv(pRaw->pData, pSkb, &sMeta);
+      return;
+    }
+
+    pSubSkb = dev_alloc_skb(uLength);
+    if (NULL != pSubSkb) {
+      memcpy(skb_put(pSubSkb, uLength), pSkb->data, uLength);
+      klem80211Recv(pRaw->pData, pSubSkb, &sMeta);
+    }
+    skb_pull(pSkb, uLength);
+  }
+
+  dev_kfree_skb(pSkb);
+}
+
+/*
+ * Queue an entry for the next ack batch, in host order.  Acks close to
+ * an earlier one for the same node share its entry.
+ */
+static void privAckQueue(raw_socket *pRaw,
+                         unsigned int uType,
+                         unsigned int uNode,
+                         u32 uStart)
+{
+  KLEM_ACK_HEADER *pAckHdr = NULL;
+  int loop;
+
+  spin_lock_bh(&pRaw->sAckLock);
+  for (loop = (int)pRaw->uAckCount - 1;
+       (KLEM_ACK_TYPE_ACK == uType) && (loop >= 0); loop--) {
+    if ((KLEM_ACK_TYPE_ACK == pRaw->ackHdr [loop].uType) &&
+        (pRaw->ackHdr [loop].uNode == uNode) &&
+        ((u32)(uStart - pRaw->ackHdr [loop].uStart) < 32)) {
+      pAckHdr = &pRaw->ackHdr [loop];
+      break;
+    }
+  }
+
+  if (NULL != pAckHdr) {
+    pAckHdr->uBitmap |= 1U << (uStart - pAckHdr->uStart);
+  } else if (pRaw->uAckCount < KLEM_ACK_MAX) {
+    pAckHdr = &pRaw->ackHdr [pRaw->uAckCount++];
+    memset(pAckHdr, 0, sizeof(KLEM_ACK_HEADER));
+    pAckHdr->uNode = (u8)uNode;
+    pAckHdr->uType = (u8)uType;
+    pAckHdr->uStart = uStart;
+    pAckHdr->uBitmap = (KLEM_ACK_TYPE_ACK == uType) ? 1 : 0;
+  } else {
+    pRaw->stats.uAckOverflow++;
+  }
+  spin_unlock_bh(&pRaw->sAckLock);
+}
+
+/*
+ * An ack batch from another host, behind uHdrLen bytes of wire
+ * headers.  Acks for our node go to the klem80211 side, probes get a
+ * reply and replies give the rtt.  Anything behind the last entry is
+ * padding.
+ */
+static void privAckReceive(raw_socket *pRaw,
+                           struct sk_buff *pSkb,
+                           unsigned int uHdrLen,
+                           KLEM_META *pMeta)
+{
+  KLEM_RAW_HEADER *pHdr = (KLEM_RAW_HEADER *)pSkb->data;
+  KLEM_ACK_HEADER *pAckHdr = NULL;
+  u8 pSrcMac [ETH_ALEN];
+  u32 uNow = (u32)ktime_to_us(ktime_get());
+
+  memcpy(pSrcMac, pHdr->pSrcMac, ETH_ALEN);
+  skb_pull(pSkb, uHdrLen);
+
+  pRaw->stats.uAckReceived++;
+  while (pSkb->len >= sizeof(KLEM_ACK_HEADER)) {
+    pAckHdr = (KLEM_ACK_HEADER *)pSkb->data;
+    if (pAckHdr->uNode == pRaw->pData->uDeviceId) {
+      switch (pAckHdr->uType)
+        {
+        case KLEM_ACK_TYPE_ACK:
+          if (0 != pAckHdr->uBitmap) {
+            klem80211Acked(pRaw->pData, ntohl(pAckHdr->uStart),
+                           ntohl(pAckHdr->uBitmap));
+          }
+          break;
+        case KLEM_ACK_TYPE_PROBE:
+          privAckQueue(pRaw, KLEM_ACK_TYPE_REPLY, pMeta->uId,
+                       ntohl(pAckHdr->uStart));
+          break;
+        case KLEM_ACK_TYPE_REPLY:
+          klemPeerRtt(pRaw->pData->pPeer, pMeta->uId, pSrcMac,
+                      uNow - ntohl(pAckHdr->uStart));
+          break;
+        default:
+          break;
+        }
+    }
+    skb_pull(pSkb, sizeof(KLEM_ACK_HEADER));
+  }
+
+  dev_kfree_skb(pSkb);
+}
+
+static void privAckSend(raw_socket *pRaw);
+
+/*
+ * Hand a frame, without its wire headers, to the klem80211 side.
+ */
+static void privRecvDeliver(raw_socket *pRaw,
+                            struct sk_buff *pSkb,
+                            KLEM_META *pMeta)
+{
+  if (pMeta->uFlags & KLEM_TAP_FLAG_CONTAINER) {
+    privContainerReceive(pRaw, pSkb, pMeta);
+  } else {
+    klem80211Recv(pRaw->pData, pSkb, pMeta);
+  }
+}
+
+/*
+ * Access category of a received frame.  A lone 802.11 frame tells us
+ * its TID, aggregates and containers the priority they were sent with.
+ */
+static unsigned int privRecvClass(struct sk_buff *pSkb, KLEM_META *pMeta)
+{
+  struct ieee80211_hdr *pHdr = (struct ieee80211_hdr *)pSkb->data;
+  unsigned int uLen = sizeof(struct ieee80211_qos_hdr);
+
+  if ((pMeta->uFlags & (KLEM_TAP_FLAG_AMPDU | KLEM_TAP_FLAG_CONTAINER)) ||
+      (pSkb->len < sizeof(struct ieee80211_hdr_3addr))) {
+    return klem80211PcpAc(KLEM_RATE_PCP(pMeta->rate.uFlags));
+  }
+
+  if (ieee80211_is_data_qos(pHdr->frame_control)) {
+    if (ieee80211_has_a4(pHdr->frame_control)) {
+      uLen += ETH_ALEN;
+    }
+    if (pSkb->len >= uLen) {
+      return klem80211PcpAc(*ieee80211_get_qos_ctl(pHdr));
+    }
+  } else if (!ieee80211_is_data(pHdr->frame_control)) {
+    return IEEE80211_AC_VO;
+  }
+
+  return IEEE80211_AC_BE;
+}
+
+/*
+ * Queue a frame, without its wire headers, by access category.  Its
+ * meta rides in the control buffer until privRecvService hands it up.
+ */
+static void privRecvFrame(raw_socket *pRaw,
+                          struct sk_buff *pSkb,
+                          KLEM_META *pMeta)
+{
+  unsigned int uAc = privRecvClass(pSkb, pMeta);
+  struct sk_buff_head *pQueue = &pRaw->rxQueue [uAc];
+  struct sk_buff *pDrop = NULL;
+
+  BUILD_BUG_ON(sizeof(KLEM_META) > sizeof(pSkb->cb));
+
+  if (skb_queue_len(pQueue) >= privConstRxQueue [uAc].uLimit) {
+    pRaw->stats.uRxDropped [uAc]++;
+    if (false == privConstRxQueue [uAc].bDropOldest) {
+      dev_kfree_skb(pSkb);
+      return;
+    }
+    pDrop = __skb_dequeue(pQueue);
+    dev_kfree_skb(pDrop);
+    pRaw->uRxQueued--;
+  }
+
+  memcpy(pSkb->cb, pMeta, sizeof(KLEM_META));
+  __skb_queue_tail(pQueue, pSkb);
+  pRaw->uRxQueued++;
+}
+
+/*
+ * Hand up to KLEM_RX_BURST queued frames to the klem80211 side, voice
+ * first when strict, by turns of privConstRxQueue weights otherwise.
+ */
+static void privRecvService(raw_socket *pRaw)
+{
+  struct sk_buff *pSkb = NULL;
+  KLEM_META sMeta;
+  unsigned int uBurst = 0;
+  unsigned int uAc = 0;
+
+  while ((uBurst++ < KLEM_RX_BURST) && (0 != pRaw->uRxQueued)) {
+    if (KLEM_RX_WEIGHTED == pRaw->pData->uRxPriority) {
+      while ((0 == pRaw->uRxCredit) ||
+             skb_queue_empty(&pRaw->rxQueue [pRaw->uRxTurn])) {
+        pRaw->uRxTurn = (pRaw->uRxTurn + 1) % KLEM_RX_QUEUES;
+        pRaw->uRxCredit = privConstRxQueue [pRaw->uRxTurn].uWeight;
+      }
+      uAc = pRaw->uRxTurn;
+      pRaw->uRxCredit--;
+    } else {
+      uAc = 0;
+      while (skb_queue_empty(&pRaw->rxQueue [uAc])) {
+        uAc++;
+      }
+    }
+
+    pSkb = __skb_dequeue(&pRaw->rxQueue [uAc]);
+    pRaw->uRxQueued--;
+    pRaw->stats.uRxDelivered [uAc]++;
+
+    /* klem80211 keeps its rx status in the control buffer */
+    memcpy(&sMeta, pSkb->cb, sizeof(KLEM_META));
+    memset(pSkb->cb, 0, sizeof(KLEM_META));
+    privRecvDeliver(pRaw, pSkb, &sMeta);
+  }
+}
+
 static int privateRecvRawThread(void *pPtr)
 {
   raw_socket *pRaw = (raw_socket *)pPtr;
   struct sk_buff *pSkb = NULL;
-  KLEM_RAW_HEADER *pHdr = NULL;
-  unsigned int uHdrLen = sizeof(KLEM_RAW_HEADER);
+  KLEM_META sMeta;
+  unsigned int uHdrLen;
+  unsigned int uBatch;
 
   set_user_nice(current, -20);
 
@@ -419,36 +1334,45 @@ static int privateRecvRawThread(void *pPtr)
     privRecvWait(pRaw);
 
     if (true == pRaw->bConnected) {
-      /* Get the packet. */
-      pSkb = skb_dequeue(&pRaw->pSocket->sk->sk_receive_queue);
-
-      if (NULL != pSkb) {
-        pHdr = (KLEM_RAW_HEADER *)pSkb->data;
+      /* Sort what the socket has into the access category queues */
+      for (uBatch = 0; uBatch < KLEM_RX_BATCH; uBatch++) {
+        pSkb = skb_dequeue(&pRaw->pSocket->sk->sk_receive_queue);
+        if (NULL == pSkb) {
+          break;
+        }
 
         if (LEMU == pRaw->pData->eMode) {
-          if (pSkb->len >= uHdrLen) {
-            /* Lets examine the incomming header */
-            pHdr = (KLEM_RAW_HEADER *)pSkb->data;
-
-            if (pRaw->uProtocol == ntohs(pHdr->uProtocol)) {
-              if (pRaw->hdr.ui == ntohl(pHdr->uHeader)) {
-                if (pRaw->uVersion == ntohl(pHdr->uVersion)) {
-
-                  /* remove the header */
-                  skb_pull(pSkb, uHdrLen);
+          /* Lets examine the incomming header */
+          uHdrLen = privWireDecode(pRaw, pSkb, &sMeta);
+          if (0 != uHdrLen) {
+            privPeerLearn(pRaw, pSkb, &sMeta);
+          }
+          if ((0 != uHdrLen) && (sMeta.uFlags & KLEM_TAP_FLAG_ACK)) {
+            /* Acks and probes, not a frame */
+            privAckReceive(pRaw, pSkb, uHdrLen, &sMeta);
+            pSkb = NULL;
+          } else if ((0 != uHdrLen) &&
+                     (sMeta.uFlags & KLEM_TAP_FLAG_SEGMENT)) {
+            /* A piece of a bigger frame, wait for the rest. */
+            pSkb = privSegReceive(pRaw, pSkb, uHdrLen, &sMeta);
+            uHdrLen = 0;
+            if (NULL != pSkb) {
+              privRecvFrame(pRaw, pSkb, &sMeta);
+              pSkb = NULL;
+            }
+          } else if (0 != uHdrLen) {
+            /* remove the header */
+            skb_pull(pSkb, uHdrLen);
 
-                  /* call the klem80211 side, to recv packet. */
-                  klem80211Recv(pRaw->pData, pSkb);
+            /* queue it for the klem80211 side */
+            privRecvFrame(pRaw, pSkb, &sMeta);
 
-                  /* I know nothing */
-                  pSkb = NULL;
-                }
-              }
-            }
+            /* I know nothing */
+            pSkb = NULL;
           }
         } else {
           /* call the klem80211 side, to recv packet. */
-          klem80211Recv(pRaw->pData, pSkb);
+          klem80211Recv(pRaw->pData, pSkb, NULL);
 
           /* I know nothing */
           pSkb = NULL;
@@ -460,6 +1384,16 @@ static int privateRecvRawThread(void *pPtr)
           pSkb = NULL;
         }
       }
+
+      /* Then hand them up, voice first */
+      privRecvService(pRaw);
+
+      /* Acks go back once we have caught up, in one batch */
+      if ((0 != pRaw->uAckCount) &&
+          ((pRaw->uAckCount >= KLEM_ACK_MAX) ||
+           skb_queue_empty(&pRaw->pSocket->sk->sk_receive_queue))) {
+        privAckSend(pRaw);
+      }
     }
   }
 
@@ -474,6 +1408,57 @@ static int privateRecvRawThread(void *pPtr)
   return 0;
 }
 
+/*
+ * Open or close our VLAN in the filter of the wired device, so a card
+ * that filters VLANs passes our frames up and drops other tenants'.
+ */
+static void privVlanFilter(raw_socket *pRaw, bool bOpen)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,3,0)) && \
+  (defined(CONFIG_VLAN_8021Q) || defined(CONFIG_VLAN_8021Q_MODULE))
+  struct net_device *pDev = NULL;
+  int rvalue = 0;
+
+  rtnl_lock();
+  pDev = __dev_get_by_index(sock_net(pRaw->pSocket->sk), pRaw->iIfIndex);
+  if (NULL != pDev) {
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0))
+    if (bOpen) {
+      rvalue = vlan_vid_add(pDev, htons(ETH_P_8021Q), pRaw->uVlan);
+    } else {
+      vlan_vid_del(pDev, htons(ETH_P_8021Q), pRaw->uVlan);
+    }
+#else
+    if (bOpen) {
+      rvalue = vlan_vid_add(pDev, pRaw->uVlan);
+    } else {
+      vlan_vid_del(pDev, pRaw->uVlan);
+    }
+#endif
+  }
+  rtnl_unlock();
+
+  if (0 != rvalue) {
+    KLEM_LOG("Error %d adding vlan %u to the device filter\n",
+             rvalue, pRaw->uVlan);
+  }
+#endif
+}
+
+/*
+ * Open our VLAN in the device filter after klemNetConnect, close it
+ * before klemNetDisconnect.  Takes the rtnl lock, so never call it
+ * with a spinlock held.
+ */
+void klemNetVlan(void *pPtr, bool bOpen)
+{
+  raw_socket *pRaw = (raw_socket *)pPtr;
+
+  if ((NULL != pRaw) && (0 != pRaw->uVlan)) {
+    privVlanFilter(pRaw, bOpen);
+  }
+}
+
 /* Add a recv callback !!!! */
 
 void *klemNetConnect(void *pPtr, char *pDevLabel)
@@ -487,6 +1472,11 @@ void *klemNetConnect(void *pPtr, char *pDevLabel)
   if (NULL != pRaw) {
     sprintf(pRaw->pRecvName, "klem-%s-recv", pDevLabel);
     pRaw->pData = pData;
+
+    /* The vlan and qos are picked when we connect */
+    pRaw->uVlan = (u16)pData->uVlan;
+    pRaw->bQos = pData->bQos;
+
     pRaw->pRecvThread = (void *)kthread_run(privateRecvRawThread,
                                             (void *)pRaw,
                                             pRaw->pRecvName);
@@ -515,20 +1505,263 @@ void klemNetDisconnect(void *pPtr)
 }
 
 /*
- * Send the contents of an sk_buff raw on a network device.
+ * Where our raw frames go.
  */
-unsigned int klemTransmit(void *pPtr,
-                          struct sk_buff *pSkb,
-                          char *pHdr, unsigned int uHdrSize)
+static void privLinkAddr(raw_socket *pRaw, struct sockaddr_ll *pAddr)
+{
+  /* Raw address family and protocol. */
+  pAddr->sll_family = htons(PF_PACKET);
+  pAddr->sll_protocol = htons(pRaw->uProtocol);
+  pAddr->sll_halen = 6;
+  pAddr->sll_ifindex = pRaw->iIfIndex;
+
+  /* Set the destination stuff. */
+  memcpy(pAddr->sll_addr, pRaw->pLemuMac, ETH_ALEN);
+}
+
+/*
+ * Send the acks and probes queued by privAckQueue in one wire frame.
+ * Entries all for one node go to its host, a mix is broadcast.
+ */
+static void privAckSend(raw_socket *pRaw)
 {
-  raw_socket *pRaw = (raw_socket *)pPtr;
-  KLEM_RAW_HEADER khdr;
   struct sockaddr_ll llAddr;
-  struct iovec sioVec [4];
+  struct iovec *sioVec = pRaw->sioVec;
+  KLEM_ACK_HEADER *pAckSend = pRaw->ackSend;
+  KLEM_META sMeta;
+  unsigned int uCount;
+  unsigned int uvsize;
+  unsigned int loop;
+  int iTargets = 1;
+
+  spin_lock_bh(&pRaw->sAckLock);
+  uCount = pRaw->uAckCount;
+  memcpy(pAckSend, pRaw->ackHdr, uCount * sizeof(KLEM_ACK_HEADER));
+  pRaw->uAckCount = 0;
+  spin_unlock_bh(&pRaw->sAckLock);
+
+  if (0 == uCount) {
+    return;
+  }
+
+  for (loop = 0; loop < uCount; loop++) {
+    if (pAckSend [loop].uNode != pAckSend [0].uNode) {
+      iTargets = -1;
+    }
+    pAckSend [loop].uStart = htonl(pAckSend [loop].uStart);
+    pAckSend [loop].uBitmap = htonl(pAckSend [loop].uBitmap);
+  }
+
+  memset(&sMeta, 0, sizeof(KLEM_META));
+  sMeta.uId = pRaw->pData->uDeviceId;
+  sMeta.uFlags = KLEM_TAP_FLAG_ACK;
+
+  /* Senders wait on acks, they go ahead of bulk data like voice */
+  sMeta.rate.uFlags = KLEM_ACK_PCP << KLEM_RATE_PCP_SHIFT;
+
+  if (down_interruptible(&pRaw->sendWait)) {
+    return;
+  }
+
+  if (false == klemPeerAddr(pRaw->pData->pPeer, pAckSend [0].uNode,
+                            pRaw->pTargets [0])) {
+    iTargets = -1;
+  }
+  privLinkAddr(pRaw, &llAddr);
+  sioVec [0].iov_base = (char *)pRaw->pWireHdr;
+  sioVec [0].iov_len = privWireEncode(pRaw, &sMeta, pRaw->pWireHdr);
+  sioVec [1].iov_base = (char *)pAckSend;
+  sioVec [1].iov_len = uCount * sizeof(KLEM_ACK_HEADER);
+  uvsize = sioVec [0].iov_len + sioVec [1].iov_len;
+
+  if (0 != privSendWire(pRaw, sioVec, 2, uvsize, &llAddr, iTargets)) {
+    pRaw->stats.uAckSent++;
+  }
+
+  up(&pRaw->sendWait);
+}
+
+/*
+ * Send the small frames waiting in the coalesce buffer, caller holds
+ * sendWait.  A frame on its own goes out without a container, and so
+ * does each one once the wire went back to version 1.
+ */
+static void privCoalesceSend(raw_socket *pRaw)
+{
+  struct sockaddr_ll llAddr;
+  struct iovec *sioVec = pRaw->sioVec;
+  KLEM_CONT_HEADER *pContHdr = NULL;
+  KLEM_META sMeta;
+  unsigned int uSkip = 0;
+  unsigned int uLength;
+  unsigned int uvsize;
+  int iTargets;
+
+  if (0 == pRaw->uCoalesceCount) {
+    return;
+  }
+
+  /* Nobody in range, the frames never leave */
+  iTargets = privTargets(pRaw, &pRaw->coalesceMeta);
+  if (0 == iTargets) {
+    pRaw->stats.uPruned += pRaw->uCoalesceCount;
+    pRaw->uCoalesceLen = 0;
+    pRaw->uCoalesceCount = 0;
+    return;
+  }
+
+  memcpy(&sMeta, &pRaw->coalesceMeta, sizeof(KLEM_META));
+  privLinkAddr(pRaw, &llAddr);
+  if ((1 != pRaw->uCoalesceCount) &&
+      (KLEM_WIRE_V2 != privWireVersion(pRaw))) {
+    while (uSkip + sizeof(KLEM_CONT_HEADER) <= pRaw->uCoalesceLen) {
+      pContHdr = (KLEM_CONT_HEADER *)(pRaw->pCoalesce + uSkip);
+      uLength = ntohs(pContHdr->uLength);
+      sioVec [0].iov_base = (char *)pRaw->pWireHdr;
+      sioVec [0].iov_len = privWireEncode(pRaw, &sMeta, pRaw->pWireHdr);
+      sioVec [1].iov_base = (char *)(pContHdr + 1);
+      sioVec [1].iov_len = uLength;
+      uvsize = sioVec [0].iov_len + sioVec [1].iov_len;
+      privSendWire(pRaw, sioVec, 2, uvsize, &llAddr, iTargets);
+      uSkip += sizeof(KLEM_CONT_HEADER) + uLength;
+    }
+    pRaw->uCoalesceLen = 0;
+    pRaw->uCoalesceCount = 0;
+    return;
+  }
+
+  if (1 == pRaw->uCoalesceCount) {
+    uSkip = sizeof(KLEM_CONT_HEADER);
+  } else {
+    sMeta.uFlags &= ~KLEM_TAP_FLAG_PROTECTED;
+    sMeta.uFlags |= KLEM_TAP_FLAG_CONTAINER;
+    pRaw->stats.uContainerSent++;
+  }
+
+  sioVec [0].iov_base = (char *)pRaw->pWireHdr;
+  sioVec [0].iov_len = privWireEncode(pRaw, &sMeta, pRaw->pWireHdr);
+  sioVec [1].iov_base = (char *)pRaw->pCoalesce + uSkip;
+  sioVec [1].iov_len = pRaw->uCoalesceLen - uSkip;
+  uvsize = sioVec [0].iov_len + sioVec [1].iov_len;
+
+  privSendWire(pRaw, sioVec, 2, uvsize, &llAddr, iTargets);
+
+  pRaw->uCoalesceLen = 0;
+  pRaw->uCoalesceCount = 0;
+}
+
+/*
+ * Point pSlice at uLength bytes from uOffset of the data in pVec,
+ * returns how many entries it took.
+ */
+static unsigned int privSliceVec(struct iovec *pVec,
+                                 unsigned int uVecLength,
+                                 unsigned int uOffset,
+                                 unsigned int uLength,
+                                 struct iovec *pSlice)
+{
+  unsigned int rvalue = 0;
+  unsigned int uTake;
+  unsigned int loop;
+
+  for (loop = 0; (loop < uVecLength) && (uLength > 0); loop++) {
+    if (uOffset >= pVec [loop].iov_len) {
+      uOffset -= pVec [loop].iov_len;
+      continue;
+    }
+
+    uTake = min_t(unsigned int, pVec [loop].iov_len - uOffset, uLength);
+    pSlice [rvalue].iov_base = (char *)pVec [loop].iov_base + uOffset;
+    pSlice [rvalue].iov_len = uTake;
+    rvalue++;
+    uLength -= uTake;
+    uOffset = 0;
+  }
+
+  return rvalue;
+}
+
+/*
+ * Send uPayload bytes in pVec as wire frame segments that fit the MTU,
+ * each one behind its own wire headers and a KLEM_SEG_HEADER.
+ */
+static unsigned int privSendSegments(raw_socket *pRaw,
+                                     KLEM_META *pMeta,
+                                     struct iovec *pVec,
+                                     unsigned int uVecLength,
+                                     unsigned int uPayload,
+                                     struct sockaddr_ll *pAddr,
+                                     int iTargets)
+{
+  struct iovec *pSegVec = pRaw->segVec;
+  KLEM_META sMeta;
+  unsigned int uOffset = 0;
+  unsigned int uLength;
+  unsigned int uRoom;
+  unsigned int uvloc;
+  unsigned int uvsize;
+
+  if (uPayload > KLEM_SEG_MAX_BYTES) {
+    KLEM_LOG("frame of %u bytes is too big to segment\n", uPayload);
+    return 0;
+  }
+
+  memcpy(&sMeta, pMeta, sizeof(KLEM_META));
+  sMeta.uFlags |= KLEM_TAP_FLAG_SEGMENT;
+  pRaw->uSegSequence++;
+
+  while (uOffset < uPayload) {
+    pSegVec [0].iov_base = (char *)pRaw->pWireHdr;
+    pSegVec [0].iov_len = privWireEncode(pRaw, &sMeta, pRaw->pWireHdr);
+
+    pRaw->segHdr.uSequence = htonl(pRaw->uSegSequence);
+    pRaw->segHdr.uTotal = htonl(uPayload);
+    pRaw->segHdr.uOffset = htonl(uOffset);
+    pSegVec [1].iov_base = (char *)&pRaw->segHdr;
+    pSegVec [1].iov_len = sizeof(KLEM_SEG_HEADER);
+
+    uRoom = pRaw->uMtu + ETH_HLEN - pSegVec [0].iov_len - pSegVec [1].iov_len;
+    uLength = min_t(unsigned int, uRoom, uPayload - uOffset);
+    uvloc = 2 + privSliceVec(pVec, uVecLength, uOffset, uLength,
+                             &pSegVec [2]);
+    uvsize = pSegVec [0].iov_len + pSegVec [1].iov_len + uLength;
+
+    if (0 == privSendWire(pRaw, pSegVec, uvloc, uvsize, pAddr, iTargets)) {
+      return 0;
+    }
+
+    /* The receiver knows the frame by its first segment */
+    if (0 == uOffset) {
+      pMeta->uSequence = sMeta.uSequence;
+    }
+
+    uOffset += uLength;
+    pRaw->stats.uSegmentSent++;
+  }
+
+  return uPayload;
+}
+
+/*
+ * Send one or more sk_buffs raw on a network device, as a single
+ * wire frame.  With bSub each sk_buff gets a KLEM_SUB_HEADER.  Frames
+ * that don't fit the MTU of the wired device go out in segments.
+ */
+static unsigned int privTransmit(raw_socket *pRaw,
+                                 struct sk_buff **ppSkb,
+                                 unsigned int uCount,
+                                 KLEM_META *pMeta,
+                                 bool bSub)
+{
+  struct sockaddr_ll llAddr;
+  struct iovec *sioVec = NULL;
   unsigned int rvalue = 0;
   unsigned int uError;
-  unsigned int uvloc = 0;
+  unsigned int uvloc = 1;
   unsigned int uvsize = 0;
+  unsigned int uData = 0;
+  unsigned int loop;
+  int iTargets;
 
   if (NULL != pRaw) {
     if (true == pRaw->bConnected) {
@@ -538,57 +1771,66 @@ unsigned int klemTransmit(void *pPtr,
         return 0;
       }
 
-      if (LEMU == pRaw->pData->eMode) {
-        /* Let everyone know our mac. */
-        memcpy(khdr.pSrcMac, pRaw->pDevMac, ETH_ALEN);
-
-        /* Broadcast the packet */
-        memcpy(khdr.pDstMac, pRaw->pLemuMac, ETH_ALEN);
-
-        /* Setup the raw ethernet header */
-        khdr.uProtocol = htons(pRaw->uProtocol);
-        khdr.uHeader = htonl(pRaw->hdr.ui);
-        khdr.uVersion = htonl(pRaw->uVersion);
-
-        /* Point to the ethernet header + klem datagram stuff */
-        sioVec [uvloc].iov_base = (char *)&khdr;
-        sioVec [uvloc].iov_len = sizeof(KLEM_RAW_HEADER);
-        uvsize += sioVec [uvloc].iov_len;
-        uvloc++;
-        if ((NULL != pHdr) && (0 != uHdrSize)) {
-          sioVec [uvloc].iov_base = (char *)pHdr;
-          sioVec [uvloc].iov_len = uHdrSize;
+      /* Small frames queued before this one go first */
+      privCoalesceSend(pRaw);
+
+      sioVec = pRaw->sioVec;
+      privLinkAddr(pRaw, &llAddr);
+
+      /*
+       * Now we need to point to our data in the sk_buffers, the
+       * first entry is left for the headers.
+       */
+      for (loop = 0; loop < uCount; loop++) {
+        if (true == bSub) {
+          pRaw->subHdr [loop].uLength = htons((u16)ppSkb [loop]->len);
+          pRaw->subHdr [loop].uReserved = 0;
+          sioVec [uvloc].iov_base = (char *)&pRaw->subHdr [loop];
+          sioVec [uvloc].iov_len = sizeof(KLEM_SUB_HEADER);
           uvsize += sioVec [uvloc].iov_len;
           uvloc++;
         }
+        sioVec [uvloc].iov_base = (char *)ppSkb [loop]->data;
+        sioVec [uvloc].iov_len = ppSkb [loop]->len;
+        uvsize += sioVec [uvloc].iov_len;
+        uData += ppSkb [loop]->len;
+        uvloc++;
       }
 
-      /* Raw address family and protocol. */
-      llAddr.sll_family = htons(PF_PACKET);
-      llAddr.sll_protocol = htons(pRaw->uProtocol);
-      llAddr.sll_halen = 6;
-      llAddr.sll_ifindex = 2;
-
-      /* Set the destination stuff. */
-      memcpy(llAddr.sll_addr, pRaw->pLemuMac, ETH_ALEN);
-
-      /* Now we need to point to our data in the sk_buffer */
-      sioVec [uvloc].iov_base = (char *)pSkb->data;
-      sioVec [uvloc].iov_len = pSkb->len;
-      uvsize += sioVec [uvloc].iov_len;
-      uvloc++;
-
       /* Do the work of sending that data. */
-      uError = privSocketSend(pPtr,
-                              sioVec,
-                              uvloc,
-                              uvsize,
-                              (void *)&llAddr,
-                              sizeof(struct sockaddr_ll));
+      if ((LEMU == pRaw->pData->eMode) && (NULL != pMeta)) {
+        iTargets = privTargets(pRaw, pMeta);
+        if (0 == iTargets) {
+          /* Nobody can hear it, as good as sent, but nobody acks it */
+          pRaw->stats.uPruned++;
+          pMeta->uFlags &= ~KLEM_TAP_FLAG_ACKREQ;
+          uError = uvsize;
+        } else if ((true == privWireV2(pRaw, pMeta)) &&
+                   (uvsize + privWireSize(pRaw, pMeta) >
+                    pRaw->uMtu + ETH_HLEN)) {
+          /* Only version 2 has segments, version 1 sends big frames whole */
+          uError = privSendSegments(pRaw, pMeta, &sioVec [1], uvloc - 1,
+                                    uvsize, &llAddr, iTargets);
+        } else {
+          /* Point to the ethernet header + klem datagram stuff */
+          sioVec [0].iov_base = (char *)pRaw->pWireHdr;
+          sioVec [0].iov_len = privWireEncode(pRaw, pMeta, pRaw->pWireHdr);
+          uvsize += sioVec [0].iov_len;
+          uError = privSendWire(pRaw, sioVec, uvloc, uvsize, &llAddr,
+                                iTargets);
+        }
+      } else {
+        uError = privSocketSend(pRaw,
+                                &sioVec [1],
+                                uvloc - 1,
+                                uvsize,
+                                (void *)&llAddr,
+                                sizeof(struct sockaddr_ll));
+      }
 
       /* Set the return value, if greater then 0, to the packet size */
       if (uError > 0) {
-        rvalue = pSkb->len;
+        rvalue = uData;
       } else {
         rvalue = 0;
       }
@@ -600,3 +1842,259 @@ unsigned int klemTransmit(void *pPtr,
   return rvalue;
 }
 
+/*
+ * Send the contents of an sk_buff raw on a network device, behind
+ * wire headers built from pMeta.
+ */
+unsigned int klemTransmit(void *pPtr,
+                          struct sk_buff *pSkb,
+                          KLEM_META *pMeta)
+{
+  return privTransmit((raw_socket *)pPtr, &pSkb, 1, pMeta, false);
+}
+
+/*
+ * Send a list of sk_buffs as one wire frame, each one behind a
+ * KLEM_SUB_HEADER.  Used for aggregates.
+ */
+unsigned int klemTransmitList(void *pPtr,
+                              struct sk_buff **ppSkb,
+                              unsigned int uCount,
+                              KLEM_META *pMeta)
+{
+  if (uCount > KLEM_MAX_SUBFRAMES) {
+    return 0;
+  }
+
+  return privTransmit((raw_socket *)pPtr, ppSkb, uCount, pMeta, true);
+}
+
+/*
+ * Send a small frame, possibly sharing one wire frame with other small
+ * frames sent within the coalesce window.  Anything else is sent right
+ * away with klemTransmit.
+ */
+unsigned int klemTransmitCoalesce(void *pPtr,
+                                  struct sk_buff *pSkb,
+                                  KLEM_META *pMeta)
+{
+  raw_socket *pRaw = (raw_socket *)pPtr;
+  KLEM_CONT_HEADER *pContHdr = NULL;
+  unsigned int uSize;
+
+  if ((NULL == pRaw) || (NULL == pMeta) || (NULL == pRaw->pCoalesce) ||
+      (LEMU != pRaw->pData->eMode) ||
+      (0 == pRaw->pData->coalesce.uUsec) ||
+      (KLEM_WIRE_V2 != privWireVersion(pRaw)) ||
+      (pSkb->len > pRaw->pData->coalesce.uBytes) ||
+      (pMeta->uFlags & ~(KLEM_TAP_FLAG_PROTECTED | KLEM_TAP_FLAG_RATE))) {
+    return klemTransmit(pPtr, pSkb, pMeta);
+  }
+
+  uSize = sizeof(KLEM_CONT_HEADER) + pSkb->len;
+  if ((false == pRaw->bConnected) || (uSize > pRaw->uCoalesceSize)) {
+    return klemTransmit(pPtr, pSkb, pMeta);
+  }
+
+  /* Take semaphore, but allow ourselves to be blocked. */
+  if (down_interruptible(&pRaw->sendWait)) {
+    return 0;
+  }
+
+  /* Only frames that look the same on the air share a wire frame */
+  if ((0 != pRaw->uCoalesceCount) &&
+      ((pRaw->uCoalesceLen + uSize > pRaw->uCoalesceSize) ||
+       (pMeta->uBand != pRaw->coalesceMeta.uBand) ||
+       (pMeta->uFrequency != pRaw->coalesceMeta.uFrequency) ||
+       (pMeta->iPower != pRaw->coalesceMeta.iPower) ||
+       (pMeta->uId != pRaw->coalesceMeta.uId) ||
+       ((false != pRaw->bQos) &&
+        (KLEM_RATE_PCP(pMeta->rate.uFlags) !=
+         KLEM_RATE_PCP(pRaw->coalesceMeta.rate.uFlags))))) {
+    privCoalesceSend(pRaw);
+  }
+
+  if (0 == pRaw->uCoalesceCount) {
+    memcpy(&pRaw->coalesceMeta, pMeta, sizeof(KLEM_META));
+    pRaw->tCoalesceStart = ktime_get();
+  }
+
+  pContHdr = (KLEM_CONT_HEADER *)(pRaw->pCoalesce + pRaw->uCoalesceLen);
+  pContHdr->uLength = htons((u16)pSkb->len);
+  pContHdr->uFlags = (pMeta->uFlags & KLEM_TAP_FLAG_PROTECTED) >>
+    KLEM_TAP_FLAGS_SHIFT;
+  pContHdr->uReserved = 0;
+  memcpy(&pContHdr->rate, &pMeta->rate, sizeof(KLEM_RATE_HEADER));
+  memcpy(pContHdr + 1, pSkb->data, pSkb->len);
+  pRaw->uCoalesceLen += uSize;
+  pRaw->uCoalesceCount++;
+  pRaw->stats.uCoalesced++;
+
+  up(&pRaw->sendWait);
+
+  return pSkb->len;
+}
+
+/*
+ * Micro seconds until the coalesce buffer is due, -1 when it's empty.
+ */
+long klemNetFlushDelay(void *pPtr)
+{
+  raw_socket *pRaw = (raw_socket *)pPtr;
+  s64 iAge;
+
+  if ((NULL == pRaw) || (0 == pRaw->uCoalesceCount)) {
+    return -1;
+  }
+
+  iAge = ktime_us_delta(ktime_get(), pRaw->tCoalesceStart);
+  if (iAge >= pRaw->pData->coalesce.uUsec) {
+    return 0;
+  }
+
+  return pRaw->pData->coalesce.uUsec - (long)iAge;
+}
+
+/*
+ * Send the coalesce buffer once it is due, or now with bForce.
+ */
+void klemNetFlush(void *pPtr, bool bForce)
+{
+  raw_socket *pRaw = (raw_socket *)pPtr;
+
+  if ((NULL == pRaw) || (0 == pRaw->uCoalesceCount)) {
+    return;
+  }
+
+  if ((false == bForce) && (klemNetFlushDelay(pPtr) > 0)) {
+    return;
+  }
+
+  if (down_interruptible(&pRaw->sendWait)) {
+    return;
+  }
+  privCoalesceSend(pRaw);
+  up(&pRaw->sendWait);
+}
+
+/*
+ * Bytes we can send behind the wire headers as one frame.  Without a
+ * jumbo MTU on the wire that is what a receiver reassembles.
+ */
+unsigned int klemNetPayload(void *pPtr)
+{
+  raw_socket *pRaw = (raw_socket *)pPtr;
+  unsigned int rvalue = 0;
+
+  if (NULL != pRaw) {
+    rvalue = pRaw->uMtu + ETH_HLEN - KLEM_MAX_WIRE_HDR;
+    rvalue = max_t(unsigned int, rvalue, KLEM_SEG_MAX_BYTES);
+  }
+
+  return rvalue;
+}
+
+/*
+ * Wire header version we are sending.
+ */
+unsigned int klemNetVersion(void *pPtr)
+{
+  raw_socket *pRaw = (raw_socket *)pPtr;
+  unsigned int rvalue = 0;
+
+  if (NULL != pRaw) {
+    rvalue = privWireVersion(pRaw);
+  }
+
+  return rvalue;
+}
+
+/*
+ * Copy out the wire counters.
+ */
+void klemNetStats(void *pPtr, KLEM_NET_STATS *pStats)
+{
+  raw_socket *pRaw = (raw_socket *)pPtr;
+  KLEM_PEER_INFO sTotal;
+
+  memset(pStats, 0, sizeof(KLEM_NET_STATS));
+  if (NULL != pRaw) {
+    memcpy(pStats, &pRaw->stats, sizeof(KLEM_NET_STATS));
+    pStats->uPeers = klemPeerCount(pRaw->pData->pPeer);
+    klemPeerTotal(pRaw->pData->pPeer, &sTotal);
+    pStats->uSeqLost = sTotal.uLost;
+    pStats->uSeqDuplicate = sTotal.uDuplicate;
+    pStats->uSeqReorder = sTotal.uReorder;
+    if ((false != pRaw->bConnected) && (NULL != pRaw->pSocket)) {
+      pStats->uSocketDrops = atomic_read(&pRaw->pSocket->sk->sk_drops);
+    }
+  }
+}
+
+/*
+ * Queue an ack for the frame node uNode sent with wire sequence
+ * uSequence, the recv thread sends the batch.  Callable from softirq.
+ */
+void klemNetAck(void *pPtr, unsigned int uNode, u32 uSequence)
+{
+  raw_socket *pRaw = (raw_socket *)pPtr;
+
+  if ((NULL == pRaw) || (uNode >= MAX_WIRELESS_NODE)) {
+    return;
+  }
+
+  privAckQueue(pRaw, KLEM_ACK_TYPE_ACK, uNode, uSequence);
+  wake_up_all(&pRaw->recvQueue);
+}
+
+/*
+ * Probe the wire rtt of every peer heard lately, once every uProbe
+ * msec.  The probes go out with the next ack batch.
+ */
+void klemNetProbe(void *pPtr)
+{
+  raw_socket *pRaw = (raw_socket *)pPtr;
+  unsigned int uNodes [KLEM_ACK_MAX];
+  unsigned int uCount;
+  unsigned int loop;
+  u32 uNow;
+
+  if ((NULL == pRaw) || (false == pRaw->bConnected) ||
+      (LEMU != pRaw->pData->eMode) || (0 == pRaw->pData->uProbe) ||
+      time_before(jiffies, pRaw->uProbeLast +
+                  msecs_to_jiffies(pRaw->pData->uProbe))) {
+    return;
+  }
+  pRaw->uProbeLast = jiffies;
+
+  uCount = klemPeerNodes(pRaw->pData->pPeer, uNodes, KLEM_ACK_MAX);
+  uNow = (u32)ktime_to_us(ktime_get());
+  for (loop = 0; loop < uCount; loop++) {
+    privAckQueue(pRaw, KLEM_ACK_TYPE_PROBE, uNodes [loop], uNow);
+  }
+  pRaw->stats.uProbeSent += uCount;
+
+  if (0 != uCount) {
+    wake_up_all(&pRaw->recvQueue);
+  }
+}
+
+/*
+ * Tell everyone we take version 2 headers, once every
+ * KLEM_WIRE_HELLO_TIME.  The hello names our own node, so the ack
+ * batch it goes out in is broadcast.
+ */
+void klemNetHello(void *pPtr)
+{
+  raw_socket *pRaw = (raw_socket *)pPtr;
+
+  if ((NULL == pRaw) || (false == pRaw->bConnected) ||
+      (KLEM_WIRE_V1 == pRaw->pData->uWireVersion) ||
+      time_before(jiffies, pRaw->uHelloLast + KLEM_WIRE_HELLO_TIME)) {
+    return;
+  }
+  pRaw->uHelloLast = jiffies;
+
+  privAckQueue(pRaw, KLEM_ACK_TYPE_HELLO, pRaw->pData->uDeviceId, 0);
+  wake_up_all(&pRaw->recvQueue);
+}
@@ -17,9 +17,54 @@
  *
  */
 #ifndef KLEM_NET_INCLUDE
+#include "klemHdr.h"
+
+/* Received frames wait in one queue per access category */
+#define KLEM_RX_QUEUES 4
+
+/* Wire counters, for proc */
+typedef struct {
+  unsigned long uSegmentSent;
+  unsigned long uReassembled;
+  unsigned long uReassemblyDropped;
+  unsigned long uCoalesced;
+  unsigned long uContainerSent;
+  unsigned long uContainerReceived;
+  unsigned long uPruned;
+  unsigned long uUnicast;
+  unsigned int uPeers;
+  unsigned long uAckSent;
+  unsigned long uAckReceived;
+  unsigned long uAckOverflow;
+  unsigned long uProbeSent;
+  unsigned long uSeqLost;
+  unsigned long uSeqDuplicate;
+  unsigned long uSeqReorder;
+  unsigned long uSocketDrops;
+  unsigned long uForeign;
+  unsigned long uRxDelivered [KLEM_RX_QUEUES];
+  unsigned long uRxDropped [KLEM_RX_QUEUES];
+} KLEM_NET_STATS;
+
 void *klemNetConnect(void *pPtr, char *pDevLabel);
 void klemNetDisconnect(void *pPtr);
+void klemNetVlan(void *pPtr, bool bOpen);
 unsigned int klemTransmit(void *pPtr, 
 			  struct sk_buff *pSkb,
-			  char *pHdr, unsigned int uHdrSize);
+			  KLEM_META *pMeta);
+unsigned int klemTransmitList(void *pPtr,
+                              struct sk_buff **ppSkb,
+                              unsigned int uCount,
+                              KLEM_META *pMeta);
+unsigned int klemTransmitCoalesce(void *pPtr,
+                                  struct sk_buff *pSkb,
+                                  KLEM_META *pMeta);
+long klemNetFlushDelay(void *pPtr);
+void klemNetFlush(void *pPtr, bool bForce);
+unsigned int klemNetPayload(void *pPtr);
+unsigned int klemNetVersion(void *pPtr);
+void klemNetStats(void *pPtr, KLEM_NET_STATS *pStats);
+void klemNetAck(void *pPtr, unsigned int uNode, u32 uSequence);
+void klemNetProbe(void *pPtr);
+void klemNetHello(void *pPtr);
 #endif
@@ -0,0 +1,390 @@
+/*
+ * Wireless Kernel Link Emulator
+ *
+ * Copyright (C) 2013 - 2016 Stuart Wells <swells@stuartwells.net>
+ * All rights reserved.
+ *
+ * Licensed under the GNU General Public License, version 2 (GPLv2)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+#include <linux/kernel.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/bitops.h>
+#include <linux/jiffies.h>
+#include <linux/etherdevice.h>
+#include "klemData.h"
+#include "klemPeer.h"
+
+/*
+ * Buckets of the peer table.  Peers are hashed on the node id alone,
+ * so finding the host of a node is one bucket.  A node heard from two
+ * hosts has an entry for each.
+ */
+#define KLEM_PEER_HASH 256
+
+typedef struct {
+  struct hlist_node node;
+  KLEM_PEER_INFO info;
+
+  /* Newest wire sequence, bit n of uSeqWindow is uSeqHigh - n */
+  u32 uSeqHigh;
+  u64 uSeqWindow;
+} peer_entry;
+
+typedef struct {
+  /* Written by the recv thread, read by senders and proc */
+  spinlock_t sLock;
+  struct hlist_head hash [KLEM_PEER_HASH];
+  unsigned int uCount;
+
+  /* Sequence counters of every peer, evicted ones included */
+  KLEM_PEER_INFO total;
+} peer_table;
+
+static struct hlist_head *privBucket(peer_table *pTable, unsigned int uId)
+{
+  return &pTable->hash [uId % KLEM_PEER_HASH];
+}
+
+/*
+ * Entry of uId at pMac, caller holds sLock.
+ */
+static peer_entry *privFind(peer_table *pTable,
+                            unsigned int uId,
+                            const u8 *pMac)
+{
+  struct hlist_node *pNode = NULL;
+  peer_entry *pEntry = NULL;
+
+  for (pNode = privBucket(pTable, uId)->first; NULL != pNode;
+       pNode = pNode->next) {
+    pEntry = hlist_entry(pNode, peer_entry, node);
+    if ((uId == pEntry->info.uId) &&
+        ether_addr_equal(pMac, pEntry->info.pMac)) {
+      return pEntry;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Drop the peer heard least recently, caller holds sLock.
+ */
+static void privEvict(peer_table *pTable)
+{
+  struct hlist_node *pNode = NULL;
+  peer_entry *pEntry = NULL;
+  peer_entry *pOldest = NULL;
+  unsigned int loop;
+
+  for (loop = 0; loop < KLEM_PEER_HASH; loop++) {
+    for (pNode = pTable->hash [loop].first; NULL != pNode;
+         pNode = pNode->next) {
+      pEntry = hlist_entry(pNode, peer_entry, node);
+      if ((NULL == pOldest) ||
+          time_before(pEntry->info.uHeard, pOldest->info.uHeard)) {
+        pOldest = pEntry;
+      }
+    }
+  }
+
+  if (NULL != pOldest) {
+    hlist_del(&pOldest->node);
+    kfree(pOldest);
+    pTable->uCount--;
+  }
+}
+
+/*
+ * Account for wire sequence uSequence from pEntry, anti replay style.
+ * A sequence is lost once it falls out of the window unseen.  Caller
+ * holds sLock.
+ */
+static void privSequence(peer_table *pTable,
+                         peer_entry *pEntry,
+                         u32 uSequence)
+{
+  s32 iDiff = (s32)(uSequence - pEntry->uSeqHigh);
+  unsigned long uLost = 0;
+  u64 uLeaving;
+
+  if ((0 == pEntry->uSeqWindow) ||
+      (iDiff >= KLEM_PEER_SEQ_RESYNC) || (iDiff <= -KLEM_PEER_SEQ_RESYNC)) {
+    /* Nothing before the first sequence may be counted lost */
+    pEntry->uSeqHigh = uSequence;
+    pEntry->uSeqWindow = ~0ULL;
+  } else if (iDiff > 0) {
+    if (iDiff >= KLEM_PEER_SEQ_WINDOW) {
+      uLeaving = pEntry->uSeqWindow;
+      uLost = KLEM_PEER_SEQ_WINDOW - hweight64(uLeaving) +
+        (iDiff - KLEM_PEER_SEQ_WINDOW);
+      pEntry->uSeqWindow = 1;
+    } else {
+      uLeaving = pEntry->uSeqWindow >> (KLEM_PEER_SEQ_WINDOW - iDiff);
+      uLost = iDiff - hweight64(uLeaving);
+      pEntry->uSeqWindow = (pEntry->uSeqWindow << iDiff) | 1;
+    }
+    pEntry->uSeqHigh = uSequence;
+    pEntry->info.uLost += uLost;
+    pTable->total.uLost += uLost;
+  } else if ((iDiff > -KLEM_PEER_SEQ_WINDOW) &&
+             (pEntry->uSeqWindow & (1ULL << -iDiff))) {
+    pEntry->info.uDuplicate++;
+    pTable->total.uDuplicate++;
+  } else {
+    /* One too late for the window was already counted lost */
+    if (iDiff > -KLEM_PEER_SEQ_WINDOW) {
+      pEntry->uSeqWindow |= 1ULL << -iDiff;
+    }
+    pEntry->info.uReorder++;
+    pTable->total.uReorder++;
+  }
+}
+
+void klemPeerCreate(void *pPtr)
+{
+  KLEMData *pData = (KLEMData *)pPtr;
+  peer_table *pTable = NULL;
+  unsigned int loop;
+
+  pTable = kzalloc(sizeof(peer_table), GFP_KERNEL);
+  if (NULL == pTable) {
+    KLEM_MSG("Failed to allocate the peer table\n");
+    return;
+  }
+
+  spin_lock_init(&pTable->sLock);
+  for (loop = 0; loop < KLEM_PEER_HASH; loop++) {
+    INIT_HLIST_HEAD(&pTable->hash [loop]);
+  }
+
+  pData->pPeer = (void *)pTable;
+  KLEM_LOG("peers at %p\n", pTable);
+}
+
+void klemPeerDestroy(void *pPtr)
+{
+  KLEMData *pData = (KLEMData *)pPtr;
+  peer_table *pTable = (peer_table *)pData->pPeer;
+  struct hlist_node *pNode = NULL;
+  unsigned int loop;
+
+  if (NULL != pTable) {
+    pData->pPeer = NULL;
+    for (loop = 0; loop < KLEM_PEER_HASH; loop++) {
+      while (NULL != (pNode = pTable->hash [loop].first)) {
+        hlist_del(pNode);
+        kfree(hlist_entry(pNode, peer_entry, node));
+      }
+    }
+    kfree(pTable);
+  }
+}
+
+/*
+ * The host at pMac sent uBytes described by pMeta.  Only 802.11 frames
+ * tell us the channel, and only those of version 2 carry a sequence.
+ */
+void klemPeerLearn(void *pPtr, const u8 *pMac, const KLEM_META *pMeta,
+                   unsigned int uBytes)
+{
+  peer_table *pTable = (peer_table *)pPtr;
+  peer_entry *pEntry = NULL;
+  unsigned int uId = pMeta->uId;
+
+  if (NULL == pTable) {
+    return;
+  }
+
+  spin_lock_bh(&pTable->sLock);
+  pEntry = privFind(pTable, uId, pMac);
+  if (NULL == pEntry) {
+    if (pTable->uCount >= KLEM_PEER_MAX) {
+      privEvict(pTable);
+    }
+
+    pEntry = kzalloc(sizeof(peer_entry), GFP_ATOMIC);
+    if (NULL != pEntry) {
+      pEntry->info.uId = uId;
+      memcpy(pEntry->info.pMac, pMac, ETH_ALEN);
+      hlist_add_head(&pEntry->node, privBucket(pTable, uId));
+      pTable->uCount++;
+    }
+  }
+
+  if (NULL != pEntry) {
+    pEntry->info.uHeard = jiffies;
+    pEntry->info.uFrames++;
+    pEntry->info.uBytes += uBytes;
+    pTable->total.uFrames++;
+    pTable->total.uBytes += uBytes;
+    if (0 == (pMeta->uFlags & KLEM_TAP_FLAG_ACK)) {
+      pEntry->info.uFrequency = pMeta->uFrequency;
+      if (KLEM_WIRE_V2 == pMeta->uVersion) {
+        privSequence(pTable, pEntry, pMeta->uSequence);
+      }
+    }
+  }
+  spin_unlock_bh(&pTable->sLock);
+}
+
+/*
+ * A probe of node uId at pMac came back after uRtt usec.  Smoothed
+ * like TCP does, an eighth of each new sample.
+ */
+void klemPeerRtt(void *pPtr, unsigned int uId, const u8 *pMac,
+                 unsigned int uRtt)
+{
+  peer_table *pTable = (peer_table *)pPtr;
+  peer_entry *pEntry = NULL;
+
+  if (NULL == pTable) {
+    return;
+  }
+
+  spin_lock_bh(&pTable->sLock);
+  pEntry = privFind(pTable, uId, pMac);
+  if (NULL != pEntry) {
+    if (0 == pEntry->info.uRtt) {
+      pEntry->info.uRtt = max_t(unsigned int, uRtt, 1);
+    } else {
+      pEntry->info.uRtt = max_t(unsigned int,
+                                (pEntry->info.uRtt * 7 + uRtt) / 8, 1);
+    }
+    pEntry->info.uReplies++;
+  }
+  spin_unlock_bh(&pTable->sLock);
+}
+
+/*
+ * Wired address of the host node uId last sent from, false if we
+ * haven't heard it within KLEM_PEER_AGE.
+ */
+bool klemPeerAddr(void *pPtr, unsigned int uId, u8 *pMac)
+{
+  peer_table *pTable = (peer_table *)pPtr;
+  struct hlist_node *pNode = NULL;
+  peer_entry *pEntry = NULL;
+  peer_entry *pLatest = NULL;
+  bool rvalue = false;
+
+  if (NULL == pTable) {
+    return false;
+  }
+
+  spin_lock_bh(&pTable->sLock);
+  for (pNode = privBucket(pTable, uId)->first; NULL != pNode;
+       pNode = pNode->next) {
+    pEntry = hlist_entry(pNode, peer_entry, node);
+    if ((uId == pEntry->info.uId) &&
+        ((NULL == pLatest) ||
+         time_after(pEntry->info.uHeard, pLatest->info.uHeard))) {
+      pLatest = pEntry;
+    }
+  }
+
+  if ((NULL != pLatest) &&
+      time_before(jiffies, pLatest->info.uHeard + KLEM_PEER_AGE)) {
+    memcpy(pMac, pLatest->info.pMac, ETH_ALEN);
+    rvalue = true;
+  }
+  spin_unlock_bh(&pTable->sLock);
+
+  return rvalue;
+}
+
+/*
+ * Ids of up to uMax nodes heard within KLEM_PEER_AGE, for probing.
+ */
+unsigned int klemPeerNodes(void *pPtr, unsigned int *puId,
+                           unsigned int uMax)
+{
+  peer_table *pTable = (peer_table *)pPtr;
+  struct hlist_node *pNode = NULL;
+  peer_entry *pEntry = NULL;
+  unsigned int rvalue = 0;
+  unsigned int loop;
+
+  if (NULL == pTable) {
+    return 0;
+  }
+
+  spin_lock_bh(&pTable->sLock);
+  for (loop = 0; (loop < KLEM_PEER_HASH) && (rvalue < uMax); loop++) {
+    for (pNode = pTable->hash [loop].first; NULL != pNode;
+         pNode = pNode->next) {
+      pEntry = hlist_entry(pNode, peer_entry, node);
+      if ((rvalue < uMax) &&
+          time_before(jiffies, pEntry->info.uHeard + KLEM_PEER_AGE) &&
+          ((0 == rvalue) || (puId [rvalue - 1] != pEntry->info.uId))) {
+        puId [rvalue++] = pEntry->info.uId;
+      }
+    }
+  }
+  spin_unlock_bh(&pTable->sLock);
+
+  return rvalue;
+}
+
+unsigned int klemPeerCount(void *pPtr)
+{
+  peer_table *pTable = (peer_table *)pPtr;
+
+  return (NULL != pTable) ? pTable->uCount : 0;
+}
+
+/*
+ * Frames and sequence counters summed over all peers ever heard.
+ */
+void klemPeerTotal(void *pPtr, KLEM_PEER_INFO *pTotal)
+{
+  peer_table *pTable = (peer_table *)pPtr;
+
+  memset(pTotal, 0, sizeof(KLEM_PEER_INFO));
+  if (NULL != pTable) {
+    spin_lock_bh(&pTable->sLock);
+    memcpy(pTotal, &pTable->total, sizeof(KLEM_PEER_INFO));
+    spin_unlock_bh(&pTable->sLock);
+  }
+}
+
+/*
+ * Copy out up to uMax peers, returns how many.
+ */
+unsigned int klemPeerList(void *pPtr, KLEM_PEER_INFO *pInfo,
+                          unsigned int uMax)
+{
+  peer_table *pTable = (peer_table *)pPtr;
+  struct hlist_node *pNode = NULL;
+  unsigned int rvalue = 0;
+  unsigned int loop;
+
+  if (NULL == pTable) {
+    return 0;
+  }
+
+  spin_lock_bh(&pTable->sLock);
+  for (loop = 0; loop < KLEM_PEER_HASH; loop++) {
+    for (pNode = pTable->hash [loop].first;
+         (NULL != pNode) && (rvalue < uMax); pNode = pNode->next) {
+      memcpy(&pInfo [rvalue++], &hlist_entry(pNode, peer_entry, node)->info,
+             sizeof(KLEM_PEER_INFO));
+    }
+  }
+  spin_unlock_bh(&pTable->sLock);
+
+  return rvalue;
+}
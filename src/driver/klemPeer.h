@@ -0,0 +1,70 @@
+/*
+ * Wireless Kernel Link Emulator
+ *
+ * Copyright (C) 2013 - 2016 Stuart Wells <swells@stuartwells.net>
+ * All rights reserved.
+ *
+ * Licensed under the GNU General Public License, version 2 (GPLv2)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+#ifndef KLEM_PEER_INCLUDE
+#define KLEM_PEER_INCLUDE
+
+#include <linux/if_ether.h>
+#include "klemHdr.h"
+
+/* proc file listing the nodes heard on the wire */
+#define KLEM_PEER_NAME "klem_peers"
+
+/* A host we haven't heard from in this long may have moved */
+#define KLEM_PEER_AGE (60 * HZ)
+
+/* Most peers we keep, the one heard least recently makes room */
+#define KLEM_PEER_MAX 1024
+
+/*
+ * Wire sequences a late frame may trail the newest by and still be
+ * told apart from a duplicate.  A jump of KLEM_PEER_SEQ_RESYNC or more
+ * is taken as the sender starting over.
+ */
+#define KLEM_PEER_SEQ_WINDOW 64
+#define KLEM_PEER_SEQ_RESYNC 4096
+
+/* A node on the wire, as seen from the frames it sent us */
+typedef struct {
+  unsigned int uId;
+  u8 pMac [ETH_ALEN];
+  unsigned long uHeard;       /* jiffies */
+  unsigned long uFrames;
+  u64 uBytes;
+  u32 uFrequency;             /* of the last 802.11 frame, MHz */
+  unsigned int uRtt;          /* smoothed wire rtt in usec, 0 unknown */
+  unsigned long uReplies;
+  unsigned long uLost;        /* wire sequences that never came */
+  unsigned long uDuplicate;
+  unsigned long uReorder;     /* came after a newer one */
+} KLEM_PEER_INFO;
+
+void klemPeerCreate(void *pPtr);
+void klemPeerDestroy(void *pPtr);
+void klemPeerLearn(void *pPtr, const u8 *pMac, const KLEM_META *pMeta,
+                   unsigned int uBytes);
+void klemPeerRtt(void *pPtr, unsigned int uId, const u8 *pMac,
+                 unsigned int uRtt);
+bool klemPeerAddr(void *pPtr, unsigned int uId, u8 *pMac);
+unsigned int klemPeerNodes(void *pPtr, unsigned int *puId,
+                           unsigned int uMax);
+unsigned int klemPeerCount(void *pPtr);
+void klemPeerTotal(void *pPtr, KLEM_PEER_INFO *pTotal);
+unsigned int klemPeerList(void *pPtr, KLEM_PEER_INFO *pInfo,
+                          unsigned int uMax);
+#endif
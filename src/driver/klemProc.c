@@ -17,6 +17,9 @@
  *
  */
 #include <linux/proc_fs.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/if_vlan.h>
 #include <linux/version.h>
 
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0))
@@ -27,6 +30,11 @@
 #include "klemHdr.h"
 #include "klemData.h"
 #include "klemCtrl.h"
+#include "klemNet.h"
+#include "klemMedium.h"
+#include "klemSchedule.h"
+#include "klemDev.h"
+#include "klemPeer.h"
 #include "klem80211.h"
 
 /* String information for starting/stopping the system. */
@@ -51,6 +59,91 @@
 #define MODE_LEMU_STR "lemu"
 #define MODE_BRIDGE_STR "bridge"
 
+/* strings to tune the fake hardware queues, bytes and micro seconds */
+#define QUEUE_MIN_STR "qmin"
+#define QUEUE_MAX_STR "qmax"
+#define QUEUE_TIME_STR "qtime"
+#define CODEL_TARGET_STR "codel_target"
+#define CODEL_INTERVAL_STR "codel_interval"
+
+/* string to pick the wire header version we send */
+#define WIRE_STR "wire"
+#define WIRE_AUTO_STR "auto"
+
+/* strings to let small frames share a wire frame, usec and bytes */
+#define COALESCE_USEC_STR "coalesce_usec"
+#define COALESCE_BYTES_STR "coalesce_bytes"
+
+/* string for the msec a hw_scan spends on each channel */
+#define SCAN_DWELL_STR "scan_dwell"
+
+/* strings for positions and the propagation model between them */
+#define PROPAGATION_STR "propagation"
+#define EXPONENT_STR "exponent"
+#define SENSITIVITY_STR "sensitivity"
+#define POSITION_STR "position"
+#define PATHLOSS_STR "pathloss"
+
+/* strings to control playback of an uploaded schedule */
+#define PLAYBACK_STR "playback"
+#define PLAYBACK_START_STR "start"
+#define PLAYBACK_STOP_STR "stop"
+#define PLAYBACK_PAUSE_STR "pause"
+#define PLAYBACK_RESUME_STR "resume"
+#define PLAYBACK_CLEAR_STR "clear"
+#define SPEED_STR "speed"
+
+/* values of the commands that switch something on or off */
+#define ON_STR "on"
+#define OFF_STR "off"
+
+/* string to turn the SINR interference model on or off */
+#define INTERFERENCE_STR "interference"
+
+/* string to turn carrier sense and backoff on or off */
+#define CSMA_STR "csma"
+
+/* strings for sender side pruning and the pushed link table */
+#define PRUNE_STR "prune"
+#define PRUNE_OFF_STR "off"
+#define PRUNE_UNICAST_STR "unicast"
+#define PRUNE_COPIES_STR "prune_copies"
+#define REACH_STR "reach"
+
+/* strings for retry emulation and its extra loss */
+#define RETRY_STR "retry"
+#define RETRY_LOSS_STR "retry_loss"
+
+/* strings for acks from the receiving host, and how long to wait */
+#define ACK_STR "ack"
+#define ACK_TIMEOUT_STR "ack_timeout"
+
+/* string for the msec between rtt probes of the peers */
+#define PROBE_STR "probe"
+
+/* strings to keep experiments sharing a wire apart */
+#define EXPERIMENT_STR "experiment"
+#define VLAN_STR "vlan"
+
+/* string to carry the access category onto the wire as 802.1p */
+#define QOS_STR "qos"
+
+/* strings to pick how received frames leave their queues */
+#define RX_PRIORITY_STR "rx_priority"
+#define RX_STRICT_STR "strict"
+#define RX_WEIGHTED_STR "weighted"
+
+/* Column titles of the peer list */
+#define PEER_TITLE_STR "node host              heard msec  freq     frames          bytes  rtt usec       gaps       dups    reorder\n"
+
+/* Propagation model names, indexed by KLEM_MEDIUM_* */
+static const char *privModelNames [] = {
+  "off",
+  "free",
+  "logdist",
+  "tworay",
+};
+
 /*
  * Interface to send information to the proc file system.
  */
@@ -65,7 +158,12 @@ static int privProcOutput(char *pKernBuf,
 {
   KLEMData *pData = (KLEMData *)pPtr;
   char *pOutput = pData->proc.pBuffer + iKernOffset;
+  char *pEnd = pData->proc.pBuffer + sizeof(pData->proc.pBuffer);
   int iOutLen = pData->proc.iSize - iKernOffset;
+  KLEM_NET_STATS sNetStats;
+  KLEM_MEDIUM_INFO sMedium;
+  KLEM_SCHED_INFO sSched;
+  KLEM_DEV_INFO sDev;
   int rvalue = 0;
   int loop;
   int ufnum = 0;
@@ -74,59 +172,172 @@ static int privProcOutput(char *pKernBuf,
 
   if (0 == iKernOffset) {
 
-    sprintf(pOutput, "KLEM Proc Interface\n\n");
-    pOutput += strlen(pOutput);
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "KLEM Proc Interface\n\n");
 
-    sprintf(pOutput, "Version:              %d\n", pData->uiVersion);
-    pOutput += strlen(pOutput);
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "Version:              %d\n", pData->uiVersion);
 
-    sprintf(pOutput, "raw-device:           %s\n", pData->pDevName);
-    pOutput += strlen(pOutput);
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "raw-device:           %s\n", pData->pDevName);
 
     if (NULL != pData->pRawSocket) {
-      sprintf(pOutput, "raw-socket:           %p\n", pData->pRawSocket);
+      pOutput += scnprintf(pOutput, pEnd - pOutput,
+                           "raw-socket:           %p\n", pData->pRawSocket);
     } else {
-      sprintf(pOutput, "raw-socket:           null\n");
+      pOutput += scnprintf(pOutput, pEnd - pOutput,
+                           "raw-socket:           null\n");
     }
-    pOutput += strlen(pOutput);
 
     if (NULL != pData->pNetLink) {
-      sprintf(pOutput, "netlink:              %p\n", pData->pNetLink);
+      pOutput += scnprintf(pOutput, pEnd - pOutput,
+                           "netlink:              %p\n", pData->pNetLink);
     } else {
-      sprintf(pOutput, "netlink:              null\n");
+      pOutput += scnprintf(pOutput, pEnd - pOutput,
+                           "netlink:              null\n");
     }
-    pOutput += strlen(pOutput);
 
-    sprintf(pOutput, "device-id:            %d\n", pData->uDeviceId);
-    pOutput += strlen(pOutput);
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "device-id:            %d\n", pData->uDeviceId);
 
     if (LEMU == pData->eMode) {
-      sprintf(pOutput, "device-id:            lemu\n");
+      pOutput += scnprintf(pOutput, pEnd - pOutput,
+                           "device-id:            lemu\n");
     } else {
-      sprintf(pOutput, "device-id:            bridge\n");
+      pOutput += scnprintf(pOutput, pEnd - pOutput,
+                           "device-id:            bridge\n");
     }
-    pOutput += strlen(pOutput);
 
     ufnum = 0;
-    sprintf(pOutput, "filter:               ");
-    pOutput += strlen(pOutput);
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "filter:               ");
     for (loop = 0; loop < MAX_WIRELESS_NODE; loop++) {
       if (true == pData->bFilterNode [loop]) {
-        sprintf(pOutput, "%03d ", loop);
-        pOutput += strlen(pOutput);
+        pOutput += scnprintf(pOutput, pEnd - pOutput,
+                             "%03d ", loop);
         ufnum += 1;
         if ((0 != ufnum) && (0 == ufnum % 8)) {
-          sprintf(pOutput, "\nfilter:               ");
-          pOutput += strlen(pOutput);
+          pOutput += scnprintf(pOutput, pEnd - pOutput,
+                               "\nfilter:               ");
         }
       }
     }
 
-    sprintf(pOutput, "\n");
-    pOutput += strlen(pOutput);
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "\n");
+
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "queue bytes:          %u - %u (%u usec)\n",
+                         pData->queue.uMinBytes, pData->queue.uMaxBytes,
+                         pData->queue.uTimeUsec);
+
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "codel:                target %u usec interval %u usec\n",
+                         pData->queue.uCodelTarget, pData->queue.uCodelInterval);
+
+    if (KLEM_WIRE_AUTO == pData->uWireVersion) {
+      pOutput += scnprintf(pOutput, pEnd - pOutput,
+                           "wire:                 auto (sending %u)\n",
+                           klemNetVersion(pData->pRawSocket));
+    } else {
+      pOutput += scnprintf(pOutput, pEnd - pOutput,
+                           "wire:                 %u\n", pData->uWireVersion);
+    }
+
+    klemNetStats(pData->pRawSocket, &sNetStats);
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "wire segments:        %ld sent %ld reassembled %ld dropped\n",
+                         sNetStats.uSegmentSent, sNetStats.uReassembled,
+                         sNetStats.uReassemblyDropped);
+
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "coalesce:             %u usec, frames up to %u bytes\n",
+                         pData->coalesce.uUsec, pData->coalesce.uBytes);
+
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "wire containers:      %ld frames %ld sent %ld received\n",
+                         sNetStats.uCoalesced, sNetStats.uContainerSent,
+                         sNetStats.uContainerReceived);
+
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "prune:                %s up to %u copies, %u peers %ld pruned %ld unicast\n",
+                         (KLEM_PRUNE_UNICAST == pData->uPrune) ? "unicast" : "off",
+                         pData->uPruneCopies, sNetStats.uPeers, sNetStats.uPruned,
+                         sNetStats.uUnicast);
+
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "scan dwell:           %u msec\n", pData->uScanDwell);
+
+    klemMediumInfo(pData->pMedium, &sMedium);
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "propagation:          %s exponent %d sensitivity %d dBm\n",
+                         privModelNames [sMedium.uModel], sMedium.iExponent,
+                         sMedium.iSensitivity);
+
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "medium:               %u placed %u fixed %ld too weak\n",
+                         sMedium.uPlaced, sMedium.uOverrides, sMedium.uDropped);
+
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "interference:         %s %ld lost\n",
+                         (sMedium.bInterference) ? "on" : "off", sMedium.uInterfered);
+
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "csma:                 %s\n",
+                         (sMedium.bCsma) ? "on" : "off");
+
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "retry:                %s loss %u%%\n",
+                         (pData->bRetry) ? "on" : "off", pData->uRetryLoss);
+
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "ack:                  %s timeout %u msec, %ld batches sent %ld received %ld overflow\n",
+                         (pData->bAck) ? "on" : "off", pData->uAckTimeout,
+                         sNetStats.uAckSent, sNetStats.uAckReceived,
+                         sNetStats.uAckOverflow);
+
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "probe:                %u msec, %ld probes sent\n",
+                         pData->uProbe, sNetStats.uProbeSent);
+
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "wire loss:            %ld gaps %ld duplicates %ld reordered %ld socket drops\n",
+                         sNetStats.uSeqLost, sNetStats.uSeqDuplicate,
+                         sNetStats.uSeqReorder, sNetStats.uSocketDrops);
+
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "experiment:           %u vlan %u, %ld foreign dropped\n",
+                         pData->uExperiment, pData->uVlan, sNetStats.uForeign);
+
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "qos:                  %s\n",
+                         (pData->bQos) ? "on" : "off");
+
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "rx queues:            %s, received/dropped vo %ld/%ld vi %ld/%ld be %ld/%ld bk %ld/%ld\n",
+                         (KLEM_RX_WEIGHTED == pData->uRxPriority) ? "weighted" : "strict",
+                         sNetStats.uRxDelivered [0], sNetStats.uRxDropped [0],
+                         sNetStats.uRxDelivered [1], sNetStats.uRxDropped [1],
+                         sNetStats.uRxDelivered [2], sNetStats.uRxDropped [2],
+                         sNetStats.uRxDelivered [3], sNetStats.uRxDropped [3]);
+
+    klemScheduleInfo(pData->pSchedule, &sSched);
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "playback:             %s %u/%u events %lu bytes speed %u%%\n",
+                         (sSched.bRunning) ? ((sSched.bPaused) ? "paused" : "running") :
+                         ((sSched.bLoaded) ? "done" : "idle"),
+                         sSched.uNext, sSched.uCount, (unsigned long)sSched.uBytes,
+                         sSched.uSpeed);
+
+    klemDevInfo(pData->pDevice, &sDev);
+    pOutput += scnprintf(pOutput, pEnd - pOutput,
+                         "external:             %s %lu posted %lu delivered %lu dropped %lu overflow %lu expired\n",
+                         (sDev.bAttached) ? "attached" : "detached",
+                         sDev.uPosted, sDev.uDelivered, sDev.uDropped,
+                         sDev.uOverflow, sDev.uExpired);
 
     /* Printout wireless emulation data */
-    pOutput += klem80211Proc(pData, pOutput);
+    pOutput += klem80211Proc(pData, pOutput, pEnd - pOutput);
 
     pOutput = pData->proc.pBuffer;
     pData->proc.iSize = strlen(pOutput);
@@ -154,6 +365,10 @@ static int privProcOutput(char *pKernBuf,
 static int privProcOutputSeq(struct seq_file *pOutput, void *pBuffer)
 {
   KLEMData *pData;
+  KLEM_NET_STATS sNetStats;
+  KLEM_MEDIUM_INFO sMedium;
+  KLEM_SCHED_INFO sSched;
+  KLEM_DEV_INFO sDev;
   int loop;
   int ufnum = 0;
 
@@ -199,6 +414,84 @@ static int privProcOutputSeq(struct seq_file *pOutput, void *pBuffer)
 
       seq_printf(pOutput, "\n");
 
+      seq_printf(pOutput, "queue bytes:          %u - %u (%u usec)\n",
+                 pData->queue.uMinBytes, pData->queue.uMaxBytes,
+                 pData->queue.uTimeUsec);
+      seq_printf(pOutput, "codel:                target %u usec interval %u usec\n",
+                 pData->queue.uCodelTarget, pData->queue.uCodelInterval);
+
+      if (KLEM_WIRE_AUTO == pData->uWireVersion) {
+        seq_printf(pOutput, "wire:                 auto (sending %u)\n",
+                   klemNetVersion(pData->pRawSocket));
+      } else {
+        seq_printf(pOutput, "wire:                 %u\n",
+                   pData->uWireVersion);
+      }
+
+      klemNetStats(pData->pRawSocket, &sNetStats);
+      seq_printf(pOutput, "wire segments:        %ld sent %ld reassembled %ld dropped\n",
+                 sNetStats.uSegmentSent, sNetStats.uReassembled,
+                 sNetStats.uReassemblyDropped);
+      seq_printf(pOutput, "coalesce:             %u usec, frames up to %u bytes\n",
+                 pData->coalesce.uUsec, pData->coalesce.uBytes);
+      seq_printf(pOutput, "wire containers:      %ld frames %ld sent %ld received\n",
+                 sNetStats.uCoalesced, sNetStats.uContainerSent,
+                 sNetStats.uContainerReceived);
+      seq_printf(pOutput, "prune:                %s up to %u copies, %u peers %ld pruned %ld unicast\n",
+                 (KLEM_PRUNE_UNICAST == pData->uPrune) ? "unicast" : "off",
+                 pData->uPruneCopies, sNetStats.uPeers, sNetStats.uPruned,
+                 sNetStats.uUnicast);
+      seq_printf(pOutput, "scan dwell:           %u msec\n",
+                 pData->uScanDwell);
+
+      klemMediumInfo(pData->pMedium, &sMedium);
+      seq_printf(pOutput, "propagation:          %s exponent %d sensitivity %d dBm\n",
+                 privModelNames [sMedium.uModel], sMedium.iExponent,
+                 sMedium.iSensitivity);
+      seq_printf(pOutput, "medium:               %u placed %u fixed %ld too weak\n",
+                 sMedium.uPlaced, sMedium.uOverrides, sMedium.uDropped);
+      seq_printf(pOutput, "interference:         %s %ld lost\n",
+                 (sMedium.bInterference) ? "on" : "off",
+                 sMedium.uInterfered);
+      seq_printf(pOutput, "csma:                 %s\n",
+                 (sMedium.bCsma) ? "on" : "off");
+      seq_printf(pOutput, "retry:                %s loss %u%%\n",
+                 (pData->bRetry) ? "on" : "off", pData->uRetryLoss);
+      seq_printf(pOutput, "ack:                  %s timeout %u msec, %ld batches sent %ld received %ld overflow\n",
+                 (pData->bAck) ? "on" : "off", pData->uAckTimeout,
+                 sNetStats.uAckSent, sNetStats.uAckReceived,
+                 sNetStats.uAckOverflow);
+      seq_printf(pOutput, "probe:                %u msec, %ld probes sent\n",
+                 pData->uProbe, sNetStats.uProbeSent);
+      seq_printf(pOutput, "wire loss:            %ld gaps %ld duplicates %ld reordered %ld socket drops\n",
+                 sNetStats.uSeqLost, sNetStats.uSeqDuplicate,
+                 sNetStats.uSeqReorder, sNetStats.uSocketDrops);
+      seq_printf(pOutput, "experiment:           %u vlan %u, %ld foreign dropped\n",
+                 pData->uExperiment, pData->uVlan, sNetStats.uForeign);
+      seq_printf(pOutput, "qos:                  %s\n",
+                 (pData->bQos) ? "on" : "off");
+      seq_printf(pOutput, "rx queues:            %s, received/dropped vo %ld/%ld vi %ld/%ld be %ld/%ld bk %ld/%ld\n",
+                 (KLEM_RX_WEIGHTED == pData->uRxPriority) ?
+                 "weighted" : "strict",
+                 sNetStats.uRxDelivered [0], sNetStats.uRxDropped [0],
+                 sNetStats.uRxDelivered [1], sNetStats.uRxDropped [1],
+                 sNetStats.uRxDelivered [2], sNetStats.uRxDropped [2],
+                 sNetStats.uRxDelivered [3], sNetStats.uRxDropped [3]);
+
+      klemScheduleInfo(pData->pSchedule, &sSched);
+      seq_printf(pOutput, "playback:             %s %u/%u events %lu bytes speed %u%%\n",
+                 (sSched.bRunning) ?
+                 ((sSched.bPaused) ? "paused" : "running") :
+                 ((sSched.bLoaded) ? "done" : "idle"),
+                 sSched.uNext, sSched.uCount, (unsigned long)sSched.uBytes,
+                 sSched.uSpeed);
+
+      klemDevInfo(pData->pDevice, &sDev);
+      seq_printf(pOutput, "external:             %s %lu posted %lu delivered %lu dropped %lu overflow %lu expired\n",
+                 (sDev.bAttached) ? "attached" : "detached",
+                 sDev.uPosted, sDev.uDelivered, sDev.uDropped,
+                 sDev.uOverflow, sDev.uExpired);
+
       /* Printout wireless emulation data */
       klem80211Proc(pData, pOutput);
     }
@@ -208,6 +501,35 @@ static int privProcOutputSeq(struct seq_file *pOutput, void *pBuffer)
 }
 #endif
 
+/*
+ * Split a value such as "3,100,-20" into at most iMax integers,
+ * returns how many were found.
+ */
+static int privProcIntegers(const char *pValue,
+                            unsigned int iValueLen,
+                            int *piValues,
+                            int iMax)
+{
+  const char *pEnd = pValue + iValueLen;
+  char *pNext = NULL;
+  int iCount = 0;
+
+  while ((pValue < pEnd) && (iCount < iMax)) {
+    piValues [iCount] = (int)simple_strtol(pValue, &pNext, 10);
+    if (pNext == pValue) {
+      break;
+    }
+    iCount++;
+
+    if ((pNext >= pEnd) || (',' != *pNext)) {
+      break;
+    }
+    pValue = pNext + 1;
+  }
+
+  return iCount;
+}
+
 /*
  * Interface to recv information from the proc file system.
  * A way to use script files to configure experiments without
@@ -229,6 +551,8 @@ static int privProcInput(struct file *pFile,
   bool bParse = false;
   unsigned int loop = 0;
   unsigned int utmp;
+  int itmp;
+  int iValues [4];
   mm_segment_t mSegment;
 
   mSegment = get_fs();
@@ -319,6 +643,244 @@ static int privProcInput(struct file *pFile,
         } else if (strncmp(pValue, MODE_BRIDGE_STR, iValueLen) == 0) {
           pData->eMode = BRIDGE;
         }
+      } else if (strncmp(pCommand, QUEUE_MIN_STR, iCommandLen) == 0) {
+        utmp = (unsigned int)simple_strtol(pValue, NULL, 10);
+        if ((utmp < ETH_FRAME_LEN) || (utmp > pData->queue.uMaxBytes)) {
+          KLEM_LOG("Error, qmin %s must be between %d and qmax\n",
+                   pValue, ETH_FRAME_LEN);
+        } else {
+          pData->queue.uMinBytes = utmp;
+        }
+      } else if (strncmp(pCommand, QUEUE_MAX_STR, iCommandLen) == 0) {
+        utmp = (unsigned int)simple_strtol(pValue, NULL, 10);
+        if (utmp < pData->queue.uMinBytes) {
+          KLEM_LOG("Error, qmax %s must not be below qmin\n", pValue);
+        } else {
+          pData->queue.uMaxBytes = utmp;
+        }
+      } else if (strncmp(pCommand, QUEUE_TIME_STR, iCommandLen) == 0) {
+        utmp = (unsigned int)simple_strtol(pValue, NULL, 10);
+        if (0 == utmp) {
+          KLEM_LOG("Error, qtime %s must be non zero\n", pValue);
+        } else {
+          pData->queue.uTimeUsec = utmp;
+        }
+      } else if (strncmp(pCommand, CODEL_TARGET_STR, iCommandLen) == 0) {
+        utmp = (unsigned int)simple_strtol(pValue, NULL, 10);
+        if (0 == utmp) {
+          KLEM_LOG("Error, codel_target %s must be non zero\n", pValue);
+        } else {
+          pData->queue.uCodelTarget = utmp;
+        }
+      } else if (strncmp(pCommand, CODEL_INTERVAL_STR, iCommandLen) == 0) {
+        utmp = (unsigned int)simple_strtol(pValue, NULL, 10);
+        if (utmp < pData->queue.uCodelTarget) {
+          KLEM_LOG("Error, codel_interval %s must not be below target\n",
+                   pValue);
+        } else {
+          pData->queue.uCodelInterval = utmp;
+        }
+      } else if (strncmp(pCommand, WIRE_STR, iCommandLen) == 0) {
+        if (strncmp(pValue, WIRE_AUTO_STR, iValueLen) == 0) {
+          pData->uWireVersion = KLEM_WIRE_AUTO;
+        } else {
+          utmp = (unsigned int)simple_strtol(pValue, NULL, 10);
+          if ((KLEM_WIRE_V1 == utmp) || (KLEM_WIRE_V2 == utmp)) {
+            pData->uWireVersion = utmp;
+          } else {
+            KLEM_LOG("Error, wire %s must be 1, 2 or auto\n", pValue);
+          }
+        }
+      } else if (strncmp(pCommand, COALESCE_USEC_STR, iCommandLen) == 0) {
+        utmp = (unsigned int)simple_strtol(pValue, NULL, 10);
+        if (utmp > USEC_PER_SEC) {
+          KLEM_LOG("Error, coalesce_usec %s must be at most 1000000\n",
+                   pValue);
+        } else {
+          pData->coalesce.uUsec = utmp;
+        }
+      } else if (strncmp(pCommand, COALESCE_BYTES_STR, iCommandLen) == 0) {
+        utmp = (unsigned int)simple_strtol(pValue, NULL, 10);
+        if ((utmp < 10) || (utmp > ETH_DATA_LEN)) {
+          KLEM_LOG("Error, coalesce_bytes %s must be between 10 and %d\n",
+                   pValue, ETH_DATA_LEN);
+        } else {
+          pData->coalesce.uBytes = utmp;
+        }
+      } else if (strncmp(pCommand, SCAN_DWELL_STR, iCommandLen) == 0) {
+        utmp = (unsigned int)simple_strtol(pValue, NULL, 10);
+        if (utmp > KLEM_SCAN_DWELL_MAX) {
+          KLEM_LOG("Error, scan_dwell %s must be at most %d\n",
+                   pValue, KLEM_SCAN_DWELL_MAX);
+        } else {
+          pData->uScanDwell = utmp;
+        }
+      } else if (strncmp(pCommand, PROPAGATION_STR, iCommandLen) == 0) {
+        for (utmp = 0; utmp < ARRAY_SIZE(privModelNames); utmp++) {
+          if ((strlen(privModelNames [utmp]) == iValueLen) &&
+              (strncmp(pValue, privModelNames [utmp], iValueLen) == 0)) {
+            klemMediumModel(pData->pMedium, utmp);
+            break;
+          }
+        }
+        if (utmp == ARRAY_SIZE(privModelNames)) {
+          KLEM_LOG("Error, propagation %s must be off, free, logdist or "
+                   "tworay\n", pValue);
+        }
+      } else if (strncmp(pCommand, EXPONENT_STR, iCommandLen) == 0) {
+        itmp = (int)simple_strtol(pValue, NULL, 10);
+        if ((itmp < 10) || (itmp > 60)) {
+          KLEM_LOG("Error, exponent %s must be between 10 and 60 tenths\n",
+                   pValue);
+        } else {
+          klemMediumExponent(pData->pMedium, itmp);
+        }
+      } else if (strncmp(pCommand, SENSITIVITY_STR, iCommandLen) == 0) {
+        itmp = (int)simple_strtol(pValue, NULL, 10);
+        if ((itmp < -120) || (itmp > 0)) {
+          KLEM_LOG("Error, sensitivity %s must be between -120 and 0\n",
+                   pValue);
+        } else {
+          klemMediumSensitivity(pData->pMedium, itmp);
+        }
+      } else if (strncmp(pCommand, POSITION_STR, iCommandLen) == 0) {
+        /* id,x,y[,z] in cm */
+        iValues [3] = 0;
+        if ((privProcIntegers(pValue, iValueLen, iValues, 4) < 3) ||
+            (iValues [0] < 0) || (iValues [0] >= MAX_WIRELESS_NODE)) {
+          KLEM_LOG("Error, position %s must be id,x,y or id,x,y,z\n",
+                   pValue);
+        } else {
+          klemMediumPosition(pData->pMedium, iValues [0],
+                             iValues [1], iValues [2], iValues [3]);
+        }
+      } else if (strncmp(pCommand, PATHLOSS_STR, iCommandLen) == 0) {
+        /* tx,rx,dB or a negative dB to use the model again */
+        if ((privProcIntegers(pValue, iValueLen, iValues, 3) < 3) ||
+            (iValues [0] < 0) || (iValues [0] >= MAX_WIRELESS_NODE) ||
+            (iValues [1] < 0) || (iValues [1] >= MAX_WIRELESS_NODE)) {
+          KLEM_LOG("Error, pathloss %s must be tx,rx,dB\n", pValue);
+        } else {
+          klemMediumOverride(pData->pMedium, iValues [0], iValues [1],
+                             (iValues [2] >= 0), iValues [2]);
+        }
+      } else if (strncmp(pCommand, PLAYBACK_STR, iCommandLen) == 0) {
+        if (strncmp(pValue, PLAYBACK_START_STR, iValueLen) == 0) {
+          klemScheduleStart(pData->pSchedule);
+        } else if (strncmp(pValue, PLAYBACK_STOP_STR, iValueLen) == 0) {
+          klemScheduleStop(pData->pSchedule);
+        } else if (strncmp(pValue, PLAYBACK_PAUSE_STR, iValueLen) == 0) {
+          klemSchedulePause(pData->pSchedule);
+        } else if (strncmp(pValue, PLAYBACK_RESUME_STR, iValueLen) == 0) {
+          klemScheduleResume(pData->pSchedule);
+        } else if (strncmp(pValue, PLAYBACK_CLEAR_STR, iValueLen) == 0) {
+          klemScheduleClear(pData->pSchedule);
+        }
+      } else if (strncmp(pCommand, SPEED_STR, iCommandLen) == 0) {
+        utmp = (unsigned int)simple_strtol(pValue, NULL, 10);
+        if ((utmp < 1) || (utmp > KLEM_SCHED_SPEED_MAX)) {
+          KLEM_LOG("Error, speed %s must be between 1 and %d percent\n",
+                   pValue, KLEM_SCHED_SPEED_MAX);
+        } else {
+          klemScheduleSpeed(pData->pSchedule, utmp);
+        }
+      } else if (strncmp(pCommand, INTERFERENCE_STR, iCommandLen) == 0) {
+        if (strncmp(pValue, ON_STR, iValueLen) == 0) {
+          klemMediumInterference(pData->pMedium, true);
+        } else if (strncmp(pValue, OFF_STR, iValueLen) == 0) {
+          klemMediumInterference(pData->pMedium, false);
+        }
+      } else if (strncmp(pCommand, PRUNE_STR, iCommandLen) == 0) {
+        if (strncmp(pValue, PRUNE_OFF_STR, iValueLen) == 0) {
+          pData->uPrune = KLEM_PRUNE_OFF;
+        } else if (strncmp(pValue, PRUNE_UNICAST_STR, iValueLen) == 0) {
+          pData->uPrune = KLEM_PRUNE_UNICAST;
+        }
+      } else if (strncmp(pCommand, PRUNE_COPIES_STR, iCommandLen) == 0) {
+        utmp = (unsigned int)simple_strtol(pValue, NULL, 10);
+        if (utmp > KLEM_PRUNE_COPIES_MAX) {
+          KLEM_LOG("Error, prune_copies %s must be at most %d\n",
+                   pValue, KLEM_PRUNE_COPIES_MAX);
+        } else {
+          pData->uPruneCopies = utmp;
+        }
+      } else if (strncmp(pCommand, REACH_STR, iCommandLen) == 0) {
+        /* node,1 hears us, node,0 doesn't, node,-1 asks the medium */
+        if ((privProcIntegers(pValue, iValueLen, iValues, 2) < 2) ||
+            (iValues [0] < 0) || (iValues [0] >= MAX_WIRELESS_NODE) ||
+            (iValues [1] < KLEM_REACH_UNKNOWN) ||
+            (iValues [1] > KLEM_REACH_YES)) {
+          KLEM_LOG("Error, reach %s must be id,1 id,0 or id,-1\n", pValue);
+        } else {
+          pData->iReach [iValues [0]] = (s8)iValues [1];
+        }
+      } else if (strncmp(pCommand, CSMA_STR, iCommandLen) == 0) {
+        if (strncmp(pValue, ON_STR, iValueLen) == 0) {
+          klemMediumCsma(pData->pMedium, true);
+        } else if (strncmp(pValue, OFF_STR, iValueLen) == 0) {
+          klemMediumCsma(pData->pMedium, false);
+        }
+      } else if (strncmp(pCommand, RETRY_STR, iCommandLen) == 0) {
+        if (strncmp(pValue, ON_STR, iValueLen) == 0) {
+          pData->bRetry = true;
+        } else if (strncmp(pValue, OFF_STR, iValueLen) == 0) {
+          pData->bRetry = false;
+        }
+      } else if (strncmp(pCommand, RETRY_LOSS_STR, iCommandLen) == 0) {
+        utmp = (unsigned int)simple_strtol(pValue, NULL, 10);
+        if (utmp > 100) {
+          KLEM_LOG("Error, retry_loss %s must be at most 100\n", pValue);
+        } else {
+          pData->uRetryLoss = utmp;
+        }
+      } else if (strncmp(pCommand, ACK_STR, iCommandLen) == 0) {
+        if (strncmp(pValue, ON_STR, iValueLen) == 0) {
+          pData->bAck = true;
+        } else if (strncmp(pValue, OFF_STR, iValueLen) == 0) {
+          pData->bAck = false;
+        }
+      } else if (strncmp(pCommand, ACK_TIMEOUT_STR, iCommandLen) == 0) {
+        utmp = (unsigned int)simple_strtol(pValue, NULL, 10);
+        if ((utmp < 1) || (utmp > 1000)) {
+          KLEM_LOG("Error, ack_timeout %s must be 1 to 1000 msec\n", pValue);
+        } else {
+          pData->uAckTimeout = utmp;
+        }
+      } else if (strncmp(pCommand, PROBE_STR, iCommandLen) == 0) {
+        utmp = (unsigned int)simple_strtol(pValue, NULL, 10);
+        if (utmp > 60000) {
+          KLEM_LOG("Error, probe %s must be at most 60000 msec\n", pValue);
+        } else {
+          pData->uProbe = utmp;
+        }
+      } else if (strncmp(pCommand, EXPERIMENT_STR, iCommandLen) == 0) {
+        utmp = (unsigned int)simple_strtol(pValue, NULL, 10);
+        if (utmp > KLEM_EXPERIMENT_MAX) {
+          KLEM_LOG("Error, experiment %s must be 0-%u\n", pValue,
+                   KLEM_EXPERIMENT_MAX);
+        } else {
+          pData->uExperiment = utmp;
+        }
+      } else if (strncmp(pCommand, VLAN_STR, iCommandLen) == 0) {
+        utmp = (unsigned int)simple_strtol(pValue, NULL, 10);
+        if (utmp >= VLAN_N_VID - 1) {
+          KLEM_LOG("Error, vlan %s must be 0-%u\n", pValue,
+                   VLAN_N_VID - 2);
+        } else {
+          pData->uVlan = utmp;
+        }
+      } else if (strncmp(pCommand, QOS_STR, iCommandLen) == 0) {
+        if (strncmp(pValue, ON_STR, iValueLen) == 0) {
+          pData->bQos = true;
+        } else if (strncmp(pValue, OFF_STR, iValueLen) == 0) {
+          pData->bQos = false;
+        }
+      } else if (strncmp(pCommand, RX_PRIORITY_STR, iCommandLen) == 0) {
+        if (strncmp(pValue, RX_STRICT_STR, iValueLen) == 0) {
+          pData->uRxPriority = KLEM_RX_STRICT;
+        } else if (strncmp(pValue, RX_WEIGHTED_STR, iValueLen) == 0) {
+          pData->uRxPriority = KLEM_RX_WEIGHTED;
+        }
       }
       pCommand = NULL;
       pValue = NULL;
@@ -361,6 +923,124 @@ static ssize_t privProcInputSeq(struct file *pFile,
 
 #endif
 
+/*
+ * The schedule proc file only takes writes, the binary schedule as is.
+ */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0))
+static int privScheduleInput(struct file *pFile,
+                             const char __user *pUserBuf,
+                             unsigned long uiCount,
+                             void *pMyData)
+{
+  KLEMData *pData = (KLEMData *)pMyData;
+
+  return (int)klemScheduleWrite(pData->pSchedule, pUserBuf, uiCount);
+}
+#else
+static ssize_t privScheduleInputSeq(struct file *pFile,
+                                    const char __user *pBuffer,
+                                    size_t iCount,
+                                    loff_t *pPos)
+{
+  KLEMData *pData = klemGetData();
+
+  return klemScheduleWrite(pData->pSchedule, pBuffer, iCount);
+}
+
+static const struct file_operations priv_schedule_fops = {
+  .owner   = THIS_MODULE,
+  .write   = privScheduleInputSeq,
+};
+#endif
+
+/*
+ * The peer proc file lists every node heard on the wire.
+ */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0))
+static int privPeerOutput(char *pKernBuf,
+                          char **ppIgnore,
+                          off_t iKernOffset,
+                          int iKernLen,
+                          int *pEOF,
+                          void *pPtr)
+{
+  KLEMData *pData = (KLEMData *)pPtr;
+  KLEM_PEER_INFO *pInfo = NULL;
+  unsigned int uCount;
+  unsigned int loop;
+  int rvalue = 0;
+
+  *pEOF = 1;
+  if (0 != iKernOffset) {
+    return 0;
+  }
+
+  /* The whole table is too big for kmalloc to find in one piece */
+  pInfo = vmalloc(sizeof(KLEM_PEER_INFO) * KLEM_PEER_MAX);
+  if (NULL == pInfo) {
+    return 0;
+  }
+
+  uCount = klemPeerList(pData->pPeer, pInfo, KLEM_PEER_MAX);
+  rvalue = snprintf(pKernBuf, iKernLen, PEER_TITLE_STR);
+  for (loop = 0; (loop < uCount) && (rvalue < iKernLen); loop++) {
+    rvalue += snprintf(pKernBuf + rvalue, iKernLen - rvalue,
+                       "%4u %pM %10u %5u %10lu %14llu %9u %10lu %10lu %10lu\n",
+                       pInfo [loop].uId, pInfo [loop].pMac,
+                       jiffies_to_msecs(jiffies - pInfo [loop].uHeard),
+                       pInfo [loop].uFrequency, pInfo [loop].uFrames,
+                       (unsigned long long)pInfo [loop].uBytes,
+                       pInfo [loop].uRtt, pInfo [loop].uLost,
+                       pInfo [loop].uDuplicate, pInfo [loop].uReorder);
+  }
+  vfree(pInfo);
+
+  return min(rvalue, iKernLen);
+}
+#else
+static int privPeerOutputSeq(struct seq_file *pOutput, void *pBuffer)
+{
+  KLEMData *pData = (KLEMData *)pOutput->private;
+  KLEM_PEER_INFO *pInfo = NULL;
+  unsigned int uCount;
+  unsigned int loop;
+
+  /* The whole table is too big for kmalloc to find in one piece */
+  pInfo = vmalloc(sizeof(KLEM_PEER_INFO) * KLEM_PEER_MAX);
+  if (NULL == pInfo) {
+    return -ENOMEM;
+  }
+
+  uCount = klemPeerList(pData->pPeer, pInfo, KLEM_PEER_MAX);
+  seq_printf(pOutput, PEER_TITLE_STR);
+  for (loop = 0; loop < uCount; loop++) {
+    seq_printf(pOutput, "%4u %pM %10u %5u %10lu %14llu %9u %10lu %10lu %10lu\n",
+               pInfo [loop].uId, pInfo [loop].pMac,
+               jiffies_to_msecs(jiffies - pInfo [loop].uHeard),
+               pInfo [loop].uFrequency, pInfo [loop].uFrames,
+               (unsigned long long)pInfo [loop].uBytes,
+               pInfo [loop].uRtt, pInfo [loop].uLost,
+               pInfo [loop].uDuplicate, pInfo [loop].uReorder);
+  }
+  vfree(pInfo);
+
+  return 0;
+}
+
+static int privPeerOpen(struct inode *pINode, struct file *pFile)
+{
+  return single_open(pFile, privPeerOutputSeq, PDE_DATA(pINode));
+}
+
+static const struct file_operations priv_peer_fops = {
+  .owner   = THIS_MODULE,
+  .open    = privPeerOpen,
+  .read    = seq_read,
+  .llseek  = seq_lseek,
+  .release = single_release,
+};
+#endif
+
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0))
 
 static int privProcOpen(struct inode *pINode, struct file *pFile)
@@ -396,6 +1076,20 @@ void klemProcInit(void *pPtr)
     } else {
       pData->proc.pEntry->write_proc = privProcInput;
     }
+
+    pData->proc.pScheduleEntry = create_proc_entry(KLEM_SCHEDULE_NAME,
+                                                   0200,
+                                                   NULL);
+    if (NULL != pData->proc.pScheduleEntry) {
+      pData->proc.pScheduleEntry->data = pPtr;
+      pData->proc.pScheduleEntry->write_proc = privScheduleInput;
+    }
+
+    pData->proc.pPeerEntry = create_proc_read_entry(KLEM_PEER_NAME,
+                                                    0444,
+                                                    NULL,
+                                                    privPeerOutput,
+                                                    pPtr);
 #else
     pData->proc.pEntry = proc_create_data(KLEM_NAME,
 					  0644,
@@ -403,7 +1097,25 @@ void klemProcInit(void *pPtr)
 					  &priv_proc_fops,
 					  pPtr);
 
+    pData->proc.pScheduleEntry = proc_create_data(KLEM_SCHEDULE_NAME,
+                                                  0200,
+                                                  NULL,
+                                                  &priv_schedule_fops,
+                                                  pPtr);
+
+    pData->proc.pPeerEntry = proc_create_data(KLEM_PEER_NAME,
+                                              0444,
+                                              NULL,
+                                              &priv_peer_fops,
+                                              pPtr);
 #endif
+    if (NULL == pData->proc.pScheduleEntry) {
+      KLEM_LOG("Failed to create proc entry %s\n", KLEM_SCHEDULE_NAME);
+    }
+
+    if (NULL == pData->proc.pPeerEntry) {
+      KLEM_LOG("Failed to create proc entry %s\n", KLEM_PEER_NAME);
+    }
   }
 }
 
@@ -418,5 +1130,15 @@ void klemProcDeinit(void *pPtr)
       remove_proc_entry(KLEM_NAME, NULL);
       pData->proc.pEntry = NULL;
     }
+
+    if (NULL != pData->proc.pScheduleEntry) {
+      remove_proc_entry(KLEM_SCHEDULE_NAME, NULL);
+      pData->proc.pScheduleEntry = NULL;
+    }
+
+    if (NULL != pData->proc.pPeerEntry) {
+      remove_proc_entry(KLEM_PEER_NAME, NULL);
+      pData->proc.pPeerEntry = NULL;
+    }
   }
 }
@@ -0,0 +1,500 @@
+/*
+ * Wireless Kernel Link Emulator
+ *
+ * Copyright (C) 2013 - 2016 Stuart Wells <swells@stuartwells.net>
+ * All rights reserved.
+ *
+ * Licensed under the GNU General Public License, version 2 (GPLv2)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+#include <linux/kernel.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#include <linux/sched.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/uaccess.h>
+#include "klemData.h"
+#include "klemMedium.h"
+#include "klemSchedule.h"
+
+/*
+ * Events applied before the work yields the CPU, a late timer catches
+ * up in steps.
+ */
+#define KLEM_SCHED_BATCH 256
+
+/*
+ * Trace time runs at uSpeed percent of wall time from (tWallBase,
+ * uTraceBase).  Pause, resume and speed changes move that base, so
+ * the timer only ever needs the next event's wall time.
+ */
+typedef struct {
+  KLEMData *pData;
+
+  /*
+   * Playback state shared with the timer.  An upload owns pBuffer while
+   * bWriting is set, proc commands arrive under sLock of KLEMData and
+   * may not sleep.
+   */
+  spinlock_t sLock;
+  bool bWriting;
+  struct hrtimer sTimer;
+
+  /*
+   * The timer only wakes the work, events are applied in process
+   * context where a position change may take its time.
+   */
+  struct work_struct sWork;
+  char *pBuffer;
+  size_t uBytes;
+  size_t uSize;
+  KLEM_SCHED_EVENT *pEvents;
+  unsigned int uCount;
+  unsigned int uNext;
+  bool bRunning;
+  bool bPaused;
+  unsigned int uSpeed;
+  u64 uTraceBase;
+  ktime_t tWallBase;
+  unsigned long uApplied;
+} sched_data;
+
+/* Trace time in usec now, called with sLock held. */
+static u64 privTraceNow(sched_data *pSched)
+{
+  s64 iWall = ktime_us_delta(ktime_get(), pSched->tWallBase);
+
+  if (iWall < 0) {
+    iWall = 0;
+  }
+
+  return pSched->uTraceBase + div_u64((u64)iWall * pSched->uSpeed, 100);
+}
+
+/* Wall time the trace reaches uTime, called with sLock held. */
+static ktime_t privWallTime(sched_data *pSched, u64 uTime)
+{
+  u64 uDelta = 0;
+
+  if (uTime > pSched->uTraceBase) {
+    uDelta = div_u64((uTime - pSched->uTraceBase) * 100, pSched->uSpeed);
+  }
+
+  return ktime_add_us(pSched->tWallBase, uDelta);
+}
+
+static void privApply(sched_data *pSched, KLEM_SCHED_EVENT *pEvent)
+{
+  KLEMData *pData = pSched->pData;
+  unsigned int uNode = le16_to_cpu(pEvent->uNode);
+  unsigned int uPeer = le16_to_cpu(pEvent->uPeer);
+  s32 iX = (s32)le32_to_cpu(pEvent->iValue [0]);
+  s32 iY = (s32)le32_to_cpu(pEvent->iValue [1]);
+  s32 iZ = (s32)le32_to_cpu(pEvent->iValue [2]);
+
+  if (uNode >= MAX_WIRELESS_NODE) {
+    return;
+  }
+
+  switch (pEvent->uType)
+    {
+    case KLEM_SCHED_POSITION:
+      klemMediumPosition(pData->pMedium, uNode, iX, iY, iZ);
+      break;
+    case KLEM_SCHED_PATHLOSS:
+      klemMediumOverride(pData->pMedium, uNode, uPeer, (iX >= 0), iX);
+      break;
+    case KLEM_SCHED_FILTER:
+      /* a single store, the receive path reads it without sLock */
+      pData->bFilterNode [uNode] = (0 != iX);
+      break;
+    default:
+      break;
+    }
+}
+
+/*
+ * Apply the events that are due, one at a time so sLock is never held
+ * across klemMedium, and give the CPU up between batches.  Stop, pause
+ * and a new upload are seen before the next event.
+ */
+static void privScheduleWork(struct work_struct *pWork)
+{
+  sched_data *pSched = container_of(pWork, sched_data, sWork);
+  KLEM_SCHED_EVENT sEvent;
+  unsigned long uFlags;
+  unsigned int uBatch = 0;
+  ktime_t tExpire;
+  bool bApply;
+  bool bArm = false;
+
+  while (true) {
+    bApply = false;
+
+    spin_lock_irqsave(&pSched->sLock, uFlags);
+    if ((true == pSched->bRunning) && (false == pSched->bPaused)) {
+      if (pSched->uNext >= pSched->uCount) {
+        pSched->bRunning = false;
+        KLEM_LOG("schedule done, %u events\n", pSched->uCount);
+      } else if (le64_to_cpu(pSched->pEvents [pSched->uNext].uTime) <=
+                 privTraceNow(pSched)) {
+        sEvent = pSched->pEvents [pSched->uNext];
+        pSched->uNext++;
+        pSched->uApplied++;
+        bApply = true;
+      } else {
+        tExpire =
+          privWallTime(pSched,
+                       le64_to_cpu(pSched->pEvents [pSched->uNext].uTime));
+        bArm = true;
+      }
+    }
+    spin_unlock_irqrestore(&pSched->sLock, uFlags);
+
+    if (false == bApply) {
+      break;
+    }
+
+    privApply(pSched, &sEvent);
+
+    if (++uBatch >= KLEM_SCHED_BATCH) {
+      uBatch = 0;
+      cond_resched();
+    }
+  }
+
+  if (true == bArm) {
+    hrtimer_start(&pSched->sTimer, tExpire, HRTIMER_MODE_ABS);
+  }
+}
+
+static enum hrtimer_restart privScheduleTimer(struct hrtimer *pTimer)
+{
+  sched_data *pSched = container_of(pTimer, sched_data, sTimer);
+
+  schedule_work(&pSched->sWork);
+
+  return HRTIMER_NORESTART;
+}
+
+/* Arm the timer for the next event, the timer must not be running. */
+static void privArm(sched_data *pSched)
+{
+  unsigned long uFlags;
+  ktime_t tExpire;
+  bool bArm = false;
+
+  spin_lock_irqsave(&pSched->sLock, uFlags);
+  if ((true == pSched->bRunning) && (false == pSched->bPaused) &&
+      (pSched->uNext < pSched->uCount)) {
+    tExpire = privWallTime(pSched,
+                           le64_to_cpu(pSched->pEvents [pSched->uNext].uTime));
+    bArm = true;
+  }
+  spin_unlock_irqrestore(&pSched->sLock, uFlags);
+
+  if (true == bArm) {
+    hrtimer_start(&pSched->sTimer, tExpire, HRTIMER_MODE_ABS);
+  }
+}
+
+void klemScheduleCreate(void *pPtr)
+{
+  KLEMData *pData = (KLEMData *)pPtr;
+  sched_data *pSched = NULL;
+
+  pSched = kzalloc(sizeof(sched_data), GFP_KERNEL);
+  if (NULL == pSched) {
+    KLEM_MSG("Failed to allocate the schedule\n");
+    return;
+  }
+
+  pSched->pData = pData;
+  spin_lock_init(&pSched->sLock);
+  hrtimer_init(&pSched->sTimer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+  pSched->sTimer.function = privScheduleTimer;
+  INIT_WORK(&pSched->sWork, privScheduleWork);
+  pSched->uSpeed = KLEM_SCHED_SPEED;
+
+  pData->pSchedule = (void *)pSched;
+}
+
+void klemScheduleDestroy(void *pPtr)
+{
+  KLEMData *pData = (KLEMData *)pPtr;
+  sched_data *pSched = (sched_data *)pData->pSchedule;
+
+  if (NULL != pSched) {
+    /* A work run may have armed the timer again, which queues it again */
+    klemScheduleStop(pSched);
+    cancel_work_sync(&pSched->sWork);
+    hrtimer_cancel(&pSched->sTimer);
+    cancel_work_sync(&pSched->sWork);
+    pData->pSchedule = NULL;
+    if (NULL != pSched->pBuffer) {
+      vfree(pSched->pBuffer);
+    }
+    kfree(pSched);
+  }
+}
+
+/*
+ * Append to the schedule being uploaded, it may take several writes.
+ * The first write after a schedule was started replaces it.
+ */
+ssize_t klemScheduleWrite(void *pPtr, const char __user *pBuffer,
+                          size_t uCount)
+{
+  sched_data *pSched = (sched_data *)pPtr;
+  unsigned long uFlags;
+  char *pNew = NULL;
+  size_t uBytes;
+  size_t uSize;
+  ssize_t rvalue = uCount;
+
+  if (NULL == pSched) {
+    return -ENODEV;
+  }
+
+  spin_lock_irqsave(&pSched->sLock, uFlags);
+  if ((true == pSched->bRunning) || (true == pSched->bWriting)) {
+    rvalue = -EBUSY;
+  } else {
+    if (NULL != pSched->pEvents) {
+      pSched->pEvents = NULL;
+      pSched->uCount = 0;
+      pSched->uNext = 0;
+      pSched->uBytes = 0;
+    }
+    pSched->bWriting = true;
+  }
+  uBytes = pSched->uBytes;
+  spin_unlock_irqrestore(&pSched->sLock, uFlags);
+
+  if (rvalue < 0) {
+    return rvalue;
+  }
+
+  if (uBytes + uCount > KLEM_SCHED_MAX_BYTES) {
+    rvalue = -EFBIG;
+  } else if (uBytes + uCount > pSched->uSize) {
+    uSize = max_t(size_t, pSched->uSize * 2, uBytes + uCount);
+    uSize = min_t(size_t, uSize, KLEM_SCHED_MAX_BYTES);
+    pNew = vmalloc(uSize);
+    if (NULL == pNew) {
+      rvalue = -ENOMEM;
+    } else {
+      if (NULL != pSched->pBuffer) {
+        memcpy(pNew, pSched->pBuffer, uBytes);
+        vfree(pSched->pBuffer);
+      }
+      pSched->pBuffer = pNew;
+      pSched->uSize = uSize;
+    }
+  }
+
+  if (rvalue > 0) {
+    if (copy_from_user(pSched->pBuffer + uBytes, pBuffer, uCount)) {
+      rvalue = -EFAULT;
+    } else {
+      uBytes += uCount;
+    }
+  }
+
+  spin_lock_irqsave(&pSched->sLock, uFlags);
+  pSched->uBytes = uBytes;
+  pSched->bWriting = false;
+  spin_unlock_irqrestore(&pSched->sLock, uFlags);
+
+  return rvalue;
+}
+
+/* Check the uploaded schedule and play it from the start. */
+int klemScheduleStart(void *pPtr)
+{
+  sched_data *pSched = (sched_data *)pPtr;
+  KLEM_SCHED_HEADER *pHdr = NULL;
+  KLEM_SCHED_EVENT *pEvents = NULL;
+  unsigned long uFlags;
+  unsigned int uCount = 0;
+  unsigned int loop;
+  int rvalue = 0;
+
+  if (NULL == pSched) {
+    return -ENODEV;
+  }
+
+  klemScheduleStop(pSched);
+
+  spin_lock_irqsave(&pSched->sLock, uFlags);
+  pHdr = (KLEM_SCHED_HEADER *)pSched->pBuffer;
+  if (true == pSched->bWriting) {
+    rvalue = -EBUSY;
+  } else if ((NULL == pHdr) ||
+             (pSched->uBytes < sizeof(KLEM_SCHED_HEADER)) ||
+             (KLEM_SCHED_MAGIC != le32_to_cpu(pHdr->uMagic)) ||
+             (KLEM_SCHED_VERSION != le32_to_cpu(pHdr->uVersion))) {
+    rvalue = -EINVAL;
+  } else {
+    uCount = le32_to_cpu(pHdr->uCount);
+    pEvents = (KLEM_SCHED_EVENT *)(pHdr + 1);
+    /* Nothing to play would never finish, refuse it */
+    if ((0 == uCount) ||
+        ((pSched->uBytes - sizeof(KLEM_SCHED_HEADER)) /
+         sizeof(KLEM_SCHED_EVENT) < uCount)) {
+      rvalue = -EINVAL;
+    }
+
+    for (loop = 1; (0 == rvalue) && (loop < uCount); loop++) {
+      if (le64_to_cpu(pEvents [loop].uTime) <
+          le64_to_cpu(pEvents [loop - 1].uTime)) {
+        rvalue = -EINVAL;
+      }
+    }
+  }
+
+  if (0 == rvalue) {
+    pSched->pEvents = pEvents;
+    pSched->uCount = uCount;
+    pSched->uNext = 0;
+    pSched->uApplied = 0;
+    pSched->uTraceBase = 0;
+    pSched->tWallBase = ktime_get();
+    pSched->bPaused = false;
+    pSched->bRunning = true;
+  }
+  spin_unlock_irqrestore(&pSched->sLock, uFlags);
+
+  if (0 == rvalue) {
+    privArm(pSched);
+  } else {
+    KLEM_LOG("Error, schedule of %lu bytes can't be played (%d)\n",
+             (unsigned long)pSched->uBytes, rvalue);
+  }
+
+  return rvalue;
+}
+
+void klemScheduleStop(void *pPtr)
+{
+  sched_data *pSched = (sched_data *)pPtr;
+  unsigned long uFlags;
+
+  if (NULL != pSched) {
+    spin_lock_irqsave(&pSched->sLock, uFlags);
+    pSched->bRunning = false;
+    spin_unlock_irqrestore(&pSched->sLock, uFlags);
+
+    hrtimer_cancel(&pSched->sTimer);
+  }
+}
+
+void klemSchedulePause(void *pPtr)
+{
+  sched_data *pSched = (sched_data *)pPtr;
+  unsigned long uFlags;
+
+  if (NULL != pSched) {
+    spin_lock_irqsave(&pSched->sLock, uFlags);
+    if ((true == pSched->bRunning) && (false == pSched->bPaused)) {
+      pSched->uTraceBase = privTraceNow(pSched);
+      pSched->bPaused = true;
+    }
+    spin_unlock_irqrestore(&pSched->sLock, uFlags);
+
+    hrtimer_cancel(&pSched->sTimer);
+  }
+}
+
+void klemScheduleResume(void *pPtr)
+{
+  sched_data *pSched = (sched_data *)pPtr;
+  unsigned long uFlags;
+
+  if (NULL != pSched) {
+    spin_lock_irqsave(&pSched->sLock, uFlags);
+    if (true == pSched->bPaused) {
+      pSched->tWallBase = ktime_get();
+      pSched->bPaused = false;
+    }
+    spin_unlock_irqrestore(&pSched->sLock, uFlags);
+
+    hrtimer_cancel(&pSched->sTimer);
+    privArm(pSched);
+  }
+}
+
+/* Forget the uploaded schedule, its buffer is kept for the next one. */
+void klemScheduleClear(void *pPtr)
+{
+  sched_data *pSched = (sched_data *)pPtr;
+  unsigned long uFlags;
+
+  if (NULL != pSched) {
+    klemScheduleStop(pSched);
+
+    spin_lock_irqsave(&pSched->sLock, uFlags);
+    if (false == pSched->bWriting) {
+      pSched->pEvents = NULL;
+      pSched->uCount = 0;
+      pSched->uNext = 0;
+      pSched->uBytes = 0;
+    }
+    spin_unlock_irqrestore(&pSched->sLock, uFlags);
+  }
+}
+
+/* Speed in percent of real time, takes effect from now on. */
+void klemScheduleSpeed(void *pPtr, unsigned int uSpeed)
+{
+  sched_data *pSched = (sched_data *)pPtr;
+  unsigned long uFlags;
+  bool bRearm = false;
+
+  if ((NULL != pSched) && (uSpeed > 0)) {
+    spin_lock_irqsave(&pSched->sLock, uFlags);
+    if ((true == pSched->bRunning) && (false == pSched->bPaused)) {
+      pSched->uTraceBase = privTraceNow(pSched);
+      pSched->tWallBase = ktime_get();
+      bRearm = true;
+    }
+    pSched->uSpeed = uSpeed;
+    spin_unlock_irqrestore(&pSched->sLock, uFlags);
+
+    if (true == bRearm) {
+      hrtimer_cancel(&pSched->sTimer);
+      privArm(pSched);
+    }
+  }
+}
+
+void klemScheduleInfo(void *pPtr, KLEM_SCHED_INFO *pInfo)
+{
+  sched_data *pSched = (sched_data *)pPtr;
+
+  memset(pInfo, 0, sizeof(KLEM_SCHED_INFO));
+  if (NULL != pSched) {
+    pInfo->bLoaded = (NULL != pSched->pEvents);
+    pInfo->bRunning = pSched->bRunning;
+    pInfo->bPaused = pSched->bPaused;
+    pInfo->uSpeed = pSched->uSpeed;
+    pInfo->uCount = pSched->uCount;
+    pInfo->uNext = pSched->uNext;
+    pInfo->uApplied = pSched->uApplied;
+    pInfo->uBytes = pSched->uBytes;
+  }
+}
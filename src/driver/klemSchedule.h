@@ -0,0 +1,82 @@
+/*
+ * Wireless Kernel Link Emulator
+ *
+ * Copyright (C) 2013 - 2016 Stuart Wells <swells@stuartwells.net>
+ * All rights reserved.
+ *
+ * Licensed under the GNU General Public License, version 2 (GPLv2)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+#ifndef KLEM_SCHEDULE_INCLUDE
+#define KLEM_SCHEDULE_INCLUDE
+
+/* proc file the binary schedule is written to */
+#define KLEM_SCHEDULE_NAME "klem_schedule"
+
+/*
+ * A schedule is a KLEM_SCHED_HEADER followed by uCount events sorted
+ * by time, all little endian.
+ */
+#define KLEM_SCHED_MAGIC 0x534d4c4b
+#define KLEM_SCHED_VERSION 1
+#define KLEM_SCHED_MAX_BYTES (16 * 1024 * 1024)
+
+typedef struct {
+  u32 uMagic;
+  u32 uVersion;
+  u32 uCount;
+  u32 uReserved;
+} __attribute__((packed)) KLEM_SCHED_HEADER;
+
+/* Event types and what the values mean */
+#define KLEM_SCHED_POSITION 1 /* node moves to x, y, z cm */
+#define KLEM_SCHED_PATHLOSS 2 /* node to peer fixed at x dB, < 0 clears */
+#define KLEM_SCHED_FILTER 3   /* x != 0 filters node, 0 accepts it */
+
+typedef struct {
+  u64 uTime;          /* usec since playback started */
+  u8 uType;
+  u8 uReserved;
+  u16 uNode;
+  u16 uPeer;
+  u16 uReserved2;
+  s32 iValue [3];
+} __attribute__((packed)) KLEM_SCHED_EVENT;
+
+/* Playback speed in percent of real time */
+#define KLEM_SCHED_SPEED 100
+#define KLEM_SCHED_SPEED_MAX 10000
+
+/* Playback state and counters, for proc */
+typedef struct {
+  bool bLoaded;
+  bool bRunning;
+  bool bPaused;
+  unsigned int uSpeed;
+  unsigned int uCount;
+  unsigned int uNext;
+  unsigned long uApplied;
+  size_t uBytes;
+} KLEM_SCHED_INFO;
+
+void klemScheduleCreate(void *pPtr);
+void klemScheduleDestroy(void *pPtr);
+ssize_t klemScheduleWrite(void *pPtr, const char __user *pBuffer,
+                          size_t uCount);
+int klemScheduleStart(void *pPtr);
+void klemScheduleStop(void *pPtr);
+void klemSchedulePause(void *pPtr);
+void klemScheduleResume(void *pPtr);
+void klemScheduleClear(void *pPtr);
+void klemScheduleSpeed(void *pPtr, unsigned int uSpeed);
+void klemScheduleInfo(void *pPtr, KLEM_SCHED_INFO *pInfo);
+#endif
@@ -0,0 +1,204 @@
+/*
+ * Wireless Kernel Link Emulator
+ *
+ * Copyright (C) 2013 - 2016 Stuart Wells <swells@stuartwells.net>
+ * All rights reserved.
+ *
+ * Licensed under the GNU General Public License, version 2 (GPLv2)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Stand in medium daemon for /dev/klem.  Every frame loses a fixed
+ * path loss, frames below the sensitivity or picked by the drop rate
+ * are dropped, the rest are delivered after a fixed delay.  A real
+ * model replaces privDecide.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "klemDev.h"
+
+#define KLEMD_DEVICE "/dev/" KLEM_DEV_NAME
+
+static volatile sig_atomic_t bStop = 0;
+
+static int iLoss = 0;
+static int iSensitivity = -90;
+static unsigned int uDropPercent = 0;
+static unsigned int uDelay = 0;
+
+static unsigned long uFrames = 0;
+static unsigned long uDelivered = 0;
+static unsigned long uWakeups = 0;
+
+static void privSignal(int iSig)
+{
+  (void)iSig;
+  bStop = 1;
+}
+
+static void privDecide(const KLEM_DEV_FRAME *pFrame,
+                       KLEM_DEV_DECISION *pDecision)
+{
+  memset(pDecision, 0, sizeof(KLEM_DEV_DECISION));
+  pDecision->uCookie = pFrame->uCookie;
+  pDecision->iSignal = pFrame->iPower - iLoss;
+  pDecision->uDelay = uDelay;
+
+  if ((pDecision->iSignal >= iSensitivity) &&
+      ((0 == uDropPercent) ||
+       ((unsigned int)(random() % 100) >= uDropPercent))) {
+    pDecision->uAction = KLEM_DEV_DELIVER;
+    uDelivered++;
+  } else {
+    pDecision->uAction = KLEM_DEV_DROP;
+  }
+}
+
+static void privUsage(const char *pName)
+{
+  fprintf(stderr,
+          "usage: %s [-l loss dB] [-s sensitivity dBm] [-p drop %%] "
+          "[-d delay usec]\n", pName);
+}
+
+int main(int argc, char **argv)
+{
+  KLEM_DEV_HEADER *pHeader = NULL;
+  KLEM_DEV_FRAME *pFrames = NULL;
+  KLEM_DEV_DECISION *pDecisions = NULL;
+  struct pollfd sPoll;
+  size_t uSize;
+  void *pArea = NULL;
+  __u32 uHead;
+  __u32 uTail;
+  __u32 uDecisionHead;
+  unsigned int uBatch;
+  int iFd;
+  int iOpt;
+
+  while ((iOpt = getopt(argc, argv, "l:s:p:d:h")) != -1) {
+    switch (iOpt)
+      {
+      case 'l':
+        iLoss = atoi(optarg);
+        break;
+      case 's':
+        iSensitivity = atoi(optarg);
+        break;
+      case 'p':
+        uDropPercent = (unsigned int)atoi(optarg);
+        break;
+      case 'd':
+        uDelay = (unsigned int)atoi(optarg);
+        break;
+      default:
+        privUsage(argv [0]);
+        return 1;
+      }
+  }
+
+  iFd = open(KLEMD_DEVICE, O_RDWR);
+  if (iFd < 0) {
+    perror(KLEMD_DEVICE);
+    return 1;
+  }
+
+  /* Map the header first, it tells us where the rings are */
+  pArea = mmap(NULL, sizeof(KLEM_DEV_HEADER), PROT_READ, MAP_SHARED, iFd, 0);
+  if (MAP_FAILED == pArea) {
+    perror("mmap");
+    return 1;
+  }
+  pHeader = (KLEM_DEV_HEADER *)pArea;
+  if ((KLEM_DEV_MAGIC != pHeader->uMagic) ||
+      (KLEM_DEV_VERSION != pHeader->uVersion)) {
+    fprintf(stderr, "%s: unknown ring version %u\n", KLEMD_DEVICE,
+            pHeader->uVersion);
+    return 1;
+  }
+  uSize = pHeader->uDecisionOffset +
+    (size_t)pHeader->uSlots * sizeof(KLEM_DEV_DECISION);
+  munmap(pArea, sizeof(KLEM_DEV_HEADER));
+
+  pArea = mmap(NULL, uSize, PROT_READ | PROT_WRITE, MAP_SHARED, iFd, 0);
+  if (MAP_FAILED == pArea) {
+    perror("mmap");
+    return 1;
+  }
+  pHeader = (KLEM_DEV_HEADER *)pArea;
+  pFrames = (KLEM_DEV_FRAME *)((char *)pArea + pHeader->uFrameOffset);
+  pDecisions = (KLEM_DEV_DECISION *)((char *)pArea +
+                                     pHeader->uDecisionOffset);
+
+  signal(SIGINT, privSignal);
+  signal(SIGTERM, privSignal);
+
+  sPoll.fd = iFd;
+  sPoll.events = POLLIN;
+  uDecisionHead = pHeader->uDecisionHead;
+
+  while (0 == bStop) {
+    if ((poll(&sPoll, 1, 1000) < 0) && (EINTR != errno)) {
+      perror("poll");
+      break;
+    }
+    uWakeups++;
+
+    /* Everything posted so far goes back in one batch */
+    uHead = __atomic_load_n(&pHeader->uFrameHead, __ATOMIC_ACQUIRE);
+    uTail = pHeader->uFrameTail;
+    uBatch = 0;
+    while (uTail != uHead) {
+      /* The decision ring is full, let klem catch up */
+      if ((uDecisionHead -
+           __atomic_load_n(&pHeader->uDecisionTail, __ATOMIC_ACQUIRE)) >=
+          pHeader->uSlots) {
+        __atomic_store_n(&pHeader->uDecisionHead, uDecisionHead,
+                         __ATOMIC_RELEASE);
+        if (write(iFd, "", 1) < 0) {
+          perror("write");
+        }
+        continue;
+      }
+
+      privDecide(&pFrames [uTail % pHeader->uSlots],
+                 &pDecisions [uDecisionHead % pHeader->uSlots]);
+      uDecisionHead++;
+      uTail++;
+      uBatch++;
+    }
+
+    if (0 != uBatch) {
+      uFrames += uBatch;
+      __atomic_store_n(&pHeader->uDecisionHead, uDecisionHead,
+                       __ATOMIC_RELEASE);
+      __atomic_store_n(&pHeader->uFrameTail, uTail, __ATOMIC_RELEASE);
+      if (write(iFd, "", 1) < 0) {
+        perror("write");
+      }
+    }
+  }
+
+  printf("%lu frames, %lu delivered, %lu wakeups\n",
+         uFrames, uDelivered, uWakeups);
+  munmap(pArea, uSize);
+  close(iFd);
+  return 0;
+}
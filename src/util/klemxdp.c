@@ -0,0 +1,263 @@
+/*
+ * Wireless Kernel Link Emulator
+ *
+ * Copyright (C) 2013 - 2016 Stuart Wells <swells@stuartwells.net>
+ * All rights reserved.
+ *
+ * Licensed under the GNU General Public License, version 2 (GPLv2)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Loads klemxdp_kern.o onto the wired device klem is connected to,
+ * fills in its maps and keeps it attached until interrupted.  The
+ * experiment and the filtered nodes should match what /proc/klem was
+ * given, the program drops the rest before klem would.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <net/if.h>
+#include <linux/if_link.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include "klemxdp.h"
+
+static volatile sig_atomic_t bStop = 0;
+
+static void privSignal(int iSig)
+{
+  (void)iSig;
+  bStop = 1;
+}
+
+static void privUsage(const char *pName)
+{
+  fprintf(stderr,
+          "usage: %s -i device [-e experiment] [-f node]... "
+          "[-c cpu,cpu...] [-q queue size] [-g] [-o object]\n", pName);
+}
+
+static int privMapFd(struct bpf_object *pObj, const char *pName)
+{
+  int iFd = bpf_object__find_map_fd_by_name(pObj, pName);
+
+  if (iFd < 0) {
+    fprintf(stderr, "%s: no map %s\n", KLEMXDP_OBJECT, pName);
+  }
+  return iFd;
+}
+
+/* Fills the cpu list and the cpumap, returns how many CPUs were given */
+static int privCpus(const char *pList, int iCpusFd, int iCpumapFd,
+                    __u32 uQueue)
+{
+  char *pCopy = strdup(pList);
+  char *pSave = NULL;
+  char *pToken;
+  __u32 uSlot = 0;
+  __u32 uCpu;
+  int rvalue = 0;
+
+  if (NULL == pCopy) {
+    return -1;
+  }
+
+  for (pToken = strtok_r(pCopy, ",", &pSave); NULL != pToken;
+       pToken = strtok_r(NULL, ",", &pSave)) {
+    if (uSlot >= KLEMXDP_MAX_CPUS) {
+      fprintf(stderr, "only %d cpus are used\n", KLEMXDP_MAX_CPUS);
+      break;
+    }
+    uCpu = (__u32)atoi(pToken);
+    if (uCpu >= KLEMXDP_MAX_CPUS) {
+      fprintf(stderr, "cpu %u out of range\n", uCpu);
+      rvalue = -1;
+      break;
+    }
+    if ((0 != bpf_map_update_elem(iCpumapFd, &uCpu, &uQueue, BPF_ANY)) ||
+        (0 != bpf_map_update_elem(iCpusFd, &uSlot, &uCpu, BPF_ANY))) {
+      fprintf(stderr, "cpu %u: %s\n", uCpu, strerror(errno));
+      rvalue = -1;
+      break;
+    }
+    uSlot++;
+  }
+
+  free(pCopy);
+  return (0 == rvalue) ? (int)uSlot : rvalue;
+}
+
+int main(int argc, char **argv)
+{
+  static const char *pConstStat [KLEMXDP_STATS] = {
+    "passed", "redirected", "foreign", "filtered"
+  };
+  KLEMXDP_CONFIG sConfig;
+  struct bpf_object *pObj = NULL;
+  struct bpf_program *pProg = NULL;
+  const char *pDevice = NULL;
+  const char *pObject = KLEMXDP_OBJECT;
+  const char *pCpus = NULL;
+  unsigned long long uTotal;
+  __u64 *pCounts = NULL;
+  __u32 uQueue = KLEMXDP_QUEUE_SIZE;
+  __u32 uFilter [KLEMXDP_MAX_NODE];
+  __u32 uKey;
+  __u32 uFlags = XDP_FLAGS_DRV_MODE;
+  int iPossible;
+  int iIndex;
+  int iProgFd;
+  int iConfigFd;
+  int iFilterFd;
+  int iCpusFd;
+  int iCpumapFd;
+  int iStatsFd;
+  int iOpt;
+  int iCpu;
+  int iNode;
+  int rvalue = 1;
+
+  memset(&sConfig, 0, sizeof(sConfig));
+  memset(uFilter, 0, sizeof(uFilter));
+
+  while ((iOpt = getopt(argc, argv, "i:e:f:c:q:go:h")) != -1) {
+    switch (iOpt)
+      {
+      case 'i':
+        pDevice = optarg;
+        break;
+      case 'e':
+        sConfig.uExperiment = (__u32)atoi(optarg);
+        break;
+      case 'f':
+        iNode = atoi(optarg);
+        if ((iNode < 0) || (iNode >= KLEMXDP_MAX_NODE)) {
+          fprintf(stderr, "node %d out of range\n", iNode);
+          return 1;
+        }
+        uFilter [iNode] = 1;
+        break;
+      case 'c':
+        pCpus = optarg;
+        break;
+      case 'q':
+        uQueue = (__u32)atoi(optarg);
+        break;
+      case 'g':
+        uFlags = XDP_FLAGS_SKB_MODE;
+        break;
+      case 'o':
+        pObject = optarg;
+        break;
+      default:
+        privUsage(argv [0]);
+        return 1;
+      }
+  }
+
+  if (NULL == pDevice) {
+    privUsage(argv [0]);
+    return 1;
+  }
+
+  iIndex = (int)if_nametoindex(pDevice);
+  if (0 == iIndex) {
+    perror(pDevice);
+    return 1;
+  }
+
+  pObj = bpf_object__open_file(pObject, NULL);
+  if ((NULL == pObj) || (0 != libbpf_get_error(pObj))) {
+    fprintf(stderr, "%s: can't open\n", pObject);
+    return 1;
+  }
+  if (0 != bpf_object__load(pObj)) {
+    fprintf(stderr, "%s: can't load\n", pObject);
+    goto close;
+  }
+
+  pProg = bpf_object__find_program_by_name(pObj, KLEMXDP_PROGRAM);
+  iProgFd = (NULL == pProg) ? -1 : bpf_program__fd(pProg);
+  iConfigFd = privMapFd(pObj, "klem_config");
+  iFilterFd = privMapFd(pObj, "klem_filter");
+  iCpusFd = privMapFd(pObj, "klem_cpus");
+  iCpumapFd = privMapFd(pObj, "klem_cpumap");
+  iStatsFd = privMapFd(pObj, "klem_stats");
+  if ((iProgFd < 0) || (iConfigFd < 0) || (iFilterFd < 0) ||
+      (iCpusFd < 0) || (iCpumapFd < 0) || (iStatsFd < 0)) {
+    goto close;
+  }
+
+  for (uKey = 0; uKey < KLEMXDP_MAX_NODE; uKey++) {
+    if (0 != uFilter [uKey]) {
+      bpf_map_update_elem(iFilterFd, &uKey, &uFilter [uKey], BPF_ANY);
+    }
+  }
+
+  /* Without a cpu list frames stay on the CPU that took them */
+  if (NULL != pCpus) {
+    iCpu = privCpus(pCpus, iCpusFd, iCpumapFd, uQueue);
+    if (iCpu < 0) {
+      goto close;
+    }
+    sConfig.uCpus = (__u32)iCpu;
+  }
+
+  uKey = 0;
+  if (0 != bpf_map_update_elem(iConfigFd, &uKey, &sConfig, BPF_ANY)) {
+    perror("klem_config");
+    goto close;
+  }
+
+  if (0 != bpf_xdp_attach(iIndex, iProgFd, uFlags, NULL)) {
+    fprintf(stderr, "%s: can't attach, try -g\n", pDevice);
+    goto close;
+  }
+
+  signal(SIGINT, privSignal);
+  signal(SIGTERM, privSignal);
+
+  while (0 == bStop) {
+    sleep(1);
+  }
+
+  /* The counters are per CPU, add them up */
+  iPossible = libbpf_num_possible_cpus();
+  if (iPossible > 0) {
+    pCounts = calloc((size_t)iPossible, sizeof(__u64));
+  }
+  if (NULL != pCounts) {
+    for (uKey = 0; uKey < KLEMXDP_STATS; uKey++) {
+      uTotal = 0;
+      if (0 == bpf_map_lookup_elem(iStatsFd, &uKey, pCounts)) {
+        for (iCpu = 0; iCpu < iPossible; iCpu++) {
+          uTotal += pCounts [iCpu];
+        }
+      }
+      printf("%s%llu %s", (0 == uKey) ? "" : ", ", uTotal,
+             pConstStat [uKey]);
+    }
+    printf("\n");
+    free(pCounts);
+  }
+
+  bpf_xdp_detach(iIndex, uFlags, NULL);
+  rvalue = 0;
+
+ close:
+  bpf_object__close(pObj);
+  return rvalue;
+}
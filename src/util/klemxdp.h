@@ -0,0 +1,54 @@
+/*
+ * Wireless Kernel Link Emulator
+ *
+ * Copyright (C) 2013 - 2016 Stuart Wells <swells@stuartwells.net>
+ * All rights reserved.
+ *
+ * Licensed under the GNU General Public License, version 2 (GPLv2)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+#ifndef KLEM_XDP_INCLUDE
+#define KLEM_XDP_INCLUDE
+
+#include <linux/types.h>
+
+/* Object file the loader takes the program from, and its name */
+#define KLEMXDP_OBJECT "klemxdp_kern.o"
+#define KLEMXDP_PROGRAM "klem_xdp"
+
+/* Most CPUs klem frames are spread over */
+#define KLEMXDP_MAX_CPUS 64
+
+/* Frames a cpumap entry queues for its CPU */
+#define KLEMXDP_QUEUE_SIZE 2048
+
+/* One past the highest node id, as MAX_WIRELESS_NODE */
+#define KLEMXDP_MAX_NODE 256
+
+/* Per CPU counters, by what happened to a klem frame */
+#define KLEMXDP_STAT_PASS 0
+#define KLEMXDP_STAT_REDIRECT 1
+#define KLEMXDP_STAT_FOREIGN 2
+#define KLEMXDP_STAT_FILTERED 3
+#define KLEMXDP_STATS 4
+
+/*
+ * Set by the loader before the program is attached.  Frames go to
+ * CPU number uHash % uCpus of the cpu list, 0 leaves them where they
+ * arrived.
+ */
+typedef struct {
+  __u32 uExperiment;
+  __u32 uCpus;
+} KLEMXDP_CONFIG;
+
+#endif
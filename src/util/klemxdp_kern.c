@@ -0,0 +1,205 @@
+/*
+ * Wireless Kernel Link Emulator
+ *
+ * Copyright (C) 2013 - 2016 Stuart Wells <swells@stuartwells.net>
+ * All rights reserved.
+ *
+ * Licensed under the GNU General Public License, version 2 (GPLv2)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * XDP program for the wired device of a klem host.  Frames of other
+ * experiments and of filtered nodes are dropped in the driver, the
+ * rest of the klem frames are spread over a set of CPUs through a
+ * cpumap, by sender so each sender's frames stay in order.  Anything
+ * that isn't a klem frame, or a header we don't understand, is left
+ * to the stack and klem.
+ */
+#include <stddef.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+typedef __u8 u8;
+typedef __u16 u16;
+typedef __u32 u32;
+typedef __s8 s8;
+typedef __s32 s32;
+
+#include "klemHdr.h"
+#include "klemxdp.h"
+
+/* An 802.1Q tag, between the addresses and the klem ethertype */
+typedef struct {
+  __be16 uTCI;
+  __be16 uProtocol;
+} __attribute__((packed)) KLEMXDP_VLAN;
+
+struct {
+  __uint(type, BPF_MAP_TYPE_ARRAY);
+  __uint(max_entries, 1);
+  __type(key, __u32);
+  __type(value, KLEMXDP_CONFIG);
+} klem_config SEC(".maps");
+
+/* Non zero for the node ids filtered out, as "filter = id" */
+struct {
+  __uint(type, BPF_MAP_TYPE_ARRAY);
+  __uint(max_entries, KLEMXDP_MAX_NODE);
+  __type(key, __u32);
+  __type(value, __u32);
+} klem_filter SEC(".maps");
+
+/* CPU of each slot of the cpu list */
+struct {
+  __uint(type, BPF_MAP_TYPE_ARRAY);
+  __uint(max_entries, KLEMXDP_MAX_CPUS);
+  __type(key, __u32);
+  __type(value, __u32);
+} klem_cpus SEC(".maps");
+
+struct {
+  __uint(type, BPF_MAP_TYPE_CPUMAP);
+  __uint(max_entries, KLEMXDP_MAX_CPUS);
+  __type(key, __u32);
+  __type(value, __u32);
+} klem_cpumap SEC(".maps");
+
+struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+  __uint(max_entries, KLEMXDP_STATS);
+  __type(key, __u32);
+  __type(value, __u64);
+} klem_stats SEC(".maps");
+
+static __always_inline void privCount(__u32 uStat)
+{
+  __u64 *pCount = bpf_map_lookup_elem(&klem_stats, &uStat);
+
+  if (NULL != pCount) {
+    *pCount += 1;
+  }
+}
+
+SEC("xdp")
+int klem_xdp(struct xdp_md *pCtx)
+{
+  void *pData = (void *)(long)pCtx->data;
+  void *pEnd = (void *)(long)pCtx->data_end;
+  struct ethhdr *pEth = (struct ethhdr *)pData;
+  KLEMXDP_VLAN *pVlan = NULL;
+  KLEM_RAW_HEADER *pHdr = NULL;
+  KLEM_RAW_HEADER_V2 *pHdrV2 = NULL;
+  KLEM_TAP_HEADER *pTapHdr = NULL;
+  KLEMXDP_CONFIG *pConfig = NULL;
+  __u32 *pValue = NULL;
+  __u32 uOffset = 0;
+  __u32 uExperiment;
+  __u32 uNode;
+  __u32 uFlags;
+  __u32 uName;
+  __u32 uHash;
+  __u32 uCpus;
+  __u32 uKey = 0;
+  __be16 uProtocol;
+  long iAction;
+
+  if ((void *)(pEth + 1) > pEnd) {
+    return XDP_PASS;
+  }
+
+  /* Cards that don't strip the tag leave it in front of us */
+  uProtocol = pEth->h_proto;
+  if (bpf_htons(ETH_P_8021Q) == uProtocol) {
+    pVlan = (KLEMXDP_VLAN *)(pEth + 1);
+    if ((void *)(pVlan + 1) > pEnd) {
+      return XDP_PASS;
+    }
+    uProtocol = pVlan->uProtocol;
+    uOffset = sizeof(KLEMXDP_VLAN);
+  }
+
+  if (bpf_htons(KLEM_PROTOCOL) != uProtocol) {
+    return XDP_PASS;
+  }
+
+  pConfig = bpf_map_lookup_elem(&klem_config, &uKey);
+  if (NULL == pConfig) {
+    return XDP_PASS;
+  }
+
+  /* The headers start at the addresses, a tag moves the rest along */
+  pHdr = (KLEM_RAW_HEADER *)(pData + uOffset);
+  pHdrV2 = (KLEM_RAW_HEADER_V2 *)(pData + uOffset);
+  if ((void *)(pHdrV2 + 1) > pEnd) {
+    return XDP_PASS;
+  }
+
+  __builtin_memcpy(&uName, KLEM_NAME, sizeof(uName));
+  if ((KLEM_WIRE_MAGIC == bpf_ntohs(pHdrV2->uMagic)) &&
+      (KLEM_WIRE_V2 == pHdrV2->uVersion)) {
+    uExperiment = bpf_ntohl(pHdrV2->uId) >> KLEM_EXPERIMENT_SHIFT;
+    uNode = bpf_ntohl(pHdrV2->uId) & KLEM_TAP_ID_MASK;
+    uFlags = (__u32)pHdrV2->uFlags << KLEM_TAP_FLAGS_SHIFT;
+  } else if (uName == bpf_ntohl(pHdr->uHeader)) {
+    pTapHdr = (KLEM_TAP_HEADER *)(pHdr + 1);
+    if ((void *)(pTapHdr + 1) > pEnd) {
+      return XDP_PASS;
+    }
+    uExperiment = bpf_ntohl(pHdr->uVersion) >> KLEM_EXPERIMENT_SHIFT;
+    uNode = bpf_ntohl(pTapHdr->uId) & KLEM_TAP_ID_MASK;
+    uFlags = bpf_ntohl(pTapHdr->uId) & ~KLEM_TAP_ID_MASK;
+  } else {
+    privCount(KLEMXDP_STAT_PASS);
+    return XDP_PASS;
+  }
+
+  if (uExperiment != pConfig->uExperiment) {
+    privCount(KLEMXDP_STAT_FOREIGN);
+    return XDP_DROP;
+  }
+
+  /* klem takes acks even from the nodes it filters */
+  pValue = bpf_map_lookup_elem(&klem_filter, &uNode);
+  if ((0 == (uFlags & KLEM_TAP_FLAG_ACK)) &&
+      (NULL != pValue) && (0 != *pValue)) {
+    privCount(KLEMXDP_STAT_FILTERED);
+    return XDP_DROP;
+  }
+
+  uCpus = pConfig->uCpus;
+  if (0 == uCpus) {
+    privCount(KLEMXDP_STAT_PASS);
+    return XDP_PASS;
+  }
+
+  /* One CPU per sender keeps its sequences and segments in order */
+  uHash = ((__u32)pEth->h_source [2] << 24) |
+    ((__u32)pEth->h_source [3] << 16) |
+    ((__u32)pEth->h_source [4] << 8) | pEth->h_source [5];
+  uKey = (uHash ^ (uHash >> 16)) % uCpus;
+  pValue = bpf_map_lookup_elem(&klem_cpus, &uKey);
+  if (NULL == pValue) {
+    privCount(KLEMXDP_STAT_PASS);
+    return XDP_PASS;
+  }
+
+  /* A CPU missing from the cpumap leaves the frame where it arrived */
+  iAction = bpf_redirect_map(&klem_cpumap, *pValue, XDP_PASS);
+  privCount((XDP_REDIRECT == iAction) ?
+            KLEMXDP_STAT_REDIRECT : KLEMXDP_STAT_PASS);
+  return iAction;
+}
+
+char _license [] SEC("license") = "GPL";